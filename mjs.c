@@ -2944,6 +2944,7 @@ MJS_PRIVATE int gc_check_ptr(const struct gc_arena *a, const void *p);
 #ifndef MJS_CORE_H
 #define MJS_CORE_H
 
+/* Amalgamated: #include "mjs_exec_public.h" */
 /* Amalgamated: #include "mjs_ffi.h" */
 /* Amalgamated: #include "mjs_gc.h" */
 /* Amalgamated: #include "mjs_internal.h" */
@@ -2974,14 +2975,53 @@ enum mjs_type {
   MJS_TYPES_CNT
 };
 
-enum mjs_call_stack_frame_item {
-  CALL_STACK_FRAME_ITEM_RETVAL_STACK_IDX, /* TOS */
-  CALL_STACK_FRAME_ITEM_LOOP_ADDR_IDX,
-  CALL_STACK_FRAME_ITEM_SCOPE_IDX,
-  CALL_STACK_FRAME_ITEM_RETURN_ADDR,
-  CALL_STACK_FRAME_ITEM_THIS,
+/*
+ * Call stack frame, see `call_stack_push_frame()`. `mjs->call_stack` is an
+ * array of them.
+ */
+struct mjs_frame {
+  size_t ret_addr;    /* Global bcode offset to return to */
+  size_t scope_idx;   /* Size of `mjs->scopes` at the time of the call */
+  size_t loop_idx;    /* Loops count in `mjs->loop_addresses` at the call */
+  size_t retval_idx;  /* Data stack index right after the called function */
+  size_t stack_limit; /* `mjs->stack_limit` of the caller */
+  mjs_val_t this_obj; /* `this` of the caller */
+};
+
+/*
+ * Variable of a scope which is not materialised, see mjs_scopes_truncate().
+ * `mjs->scope_vars` is an array of them.
+ */
+struct mjs_scope_var {
+  mjs_val_t key;    /* Variable name */
+  mjs_val_t value;  /* Variable value */
+  size_t scope_idx; /* Index of the scope in `mjs->scopes` */
+};
+
+/*
+ * Loop record pushed by OP_LOOP. `mjs->loop_addresses` is an array of them.
+ */
+struct mjs_loop {
+  size_t scope_idx; /* Size of `mjs->scopes` when the loop was entered */
+  uint32_t brk;     /* Index of the "break" target instruction in the part */
+  uint32_t cont;    /* Index of the "continue" target instruction */
+};
 
-  CALL_STACK_FRAME_ITEMS_CNT
+/*
+ * State of mjs_execute() which is not kept on the stacks of `struct mjs`. It's
+ * saved into `mjs->exec_state` when the execution is suspended, and picked up
+ * from there by mjs_resume().
+ */
+struct mjs_exec_state {
+  size_t off;          /* Global bcode offset of the next instruction */
+  size_t start_off;    /* Offset at which the execution was started */
+  uint8_t prev_opcode; /* Opcode executed before the next one */
+  /* Lengths of the stacks at the start, restored in case of an error */
+  size_t stack_len;
+  size_t call_stack_len;
+  size_t arg_stack_len;
+  size_t scopes_len;
+  size_t loop_addresses_len;
 };
 
 /*
@@ -3024,6 +3064,54 @@ struct mjs_vals {
   mjs_val_t last_getprop_obj;
 };
 
+/*
+ * Bcode instruction with all its operands decoded, see
+ * `mjs_bcode_part_decode()`.
+ */
+struct mjs_insn {
+  uint8_t opcode;
+  /*
+   * OP_EXPR: operator token; OP_SET_ARG: number of OP_SET_ARG, starting from
+   * this one, which bind arguments at once, see mjs_bcode_part_decode()
+   */
+  uint8_t op;
+  uint32_t off; /* Offset of the instruction in the bcode part */
+  /*
+   * Jumps: index of the target instruction; OP_LOOP: index of the "break"
+   * target; opcodes with a string operand: index of the string in `consts`
+   * of the part; OP_GET_LOCAL, OP_SET_LOCAL: slot index; OP_LOCALS: number of
+   * slots
+   */
+  uint32_t a;
+  /*
+   * OP_LOOP: index of the "continue" target; OP_SET_ARG: argument number;
+   * OP_LOCALS: number of parameters; property access sites: index of the
+   * inline cache in `prop_caches` of the part; OP_JMP over a function body:
+   * number of values the function can push, see mjs_bcode_part_decode()
+   */
+  uint32_t b;
+  union {
+    int64_t i; /* OP_PUSH_INT; OP_PUSH_FUNC: global function offset */
+    double d;  /* OP_PUSH_DBL */
+  } v;
+};
+
+/*
+ * Inline cache of a property access site: the property nodes found for the
+ * last few objects (and keys, for computed ones). Entries are only valid while
+ * `epoch` equals `mjs->prop_cache_epoch`, which is advanced whenever a node can
+ * be detached from its object or reused: on property deletion and on GC.
+ */
+struct mjs_prop_cache {
+  unsigned int epoch;
+  unsigned int next; /* Entry to replace on the next miss */
+  struct {
+    mjs_val_t obj;
+    mjs_val_t key; /* MJS_UNDEFINED for the sites with a constant name */
+    struct mjs_node *node;
+  } entries[MJS_PROP_CACHE_SIZE];
+};
+
 struct mjs_bcode_part {
   /* Global index of the bcode part */
   size_t start_idx;
@@ -3034,6 +3122,34 @@ struct mjs_bcode_part {
     size_t len;    /* Memory chunk length */
   } data;
 
+  /*
+   * Decoded instructions, terminated with OP_EXIT. NULL until the part is
+   * executed for the first time.
+   */
+  struct mjs_insn *insns;
+  size_t insns_cnt;
+
+  /* Inline caches of the property access sites, see `struct mjs_insn` */
+  struct mjs_prop_cache *prop_caches;
+
+  /*
+   * Constant pool: string operands of the instructions, each distinct string
+   * is created once. The strings are owned, so the pool is a GC root.
+   */
+  mjs_val_t *consts;
+  size_t consts_cnt;
+
+  /*
+   * Number of values the code of the part, or any function of it, can push
+   * to the data stack; the room for them is reserved before running the part
+   */
+  size_t stack_max;
+
+#if MJS_ENABLE_JIT
+  /* Call counters and native code of the functions, see mjs_jit.h */
+  struct mjs_jit *jit;
+#endif
+
   /*
    * Result of evaluation (not parsing: if there is an error during parsing,
    * the bcode is not even committed). It is used to determine whether we
@@ -3051,10 +3167,16 @@ struct mjs {
   struct mbuf bcode_parts;
   size_t bcode_len;
   struct mbuf stack;
-  struct mbuf call_stack;
+  /*
+   * Length of the data stack up to which the running code can push, see
+   * exec_stack_reserve()
+   */
+  size_t stack_limit;
+  struct mbuf call_stack; /* Call frames (struct mjs_frame) */
   struct mbuf arg_stack;
   struct mbuf scopes;          /* Scope objects */
-  struct mbuf loop_addresses;  /* Addresses for breaks & continues */
+  struct mbuf scope_vars;      /* Variables of scopes (struct mjs_scope_var) */
+  struct mbuf loop_addresses;  /* Loops being executed (struct mjs_loop) */
   struct mbuf owned_strings;   /* Sequence of (varint len, char data[]) */
   struct mbuf foreign_strings; /* Sequence of (varint len, char *data) */
   struct mbuf owned_values;
@@ -3065,15 +3187,24 @@ struct mjs {
   enum mjs_err error;
   mjs_ffi_resolver_t *dlsym;  /* Symbol resolver function for FFI */
   ffi_cb_args_t *ffi_cb_args; /* List of FFI args descriptors */
+  mjs_trace_cb_t *trace_cb;   /* Execution trace hook, see mjs_set_trace() */
+  void *trace_user_data;
+  long exec_budget; /* Calls and loop iterations left, or -1 if unlimited */
+  struct mjs_exec_state exec_state; /* Suspended execution, see mjs_resume() */
+  int exec_depth; /* Number of nested mjs_execute() calls being run */
   size_t cur_bcode_offset;
 
   struct gc_arena object_arena;
   struct gc_arena node_arena;
   struct gc_arena ffi_sig_arena;
 
+  unsigned int prop_cache_epoch; /* See `struct mjs_prop_cache` */
+
   unsigned inhibit_gc : 1;
   unsigned need_gc : 1;
   unsigned generate_jsc : 1;
+  unsigned can_suspend : 1; /* Whether the outermost execution can suspend */
+  unsigned suspended : 1;   /* Whether `exec_state` is valid */
 };
 
 /*
@@ -3087,14 +3218,48 @@ enum mjs_header_items {
                                 counting the OP_BCODE_HEADER byte) */
   MJS_HDR_ITEM_MAP_OFFSET,   /* Offset to the start of offset-to-line_no mapping
                                 k*/
+  MJS_HDR_ITEM_VERSION,      /* Bcode format version, see MJS_BCODE_VERSION.
+                                Version 0 bcode does not have this item */
 
   MJS_HDR_ITEMS_CNT
 };
 
+/*
+ * Version of the bcode format generated by the parser. Bcode of all the
+ * versions up to this one can be executed.
+ *
+ * 0: initial format;
+ * 1: OP_PUSH_DBL operand is a binary double instead of a decimal string.
+ */
+#define MJS_BCODE_VERSION 1
+
 MJS_PRIVATE size_t mjs_get_func_addr(mjs_val_t v);
 
 MJS_PRIVATE int mjs_getretvalpos(struct mjs *mjs);
 
+/*
+ * Returns the number of frames in the call stack
+ */
+MJS_PRIVATE size_t mjs_call_frames_cnt(struct mjs *mjs);
+
+/*
+ * Returns the call frame `n` frames below the top one, or NULL if there's no
+ * such frame
+ */
+MJS_PRIVATE struct mjs_frame *mjs_call_frame(struct mjs *mjs, size_t n);
+
+/*
+ * Pops scopes from `mjs->scopes`, leaving `n` of them, and drops variables of
+ * the popped scopes.
+ *
+ * Scopes of blocks and function calls are pushed by OP_NEW_SCOPE as
+ * `undefined` rather than as new objects: their variables are kept in
+ * `mjs->scope_vars` instead, in the order they are created, so all variables
+ * of a scope are released at once here. Such a scope is turned into an object
+ * only when the object itself is needed, see OP_FIND_SCOPE.
+ */
+MJS_PRIVATE void mjs_scopes_truncate(struct mjs *mjs, size_t n);
+
 MJS_PRIVATE enum mjs_type mjs_get_type(mjs_val_t v);
 
 /*
@@ -3481,6 +3646,48 @@ enum mjs_opcode {
   OP_BCODE_HEADER, /* ( -- ) */
   OP_ARGS,         /* ( -- ) Mark the beginning of function call arguments */
   OP_FOR_IN_NEXT,  /* ( name obj iter_ptr -- name obj iter_ptr_next ) */
+  /*
+   * Superinstructions for the common sequences, all of them take a string
+   * operand (the name):
+   */
+  OP_GET_VAR,        /* ( -- a ) Like PUSH_STR FIND_SCOPE GET */
+  OP_SET_VAR,        /* ( a -- a ) Like PUSH_STR FIND_SCOPE ... EXPR = */
+  OP_CREATE_VAR,     /* ( -- ) Like PUSH_STR PUSH_SCOPE CREATE */
+  OP_GET_PROP_CONST, /* ( obj -- obj[name] ) Like PUSH_STR SWAP GET */
+  /*
+   * Local variables resolved by the parser to slots of the function frame,
+   * see parse_function(). Slots live on the data stack, right after the
+   * function being called: the first ones are the arguments.
+   */
+  OP_GET_LOCAL, /* ( -- a ) Push the value of the slot */
+  OP_SET_LOCAL, /* ( a -- a ) Set the slot to the TOS */
+  OP_LOCALS,    /* ( -- ) Reserve slots: nparams nslots */
+  /* One more superinstruction with a string operand, like the ones above */
+  OP_SET_PROP_CONST, /* ( obj a -- a ) Like PUSH_STR SWAP ... EXPR = */
+  /*
+   * Binary operators with their own opcodes, so that numbers can be handled
+   * right away. Each one is like EXPR with the corresponding operator.
+   */
+  OP_ADD,   /* ( a b -- a+b ) */
+  OP_SUB,   /* ( a b -- a-b ) */
+  OP_MUL,   /* ( a b -- a*b ) */
+  OP_DIV,   /* ( a b -- a/b ) */
+  OP_LT,    /* ( a b -- a<b ) */
+  OP_LE,    /* ( a b -- a<=b ) */
+  OP_GT,    /* ( a b -- a>b ) */
+  OP_GE,    /* ( a b -- a>=b ) */
+  OP_EQ_EQ, /* ( a b -- a===b ) */
+  OP_NE_NE, /* ( a b -- a!==b ) */
+  /*
+   * Comparisons fused with OP_JMP_FALSE, for conditions of loops and `if`;
+   * the order is the same as of the comparison opcodes above.
+   */
+  OP_JMP_FALSE_LT,    /* ( a b -- ) Like LT JMP_FALSE */
+  OP_JMP_FALSE_LE,    /* ( a b -- ) Like LE JMP_FALSE */
+  OP_JMP_FALSE_GT,    /* ( a b -- ) Like GT JMP_FALSE */
+  OP_JMP_FALSE_GE,    /* ( a b -- ) Like GE JMP_FALSE */
+  OP_JMP_FALSE_EQ_EQ, /* ( a b -- ) Like EQ_EQ JMP_FALSE */
+  OP_JMP_FALSE_NE_NE, /* ( a b -- ) Like NE_NE JMP_FALSE */
   OP_MAX
 };
 
@@ -3490,6 +3697,20 @@ struct mjs;
 MJS_PRIVATE void emit_byte(struct pstate *pstate, uint8_t byte);
 MJS_PRIVATE void emit_int(struct pstate *pstate, int64_t n);
 MJS_PRIVATE void emit_str(struct pstate *pstate, const char *ptr, size_t len);
+MJS_PRIVATE void emit_dbl(struct pstate *pstate, double d);
+
+/*
+ * Returns bcode format version of the bcode part which starts with
+ * OP_BCODE_HEADER at `data`.
+ */
+MJS_PRIVATE mjs_header_item_t mjs_bcode_version(const uint8_t *data);
+
+/*
+ * Returns size of the header items of the bcode part which starts with
+ * OP_BCODE_HEADER at `data`, i.e. the offset of the filename after the
+ * OP_BCODE_HEADER byte.
+ */
+MJS_PRIVATE size_t mjs_bcode_header_size(const uint8_t *data);
 
 /*
  * Inserts provided offset `v` at the offset `offset`.
@@ -3512,11 +3733,37 @@ MJS_PRIVATE void mjs_bcode_part_add(struct mjs *mjs,
 MJS_PRIVATE struct mjs_bcode_part *mjs_bcode_part_get(struct mjs *mjs, int num);
 
 /*
- * Returns bcode part by the global bcode offset
+ * Returns bcode part by the global bcode offset, or NULL if there is no such
+ * offset. Takes O(log n) of the number of parts.
  */
 MJS_PRIVATE struct mjs_bcode_part *mjs_bcode_part_get_by_offset(struct mjs *mjs,
                                                                 size_t offset);
 
+/*
+ * Decodes instructions of the given bcode part into `bp->insns`, unless it's
+ * already done. The interpreter executes decoded instructions, so that
+ * operands are decoded only once per part, and not every time the instruction
+ * is executed. String operands are interned into `bp->consts`.
+ */
+MJS_PRIVATE void mjs_bcode_part_decode(struct mjs *mjs,
+                                       struct mjs_bcode_part *bp);
+
+/*
+ * Returns index of the decoded instruction at the given offset in the bcode
+ * part. The part should be already decoded.
+ */
+MJS_PRIVATE size_t mjs_bcode_part_insn_idx(const struct mjs_bcode_part *bp,
+                                           size_t offset);
+
+/*
+ * Peephole optimizer of the code generated by the parser: from
+ * `p->start_bcode_idx` up to `p->cur_idx`, which should end with OP_EXIT.
+ * Threads jumps to unconditional jumps, and removes jumps to the next
+ * instruction, as well as values which are pushed and dropped right away.
+ * Offset operands, `p->cur_idx` and the line numbers map are adjusted.
+ */
+MJS_PRIVATE void mjs_bcode_optimize(struct pstate *p);
+
 /*
  * Returns a number of bcode parts
  */
@@ -3533,6 +3780,120 @@ MJS_PRIVATE void mjs_bcode_commit(struct mjs *mjs);
 
 #endif /* MJS_BCODE_H_ */
 #ifdef MJS_MODULE_LINES
+#line 1 "src/mjs_jit.h"
+#endif
+
+#ifndef MJS_JIT_H_
+#define MJS_JIT_H_
+
+/* Amalgamated: #include "mjs_core.h" */
+/* Amalgamated: #include "mjs_internal.h" */
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* __cplusplus */
+
+#if MJS_ENABLE_JIT
+
+/*
+ * Template JIT: once a function is called MJS_JIT_THRESHOLD times, its decoded
+ * instructions are translated into x86-64 code, one template per instruction.
+ * Numbers, stack and local slots, and jumps are handled by the native code
+ * itself; most of the other opcodes call the same C helpers as the
+ * interpreter, see `struct mjs_jit_helpers`. Calls, returns and a few rare
+ * opcodes are left to the interpreter: the native code returns to it right
+ * before such an instruction, and it enters the native code again right after
+ * (see `op_jit` in exec_run()).
+ */
+
+/*
+ * Entry of `code` of the instructions which are always executed by the
+ * interpreter
+ */
+#define MJS_JIT_EXIT ((void *) 1)
+
+/* JIT state of a bcode part, created along with its decoded instructions */
+struct mjs_jit {
+  /* Number of calls, by index of the first instruction of the function */
+  uint32_t *calls;
+  /*
+   * Native code of the compiled instructions, by index: NULL if the
+   * instruction is not compiled, MJS_JIT_EXIT if it's executed by the
+   * interpreter
+   */
+  void **code;
+  /* Entry point of the native code, see mjs_jit_run() */
+  void *enter;
+  /* Executable memory of the compiled functions, see mjs_jit_compile() */
+  struct mjs_jit_block *blocks;
+};
+
+/* State of the interpreter which is visible to the native code */
+struct mjs_jit_ctx {
+  size_t frame_base;   /* See exec_frame_base() */
+  uint8_t prev_opcode; /* Opcode of the last executed instruction */
+};
+
+/*
+ * C helpers called by the native code; each one does what the interpreter
+ * does for the given opcode.
+ */
+struct mjs_jit_helpers {
+  void (*expr)(struct mjs *mjs, int op);
+  /* Comparison `op` fused with OP_JMP_FALSE: returns truthiness of the result */
+  int (*cmp)(struct mjs *mjs, int op);
+  void (*get)(struct mjs *mjs, struct mjs_prop_cache *c, int prev_opcode);
+  void (*get_var)(struct mjs *mjs, mjs_val_t key);
+  void (*set_var)(struct mjs *mjs, mjs_val_t key);
+  void (*create_var)(struct mjs *mjs, mjs_val_t key);
+  void (*get_prop_const)(struct mjs *mjs, mjs_val_t key,
+                         struct mjs_prop_cache *c);
+  void (*set_prop_const)(struct mjs *mjs, mjs_val_t key,
+                         struct mjs_prop_cache *c);
+  void (*assign)(struct mjs *mjs, struct mjs_prop_cache *c);
+  void (*find_scope)(struct mjs *mjs);
+  void (*args)(struct mjs *mjs, int prev_opcode);
+  void (*setretval)(struct mjs *mjs);
+  void (*loop)(struct mjs *mjs, size_t brk, size_t cont);
+  /*
+   * OP_CONTINUE and OP_BREAK: return index of the instruction to jump to, or
+   * (size_t) -1 if the instruction has to be executed by the interpreter.
+   */
+  size_t (*cont)(struct mjs *mjs);
+  size_t (*brk)(struct mjs *mjs);
+};
+
+/* Creates JIT state of the bcode part with `insns_cnt` instructions */
+MJS_PRIVATE struct mjs_jit *mjs_jit_create(size_t insns_cnt);
+
+/* Frees JIT state and all native code of the bcode part */
+MJS_PRIVATE void mjs_jit_free(struct mjs_jit *jit);
+
+/*
+ * Compiles the function whose first instruction is `entry`, setting its
+ * entries in `bp->jit->code`. If the function can't be compiled, nothing is
+ * changed, and it's executed by the interpreter.
+ */
+MJS_PRIVATE void mjs_jit_compile(struct mjs *mjs,
+                                 const struct mjs_bcode_part *bp, size_t entry,
+                                 const struct mjs_jit_helpers *h);
+
+/*
+ * Runs native code `code` of an instruction. Returns index of the next
+ * instruction, which is to be executed by the interpreter: either it's one
+ * which is not compiled, or an error was set by the instruction itself.
+ */
+MJS_PRIVATE size_t mjs_jit_run(struct mjs *mjs, const struct mjs_jit *jit,
+                               struct mjs_jit_ctx *ctx, void *code);
+
+#endif /* MJS_ENABLE_JIT */
+
+#if defined(__cplusplus)
+}
+#endif /* __cplusplus */
+
+#endif /* MJS_JIT_H_ */
+#ifdef MJS_MODULE_LINES
 #line 1 "src/mjs_tok.h"
 #endif
 
@@ -3565,6 +3926,22 @@ struct pstate {
   int cur_idx; /* Index in mjs->bcode at which newly generated code is inserted
                   */
   int depth;
+  int expr_start_idx;    /* cur_idx at the start of the current assignment */
+  struct tok assign_var; /* Variable assigned with `=`, see parse_assignment */
+  int assign_slot;       /* Local slot of assign_var, or -1 */
+  int assign_prop;       /* If assign_var is a property: cur_idx after it */
+  struct mbuf locals;    /* Names of the local slots in scope (struct tok) */
+  int locals_block;      /* Index of the first slot of the current block */
+  int locals_max;        /* Number of slots used by the current function */
+  int use_locals;        /* Whether the current function uses local slots */
+  int local_ref;         /* Slot pushed by the last identifier, or -1 */
+  int local_ref_idx;     /* cur_idx right after local_ref was pushed */
+  int loops;             /* Loops being parsed in the current function */
+  int cmp_idx;           /* cur_idx of the last comparison opcode, or -1 */
+  int lits[4];           /* Offsets of the literals just emitted: fold_op() */
+  int lits_cnt;          /* Number of items in `lits` */
+  int lits_end;          /* cur_idx after the last literal */
+  size_t lits_map_len;   /* offset_lineno_map.len after the last literal */
 };
 
 enum {
@@ -3724,6 +4101,13 @@ extern "C" {
 
 MJS_PRIVATE mjs_err_t mjs_execute(struct mjs *mjs, size_t off, mjs_val_t *res);
 
+/*
+ * Applies arithmetic or bitwise operator `op` (TOK_PLUS, etc) to numbers.
+ * Sets `resnan` if the result is NaN. Also used by the parser for constant
+ * folding.
+ */
+MJS_PRIVATE double do_arith_op(double da, double db, int op, bool *resnan);
+
 #if defined(__cplusplus)
 }
 #endif /* __cplusplus */
@@ -7132,6 +7516,8 @@ clean:
 /* Amalgamated: #include "mjs_internal.h" */
 /* Amalgamated: #include "mjs_bcode.h" */
 /* Amalgamated: #include "mjs_core.h" */
+/* Amalgamated: #include "mjs_jit.h" */
+/* Amalgamated: #include "mjs_string.h" */
 /* Amalgamated: #include "mjs_tok.h" */
 
 static void add_lineno_map_item(struct pstate *pstate) {
@@ -7184,6 +7570,39 @@ MJS_PRIVATE void emit_str(struct pstate *pstate, const char *ptr, size_t len) {
   pstate->cur_idx += llen + len;
 }
 
+MJS_PRIVATE void emit_dbl(struct pstate *pstate, double d) {
+  add_lineno_map_item(pstate);
+  mbuf_insert(&pstate->mjs->bcode_gen, pstate->cur_idx, &d, sizeof(d));
+  pstate->cur_idx += sizeof(d);
+}
+
+MJS_PRIVATE mjs_header_item_t mjs_bcode_version(const uint8_t *data) {
+  const char *items = (const char *) data + 1 /* OP_BCODE_HEADER */;
+  const char *v0_filename =
+      items + sizeof(mjs_header_item_t) * MJS_HDR_ITEM_VERSION;
+  mjs_header_item_t bcode_offset, version;
+  memcpy(&bcode_offset,
+         items + sizeof(mjs_header_item_t) * MJS_HDR_ITEM_BCODE_OFFSET,
+         sizeof(bcode_offset));
+  /*
+   * Version 0 header has no version item, and the NUL-terminated filename
+   * follows the map offset, right up to the bcode. In later versions, there's
+   * a version item which contains zero bytes in place of the filename, so
+   * it can't span up to the bcode.
+   */
+  if (v0_filename + strlen(v0_filename) + 1 == items + bcode_offset) {
+    return 0;
+  }
+  memcpy(&version, v0_filename, sizeof(version));
+  return version;
+}
+
+MJS_PRIVATE size_t mjs_bcode_header_size(const uint8_t *data) {
+  return sizeof(mjs_header_item_t) *
+         (mjs_bcode_version(data) == 0 ? MJS_HDR_ITEM_VERSION
+                                       : MJS_HDR_ITEMS_CNT);
+}
+
 MJS_PRIVATE int mjs_bcode_insert_offset(struct pstate *p, struct mjs *mjs,
                                         size_t offset, size_t v) {
   int llen = (int) cs_varint_llen(v);
@@ -7209,6 +7628,8 @@ MJS_PRIVATE int mjs_bcode_insert_offset(struct pstate *p, struct mjs *mjs,
   if (p->cur_idx >= (int) offset) {
     p->cur_idx += diff;
   }
+  /* The code moves, and the jump target is here: no folding across it */
+  p->lits_cnt = 0;
   return diff;
 }
 
@@ -7226,147 +7647,797 @@ MJS_PRIVATE struct mjs_bcode_part *mjs_bcode_part_get(struct mjs *mjs,
 
 MJS_PRIVATE struct mjs_bcode_part *mjs_bcode_part_get_by_offset(struct mjs *mjs,
                                                                 size_t offset) {
-  int i;
-  int parts_cnt = mjs_bcode_parts_cnt(mjs);
+  int lo = 0, hi = mjs_bcode_parts_cnt(mjs) - 1;
   struct mjs_bcode_part *bp = NULL;
 
   if (offset >= mjs->bcode_len) {
     return NULL;
   }
 
-  for (i = 0; i < parts_cnt; i++) {
-    bp = mjs_bcode_part_get(mjs, i);
-    if (offset < bp->start_idx + bp->data.len) {
-      break;
+  /*
+   * Parts are only appended, each one right after the previous, so they are
+   * sorted by `start_idx`: find the last one starting at or before the offset
+   */
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (mjs_bcode_part_get(mjs, mid)->start_idx <= offset) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
     }
   }
+  bp = mjs_bcode_part_get(mjs, lo);
 
   /* given the non-corrupted data, the needed part must be found */
-  assert(i < parts_cnt);
+  assert(offset - bp->start_idx < bp->data.len);
 
   return bp;
 }
 
-MJS_PRIVATE int mjs_bcode_parts_cnt(struct mjs *mjs) {
-  return mjs->bcode_parts.len / sizeof(struct mjs_bcode_part);
-}
-
-MJS_PRIVATE void mjs_bcode_commit(struct mjs *mjs) {
-  struct mjs_bcode_part bp;
-  memset(&bp, 0, sizeof(bp));
-
-  /* Make sure the bcode doesn't occupy any extra space */
-  mbuf_trim(&mjs->bcode_gen);
-
-  /* Transfer the ownership of the bcode data */
-  bp.data.p = mjs->bcode_gen.buf;
-  bp.data.len = mjs->bcode_gen.len;
-  mbuf_init(&mjs->bcode_gen, 0);
-
-  bp.start_idx = mjs->bcode_len;
-  bp.exec_res = MJS_ERRS_CNT;
-
-  mjs_bcode_part_add(mjs, &bp);
-
-  mjs->bcode_len += bp.data.len;
-}
-#ifdef MJS_MODULE_LINES
-#line 1 "src/mjs_builtin.c"
-#endif
-
-/* Amalgamated: #include "mjs_bcode.h" */
-/* Amalgamated: #include "mjs_core.h" */
-/* Amalgamated: #include "mjs_dataview.h" */
-/* Amalgamated: #include "mjs_exec.h" */
-/* Amalgamated: #include "mjs_gc.h" */
-/* Amalgamated: #include "mjs_internal.h" */
-/* Amalgamated: #include "mjs_json.h" */
-/* Amalgamated: #include "mjs_object.h" */
-/* Amalgamated: #include "mjs_primitive.h" */
-/* Amalgamated: #include "mjs_string.h" */
-/* Amalgamated: #include "mjs_util.h" */
-
-static void mjs_print(struct mjs *mjs) {
-  size_t i, num_args = mjs_nargs(mjs);
-  for (i = 0; i < num_args; i++) {
-    mjs_fprintf(mjs_arg(mjs, i), mjs, stdout);
-    putchar(' ');
+MJS_PRIVATE size_t mjs_bcode_part_insn_idx(const struct mjs_bcode_part *bp,
+                                           size_t offset) {
+  size_t lo = 0, hi = bp->insns_cnt - 1;
+  /* Find the first instruction at or after the given offset */
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (bp->insns[mid].off < offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
   }
-  putchar('\n');
-  mjs_return(mjs, MJS_UNDEFINED);
+  return lo;
 }
 
 /*
- * If the file with the given filename was already loaded, returns the
- * corresponding bcode part; otherwise returns NULL.
+ * Returns index of the string `p`, `len` in the constant pool of the part,
+ * adding it to the pool if it's not there yet. `tab` is a hash table of pool
+ * indices plus one, of size `tab_size` (a power of two), which should be
+ * larger than the pool.
  */
-static struct mjs_bcode_part *mjs_get_loaded_file_bcode(struct mjs *mjs,
-                                                        const char *filename) {
-  int parts_cnt = mjs_bcode_parts_cnt(mjs);
-  int i;
-
-  if (filename == NULL) {
-    return 0;
+static size_t bcode_part_intern(struct mjs *mjs, struct mjs_bcode_part *bp,
+                                size_t *tab, size_t tab_size, const char *p,
+                                size_t len) {
+  size_t h = 2166136261u, j;
+  for (j = 0; j < len; j++) {
+    h = (h ^ (uint8_t) p[j]) * 16777619u;
+  }
+  for (h &= tab_size - 1; tab[h] != 0; h = (h + 1) & (tab_size - 1)) {
+    size_t n;
+    const char *s = mjs_get_string(mjs, &bp->consts[tab[h] - 1], &n);
+    if (n == len && memcmp(s, p, len) == 0) return tab[h] - 1;
   }
+  bp->consts[bp->consts_cnt] = mjs_mk_string(mjs, p, len, 1);
+  tab[h] = ++bp->consts_cnt;
+  return tab[h] - 1;
+}
 
-  for (i = 0; i < parts_cnt; i++) {
-    struct mjs_bcode_part *bp = mjs_bcode_part_get(mjs, i);
-    const char *cur_fn = mjs_get_bcode_filename(mjs, bp);
-    if (strcmp(filename, cur_fn) == 0) {
-      return bp;
+/*
+ * Returns the number of values the instructions `from` ... `to` - 1 can push
+ * to the data stack. No instruction pushes more than one value, except
+ * OP_LOCALS which pushes the slots; a loop leaves the stack as it was, so
+ * each instruction is counted once. Bodies of nested functions are skipped,
+ * the room for them is reserved when they are called.
+ */
+static size_t bcode_stack_need(const struct mjs_insn *insns, size_t from,
+                               size_t to) {
+  size_t k, need = 0;
+  for (k = from; k < to; k++) {
+    if (insns[k].opcode == OP_JMP && insns[k].b != 0 && insns[k].a > k) {
+      /* Continue at OP_PUSH_FUNC of the nested function */
+      k = insns[k].a - 1;
+    } else {
+      need += insns[k].opcode == OP_LOCALS ? insns[k].a : 1;
     }
   }
-  return NULL;
+  return need;
 }
 
-static void mjs_load(struct mjs *mjs) {
-  mjs_val_t res = MJS_UNDEFINED;
-  mjs_val_t arg0 = mjs_arg(mjs, 0);
-  mjs_val_t arg1 = mjs_arg(mjs, 1);
-  int custom_global = 0; /* whether the custom global object was provided */
+MJS_PRIVATE void mjs_bcode_part_decode(struct mjs *mjs,
+                                       struct mjs_bcode_part *bp) {
+  const uint8_t *code = (const uint8_t *) bp->data.p;
+  size_t i = 0, end = bp->data.len, k, ncaches = 0, nstrs = 0, tab_size = 1;
+  size_t *tab;
+  mjs_header_item_t version = MJS_BCODE_VERSION;
+  struct mbuf insns;
+  struct mjs_insn in;
 
-  if (mjs_is_string(arg0)) {
-    const char *path = mjs_get_cstring(mjs, &arg0);
-    struct mjs_bcode_part *bp = NULL;
-    mjs_err_t ret;
+  if (bp->insns != NULL) return;
 
-    if (mjs_is_object(arg1)) {
-      custom_global = 1;
-      push_mjs_val(&mjs->scopes, arg1);
-    }
-    bp = mjs_get_loaded_file_bcode(mjs, path);
-    if (bp == NULL) {
-      /* File was not loaded before, so, load */
-      ret = mjs_exec_file(mjs, path, &res);
-    } else {
-      /*
-       * File was already loaded before, so if it was evaluated successfully,
-       * then skip the evaluation at all (and assume MJS_OK); otherwise
-       * re-evaluate it again.
-       *
-       * However, if the custom global object was provided, then reevaluate
-       * the file in any case.
-       */
-      if (bp->exec_res != MJS_OK || custom_global) {
-        ret = mjs_execute(mjs, bp->start_idx, &res);
-      } else {
-        ret = MJS_OK;
-      }
-    }
-    if (ret != MJS_OK) {
-      /*
-       * arg0 and path might be invalidated by executing a file, so refresh
-       * them
-       */
-      arg0 = mjs_arg(mjs, 0);
-      path = mjs_get_cstring(mjs, &arg0);
-      mjs_prepend_errorf(mjs, ret, "failed to exec file \"%s\"", path);
-      goto clean;
-    }
+  mbuf_init(&insns, 0);
+  memset(&in, 0, sizeof(in));
+
+  if (end > 0 && code[0] == OP_BCODE_HEADER) {
+    /* Skip the header and the filename, and don't decode the line map */
+    mjs_header_item_t bcode_offset, map_offset;
+    memcpy(&bcode_offset, code + 1 + sizeof(mjs_header_item_t) *
+                                         MJS_HDR_ITEM_BCODE_OFFSET,
+           sizeof(bcode_offset));
+    memcpy(&map_offset,
+           code + 1 + sizeof(mjs_header_item_t) * MJS_HDR_ITEM_MAP_OFFSET,
+           sizeof(map_offset));
+    version = mjs_bcode_version(code);
+    in.opcode = OP_BCODE_HEADER;
+    mbuf_append(&insns, &in, sizeof(in));
+    i = 1 + bcode_offset;
+    end = 1 + map_offset;
+  }
+
+  while (i < end) {
+    int llen, llen2;
+    memset(&in, 0, sizeof(in));
+    in.opcode = code[i];
+    in.off = i;
+    i++;
+    switch (in.opcode) {
+      case OP_JMP:
+      case OP_JMP_TRUE:
+      case OP_JMP_NEUTRAL_TRUE:
+      case OP_JMP_FALSE:
+      case OP_JMP_NEUTRAL_FALSE:
+      case OP_JMP_FALSE_LT:
+      case OP_JMP_FALSE_LE:
+      case OP_JMP_FALSE_GT:
+      case OP_JMP_FALSE_GE:
+      case OP_JMP_FALSE_EQ_EQ:
+      case OP_JMP_FALSE_NE_NE: {
+        /* Jump targets are resolved to instruction indices below */
+        uint64_t n = cs_varint_decode_unsafe(&code[i], &llen);
+        i += llen;
+        in.a = i + n;
+        break;
+      }
+      case OP_LOOP: {
+        uint64_t n1 = cs_varint_decode_unsafe(&code[i], &llen);
+        uint64_t n2 = cs_varint_decode_unsafe(&code[i + llen], &llen2);
+        in.a = i + llen + n1;
+        in.b = i + llen + llen2 + n2;
+        i += llen + llen2;
+        break;
+      }
+      case OP_PUSH_FUNC: {
+        uint64_t n = cs_varint_decode_unsafe(&code[i], &llen);
+        in.v.i = bp->start_idx + in.off - n;
+        i += llen;
+        break;
+      }
+      case OP_PUSH_INT:
+        in.v.i = cs_varint_decode_unsafe(&code[i], &llen);
+        i += llen;
+        break;
+      case OP_PUSH_DBL:
+        if (version >= 1) {
+          memcpy(&in.v.d, code + i, sizeof(in.v.d));
+          i += sizeof(in.v.d);
+        } else {
+          /* Version 0 bcode: the number is a decimal string */
+          char buf[50];
+          size_t n = cs_varint_decode_unsafe(&code[i], &llen);
+          i += llen;
+          if (n >= sizeof(buf)) n = sizeof(buf) - 1;
+          memcpy(buf, code + i, n);
+          buf[n] = '\0';
+          in.v.d = strtod(buf, NULL);
+          i += n;
+        }
+        break;
+      case OP_PUSH_STR:
+      case OP_GET_VAR:
+      case OP_SET_VAR:
+      case OP_CREATE_VAR:
+      case OP_GET_PROP_CONST:
+      case OP_SET_PROP_CONST:
+        /* The string is interned below, keep its offset for now */
+        in.a = cs_varint_decode_unsafe(&code[i], &llen);
+        in.v.i = i + llen;
+        i += llen + in.a;
+        nstrs++;
+        break;
+      case OP_SET_ARG:
+        in.b = cs_varint_decode_unsafe(&code[i], &llen);
+        in.a = cs_varint_decode_unsafe(&code[i + llen], &llen2);
+        in.v.i = i + llen + llen2;
+        i += llen + llen2 + in.a;
+        nstrs++;
+        break;
+      case OP_GET_LOCAL:
+      case OP_SET_LOCAL:
+        in.a = cs_varint_decode_unsafe(&code[i], &llen);
+        i += llen;
+        break;
+      case OP_LOCALS:
+        in.b = cs_varint_decode_unsafe(&code[i], &llen);
+        in.a = cs_varint_decode_unsafe(&code[i + llen], &llen2);
+        i += llen + llen2;
+        break;
+      case OP_EXPR:
+        in.op = code[i];
+        i++;
+        break;
+      default:
+        break;
+    }
+    mbuf_append(&insns, &in, sizeof(in));
+  }
+
+  /* Terminate the stream, so that falling off the end exits */
+  memset(&in, 0, sizeof(in));
+  in.opcode = OP_EXIT;
+  in.off = end;
+  mbuf_append(&insns, &in, sizeof(in));
+
+  mbuf_trim(&insns);
+  bp->insns = (struct mjs_insn *) insns.buf;
+  bp->insns_cnt = insns.len / sizeof(in);
+
+  /*
+   * Convert jump targets from bcode offsets to instruction indices, give each
+   * property access site its inline cache, and turn string operands into
+   * values of the constant pool, so that they're not created every time the
+   * instruction is executed.
+   */
+  while (tab_size <= nstrs * 2) tab_size <<= 1;
+  tab = (size_t *) calloc(tab_size, sizeof(*tab));
+  bp->consts = (mjs_val_t *) calloc(nstrs > 0 ? nstrs : 1, sizeof(mjs_val_t));
+  for (k = 0; k < bp->insns_cnt; k++) {
+    struct mjs_insn *p = &bp->insns[k];
+    switch (p->opcode) {
+      case OP_PUSH_STR:
+      case OP_GET_VAR:
+      case OP_SET_VAR:
+      case OP_CREATE_VAR:
+      case OP_SET_ARG:
+        p->a = bcode_part_intern(mjs, bp, tab, tab_size,
+                                 (const char *) code + p->v.i, p->a);
+        break;
+      case OP_EXPR:
+        if (p->op == TOK_ASSIGN) p->b = ncaches++;
+        break;
+      case OP_GET_PROP_CONST:
+      case OP_SET_PROP_CONST:
+        p->a = bcode_part_intern(mjs, bp, tab, tab_size,
+                                 (const char *) code + p->v.i, p->a);
+        p->b = ncaches++;
+        break;
+      case OP_GET:
+        p->b = ncaches++;
+        break;
+      case OP_JMP:
+      case OP_JMP_TRUE:
+      case OP_JMP_NEUTRAL_TRUE:
+      case OP_JMP_FALSE:
+      case OP_JMP_NEUTRAL_FALSE:
+      case OP_JMP_FALSE_LT:
+      case OP_JMP_FALSE_LE:
+      case OP_JMP_FALSE_GT:
+      case OP_JMP_FALSE_GE:
+      case OP_JMP_FALSE_EQ_EQ:
+      case OP_JMP_FALSE_NE_NE:
+        p->a = mjs_bcode_part_insn_idx(bp, p->a);
+        break;
+      case OP_LOOP:
+        p->a = mjs_bcode_part_insn_idx(bp, p->a);
+        p->b = mjs_bcode_part_insn_idx(bp, p->b);
+        break;
+      default:
+        break;
+    }
+  }
+  free(tab);
+
+  /*
+   * Parameters of a function which doesn't use local slots are bound by a run
+   * of OP_SET_ARG, and the first one of them binds all the run at once. The
+   * run is cut before a repeated name, which has to be bound on its own.
+   */
+  for (k = bp->insns_cnt; k-- > 0;) {
+    struct mjs_insn *p = &bp->insns[k];
+    if (p->opcode == OP_SET_ARG) {
+      size_t j, n = p[1].opcode == OP_SET_ARG && p[1].op < 255 ? p[1].op : 0;
+      for (j = 1; j <= n; j++) {
+        if (p[j].a == p->a) break;
+      }
+      p->op = j > n ? n + 1 : 1;
+    }
+  }
+
+  /*
+   * A function body is preceded by OP_JMP over it, which keeps the number of
+   * values the function can push: OP_CALL leaves the index of the OP_JMP as
+   * the current one, and reserves the room before running the body. Nested
+   * functions come before the outer ones' OP_PUSH_FUNC, so they are counted
+   * first.
+   */
+  bp->stack_max = 0;
+  for (k = 0; k < bp->insns_cnt; k++) {
+    struct mjs_insn *p = &bp->insns[k];
+    if (p->opcode == OP_PUSH_FUNC) {
+      size_t entry =
+          mjs_bcode_part_insn_idx(bp, (size_t) p->v.i - bp->start_idx);
+      assert(entry > 0 && entry < k);
+      assert(bp->insns[entry - 1].opcode == OP_JMP);
+      bp->insns[entry - 1].b = bcode_stack_need(bp->insns, entry, k);
+      if (bp->insns[entry - 1].b > bp->stack_max) {
+        bp->stack_max = bp->insns[entry - 1].b;
+      }
+    }
+  }
+  k = bcode_stack_need(bp->insns, 0, bp->insns_cnt);
+  if (k > bp->stack_max) bp->stack_max = k;
+
+  bp->prop_caches = (struct mjs_prop_cache *) calloc(
+      ncaches > 0 ? ncaches : 1, sizeof(struct mjs_prop_cache));
+#if MJS_ENABLE_JIT
+  bp->jit = mjs_jit_create(bp->insns_cnt);
+#endif
+}
+
+/*
+ * Instruction of the code being optimized, see mjs_bcode_optimize()
+ */
+struct bcode_opt_insn {
+  size_t off;     /* Offset in the original code */
+  size_t len;     /* Length in the original code */
+  size_t noff;    /* Offset in the optimized code */
+  size_t tgt[2];  /* Instructions which the offset operands refer to */
+  size_t olen[2]; /* Lengths of the offset operands in the original code */
+  size_t llen[2]; /* Lengths of the offset operands in the optimized code */
+  int ntgt;       /* Number of offset operands */
+  uint8_t opcode;
+  int removed;
+  int is_target; /* Whether some offset operand refers to the instruction */
+};
+
+static int bcode_opt_is_jump(uint8_t opcode) {
+  switch (opcode) {
+    case OP_JMP:
+    case OP_JMP_TRUE:
+    case OP_JMP_NEUTRAL_TRUE:
+    case OP_JMP_FALSE:
+    case OP_JMP_NEUTRAL_FALSE:
+    case OP_JMP_FALSE_LT:
+    case OP_JMP_FALSE_LE:
+    case OP_JMP_FALSE_GT:
+    case OP_JMP_FALSE_GE:
+    case OP_JMP_FALSE_EQ_EQ:
+    case OP_JMP_FALSE_NE_NE:
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Whether the instruction just pushes a value, so that it can be removed
+ * together with OP_DROP which follows.
+ */
+static int bcode_opt_is_push(uint8_t opcode) {
+  switch (opcode) {
+    case OP_DUP:
+    case OP_PUSH_SCOPE:
+    case OP_PUSH_STR:
+    case OP_PUSH_TRUE:
+    case OP_PUSH_FALSE:
+    case OP_PUSH_INT:
+    case OP_PUSH_DBL:
+    case OP_PUSH_NULL:
+    case OP_PUSH_UNDEF:
+    case OP_PUSH_THIS:
+    case OP_GET_LOCAL:
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Decodes the instruction at `code[i]` into `in`. Offset operands (of jumps,
+ * OP_LOOP and OP_PUSH_FUNC) are stored as bcode offsets of the instructions
+ * they refer to.
+ */
+static void bcode_opt_decode(const uint8_t *code, size_t i,
+                             struct bcode_opt_insn *in) {
+  int llen, llen2;
+  size_t n;
+  memset(in, 0, sizeof(*in));
+  in->opcode = code[i];
+  in->off = i++;
+  if (bcode_opt_is_jump(in->opcode)) {
+    n = cs_varint_decode_unsafe(&code[i], &llen);
+    in->olen[0] = llen;
+    in->tgt[0] = i + llen + n;
+    in->ntgt = 1;
+    i += llen;
+  } else {
+    switch (in->opcode) {
+      case OP_LOOP:
+        n = cs_varint_decode_unsafe(&code[i], &llen);
+        in->olen[0] = llen;
+        in->tgt[0] = i + llen + n;
+        i += llen;
+        n = cs_varint_decode_unsafe(&code[i], &llen);
+        in->olen[1] = llen;
+        in->tgt[1] = i + llen + n;
+        in->ntgt = 2;
+        i += llen;
+        break;
+      case OP_PUSH_FUNC:
+        n = cs_varint_decode_unsafe(&code[i], &llen);
+        in->olen[0] = llen;
+        in->tgt[0] = in->off - n;
+        in->ntgt = 1;
+        i += llen;
+        break;
+      case OP_PUSH_INT:
+      case OP_GET_LOCAL:
+      case OP_SET_LOCAL:
+        cs_varint_decode_unsafe(&code[i], &llen);
+        i += llen;
+        break;
+      case OP_LOCALS:
+        cs_varint_decode_unsafe(&code[i], &llen);
+        cs_varint_decode_unsafe(&code[i + llen], &llen2);
+        i += llen + llen2;
+        break;
+      case OP_PUSH_DBL:
+        i += sizeof(double);
+        break;
+      case OP_PUSH_STR:
+      case OP_GET_VAR:
+      case OP_SET_VAR:
+      case OP_CREATE_VAR:
+      case OP_GET_PROP_CONST:
+      case OP_SET_PROP_CONST:
+        n = cs_varint_decode_unsafe(&code[i], &llen);
+        i += llen + n;
+        break;
+      case OP_SET_ARG:
+        cs_varint_decode_unsafe(&code[i], &llen);
+        n = cs_varint_decode_unsafe(&code[i + llen], &llen2);
+        i += llen + llen2 + n;
+        break;
+      case OP_EXPR:
+        i++;
+        break;
+      default:
+        break;
+    }
+  }
+  in->len = i - in->off;
+  in->llen[0] = in->olen[0];
+  in->llen[1] = in->olen[1];
+}
+
+/* Returns index of the instruction which starts at or contains `off` */
+static size_t bcode_opt_find(const struct bcode_opt_insn *insns, size_t cnt,
+                             size_t off) {
+  size_t lo = 0, hi = cnt - 1;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo + 1) / 2;
+    if (insns[mid].off <= off) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+/* Returns the first instruction which is not removed, starting from `k` */
+static size_t bcode_opt_live(const struct bcode_opt_insn *insns, size_t k) {
+  while (insns[k].removed) k++;
+  return k;
+}
+
+/* Returns length of the instruction in the optimized code */
+static size_t bcode_opt_len(const struct bcode_opt_insn *in) {
+  return in->len - in->olen[0] - in->olen[1] + in->llen[0] + in->llen[1];
+}
+
+/*
+ * Returns value of the offset operand `j` of the instruction `k` in the
+ * optimized code. Like in the original code, it's the distance from the end
+ * of the varint to the target, or, for OP_PUSH_FUNC, back from the opcode.
+ */
+static size_t bcode_opt_operand(const struct bcode_opt_insn *insns, size_t k,
+                                int j) {
+  const struct bcode_opt_insn *in = &insns[k];
+  if (in->opcode == OP_PUSH_FUNC) {
+    return in->noff - insns[in->tgt[0]].noff;
+  } else if (in->opcode == OP_LOOP) {
+    return insns[in->tgt[j]].noff -
+           (in->noff + 1 + in->llen[0] + (j == 1 ? in->llen[1] : 0));
+  }
+  return insns[in->tgt[0]].noff - (in->noff + bcode_opt_len(in));
+}
+
+/*
+ * Encodes varint into exactly `llen` bytes, which might be more than needed:
+ * then the extra bytes are zeros with the continuation bit set before them.
+ */
+static void bcode_opt_encode(uint64_t v, uint8_t *buf, size_t llen) {
+  size_t j;
+  for (j = 0; j < llen; j++) {
+    buf[j] = (uint8_t)((v & 0x7f) | (j + 1 < llen ? 0x80 : 0));
+    v >>= 7;
+  }
+}
+
+/* Maps offset in the original code to the offset in the optimized code */
+static size_t bcode_opt_map(const struct bcode_opt_insn *insns, size_t cnt,
+                            size_t off) {
+  size_t k = bcode_opt_find(insns, cnt, off);
+  if (off >= insns[k].off + insns[k].len) {
+    return insns[k].noff + bcode_opt_len(&insns[k]);
+  } else if (insns[k].removed || off == insns[k].off) {
+    /* Removed instructions are at the offset of the next live one */
+    return insns[k].noff;
+  }
+  /* Offset within the instruction stays within it */
+  return insns[k].noff + 1;
+}
+
+MJS_PRIVATE void mjs_bcode_optimize(struct pstate *p) {
+  struct mbuf *b = &p->mjs->bcode_gen;
+  const uint8_t *code = (const uint8_t *) b->buf + p->start_bcode_idx;
+  size_t size = p->cur_idx - p->start_bcode_idx, cnt = 0, i, k, j, t, n;
+  struct bcode_opt_insn *insns, in;
+  struct mbuf out, map;
+  int changed;
+
+  if (size == 0) return;
+
+  for (i = 0; i < size; i += in.len, cnt++) {
+    bcode_opt_decode(code, i, &in);
+  }
+  insns = (struct bcode_opt_insn *) calloc(cnt, sizeof(*insns));
+  for (i = 0, k = 0; k < cnt; i += insns[k++].len) {
+    bcode_opt_decode(code, i, &insns[k]);
+  }
+  /* Code ends with OP_EXIT, which is never removed */
+  assert(insns[cnt - 1].opcode == OP_EXIT);
+
+  /* Offset operands now refer to instruction indices */
+  for (k = 0; k < cnt; k++) {
+    for (j = 0; j < (size_t) insns[k].ntgt; j++) {
+      insns[k].tgt[j] = bcode_opt_find(insns, cnt, insns[k].tgt[j]);
+    }
+  }
+
+  do {
+    changed = 0;
+
+    /*
+     * Jump threading: a jump to OP_JMP can go right where OP_JMP leads to;
+     * the same for OP_JMP_NEUTRAL_... to the jump of the same kind, since the
+     * value being checked is the same.
+     */
+    for (k = 0; k < cnt; k++) {
+      uint8_t op = insns[k].opcode;
+      if (insns[k].removed || !bcode_opt_is_jump(op)) continue;
+      for (n = 0; n < cnt; n++) {
+        uint8_t top;
+        t = bcode_opt_live(insns, insns[k].tgt[0]);
+        top = insns[t].opcode;
+        if (t == k ||
+            !(top == OP_JMP || (top == op && (op == OP_JMP_NEUTRAL_TRUE ||
+                                              op == OP_JMP_NEUTRAL_FALSE)))) {
+          break;
+        }
+        insns[k].tgt[0] = insns[t].tgt[0];
+        changed = 1;
+      }
+    }
+
+    for (k = 0; k < cnt; k++) insns[k].is_target = 0;
+    for (k = 0; k < cnt; k++) {
+      if (insns[k].removed) continue;
+      for (j = 0; j < (size_t) insns[k].ntgt; j++) {
+        insns[bcode_opt_live(insns, insns[k].tgt[j])].is_target = 1;
+      }
+    }
+
+    for (k = 0; k + 1 < cnt; k++) {
+      uint8_t op = insns[k].opcode;
+      if (insns[k].removed) continue;
+      j = bcode_opt_live(insns, k + 1);
+      if (op == OP_NOP ||
+          (op == OP_JMP && bcode_opt_live(insns, insns[k].tgt[0]) == j)) {
+        /* Does nothing, or jumps to the next instruction */
+        insns[k].removed = 1;
+        changed = 1;
+      } else if (bcode_opt_is_push(op) && insns[j].opcode == OP_DROP &&
+                 !insns[j].is_target) {
+        /* Pushes a value which is dropped right away */
+        insns[k].removed = insns[j].removed = 1;
+        changed = 1;
+      }
+    }
+  } while (changed);
+
+  /*
+   * Lay out the optimized code. Offset operands can only shrink, since the
+   * code between instructions does, so repeat until the layout is stable.
+   * Note that removed instructions get offset of the next live one.
+   */
+  do {
+    changed = 0;
+    for (k = 0, i = 0; k < cnt; k++) {
+      insns[k].noff = i;
+      if (!insns[k].removed) i += bcode_opt_len(&insns[k]);
+    }
+    for (k = 0; k < cnt; k++) {
+      if (insns[k].removed) continue;
+      for (j = 0; j < (size_t) insns[k].ntgt; j++) {
+        size_t llen = cs_varint_llen(bcode_opt_operand(insns, k, j));
+        if (llen < insns[k].llen[j]) {
+          insns[k].llen[j] = llen;
+          changed = 1;
+        }
+      }
+    }
+  } while (changed);
+
+  mbuf_init(&out, size);
+  for (k = 0; k < cnt; k++) {
+    if (insns[k].removed) continue;
+    if (insns[k].ntgt == 0) {
+      mbuf_append(&out, code + insns[k].off, insns[k].len);
+      continue;
+    }
+    /* Instructions with offset operands have no other operands */
+    mbuf_append(&out, &insns[k].opcode, 1);
+    for (j = 0; j < (size_t) insns[k].ntgt; j++) {
+      mbuf_append(&out, NULL, insns[k].llen[j]);
+      bcode_opt_encode(bcode_opt_operand(insns, k, j),
+                       (uint8_t *) out.buf + out.len - insns[k].llen[j],
+                       insns[k].llen[j]);
+    }
+  }
+
+  /* Offsets of the line numbers map, see add_lineno_map_item() */
+  mbuf_init(&map, p->offset_lineno_map.len);
+  for (i = 0; i < p->offset_lineno_map.len;) {
+    int llen, llen2;
+    const uint8_t *m = (const uint8_t *) p->offset_lineno_map.buf + i;
+    size_t off = cs_varint_decode_unsafe(m, &llen);
+    size_t line_no = cs_varint_decode_unsafe(m + llen, &llen2);
+    off = bcode_opt_map(insns, cnt, off);
+    mbuf_append(&map, NULL, cs_varint_llen(off) + llen2);
+    cs_varint_encode(off, (uint8_t *) map.buf + map.len - llen2 -
+                              cs_varint_llen(off),
+                     cs_varint_llen(off));
+    cs_varint_encode(line_no, (uint8_t *) map.buf + map.len - llen2, llen2);
+    i += llen + llen2;
+  }
+  mbuf_free(&p->offset_lineno_map);
+  p->offset_lineno_map = map;
+
+  b->len = p->start_bcode_idx;
+  mbuf_append(b, out.buf, out.len);
+  p->cur_idx = b->len;
+  mbuf_free(&out);
+  free(insns);
+}
+
+MJS_PRIVATE int mjs_bcode_parts_cnt(struct mjs *mjs) {
+  return mjs->bcode_parts.len / sizeof(struct mjs_bcode_part);
+}
+
+MJS_PRIVATE void mjs_bcode_commit(struct mjs *mjs) {
+  struct mjs_bcode_part bp;
+  memset(&bp, 0, sizeof(bp));
+
+  /* Make sure the bcode doesn't occupy any extra space */
+  mbuf_trim(&mjs->bcode_gen);
+
+  /* Transfer the ownership of the bcode data */
+  bp.data.p = mjs->bcode_gen.buf;
+  bp.data.len = mjs->bcode_gen.len;
+  mbuf_init(&mjs->bcode_gen, 0);
+
+  bp.start_idx = mjs->bcode_len;
+  bp.exec_res = MJS_ERRS_CNT;
+
+  mjs_bcode_part_add(mjs, &bp);
+
+  mjs->bcode_len += bp.data.len;
+}
+#ifdef MJS_MODULE_LINES
+#line 1 "src/mjs_builtin.c"
+#endif
+
+/* Amalgamated: #include "mjs_bcode.h" */
+/* Amalgamated: #include "mjs_core.h" */
+/* Amalgamated: #include "mjs_dataview.h" */
+/* Amalgamated: #include "mjs_exec.h" */
+/* Amalgamated: #include "mjs_gc.h" */
+/* Amalgamated: #include "mjs_internal.h" */
+/* Amalgamated: #include "mjs_json.h" */
+/* Amalgamated: #include "mjs_object.h" */
+/* Amalgamated: #include "mjs_primitive.h" */
+/* Amalgamated: #include "mjs_string.h" */
+/* Amalgamated: #include "mjs_util.h" */
+
+static void mjs_print(struct mjs *mjs) {
+  size_t i, num_args = mjs_nargs(mjs);
+  for (i = 0; i < num_args; i++) {
+    mjs_fprintf(mjs_arg(mjs, i), mjs, stdout);
+    putchar(' ');
+  }
+  putchar('\n');
+  mjs_return(mjs, MJS_UNDEFINED);
+}
+
+/*
+ * If the file with the given filename was already loaded, returns the
+ * corresponding bcode part; otherwise returns NULL.
+ */
+static struct mjs_bcode_part *mjs_get_loaded_file_bcode(struct mjs *mjs,
+                                                        const char *filename) {
+  int parts_cnt = mjs_bcode_parts_cnt(mjs);
+  int i;
+
+  if (filename == NULL) {
+    return 0;
+  }
+
+  for (i = 0; i < parts_cnt; i++) {
+    struct mjs_bcode_part *bp = mjs_bcode_part_get(mjs, i);
+    const char *cur_fn = mjs_get_bcode_filename(mjs, bp);
+    if (strcmp(filename, cur_fn) == 0) {
+      return bp;
+    }
+  }
+  return NULL;
+}
+
+static void mjs_load(struct mjs *mjs) {
+  mjs_val_t res = MJS_UNDEFINED;
+  mjs_val_t arg0 = mjs_arg(mjs, 0);
+  mjs_val_t arg1 = mjs_arg(mjs, 1);
+  int custom_global = 0; /* whether the custom global object was provided */
+
+  if (mjs_is_string(arg0)) {
+    const char *path = mjs_get_cstring(mjs, &arg0);
+    struct mjs_bcode_part *bp = NULL;
+    mjs_err_t ret;
+
+    if (mjs_is_object(arg1)) {
+      custom_global = 1;
+      push_mjs_val(&mjs->scopes, arg1);
+    }
+    bp = mjs_get_loaded_file_bcode(mjs, path);
+    if (bp == NULL) {
+      /* File was not loaded before, so, load */
+      ret = mjs_exec_file(mjs, path, &res);
+    } else {
+      /*
+       * File was already loaded before, so if it was evaluated successfully,
+       * then skip the evaluation at all (and assume MJS_OK); otherwise
+       * re-evaluate it again.
+       *
+       * However, if the custom global object was provided, then reevaluate
+       * the file in any case.
+       */
+      if (bp->exec_res != MJS_OK || custom_global) {
+        ret = mjs_execute(mjs, bp->start_idx, &res);
+      } else {
+        ret = MJS_OK;
+      }
+    }
+    if (ret != MJS_OK) {
+      /*
+       * arg0 and path might be invalidated by executing a file, so refresh
+       * them
+       */
+      arg0 = mjs_arg(mjs, 0);
+      path = mjs_get_cstring(mjs, &arg0);
+      mjs_prepend_errorf(mjs, ret, "failed to exec file \"%s\"", path);
+      goto clean;
+    }
 
   clean:
     if (custom_global) {
-      mjs_pop_val(&mjs->scopes);
+      mjs_scopes_truncate(mjs, mjs_stack_size(&mjs->scopes) - 1);
     }
   }
   mjs_return(mjs, res);
@@ -7542,6 +8613,7 @@ MJS_PRIVATE int mjs_is_truthy(struct mjs *mjs, mjs_val_t v) {
 /* Amalgamated: #include "mjs_exec.h" */
 /* Amalgamated: #include "mjs_ffi.h" */
 /* Amalgamated: #include "mjs_internal.h" */
+/* Amalgamated: #include "mjs_jit.h" */
 /* Amalgamated: #include "mjs_object.h" */
 /* Amalgamated: #include "mjs_primitive.h" */
 /* Amalgamated: #include "mjs_string.h" */
@@ -7567,6 +8639,10 @@ MJS_PRIVATE int mjs_is_truthy(struct mjs *mjs, mjs_val_t v) {
 #define MJS_FUNC_FFI_ARENA_INC_SIZE 10
 #endif
 
+#ifndef MJS_CALL_STACK_INIT_FRAMES
+#define MJS_CALL_STACK_INIT_FRAMES 16
+#endif
+
 void mjs_destroy(struct mjs *mjs) {
   {
     int parts_cnt = mjs_bcode_parts_cnt(mjs);
@@ -7576,6 +8652,12 @@ void mjs_destroy(struct mjs *mjs) {
       if (!bp->in_rom) {
         free((void *) bp->data.p);
       }
+      free(bp->insns);
+      free(bp->prop_caches);
+      free(bp->consts);
+#if MJS_ENABLE_JIT
+      mjs_jit_free(bp->jit);
+#endif
     }
   }
 
@@ -7588,6 +8670,7 @@ void mjs_destroy(struct mjs *mjs) {
   mbuf_free(&mjs->foreign_strings);
   mbuf_free(&mjs->owned_values);
   mbuf_free(&mjs->scopes);
+  mbuf_free(&mjs->scope_vars);
   mbuf_free(&mjs->loop_addresses);
   mbuf_free(&mjs->json_visited_stack);
   free(mjs->error_msg);
@@ -7603,7 +8686,8 @@ struct mjs *mjs_create(void) {
   mjs_val_t global_object;
   struct mjs *mjs = calloc(1, sizeof(*mjs));
   mbuf_init(&mjs->stack, 0);
-  mbuf_init(&mjs->call_stack, 0);
+  mbuf_init(&mjs->call_stack,
+            sizeof(struct mjs_frame) * MJS_CALL_STACK_INIT_FRAMES);
   mbuf_init(&mjs->arg_stack, 0);
   mbuf_init(&mjs->owned_strings, 0);
   mbuf_init(&mjs->foreign_strings, 0);
@@ -7611,6 +8695,7 @@ struct mjs *mjs_create(void) {
   mbuf_init(&mjs->bcode_parts, 0);
   mbuf_init(&mjs->owned_values, 0);
   mbuf_init(&mjs->scopes, 0);
+  mbuf_init(&mjs->scope_vars, 0);
   mbuf_init(&mjs->loop_addresses, 0);
   mbuf_init(&mjs->json_visited_stack, 0);
 
@@ -7638,6 +8723,7 @@ struct mjs *mjs_create(void) {
   mjs_set_ffi_resolver(mjs, dlsym);
   push_mjs_val(&mjs->scopes, global_object);
   mjs->vals.this_obj = MJS_UNDEFINED;
+  mjs->exec_budget = -1;
   mjs->vals.dataview_proto = MJS_UNDEFINED;
 
   return mjs;
@@ -7721,7 +8807,7 @@ const char *mjs_strerror(struct mjs *mjs, enum mjs_err err) {
       "NO_ERROR",        "SYNTAX_ERROR",    "REFERENCE_ERROR",
       "TYPE_ERROR",      "OUT_OF_MEMORY",   "INTERNAL_ERROR",
       "NOT_IMPLEMENTED", "FILE_READ_ERROR", "FILE_WRITE_ERROR",
-      "BAD_ARGUMENTS"};
+      "BAD_ARGUMENTS",   "BUDGET_EXHAUSTED", "SUSPENDED"};
   return mjs->error_msg == NULL || mjs->error_msg[0] == '\0' ? err_names[err]
                                                              : mjs->error_msg;
 }
@@ -7794,23 +8880,35 @@ static void mjs_append_stack_trace_line(struct mjs *mjs, size_t offset) {
 
 MJS_PRIVATE void mjs_gen_stack_trace(struct mjs *mjs, size_t offset) {
   mjs_append_stack_trace_line(mjs, offset);
-  while (mjs->call_stack.len >=
-         sizeof(mjs_val_t) * CALL_STACK_FRAME_ITEMS_CNT) {
-    int i;
-
+  while (mjs_call_frames_cnt(mjs) > 0) {
     /* set current offset to it to the offset stored in the frame */
-    offset = mjs_get_int(
-        mjs, *vptr(&mjs->call_stack, -1 - CALL_STACK_FRAME_ITEM_RETURN_ADDR));
+    offset = mjs_call_frame(mjs, 0)->ret_addr;
 
     /* pop frame from the call stack */
-    for (i = 0; i < CALL_STACK_FRAME_ITEMS_CNT; i++) {
-      mjs_pop_val(&mjs->call_stack);
-    }
+    mjs->call_stack.len -= sizeof(struct mjs_frame);
 
     mjs_append_stack_trace_line(mjs, offset);
   }
 }
 
+MJS_PRIVATE void mjs_scopes_truncate(struct mjs *mjs, size_t n) {
+  struct mjs_scope_var *vars = (struct mjs_scope_var *) mjs->scope_vars.buf;
+  size_t cnt = mjs->scope_vars.len / sizeof(*vars);
+  while (cnt > 0 && vars[cnt - 1].scope_idx >= n) cnt--;
+  mjs->scope_vars.len = cnt * sizeof(*vars);
+  mjs->scopes.len = n * sizeof(mjs_val_t);
+}
+
+MJS_PRIVATE size_t mjs_call_frames_cnt(struct mjs *mjs) {
+  return mjs->call_stack.len / sizeof(struct mjs_frame);
+}
+
+MJS_PRIVATE struct mjs_frame *mjs_call_frame(struct mjs *mjs, size_t n) {
+  size_t cnt = mjs_call_frames_cnt(mjs);
+  if (n >= cnt) return NULL;
+  return (struct mjs_frame *) mjs->call_stack.buf + cnt - 1 - n;
+}
+
 void mjs_own(struct mjs *mjs, mjs_val_t *v) {
   mbuf_append(&mjs->owned_values, &v, sizeof(v));
 }
@@ -7837,10 +8935,9 @@ int mjs_disown(struct mjs *mjs, mjs_val_t *v) {
  */
 MJS_PRIVATE int mjs_getretvalpos(struct mjs *mjs) {
   int pos;
-  mjs_val_t *ppos = vptr(&mjs->call_stack, -1);
-  // LOG(LL_INFO, ("ppos: %p %d", ppos, mjs_stack_size(&mjs->call_stack)));
-  assert(ppos != NULL && mjs_is_number(*ppos));
-  pos = mjs_get_int(mjs, *ppos) - 1;
+  struct mjs_frame *frame = mjs_call_frame(mjs, 0);
+  assert(frame != NULL);
+  pos = (int) frame->retval_idx - 1;
   assert(pos < (int) mjs_stack_size(&mjs->stack));
   return pos;
 }
@@ -8005,7 +9102,6 @@ void mjs_mem_set_int(void *ptr, int val, int size, int bigendian) {
 #endif
 
 /* Amalgamated: #include "common/cs_file.h" */
-/* Amalgamated: #include "common/cs_varint.h" */
 
 /* Amalgamated: #include "mjs_array.h" */
 /* Amalgamated: #include "mjs_bcode.h" */
@@ -8013,6 +9109,7 @@ void mjs_mem_set_int(void *ptr, int val, int size, int bigendian) {
 /* Amalgamated: #include "mjs_core.h" */
 /* Amalgamated: #include "mjs_exec.h" */
 /* Amalgamated: #include "mjs_internal.h" */
+/* Amalgamated: #include "mjs_jit.h" */
 /* Amalgamated: #include "mjs_object.h" */
 /* Amalgamated: #include "mjs_parser.h" */
 /* Amalgamated: #include "mjs_primitive.h" */
@@ -8024,80 +9121,222 @@ void mjs_mem_set_int(void *ptr, int val, int size, int bigendian) {
 #include <sys/mman.h>
 #endif
 
+/*
+ * Makes room for `n` more values on the data stack. It's done when a bcode
+ * part starts running, and when a function is called, for as many values as
+ * the code can push (see `stack_max` of `struct mjs_bcode_part`), so that the
+ * interpreter pushes with exec_push() and never grows the stack itself.
+ * Returns 0 and sets an error if there's no memory for that.
+ */
+static int exec_stack_reserve(struct mjs *mjs, size_t n) {
+  struct mbuf *m = &mjs->stack;
+  size_t limit = m->len + n * sizeof(mjs_val_t);
+  if (limit > m->size) mbuf_resize(m, m->size * 2 + n * sizeof(mjs_val_t));
+  if (limit > m->size) {
+    mjs_set_errorf(mjs, MJS_OUT_OF_MEMORY, "out of memory");
+    return 0;
+  }
+  mjs->stack_limit = limit;
+  return 1;
+}
+
+/*
+ * Pushes to the data stack, the room is reserved by exec_stack_reserve().
+ * Debug builds check that the code stays within `stack_max` it was given.
+ */
+static void exec_push(struct mjs *mjs, mjs_val_t v) {
+  assert(mjs->stack.len + sizeof(v) <= mjs->stack_limit);
+  memcpy(mjs->stack.buf + mjs->stack.len, &v, sizeof(v));
+  mjs->stack.len += sizeof(v);
+}
+
+/*
+ * Pops from the data stack. Unlike pushes, pops are still checked: code like
+ * `(a) = 1` pops more than it pushes.
+ */
+static mjs_val_t exec_pop(struct mjs *mjs) {
+  mjs_val_t v;
+  if (mjs->stack.len < sizeof(v)) {
+    mjs_set_errorf(mjs, MJS_INTERNAL_ERROR, "stack underflow");
+    return MJS_UNDEFINED;
+  }
+  mjs->stack.len -= sizeof(v);
+  memcpy(&v, mjs->stack.buf + mjs->stack.len, sizeof(v));
+  return v;
+}
+
 /*
  * Pushes call stack frame. Offset is a global bcode offset. Retval_stack_idx
  * is an index in mjs->stack at which return value should be written later.
  */
 static void call_stack_push_frame(struct mjs *mjs, size_t offset,
-                                  mjs_val_t retval_stack_idx) {
-  /* Pop `this` value, and apply it */
-  mjs_val_t this_obj = mjs_pop_val(&mjs->arg_stack);
+                                  size_t retval_stack_idx) {
+  struct mbuf *m = &mjs->call_stack;
+  struct mjs_frame *frame;
 
-  /*
-   * NOTE: the layout is described by enum mjs_call_stack_frame_item
-   */
-  push_mjs_val(&mjs->call_stack, mjs->vals.this_obj);
-  mjs->vals.this_obj = this_obj;
+  /* The stack is preallocated, so it's rarely grown */
+  if (m->len + sizeof(*frame) > m->size) {
+    mbuf_resize(m, m->size * 2 + sizeof(*frame));
+  }
+  frame = (struct mjs_frame *) (m->buf + m->len);
+  m->len += sizeof(*frame);
 
-  push_mjs_val(&mjs->call_stack, mjs_mk_number(mjs, (double) offset));
-  push_mjs_val(&mjs->call_stack,
-               mjs_mk_number(mjs, (double) mjs_stack_size(&mjs->scopes)));
-  push_mjs_val(
-      &mjs->call_stack,
-      mjs_mk_number(mjs, (double) mjs_stack_size(&mjs->loop_addresses)));
-  push_mjs_val(&mjs->call_stack, retval_stack_idx);
+  frame->ret_addr = offset;
+  frame->scope_idx = mjs_stack_size(&mjs->scopes);
+  frame->loop_idx = mjs->loop_addresses.len / sizeof(struct mjs_loop);
+  frame->retval_idx = retval_stack_idx;
+  frame->stack_limit = mjs->stack_limit;
+
+  /* Pop `this` value, and apply it */
+  frame->this_obj = mjs->vals.this_obj;
+  mjs->vals.this_obj = mjs_pop_val(&mjs->arg_stack);
 }
 
 /*
  * Restores call stack frame. Returns the return address.
  */
 static size_t call_stack_restore_frame(struct mjs *mjs) {
-  size_t retval_stack_idx, return_address, scope_index, loop_addr_index;
-  assert(mjs_stack_size(&mjs->call_stack) >= CALL_STACK_FRAME_ITEMS_CNT);
+  struct mjs_frame *frame = mjs_call_frame(mjs, 0);
+  assert(frame != NULL);
+  mjs->call_stack.len -= sizeof(*frame);
 
-  /*
-   * NOTE: the layout is described by enum mjs_call_stack_frame_item
-   */
-  retval_stack_idx = mjs_get_int(mjs, mjs_pop_val(&mjs->call_stack));
-  loop_addr_index = mjs_get_int(mjs, mjs_pop_val(&mjs->call_stack));
-  scope_index = mjs_get_int(mjs, mjs_pop_val(&mjs->call_stack));
-  return_address = mjs_get_int(mjs, mjs_pop_val(&mjs->call_stack));
-  mjs->vals.this_obj = mjs_pop_val(&mjs->call_stack);
+  mjs->vals.this_obj = frame->this_obj;
 
-  /* Remove created scopes */
-  while (mjs_stack_size(&mjs->scopes) > scope_index) {
-    mjs_pop_val(&mjs->scopes);
+  /* Remove created scopes, along with their variables */
+  if (mjs_stack_size(&mjs->scopes) > frame->scope_idx) {
+    mjs_scopes_truncate(mjs, frame->scope_idx);
   }
 
-  /* Remove loop addresses */
-  while (mjs_stack_size(&mjs->loop_addresses) > loop_addr_index) {
-    mjs_pop_val(&mjs->loop_addresses);
+  /* Remove loop records */
+  if (mjs->loop_addresses.len > frame->loop_idx * sizeof(struct mjs_loop)) {
+    mjs->loop_addresses.len = frame->loop_idx * sizeof(struct mjs_loop);
   }
 
   /* Shrink stack, leave return value on top */
-  mjs->stack.len = retval_stack_idx * sizeof(mjs_val_t);
+  mjs->stack.len = frame->retval_idx * sizeof(mjs_val_t);
+  mjs->stack_limit = frame->stack_limit;
 
   /* Jump to the return address */
-  return return_address;
+  return frame->ret_addr;
 }
 
-static mjs_val_t mjs_find_scope(struct mjs *mjs, mjs_val_t key) {
-  size_t num_scopes = mjs_stack_size(&mjs->scopes);
-  while (num_scopes > 0) {
-    mjs_val_t scope = *vptr(&mjs->scopes, num_scopes - 1);
-    num_scopes--;
-    if (mjs_get_own_node_v(mjs, scope, key) != NULL) return scope;
+/*
+ * Returns whether the two variable names are equal. Names are interned per
+ * bcode part, so they are usually equal as values as well.
+ */
+static int scope_key_eq(struct mjs *mjs, mjs_val_t a, mjs_val_t b) {
+  const char *sa, *sb;
+  size_t na, nb;
+  if (a == b) return 1;
+  sa = mjs_get_string(mjs, &a, &na);
+  sb = mjs_get_string(mjs, &b, &nb);
+  return sa != NULL && sb != NULL && na == nb && memcmp(sa, sb, na) == 0;
+}
+
+/*
+ * Looks up the variable in the scopes, from the innermost one, see
+ * mjs_scopes_truncate(). Returns the index of the scope plus one, or 0 (and
+ * sets the error) if there is no such variable. If the scope is not
+ * materialised, `*var` is set to the variable, otherwise to NULL.
+ */
+static size_t scope_find(struct mjs *mjs, mjs_val_t key,
+                         struct mjs_scope_var **var) {
+  struct mjs_scope_var *vars = (struct mjs_scope_var *) mjs->scope_vars.buf;
+  size_t n = mjs->scope_vars.len / sizeof(*vars);
+  size_t k = mjs_stack_size(&mjs->scopes);
+  *var = NULL;
+  while (k-- > 0) {
+    mjs_val_t scope = *vptr(&mjs->scopes, k);
+    /* Skip variables of the scopes above, which were materialised */
+    while (n > 0 && vars[n - 1].scope_idx > k) n--;
+    if (scope == MJS_UNDEFINED) {
+      for (; n > 0 && vars[n - 1].scope_idx == k; n--) {
+        if (scope_key_eq(mjs, vars[n - 1].key, key)) {
+          *var = &vars[n - 1];
+          return k + 1;
+        }
+      }
+    } else if (mjs_get_own_node_v(mjs, scope, key) != NULL) {
+      return k + 1;
+    }
   }
   mjs_set_errorf(mjs, MJS_REFERENCE_ERROR, "[%s] is not defined",
                  mjs_get_cstring(mjs, &key));
-  return MJS_UNDEFINED;
+  return 0;
+}
+
+/* Turns the scope `k` into an object, if it's not done yet, and returns it */
+static mjs_val_t scope_materialise(struct mjs *mjs, size_t k) {
+  mjs_val_t obj = *vptr(&mjs->scopes, k);
+  if (obj == MJS_UNDEFINED) {
+    struct mjs_scope_var *vars = (struct mjs_scope_var *) mjs->scope_vars.buf;
+    size_t i, n = mjs->scope_vars.len / sizeof(*vars);
+    obj = mjs_mk_object(mjs);
+    for (i = 0; i < n; i++) {
+      if (vars[i].scope_idx == k) {
+        mjs_set_v(mjs, obj, vars[i].key, vars[i].value);
+      }
+    }
+    /* Variables of the scope are left in place, and skipped by scope_find() */
+    *vptr(&mjs->scopes, k) = obj;
+  }
+  return obj;
+}
+
+/*
+ * Returns the variable of the innermost scope, creating it with `undefined`
+ * value if there's none. Returns NULL if the scope is materialised.
+ */
+static struct mjs_scope_var *scope_var_declare(struct mjs *mjs,
+                                               mjs_val_t key) {
+  struct mjs_scope_var *vars = (struct mjs_scope_var *) mjs->scope_vars.buf;
+  size_t n = mjs->scope_vars.len / sizeof(*vars);
+  size_t k = mjs_stack_size(&mjs->scopes) - 1;
+  struct mjs_scope_var v;
+  if (vtop(&mjs->scopes) != MJS_UNDEFINED) return NULL;
+  for (; n > 0 && vars[n - 1].scope_idx == k; n--) {
+    if (scope_key_eq(mjs, vars[n - 1].key, key)) return &vars[n - 1];
+  }
+  v.key = key;
+  v.value = MJS_UNDEFINED;
+  v.scope_idx = k;
+  mbuf_append(&mjs->scope_vars, &v, sizeof(v));
+  return (struct mjs_scope_var *) (mjs->scope_vars.buf + mjs->scope_vars.len) -
+         1;
+}
+
+/* Returns the scope object which has the variable, see scope_find() */
+static mjs_val_t mjs_find_scope(struct mjs *mjs, mjs_val_t key) {
+  struct mjs_scope_var *var;
+  size_t k = scope_find(mjs, key, &var);
+  return k == 0 ? MJS_UNDEFINED : scope_materialise(mjs, k - 1);
+}
+
+/* Sets the value of an existing variable */
+static void scope_set(struct mjs *mjs, mjs_val_t key, mjs_val_t val) {
+  struct mjs_scope_var *var;
+  size_t k = scope_find(mjs, key, &var);
+  if (var != NULL) {
+    var->value = val;
+  } else if (k != 0) {
+    mjs_set_v(mjs, *vptr(&mjs->scopes, k - 1), key, val);
+  }
 }
 
 mjs_val_t mjs_get_this(struct mjs *mjs) {
   return mjs->vals.this_obj;
 }
 
-static double do_arith_op(double da, double db, int op, bool *resnan) {
+void mjs_set_trace(struct mjs *mjs, mjs_trace_cb_t *cb, void *user_data) {
+  mjs->trace_cb = cb;
+  mjs->trace_user_data = user_data;
+}
+
+void mjs_set_exec_budget(struct mjs *mjs, long budget) {
+  mjs->exec_budget = budget < 0 ? -1 : budget;
+}
+
+MJS_PRIVATE double do_arith_op(double da, double db, int op, bool *resnan) {
   *resnan = false;
 
   if (isnan(da) || isnan(db)) {
@@ -8205,30 +9444,32 @@ static mjs_val_t do_op(struct mjs *mjs, mjs_val_t a, mjs_val_t b, int op) {
 }
 
 static void op_assign(struct mjs *mjs, int op) {
-  mjs_val_t val = mjs_pop(mjs);
-  mjs_val_t obj = mjs_pop(mjs);
-  mjs_val_t key = mjs_pop(mjs);
+  mjs_val_t val = exec_pop(mjs);
+  mjs_val_t obj = exec_pop(mjs);
+  mjs_val_t key = exec_pop(mjs);
   if (mjs_is_object(obj) && mjs_is_string(key)) {
     mjs_val_t v = mjs_get_v(mjs, obj, key);
     mjs_set_v(mjs, obj, key, do_op(mjs, v, val, op));
-    mjs_push(mjs, v);
+    exec_push(mjs, v);
   } else {
     mjs_set_errorf(mjs, MJS_TYPE_ERROR, "invalid operand");
   }
 }
 
+/*
+ * Strict equality of numbers `a` and `b`, whose values are `va` and `vb`: NaN
+ * is not equal to itself, and 0 is not -0
+ */
+static int num_strict_eq(double a, double b, mjs_val_t va, mjs_val_t vb) {
+  return a == b && va == vb;
+}
+
 static int check_equal(struct mjs *mjs, mjs_val_t a, mjs_val_t b) {
   int ret = 0;
-  if (a == MJS_TAG_NAN && b == MJS_TAG_NAN) {
-    ret = 0;
+  if (mjs_is_number(a) && mjs_is_number(b)) {
+    ret = num_strict_eq(mjs_get_double(mjs, a), mjs_get_double(mjs, b), a, b);
   } else if (a == b) {
     ret = 1;
-  } else if (mjs_is_number(a) && mjs_is_number(b)) {
-    /*
-     * The case of equal numbers is handled above, so here the result is always
-     * false
-     */
-    ret = 0;
   } else if (mjs_is_string(a) && mjs_is_string(b)) {
     ret = s_cmp(mjs, a, b) == 0;
   } else if (mjs_is_foreign(a) && b == MJS_NULL) {
@@ -8241,6 +9482,41 @@ static int check_equal(struct mjs *mjs, mjs_val_t a, mjs_val_t b) {
   return ret;
 }
 
+/*
+ * Sets `obj[key]`, returns the value which the assignment evaluates to. Used
+ * by TOK_ASSIGN and its superinstructions.
+ */
+static mjs_val_t exec_setprop(struct mjs *mjs, mjs_val_t obj, mjs_val_t key,
+                              mjs_val_t val) {
+  if (mjs_is_object(obj)) {
+    mjs_set_v(mjs, obj, key, val);
+  } else if (mjs_is_foreign(obj)) {
+    /*
+     * We don't have setters, so in order to support properties which behave
+     * like setters, we have to parse key right here, instead of having real
+     * built-in prototype objects
+     */
+
+    int ikey = mjs_get_int(mjs, key);
+    int ival = mjs_get_int(mjs, val);
+
+    if (!mjs_is_number(key)) {
+      mjs_prepend_errorf(mjs, MJS_TYPE_ERROR, "index must be a number");
+      val = MJS_UNDEFINED;
+    } else if (!mjs_is_number(val) || ival < 0 || ival > 0xff) {
+      mjs_prepend_errorf(mjs, MJS_TYPE_ERROR,
+                         "only number 0 .. 255 can be assigned");
+      val = MJS_UNDEFINED;
+    } else {
+      uint8_t *ptr = (uint8_t *) mjs_get_ptr(mjs, obj);
+      *(ptr + ikey) = (uint8_t) ival;
+    }
+  } else {
+    mjs_prepend_errorf(mjs, MJS_TYPE_ERROR, "unsupported object type");
+  }
+  return val;
+}
+
 static void exec_expr(struct mjs *mjs, int op) {
   switch (op) {
     case TOK_DOT:
@@ -8256,24 +9532,24 @@ static void exec_expr(struct mjs *mjs, int op) {
     case TOK_LSHIFT:
     case TOK_RSHIFT:
     case TOK_URSHIFT: {
-      mjs_val_t b = mjs_pop(mjs);
-      mjs_val_t a = mjs_pop(mjs);
-      mjs_push(mjs, do_op(mjs, a, b, op));
+      mjs_val_t b = exec_pop(mjs);
+      mjs_val_t a = exec_pop(mjs);
+      exec_push(mjs, do_op(mjs, a, b, op));
       break;
     }
     case TOK_UNARY_MINUS: {
-      double a = mjs_get_double(mjs, mjs_pop(mjs));
-      mjs_push(mjs, mjs_mk_number(mjs, -a));
+      double a = mjs_get_double(mjs, exec_pop(mjs));
+      exec_push(mjs, mjs_mk_number(mjs, -a));
       break;
     }
     case TOK_NOT: {
-      mjs_val_t val = mjs_pop(mjs);
-      mjs_push(mjs, mjs_mk_boolean(mjs, !mjs_is_truthy(mjs, val)));
+      mjs_val_t val = exec_pop(mjs);
+      exec_push(mjs, mjs_mk_boolean(mjs, !mjs_is_truthy(mjs, val)));
       break;
     }
     case TOK_TILDA: {
-      double a = mjs_get_double(mjs, mjs_pop(mjs));
-      mjs_push(mjs, mjs_mk_number(mjs, (double) (~(int64_t) a)));
+      double a = mjs_get_double(mjs, exec_pop(mjs));
+      exec_push(mjs, mjs_mk_number(mjs, (double) (~(int64_t) a)));
       break;
     }
     case TOK_UNARY_PLUS:
@@ -8285,468 +9561,1081 @@ static void exec_expr(struct mjs *mjs, int op) {
       mjs_set_errorf(mjs, MJS_NOT_IMPLEMENTED_ERROR, "Use !==, not !=");
       break;
     case TOK_EQ_EQ: {
-      mjs_val_t a = mjs_pop(mjs);
-      mjs_val_t b = mjs_pop(mjs);
-      mjs_push(mjs, mjs_mk_boolean(mjs, check_equal(mjs, a, b)));
+      mjs_val_t a = exec_pop(mjs);
+      mjs_val_t b = exec_pop(mjs);
+      exec_push(mjs, mjs_mk_boolean(mjs, check_equal(mjs, a, b)));
       break;
     }
     case TOK_NE_NE: {
-      mjs_val_t a = mjs_pop(mjs);
-      mjs_val_t b = mjs_pop(mjs);
-      mjs_push(mjs, mjs_mk_boolean(mjs, !check_equal(mjs, a, b)));
+      mjs_val_t a = exec_pop(mjs);
+      mjs_val_t b = exec_pop(mjs);
+      exec_push(mjs, mjs_mk_boolean(mjs, !check_equal(mjs, a, b)));
       break;
     }
     case TOK_LT: {
-      double b = mjs_get_double(mjs, mjs_pop(mjs));
-      double a = mjs_get_double(mjs, mjs_pop(mjs));
-      mjs_push(mjs, mjs_mk_boolean(mjs, a < b));
+      double b = mjs_get_double(mjs, exec_pop(mjs));
+      double a = mjs_get_double(mjs, exec_pop(mjs));
+      exec_push(mjs, mjs_mk_boolean(mjs, a < b));
       break;
     }
     case TOK_GT: {
-      double b = mjs_get_double(mjs, mjs_pop(mjs));
-      double a = mjs_get_double(mjs, mjs_pop(mjs));
-      mjs_push(mjs, mjs_mk_boolean(mjs, a > b));
+      double b = mjs_get_double(mjs, exec_pop(mjs));
+      double a = mjs_get_double(mjs, exec_pop(mjs));
+      exec_push(mjs, mjs_mk_boolean(mjs, a > b));
       break;
     }
     case TOK_LE: {
-      double b = mjs_get_double(mjs, mjs_pop(mjs));
-      double a = mjs_get_double(mjs, mjs_pop(mjs));
-      mjs_push(mjs, mjs_mk_boolean(mjs, a <= b));
+      double b = mjs_get_double(mjs, exec_pop(mjs));
+      double a = mjs_get_double(mjs, exec_pop(mjs));
+      exec_push(mjs, mjs_mk_boolean(mjs, a <= b));
       break;
     }
     case TOK_GE: {
-      double b = mjs_get_double(mjs, mjs_pop(mjs));
-      double a = mjs_get_double(mjs, mjs_pop(mjs));
-      mjs_push(mjs, mjs_mk_boolean(mjs, a >= b));
+      double b = mjs_get_double(mjs, exec_pop(mjs));
+      double a = mjs_get_double(mjs, exec_pop(mjs));
+      exec_push(mjs, mjs_mk_boolean(mjs, a >= b));
       break;
     }
     case TOK_ASSIGN: {
-      mjs_val_t val = mjs_pop(mjs);
-      mjs_val_t obj = mjs_pop(mjs);
-      mjs_val_t key = mjs_pop(mjs);
-      if (mjs_is_object(obj)) {
-        mjs_set_v(mjs, obj, key, val);
-      } else if (mjs_is_foreign(obj)) {
-        /*
-         * We don't have setters, so in order to support properties which behave
-         * like setters, we have to parse key right here, instead of having real
-         * built-in prototype objects
-         */
-
-        int ikey = mjs_get_int(mjs, key);
-        int ival = mjs_get_int(mjs, val);
-
-        if (!mjs_is_number(key)) {
-          mjs_prepend_errorf(mjs, MJS_TYPE_ERROR, "index must be a number");
-          val = MJS_UNDEFINED;
-        } else if (!mjs_is_number(val) || ival < 0 || ival > 0xff) {
-          mjs_prepend_errorf(mjs, MJS_TYPE_ERROR,
-                             "only number 0 .. 255 can be assigned");
-          val = MJS_UNDEFINED;
-        } else {
-          uint8_t *ptr = (uint8_t *) mjs_get_ptr(mjs, obj);
-          *(ptr + ikey) = (uint8_t) ival;
-        }
-      } else {
-        mjs_prepend_errorf(mjs, MJS_TYPE_ERROR, "unsupported object type");
-      }
-      mjs_push(mjs, val);
+      mjs_val_t val = exec_pop(mjs);
+      mjs_val_t obj = exec_pop(mjs);
+      mjs_val_t key = exec_pop(mjs);
+      exec_push(mjs, exec_setprop(mjs, obj, key, val));
       break;
     }
     case TOK_POSTFIX_PLUS: {
-      mjs_val_t obj = mjs_pop(mjs);
-      mjs_val_t key = mjs_pop(mjs);
+      mjs_val_t obj = exec_pop(mjs);
+      mjs_val_t key = exec_pop(mjs);
       if (mjs_is_object(obj) && mjs_is_string(key)) {
         mjs_val_t v = mjs_get_v(mjs, obj, key);
         mjs_val_t v1 = do_op(mjs, v, mjs_mk_number(mjs, 1), TOK_PLUS);
         mjs_set_v(mjs, obj, key, v1);
-        mjs_push(mjs, v);
+        exec_push(mjs, v);
       } else {
         mjs_set_errorf(mjs, MJS_TYPE_ERROR, "invalid operand for ++");
       }
       break;
     }
     case TOK_POSTFIX_MINUS: {
-      mjs_val_t obj = mjs_pop(mjs);
-      mjs_val_t key = mjs_pop(mjs);
+      mjs_val_t obj = exec_pop(mjs);
+      mjs_val_t key = exec_pop(mjs);
       if (mjs_is_object(obj) && mjs_is_string(key)) {
         mjs_val_t v = mjs_get_v(mjs, obj, key);
         mjs_val_t v1 = do_op(mjs, v, mjs_mk_number(mjs, 1), TOK_MINUS);
         mjs_set_v(mjs, obj, key, v1);
-        mjs_push(mjs, v);
+        exec_push(mjs, v);
       } else {
         mjs_set_errorf(mjs, MJS_TYPE_ERROR, "invalid operand for --");
       }
       break;
     }
     case TOK_MINUS_MINUS: {
-      mjs_val_t obj = mjs_pop(mjs);
-      mjs_val_t key = mjs_pop(mjs);
+      mjs_val_t obj = exec_pop(mjs);
+      mjs_val_t key = exec_pop(mjs);
       if (mjs_is_object(obj) && mjs_is_string(key)) {
         mjs_val_t v = mjs_get_v(mjs, obj, key);
         v = do_op(mjs, v, mjs_mk_number(mjs, 1), TOK_MINUS);
         mjs_set_v(mjs, obj, key, v);
-        mjs_push(mjs, v);
+        exec_push(mjs, v);
       } else {
         mjs_set_errorf(mjs, MJS_TYPE_ERROR, "invalid operand for --");
       }
       break;
     }
     case TOK_PLUS_PLUS: {
-      mjs_val_t obj = mjs_pop(mjs);
-      mjs_val_t key = mjs_pop(mjs);
+      mjs_val_t obj = exec_pop(mjs);
+      mjs_val_t key = exec_pop(mjs);
       if (mjs_is_object(obj) && mjs_is_string(key)) {
         mjs_val_t v = mjs_get_v(mjs, obj, key);
         v = do_op(mjs, v, mjs_mk_number(mjs, 1), TOK_PLUS);
         mjs_set_v(mjs, obj, key, v);
-        mjs_push(mjs, v);
+        exec_push(mjs, v);
       } else {
         mjs_set_errorf(mjs, MJS_TYPE_ERROR, "invalid operand for ++");
       }
       break;
     }
-    /*
-     * NOTE: TOK_LOGICAL_AND and TOK_LOGICAL_OR don't need to be here, because
-     * they are just naturally handled by the short-circuit evaluation.
-     * See PARSE_LTR_BINOP() macro in mjs_parser.c.
-     */
+    /*
+     * NOTE: TOK_LOGICAL_AND and TOK_LOGICAL_OR don't need to be here, because
+     * they are just naturally handled by the short-circuit evaluation.
+     * See PARSE_LTR_BINOP() macro in mjs_parser.c.
+     */
+
+    /* clang-format off */
+    case TOK_MINUS_ASSIGN:    op_assign(mjs, TOK_MINUS);    break;
+    case TOK_PLUS_ASSIGN:     op_assign(mjs, TOK_PLUS);     break;
+    case TOK_MUL_ASSIGN:      op_assign(mjs, TOK_MUL);      break;
+    case TOK_DIV_ASSIGN:      op_assign(mjs, TOK_DIV);      break;
+    case TOK_REM_ASSIGN:      op_assign(mjs, TOK_REM);      break;
+    case TOK_AND_ASSIGN:      op_assign(mjs, TOK_AND);      break;
+    case TOK_OR_ASSIGN:       op_assign(mjs, TOK_OR);       break;
+    case TOK_XOR_ASSIGN:      op_assign(mjs, TOK_XOR);      break;
+    case TOK_LSHIFT_ASSIGN:   op_assign(mjs, TOK_LSHIFT);   break;
+    case TOK_RSHIFT_ASSIGN:   op_assign(mjs, TOK_RSHIFT);   break;
+    case TOK_URSHIFT_ASSIGN:  op_assign(mjs, TOK_URSHIFT);  break;
+    case TOK_COMMA: break;
+    /* clang-format on */
+    case TOK_KEYWORD_TYPEOF:
+      exec_push(mjs, mjs_mk_string(mjs, mjs_typeof(exec_pop(mjs)), ~0, 1));
+      break;
+    default:
+      LOG(LL_ERROR, ("Unknown expr: %d", op));
+      break;
+  }
+}
+
+/*
+ * Returns the property name as an index, and sets `*isnum` if it's one: the
+ * same as cstr_to_ulong() of the name converted to string gives. Strings and
+ * integer numbers are not converted, so it doesn't allocate.
+ */
+static int getprop_index(struct mjs *mjs, mjs_val_t name, int *isnum) {
+  int idx = 0;
+  *isnum = 0;
+  if (mjs_is_string(name)) {
+    size_t n;
+    const char *s = mjs_get_string(mjs, &name, &n);
+    idx = cstr_to_ulong(s, n, isnum);
+  } else if (mjs_is_number(name) &&
+             fabs(mjs_get_double(mjs, name)) <= INT_MAX) {
+    double d = mjs_get_double(mjs, name);
+    if (d == (int) d) {
+      idx = (int) d;
+      *isnum = 1;
+    }
+  } else {
+    size_t n;
+    char *s = NULL;
+    int need_free = 0;
+    if (mjs_to_string(mjs, &name, &s, &n, &need_free) == MJS_OK) {
+      idx = cstr_to_ulong(s, n, isnum);
+    }
+    if (need_free) free(s);
+  }
+  return idx;
+}
+
+static int getprop_builtin_foreign(struct mjs *mjs, mjs_val_t val,
+                                   mjs_val_t name, mjs_val_t *res) {
+  int isnum = 0;
+  int idx = getprop_index(mjs, name, &isnum);
+
+  if (!isnum) {
+    mjs_prepend_errorf(mjs, MJS_TYPE_ERROR, "index must be a number");
+  } else {
+    uint8_t *ptr = (uint8_t *) mjs_get_ptr(mjs, val);
+    *res = mjs_mk_number(mjs, *(ptr + idx));
+  }
+  return 1;
+}
+
+static void mjs_apply_(struct mjs *mjs) {
+  mjs_val_t res = MJS_UNDEFINED, *args = NULL;
+  mjs_val_t func = mjs->vals.this_obj, v = mjs_arg(mjs, 1);
+  int i, nargs = 0;
+  if (mjs_is_array(v)) {
+    nargs = mjs_array_length(mjs, v);
+    args = calloc(nargs, sizeof(args[0]));
+    for (i = 0; i < nargs; i++) args[i] = mjs_array_get(mjs, v, i);
+  }
+  mjs_apply(mjs, &res, func, mjs_arg(mjs, 0), nargs, args);
+  free(args);
+  mjs_return(mjs, res);
+}
+
+/* Receivers of a builtin property, see `struct getprop_method` */
+#define GETPROP_STRING 0x01 /* Strings */
+#define GETPROP_ARRAY 0x02  /* Arrays */
+#define GETPROP_OTHER 0x04  /* Everything else which is not a string */
+
+/* Builtin property which is the same for all values of its receiver types */
+struct getprop_method {
+  const char *name;
+  uint8_t len;
+  uint8_t recv;      /* Mask of GETPROP_* */
+  mjs_func_ptr_t fn; /* Method, or NULL for `length` */
+};
+
+/*
+ * Hash of a property name, which is perfect for the names in
+ * `getprop_methods`: every one of them gets its own entry, so the lookup is a
+ * single probe and a memcmp(). When adding a name, make sure it lands in a
+ * free entry.
+ */
+#define GETPROP_HASH(s, n) \
+  (((n) + (uint8_t)(s)[0] + (uint8_t)(s)[(n) - 1]) & 15)
+
+static const struct getprop_method getprop_methods[16] = {
+    [1] = {"charCodeAt", 10, GETPROP_STRING,
+           (mjs_func_ptr_t) mjs_string_char_code_at},
+    [6] = {"indexOf", 7, GETPROP_STRING, (mjs_func_ptr_t) mjs_string_index_of},
+    [7] = {"at", 2, GETPROP_STRING, (mjs_func_ptr_t) mjs_string_char_code_at},
+    [10] = {"length", 6, GETPROP_STRING | GETPROP_ARRAY, NULL},
+    [12] = {"push", 4, GETPROP_ARRAY, (mjs_func_ptr_t) mjs_array_push_internal},
+    [13] = {"slice", 5, GETPROP_STRING, (mjs_func_ptr_t) mjs_string_slice},
+    [14] = {"splice", 6, GETPROP_ARRAY, (mjs_func_ptr_t) mjs_array_splice},
+    [15] = {"apply", 5, GETPROP_ARRAY | GETPROP_OTHER,
+            (mjs_func_ptr_t) mjs_apply_},
+};
+
+/*
+ * Returns the builtin property named `name` of values of the receiver type
+ * `recv`, or NULL if there's no such property.
+ */
+static const struct getprop_method *getprop_method_find(struct mjs *mjs,
+                                                        mjs_val_t name,
+                                                        int recv) {
+  const struct getprop_method *m;
+  size_t n;
+  const char *s = mjs_get_string(mjs, &name, &n);
+  if (n < 2) return NULL;
+  m = &getprop_methods[GETPROP_HASH(s, n)];
+  if (!(m->recv & recv) || m->len != n || memcmp(m->name, s, n) != 0) {
+    return NULL;
+  }
+  return m;
+}
+
+/* Returns value of the builtin property `m` of `val` */
+static mjs_val_t getprop_method_value(struct mjs *mjs,
+                                      const struct getprop_method *m,
+                                      mjs_val_t val) {
+  size_t len;
+  if (m->fn != NULL) return mjs_mk_foreign_func(mjs, m->fn);
+  if (mjs_is_string(val)) {
+    mjs_get_string(mjs, &val, &len);
+  } else {
+    len = mjs_array_length(mjs, val);
+  }
+  return mjs_mk_number(mjs, (double) len);
+}
+
+static int getprop_builtin_string(struct mjs *mjs, mjs_val_t val,
+                                  mjs_val_t name, mjs_val_t *res) {
+  const struct getprop_method *m;
+  int isnum = 0, idx;
+
+  if (mjs_is_string(name) &&
+      (m = getprop_method_find(mjs, name, GETPROP_STRING)) != NULL) {
+    *res = getprop_method_value(mjs, m, val);
+    return 1;
+  }
+
+  idx = getprop_index(mjs, name, &isnum);
+  if (isnum) {
+    /*
+     * string subscript: return a new one-byte string if the index
+     * is not out of bounds
+     */
+    size_t val_len;
+    const char *str = mjs_get_string(mjs, &val, &val_len);
+    if (idx >= 0 && idx < (int) val_len) {
+      *res = mjs_mk_string(mjs, str + idx, 1, 1);
+    } else {
+      *res = MJS_UNDEFINED;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Looks up builtin properties of the value. Strings and foreign pointers have
+ * their own builtin properties; every other value has `apply`, and arrays
+ * also have a few methods. All of these have string names, and are found by
+ * a single probe of `getprop_methods`, so for an ordinary object, or a name
+ * which is not a string, this is just a couple of checks.
+ */
+static int getprop_builtin(struct mjs *mjs, mjs_val_t val, mjs_val_t name,
+                           mjs_val_t *res) {
+  const struct getprop_method *m;
+
+  if (mjs_is_string(val)) {
+    return getprop_builtin_string(mjs, val, name, res);
+  } else if (mjs_is_foreign(val) && !mjs_is_string(name)) {
+    return getprop_builtin_foreign(mjs, val, name, res);
+  } else if (!mjs_is_string(name)) {
+    return 0;
+  }
+
+  m = getprop_method_find(mjs, name,
+                          mjs_is_array(val) ? GETPROP_ARRAY : GETPROP_OTHER);
+  if (m != NULL) {
+    *res = getprop_method_value(mjs, m, val);
+    return 1;
+  } else if (mjs_is_foreign(val)) {
+    return getprop_builtin_foreign(mjs, val, name, res);
+  }
+  return 0;
+}
+
+/*
+ * Interpreter dispatch. With MJS_ENABLE_COMPUTED_GOTO, each opcode handler
+ * is a label, and every handler ends with its own copy of the dispatch code
+ * (MJS_NEXT_OP()) which jumps straight to the handler of the next opcode. This
+ * gives the CPU one indirect branch per handler to predict, instead of a
+ * single shared one. Without it, handlers are just cases of a `switch`.
+ *
+ * The trace hook (see mjs_set_trace()) is not checked by the dispatch code at
+ * all. With computed goto, if it's installed, mjs_execute() dispatches through
+ * `trace_table` instead, which sends every opcode to `op_trace` first. The
+ * `switch` is on the opcode ORed with `trace_flag` instead, which is either 0
+ * or MJS_TRACE_FLAG, so that every opcode goes to the default case first.
+ */
+#define MJS_EXEC_TRACE()                                       \
+  mjs->trace_cb(mjs, (const uint8_t *) bp.data.p, code[i].off, \
+                mjs->trace_user_data)
+
+#if MJS_ENABLE_COMPUTED_GOTO
+#define MJS_OP(op) op_##op
+#define MJS_OP_DEFAULT op_default
+#define MJS_DISPATCH(opcode)                                   \
+  if ((opcode) >= OP_MAX) goto op_default;                     \
+  goto *dispatch[opcode];
+#define MJS_NEXT_OP()                                          \
+  do {                                                         \
+    if (mjs->error != MJS_OK) goto op_error;                   \
+    if (++i >= bp.insns_cnt) goto clean;                       \
+    prev_opcode = opcode;                                      \
+    opcode = code[i].opcode;                                   \
+    MJS_DISPATCH(opcode);                                      \
+  } while (0)
+#else
+#define MJS_OP(op) case op
+#define MJS_OP_DEFAULT default
+#define MJS_TRACE_FLAG 0x100
+#define MJS_DISPATCH(opcode)                                   \
+  sel = (opcode) | trace_flag;                                 \
+  op_dispatch:                                                 \
+  switch (sel)
+#define MJS_NEXT_OP() break
+#endif
+
+/*
+ * Handler of a binary operator which has its own opcode. If both operands are
+ * numbers `a` and `b`, and `cond` holds, the result is `res`, computed right
+ * here; otherwise the operator `tok` is executed by exec_expr().
+ */
+#define MJS_OP_NUM_BINOP(op, tok, cond, res)                              \
+  MJS_OP(op) : {                                                          \
+    mjs_val_t *sp = (mjs_val_t *) (mjs->stack.buf + mjs->stack.len);     \
+    if (mjs->stack.len >= 2 * sizeof(mjs_val_t) && mjs_is_number(sp[-2]) && \
+        mjs_is_number(sp[-1])) {                                          \
+      double a = mjs_get_double(mjs, sp[-2]);                             \
+      double b = mjs_get_double(mjs, sp[-1]);                             \
+      if (cond) {                                                         \
+        sp[-2] = (res);                                                   \
+        mjs->stack.len -= sizeof(mjs_val_t);                              \
+        MJS_NEXT_OP();                                                    \
+      }                                                                   \
+    }                                                                     \
+    exec_expr(mjs, tok);                                                  \
+    MJS_NEXT_OP();                                                        \
+  }
+
+/*
+ * Handler of a comparison fused with OP_JMP_FALSE. Like MJS_OP_NUM_BINOP(),
+ * if both operands are numbers `a` and `b`, the comparison is `cond`;
+ * otherwise the operator `tok` is executed by exec_expr().
+ */
+#define MJS_OP_JMP_FALSE_CMP(op, tok, cond)                               \
+  MJS_OP(op) : {                                                          \
+    mjs_val_t *sp = (mjs_val_t *) (mjs->stack.buf + mjs->stack.len);     \
+    int t;                                                                \
+    if (mjs->stack.len >= 2 * sizeof(mjs_val_t) && mjs_is_number(sp[-2]) && \
+        mjs_is_number(sp[-1])) {                                          \
+      double a = mjs_get_double(mjs, sp[-2]);                             \
+      double b = mjs_get_double(mjs, sp[-1]);                             \
+      t = (cond);                                                         \
+      mjs->stack.len -= 2 * sizeof(mjs_val_t);                            \
+    } else {                                                              \
+      exec_expr(mjs, tok);                                                \
+      t = mjs_is_truthy(mjs, exec_pop(mjs));                              \
+    }                                                                     \
+    if (!t) {                                                             \
+      exec_push(mjs, MJS_UNDEFINED);                                      \
+      i = code[i].a - 1;                                                  \
+    }                                                                     \
+    MJS_NEXT_OP();                                                        \
+  }
+
+/*
+ * Returns `obj[key]`, taking built-in properties into account. Used by OP_GET
+ * and its superinstructions.
+ */
+static mjs_val_t exec_getprop(struct mjs *mjs, mjs_val_t obj, mjs_val_t key) {
+  mjs_val_t val = MJS_UNDEFINED;
+  if (!getprop_builtin(mjs, obj, key, &val)) {
+    if (mjs_is_object(obj)) {
+      val = mjs_get_v_proto(mjs, obj, key);
+    } else {
+      mjs_prepend_errorf(mjs, MJS_TYPE_ERROR, "type error");
+    }
+  }
+  return val;
+}
+
+/*
+ * Returns the node of `obj[key]` remembered by the inline cache, or NULL. Only
+ * plain objects are cached: for arrays and other values, getprop_builtin()
+ * has to be consulted.
+ */
+static struct mjs_node *exec_prop_cache_get(struct mjs *mjs,
+                                            struct mjs_prop_cache *c,
+                                            mjs_val_t obj, mjs_val_t key) {
+  int k;
+  if ((obj & MJS_TAG_MASK) != MJS_TAG_OBJECT) return NULL;
+  if (c->epoch != mjs->prop_cache_epoch) {
+    memset(c, 0, sizeof(*c));
+    c->epoch = mjs->prop_cache_epoch;
+    return NULL;
+  }
+  for (k = 0; k < MJS_PROP_CACHE_SIZE; k++) {
+    if (c->entries[k].obj == obj && c->entries[k].key == key) {
+      return c->entries[k].node;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Remembers own property `name` of a plain object in the inline cache, under
+ * the given cache key (see `struct mjs_prop_cache`). Properties not found in
+ * the object itself are not cached: they can be shadowed later.
+ */
+static void exec_prop_cache_add(struct mjs *mjs, struct mjs_prop_cache *c,
+                                mjs_val_t obj, mjs_val_t key, mjs_val_t name) {
+  size_t n;
+  char *s = NULL;
+  int need_free = 0;
+  if ((obj & MJS_TAG_MASK) != MJS_TAG_OBJECT ||
+      c->epoch != mjs->prop_cache_epoch ||
+      mjs_to_string(mjs, &name, &s, &n, &need_free) != MJS_OK) {
+    return;
+  }
+  /* `apply` is served by getprop_builtin() */
+  if (!(n == 5 && strncmp(s, "apply", n) == 0)) {
+    struct mjs_node *node = mjs_get_own_node(mjs, obj, s, n);
+    if (node != NULL) {
+      c->entries[c->next].obj = obj;
+      c->entries[c->next].key = key;
+      c->entries[c->next].node = node;
+      c->next = (c->next + 1) % MJS_PROP_CACHE_SIZE;
+    }
+  }
+  if (need_free) free(s);
+}
+
+/*
+ * Run pending garbage collection, if any. Allocations only set `need_gc`,
+ * since values held in C locals of the caller are not rooted; the collection
+ * itself happens at the next safepoint of the interpreter: on entry, at
+ * OP_CALL, OP_RETURN and at OP_CONTINUE, which is the back edge of every loop.
+ * Straight-line code in between doesn't pay for the check.
+ */
+static void exec_gc_check(struct mjs *mjs) {
+  if (mjs->need_gc) {
+    if (maybe_gc(mjs)) {
+      mjs->need_gc = 0;
+    }
+  }
+#if MJS_AGGRESSIVE_GC
+  maybe_gc(mjs);
+#endif
+}
 
-    /* clang-format off */
-    case TOK_MINUS_ASSIGN:    op_assign(mjs, TOK_MINUS);    break;
-    case TOK_PLUS_ASSIGN:     op_assign(mjs, TOK_PLUS);     break;
-    case TOK_MUL_ASSIGN:      op_assign(mjs, TOK_MUL);      break;
-    case TOK_DIV_ASSIGN:      op_assign(mjs, TOK_DIV);      break;
-    case TOK_REM_ASSIGN:      op_assign(mjs, TOK_REM);      break;
-    case TOK_AND_ASSIGN:      op_assign(mjs, TOK_AND);      break;
-    case TOK_OR_ASSIGN:       op_assign(mjs, TOK_OR);       break;
-    case TOK_XOR_ASSIGN:      op_assign(mjs, TOK_XOR);      break;
-    case TOK_LSHIFT_ASSIGN:   op_assign(mjs, TOK_LSHIFT);   break;
-    case TOK_RSHIFT_ASSIGN:   op_assign(mjs, TOK_RSHIFT);   break;
-    case TOK_URSHIFT_ASSIGN:  op_assign(mjs, TOK_URSHIFT);  break;
-    case TOK_COMMA: break;
-    /* clang-format on */
-    case TOK_KEYWORD_TYPEOF:
-      mjs_push(mjs, mjs_mk_string(mjs, mjs_typeof(mjs_pop(mjs)), ~0, 1));
-      break;
-    default:
-      LOG(LL_ERROR, ("Unknown expr: %d", op));
-      break;
+/*
+ * Returns whether the execution being run can be suspended right now: only the
+ * outermost one can, since nested ones have the C stack of their callers.
+ */
+static int exec_can_suspend(struct mjs *mjs) {
+  return mjs->exec_depth == 1 && mjs->can_suspend;
+}
+
+/*
+ * Spends a unit of the execution budget, see mjs_set_exec_budget(). It's done
+ * at OP_CALL and OP_CONTINUE, i.e. at every call and loop iteration, since
+ * only these can make execution time unbounded.
+ *
+ * Returns 0 and sets the error if the budget is exhausted, 1 otherwise.
+ */
+static int exec_budget_check(struct mjs *mjs) {
+  if (mjs->exec_budget > 0) {
+    mjs->exec_budget--;
+  } else if (mjs->exec_budget == 0) {
+    mjs_set_errorf(mjs, MJS_BUDGET_EXHAUSTED, "execution budget exhausted");
+    return 0;
   }
+  return 1;
 }
 
-static int getprop_builtin_string(struct mjs *mjs, mjs_val_t val,
-                                  const char *name, size_t name_len,
-                                  mjs_val_t *res) {
-  int isnum = 0;
-  int idx = cstr_to_ulong(name, name_len, &isnum);
+/*
+ * Returns index of the first local slot of the function being executed, i.e.
+ * the data stack index right after the called function, see OP_LOCALS.
+ */
+static size_t exec_frame_base(struct mjs *mjs) {
+  struct mjs_frame *frame = mjs_call_frame(mjs, 0);
+  return frame != NULL ? frame->retval_idx : 0;
+}
 
-  if (strcmp(name, "length") == 0) {
-    size_t val_len;
-    mjs_get_string(mjs, &val, &val_len);
-    *res = mjs_mk_number(mjs, (double) val_len);
-    return 1;
-  } else if (strcmp(name, "at") == 0 || strcmp(name, "charCodeAt") == 0) {
-    *res = mjs_mk_foreign_func(mjs, (mjs_func_ptr_t) mjs_string_char_code_at);
-    return 1;
-  } else if (strcmp(name, "indexOf") == 0) {
-    *res = mjs_mk_foreign_func(mjs, (mjs_func_ptr_t) mjs_string_index_of);
-    return 1;
-  } else if (strcmp(name, "slice") == 0) {
-    *res = mjs_mk_foreign_func(mjs, (mjs_func_ptr_t) mjs_string_slice);
-    return 1;
-  } else if (isnum) {
+/*
+ * Returns the innermost loop being executed by the current function, or NULL
+ */
+static struct mjs_loop *exec_loop_top(struct mjs *mjs) {
+  struct mjs_frame *frame = mjs_call_frame(mjs, 0);
+  size_t cnt = mjs->loop_addresses.len / sizeof(struct mjs_loop);
+  if (cnt == 0 || (frame != NULL && cnt <= frame->loop_idx)) return NULL;
+  return (struct mjs_loop *) mjs->loop_addresses.buf + cnt - 1;
+}
+
+/* Returns a copy of the decoded bcode part containing the given offset */
+static struct mjs_bcode_part exec_part_get(struct mjs *mjs, size_t offset) {
+  struct mjs_bcode_part *bp = mjs_bcode_part_get_by_offset(mjs, offset);
+  mjs_bcode_part_decode(mjs, bp);
+  return *bp;
+}
+
+/*
+ * Makes `bp` the decoded bcode part containing the given offset. Calls and
+ * returns mostly stay within the current part, which needs no lookup then.
+ */
+static void exec_part_switch(struct mjs *mjs, struct mjs_bcode_part *bp,
+                             size_t offset) {
+  if (offset - bp->start_idx >= bp->data.len) {
+    *bp = exec_part_get(mjs, offset);
+  }
+}
+
+/*
+ * Opcodes whose handlers are shared by the interpreter and the native code of
+ * the JIT, see `struct mjs_jit_helpers`. Each one works with the data stack
+ * only, and sets the error if any.
+ */
+
+/* OP_GET: ( key obj -- obj[key] ) */
+static void exec_get(struct mjs *mjs, struct mjs_prop_cache *c,
+                     int prev_opcode) {
+  mjs_val_t obj = exec_pop(mjs);
+  mjs_val_t key = exec_pop(mjs);
+  struct mjs_node *node = exec_prop_cache_get(mjs, c, obj, key);
+
+  if (node != NULL) {
+    exec_push(mjs, node->value);
+  } else {
+    exec_push(mjs, exec_getprop(mjs, obj, key));
+    exec_prop_cache_add(mjs, c, obj, key, key);
+  }
+  if (prev_opcode != OP_FIND_SCOPE) {
     /*
-     * string subscript: return a new one-byte string if the index
-     * is not out of bounds
+     * Previous opcode was not OP_FIND_SCOPE, so it's some "custom" object
+     * which might be used as `this`, so, save it
      */
-    size_t val_len;
-    const char *str = mjs_get_string(mjs, &val, &val_len);
-    if (idx >= 0 && idx < (int) val_len) {
-      *res = mjs_mk_string(mjs, str + idx, 1, 1);
-    } else {
-      *res = MJS_UNDEFINED;
-    }
-    return 1;
+    mjs->vals.last_getprop_obj = obj;
+  } else {
+    /*
+     * Previous opcode was OP_FIND_SCOPE, so we're getting value from the
+     * scope, and it should *not* be used as `this`
+     */
+    mjs->vals.last_getprop_obj = MJS_UNDEFINED;
   }
-  return 0;
 }
 
-static int getprop_builtin_array(struct mjs *mjs, mjs_val_t val,
-                                 const char *name, size_t name_len,
-                                 mjs_val_t *res) {
-  if (strcmp(name, "splice") == 0) {
-    *res = mjs_mk_foreign_func(mjs, (mjs_func_ptr_t) mjs_array_splice);
-    return 1;
-  } else if (strcmp(name, "push") == 0) {
-    *res = mjs_mk_foreign_func(mjs, (mjs_func_ptr_t) mjs_array_push_internal);
-    return 1;
-  } else if (strcmp(name, "length") == 0) {
-    *res = mjs_mk_number(mjs, mjs_array_length(mjs, val));
-    return 1;
+/* OP_GET_VAR: ( -- a ) */
+static void exec_get_var(struct mjs *mjs, mjs_val_t key) {
+  struct mjs_scope_var *var;
+  size_t k = scope_find(mjs, key, &var);
+  if (k != 0) {
+    mjs_val_t scope = *vptr(&mjs->scopes, k - 1);
+    exec_push(mjs, var != NULL ? var->value : exec_getprop(mjs, scope, key));
+    /* Value from the scope should *not* be used as `this`, see OP_GET */
+    mjs->vals.last_getprop_obj = MJS_UNDEFINED;
   }
+}
 
-  (void) name_len;
-  return 0;
+/* OP_SET_VAR: ( a -- a ) */
+static void exec_set_var(struct mjs *mjs, mjs_val_t key) {
+  scope_set(mjs, key, vtop(&mjs->stack));
 }
 
-static int getprop_builtin_foreign(struct mjs *mjs, mjs_val_t val,
-                                   const char *name, size_t name_len,
-                                   mjs_val_t *res) {
-  int isnum = 0;
-  int idx = cstr_to_ulong(name, name_len, &isnum);
+/* OP_CREATE_VAR: ( -- ) */
+static void exec_create_var(struct mjs *mjs, mjs_val_t key) {
+  mjs_val_t scope = vtop(&mjs->scopes);
+  if (scope_var_declare(mjs, key) == NULL &&
+      mjs_get_own_node_v(mjs, scope, key) == NULL) {
+    mjs_set_v(mjs, scope, key, MJS_UNDEFINED);
+  }
+}
 
-  if (!isnum) {
-    mjs_prepend_errorf(mjs, MJS_TYPE_ERROR, "index must be a number");
+/* OP_GET_PROP_CONST: ( obj -- obj[key] ) */
+static void exec_get_prop_const(struct mjs *mjs, mjs_val_t key,
+                                struct mjs_prop_cache *c) {
+  mjs_val_t obj = exec_pop(mjs);
+  struct mjs_node *node = exec_prop_cache_get(mjs, c, obj, MJS_UNDEFINED);
+  if (node != NULL) {
+    exec_push(mjs, node->value);
   } else {
-    uint8_t *ptr = (uint8_t *) mjs_get_ptr(mjs, val);
-    *res = mjs_mk_number(mjs, *(ptr + idx));
+    exec_push(mjs, exec_getprop(mjs, obj, key));
+    exec_prop_cache_add(mjs, c, obj, MJS_UNDEFINED, key);
   }
-  return 1;
+  /* Save the object, it might be used as `this`, see OP_GET */
+  mjs->vals.last_getprop_obj = obj;
 }
 
-static void mjs_apply_(struct mjs *mjs) {
-  mjs_val_t res = MJS_UNDEFINED, *args = NULL;
-  mjs_val_t func = mjs->vals.this_obj, v = mjs_arg(mjs, 1);
-  int i, nargs = 0;
-  if (mjs_is_array(v)) {
-    nargs = mjs_array_length(mjs, v);
-    args = calloc(nargs, sizeof(args[0]));
-    for (i = 0; i < nargs; i++) args[i] = mjs_array_get(mjs, v, i);
+/* OP_SET_PROP_CONST: ( obj a -- a ) */
+static void exec_set_prop_const(struct mjs *mjs, mjs_val_t key,
+                                struct mjs_prop_cache *c) {
+  mjs_val_t val = exec_pop(mjs);
+  mjs_val_t obj = exec_pop(mjs);
+  struct mjs_node *node = exec_prop_cache_get(mjs, c, obj, MJS_UNDEFINED);
+  if (node != NULL) {
+    node->value = val;
+  } else {
+    val = exec_setprop(mjs, obj, key, val);
+    exec_prop_cache_add(mjs, c, obj, MJS_UNDEFINED, key);
   }
-  mjs_apply(mjs, &res, func, mjs_arg(mjs, 0), nargs, args);
-  free(args);
-  mjs_return(mjs, res);
+  exec_push(mjs, val);
 }
 
-static int getprop_builtin(struct mjs *mjs, mjs_val_t val, mjs_val_t name,
-                           mjs_val_t *res) {
-  size_t n;
-  char *s = NULL;
-  int need_free = 0;
-  int handled = 0;
+/*
+ * OP_EXPR with TOK_ASSIGN: ( key obj a -- a ), property assignment with an
+ * inline cache like OP_SET_PROP_CONST
+ */
+static void exec_assign(struct mjs *mjs, struct mjs_prop_cache *c) {
+  mjs_val_t val = exec_pop(mjs);
+  mjs_val_t obj = exec_pop(mjs);
+  mjs_val_t key = exec_pop(mjs);
+  struct mjs_node *node = exec_prop_cache_get(mjs, c, obj, key);
+  if (node != NULL) {
+    node->value = val;
+  } else {
+    val = exec_setprop(mjs, obj, key, val);
+    exec_prop_cache_add(mjs, c, obj, key, key);
+  }
+  exec_push(mjs, val);
+}
 
-  mjs_err_t err = mjs_to_string(mjs, &name, &s, &n, &need_free);
+/* OP_FIND_SCOPE: ( a -- a b ) */
+static void exec_find_scope(struct mjs *mjs) {
+  mjs_val_t key = vtop(&mjs->stack);
+  exec_push(mjs, mjs_find_scope(mjs, key));
+}
 
-  if (err == MJS_OK) {
-    if (mjs_is_string(val)) {
-      handled = getprop_builtin_string(mjs, val, s, n, res);
-    } else if (s != NULL && n == 5 && strncmp(s, "apply", n) == 0) {
-      *res = mjs_mk_foreign_func(mjs, (mjs_func_ptr_t) mjs_apply_);
-      handled = 1;
-    } else if (mjs_is_array(val)) {
-      handled = getprop_builtin_array(mjs, val, s, n, res);
-    } else if (mjs_is_foreign(val)) {
-      handled = getprop_builtin_foreign(mjs, val, s, n, res);
+/* OP_ARGS: ( -- ) */
+static void exec_args(struct mjs *mjs, int prev_opcode) {
+  /*
+   * If OP_ARGS follows OP_GET or OP_GET_PROP_CONST, then last_getprop_obj is
+   * set to `this` value; otherwise, last_getprop_obj is irrelevant and we have
+   * to reset it to `undefined`
+   */
+  if (prev_opcode != OP_GET && prev_opcode != OP_GET_PROP_CONST) {
+    mjs->vals.last_getprop_obj = MJS_UNDEFINED;
+  }
+
+  /* Push last_getprop_obj, which is going to be used as `this`, see OP_CALL */
+  push_mjs_val(&mjs->arg_stack, mjs->vals.last_getprop_obj);
+  /* Push current size of data stack, it's needed to place arguments properly */
+  push_mjs_val(&mjs->arg_stack,
+               mjs_mk_number(mjs, (double) mjs_stack_size(&mjs->stack)));
+}
+
+/*
+ * OP_SET_ARG: ( -- ), binds `in->op` arguments to their names in the
+ * innermost scope. The instructions which follow `in` give the rest of the
+ * names and argument numbers.
+ */
+static void exec_set_args(struct mjs *mjs, const mjs_val_t *consts,
+                          const struct mjs_insn *in) {
+  struct mbuf *m = &mjs->scope_vars;
+  struct mjs_scope_var *v = (struct mjs_scope_var *) m->buf;
+  size_t j, n = in->op, cnt = m->len / sizeof(*v);
+  size_t k = mjs_stack_size(&mjs->scopes) - 1;
+  if (vtop(&mjs->scopes) == MJS_UNDEFINED &&
+      (cnt == 0 || v[cnt - 1].scope_idx != k)) {
+    /* The scope has no variables yet, and names are distinct: no lookups */
+    size_t base = exec_frame_base(mjs), top = mjs_stack_size(&mjs->stack);
+    if (m->len + n * sizeof(*v) > m->size) {
+      mbuf_resize(m, m->size * 2 + n * sizeof(*v));
+    }
+    v = (struct mjs_scope_var *) (m->buf + m->len);
+    m->len += n * sizeof(*v);
+    for (j = 0; j < n; j++) {
+      size_t pos = base + in[j].b;
+      v[j].key = consts[in[j].a];
+      v[j].value = base > 0 && pos < top ? *vptr(&mjs->stack, pos)
+                                         : MJS_UNDEFINED;
+      v[j].scope_idx = k;
+    }
+  } else {
+    for (j = 0; j < n; j++) {
+      mjs_val_t key = consts[in[j].a];
+      mjs_val_t val = mjs_arg(mjs, in[j].b);
+      struct mjs_scope_var *var = scope_var_declare(mjs, key);
+      if (var != NULL) {
+        var->value = val;
+      } else {
+        mjs_set_v(mjs, vtop(&mjs->scopes), key, val);
+      }
     }
   }
+}
 
-  if (need_free) {
-    free(s);
-    s = NULL;
+/* OP_SETRETVAL: ( a -- ) */
+static void exec_setretval(struct mjs *mjs) {
+  struct mjs_frame *frame = mjs_call_frame(mjs, 0);
+  if (frame == NULL) {
+    mjs_set_errorf(mjs, MJS_INTERNAL_ERROR, "cannot return");
+  } else {
+    *vptr(&mjs->stack, frame->retval_idx - 1) = exec_pop(mjs);
   }
+}
 
-  return handled;
+/* OP_LOOP: ( -- ) */
+static void exec_loop(struct mjs *mjs, size_t brk, size_t cont) {
+  struct mbuf *m = &mjs->loop_addresses;
+  struct mjs_loop *loop;
+  if (m->len + sizeof(*loop) > m->size) {
+    mbuf_resize(m, m->size * 2 + sizeof(*loop));
+  }
+  loop = (struct mjs_loop *) (m->buf + m->len);
+  m->len += sizeof(*loop);
+  loop->scope_idx = mjs_stack_size(&mjs->scopes);
+  loop->brk = brk;
+  loop->cont = cont;
 }
 
-MJS_PRIVATE mjs_err_t mjs_execute(struct mjs *mjs, size_t off, mjs_val_t *res) {
-  size_t i;
-  uint8_t prev_opcode = OP_MAX;
-  uint8_t opcode = OP_MAX;
+#if MJS_ENABLE_JIT
+static int exec_jit_cmp(struct mjs *mjs, int op) {
+  exec_expr(mjs, op);
+  return mjs_is_truthy(mjs, exec_pop(mjs));
+}
 
-  /*
-   * remember lengths of all stacks, they will be restored in case of an error
-   */
-  int stack_len = mjs->stack.len;
-  int call_stack_len = mjs->call_stack.len;
-  int arg_stack_len = mjs->arg_stack.len;
-  int scopes_len = mjs->scopes.len;
-  int loop_addresses_len = mjs->loop_addresses.len;
-  size_t start_off = off;
-  const uint8_t *code;
+/*
+ * Like OP_CONTINUE, but if it can't be done right away (there's no loop, or
+ * the budget is exhausted), it's left to the interpreter.
+ */
+static size_t exec_jit_continue(struct mjs *mjs) {
+  struct mjs_loop *loop = exec_loop_top(mjs);
+  size_t cont;
+  if (loop == NULL || mjs->exec_budget == 0) return (size_t) -1;
+  exec_budget_check(mjs);
+  mjs_scopes_truncate(mjs, loop->scope_idx);
+  cont = loop->cont;
+  exec_gc_check(mjs);
+  return cont;
+}
+
+/* Like OP_BREAK, but it's left to the interpreter if there's no loop */
+static size_t exec_jit_break(struct mjs *mjs) {
+  struct mjs_loop *loop = exec_loop_top(mjs);
+  if (loop == NULL) return (size_t) -1;
+  mjs->loop_addresses.len -= sizeof(*loop);
+  mjs_scopes_truncate(mjs, loop->scope_idx);
+  return loop->brk;
+}
+
+static const struct mjs_jit_helpers exec_jit_helpers = {
+    .expr = exec_expr,
+    .cmp = exec_jit_cmp,
+    .get = exec_get,
+    .get_var = exec_get_var,
+    .set_var = exec_set_var,
+    .create_var = exec_create_var,
+    .get_prop_const = exec_get_prop_const,
+    .set_prop_const = exec_set_prop_const,
+    .assign = exec_assign,
+    .find_scope = exec_find_scope,
+    .args = exec_args,
+    .setretval = exec_setretval,
+    .loop = exec_loop,
+    .cont = exec_jit_continue,
+    .brk = exec_jit_break,
+};
+
+/*
+ * Counts a call of the function whose first instruction is `entry`, and
+ * compiles the function once it's called MJS_JIT_THRESHOLD times
+ */
+static void exec_jit_count(struct mjs *mjs, const struct mjs_bcode_part *bp,
+                           size_t entry) {
+  struct mjs_jit *jit = bp->jit;
+  if (jit->code[entry] == NULL && ++jit->calls[entry] == MJS_JIT_THRESHOLD) {
+    mjs_jit_compile(mjs, bp, entry, &exec_jit_helpers);
+  }
+}
+#endif
+
+/*
+ * Runs the interpreter from the given state, until the execution is done or
+ * suspended. The state is either a new one, see mjs_execute(), or the one of
+ * the suspended execution, see mjs_resume().
+ */
+static mjs_err_t exec_run(struct mjs *mjs, const struct mjs_exec_state *st,
+                          mjs_val_t *res) {
+#if MJS_ENABLE_COMPUTED_GOTO
+  static const void *const dispatch_table[OP_MAX] = {
+      [OP_NOP] = &&op_OP_NOP,
+      [OP_DROP] = &&op_OP_DROP,
+      [OP_DUP] = &&op_OP_DUP,
+      [OP_SWAP] = &&op_OP_SWAP,
+      [OP_JMP] = &&op_OP_JMP,
+      [OP_JMP_TRUE] = &&op_default,
+      [OP_JMP_NEUTRAL_TRUE] = &&op_OP_JMP_NEUTRAL_TRUE,
+      [OP_JMP_FALSE] = &&op_OP_JMP_FALSE,
+      [OP_JMP_NEUTRAL_FALSE] = &&op_OP_JMP_NEUTRAL_FALSE,
+      [OP_FIND_SCOPE] = &&op_OP_FIND_SCOPE,
+      [OP_PUSH_SCOPE] = &&op_OP_PUSH_SCOPE,
+      [OP_PUSH_STR] = &&op_OP_PUSH_STR,
+      [OP_PUSH_TRUE] = &&op_OP_PUSH_TRUE,
+      [OP_PUSH_FALSE] = &&op_OP_PUSH_FALSE,
+      [OP_PUSH_INT] = &&op_OP_PUSH_INT,
+      [OP_PUSH_DBL] = &&op_OP_PUSH_DBL,
+      [OP_PUSH_NULL] = &&op_OP_PUSH_NULL,
+      [OP_PUSH_UNDEF] = &&op_OP_PUSH_UNDEF,
+      [OP_PUSH_OBJ] = &&op_OP_PUSH_OBJ,
+      [OP_PUSH_ARRAY] = &&op_OP_PUSH_ARRAY,
+      [OP_PUSH_FUNC] = &&op_OP_PUSH_FUNC,
+      [OP_PUSH_THIS] = &&op_OP_PUSH_THIS,
+      [OP_GET] = &&op_OP_GET,
+      [OP_CREATE] = &&op_OP_CREATE,
+      [OP_EXPR] = &&op_OP_EXPR,
+      [OP_APPEND] = &&op_OP_APPEND,
+      [OP_SET_ARG] = &&op_OP_SET_ARG,
+      [OP_NEW_SCOPE] = &&op_OP_NEW_SCOPE,
+      [OP_DEL_SCOPE] = &&op_OP_DEL_SCOPE,
+      [OP_CALL] = &&op_OP_CALL,
+      [OP_RETURN] = &&op_OP_RETURN,
+      [OP_LOOP] = &&op_OP_LOOP,
+      [OP_BREAK] = &&op_OP_BREAK,
+      [OP_CONTINUE] = &&op_OP_CONTINUE,
+      [OP_SETRETVAL] = &&op_OP_SETRETVAL,
+      [OP_EXIT] = &&op_OP_EXIT,
+      [OP_BCODE_HEADER] = &&op_OP_BCODE_HEADER,
+      [OP_ARGS] = &&op_OP_ARGS,
+      [OP_FOR_IN_NEXT] = &&op_OP_FOR_IN_NEXT,
+      [OP_GET_VAR] = &&op_OP_GET_VAR,
+      [OP_SET_VAR] = &&op_OP_SET_VAR,
+      [OP_CREATE_VAR] = &&op_OP_CREATE_VAR,
+      [OP_GET_PROP_CONST] = &&op_OP_GET_PROP_CONST,
+      [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+      [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+      [OP_LOCALS] = &&op_OP_LOCALS,
+      [OP_SET_PROP_CONST] = &&op_OP_SET_PROP_CONST,
+      [OP_ADD] = &&op_OP_ADD,
+      [OP_SUB] = &&op_OP_SUB,
+      [OP_MUL] = &&op_OP_MUL,
+      [OP_DIV] = &&op_OP_DIV,
+      [OP_LT] = &&op_OP_LT,
+      [OP_LE] = &&op_OP_LE,
+      [OP_GT] = &&op_OP_GT,
+      [OP_GE] = &&op_OP_GE,
+      [OP_EQ_EQ] = &&op_OP_EQ_EQ,
+      [OP_NE_NE] = &&op_OP_NE_NE,
+      [OP_JMP_FALSE_LT] = &&op_OP_JMP_FALSE_LT,
+      [OP_JMP_FALSE_LE] = &&op_OP_JMP_FALSE_LE,
+      [OP_JMP_FALSE_GT] = &&op_OP_JMP_FALSE_GT,
+      [OP_JMP_FALSE_GE] = &&op_OP_JMP_FALSE_GE,
+      [OP_JMP_FALSE_EQ_EQ] = &&op_OP_JMP_FALSE_EQ_EQ,
+      [OP_JMP_FALSE_NE_NE] = &&op_OP_JMP_FALSE_NE_NE,
+  };
+  static const void *const trace_table[OP_MAX] = {
+      [0 ... OP_MAX - 1] = &&op_trace,
+  };
+#if MJS_ENABLE_JIT
+  /* Sends the next opcode to `op_jit`, see mjs_jit.h */
+  static const void *const jit_table[OP_MAX] = {
+      [0 ... OP_MAX - 1] = &&op_jit,
+  };
+#endif
+  const void *const *dispatch =
+      mjs->trace_cb != NULL ? trace_table : dispatch_table;
+#else
+  unsigned sel, trace_flag = mjs->trace_cb != NULL ? MJS_TRACE_FLAG : 0;
+#endif
+  size_t i;
+  uint8_t prev_opcode = st->prev_opcode;
+  uint8_t opcode = st->prev_opcode;
+  size_t frame_base = exec_frame_base(mjs);
+  size_t prev_stack_limit = mjs->stack_limit;
+  const struct mjs_insn *code;
 
-  struct mjs_bcode_part bp = *mjs_bcode_part_get_by_offset(mjs, off);
+  struct mjs_bcode_part bp = exec_part_get(mjs, st->off);
 
   mjs_set_errorf(mjs, MJS_OK, NULL);
   free(mjs->stack_trace);
   mjs->stack_trace = NULL;
 
-  off -= bp.start_idx;
+  if (!exec_stack_reserve(mjs, bp.stack_max)) {
+    *res = MJS_UNDEFINED;
+    return mjs->error;
+  }
 
-  for (i = off; i < bp.data.len; i++) {
-    mjs->cur_bcode_offset = i;
+  /* Only the outermost script can be suspended, see mjs_yield() */
+  if (++mjs->exec_depth == 1) {
+    mjs->can_suspend = st->call_stack_len == 0 && !mjs->suspended;
+  }
 
-    if (mjs->need_gc) {
-      if (maybe_gc(mjs)) {
-        mjs->need_gc = 0;
-      }
-    }
-#if MJS_AGGRESSIVE_GC
-    maybe_gc(mjs);
-#endif
+  code = bp.insns;
+  exec_gc_check(mjs);
 
-    code = (const uint8_t *) bp.data.p;
-#if MJS_ENABLE_DEBUG
-    mjs_disasm_single(code, i);
-#endif
+  for (i = mjs_bcode_part_insn_idx(&bp, st->off - bp.start_idx);
+       i < bp.insns_cnt; i++) {
     prev_opcode = opcode;
-    opcode = code[i];
-    switch (opcode) {
-      case OP_BCODE_HEADER: {
-        mjs_header_item_t bcode_offset;
-        memcpy(&bcode_offset,
-               code + i + 1 +
-                   sizeof(mjs_header_item_t) * MJS_HDR_ITEM_BCODE_OFFSET,
-               sizeof(bcode_offset));
-        i += bcode_offset;
-      } break;
-      case OP_PUSH_NULL:
-        mjs_push(mjs, mjs_mk_null());
-        break;
-      case OP_PUSH_UNDEF:
-        mjs_push(mjs, mjs_mk_undefined());
-        break;
-      case OP_PUSH_FALSE:
-        mjs_push(mjs, mjs_mk_boolean(mjs, 0));
-        break;
-      case OP_PUSH_TRUE:
-        mjs_push(mjs, mjs_mk_boolean(mjs, 1));
-        break;
-      case OP_PUSH_OBJ:
-        mjs_push(mjs, mjs_mk_object(mjs));
-        break;
-      case OP_PUSH_ARRAY:
-        mjs_push(mjs, mjs_mk_array(mjs));
-        break;
-      case OP_PUSH_FUNC: {
-        int llen, n = cs_varint_decode_unsafe(&code[i + 1], &llen);
-        mjs_push(mjs, mjs_mk_function(mjs, bp.start_idx + i - n));
-        i += llen;
-        break;
-      }
-      case OP_PUSH_THIS:
-        mjs_push(mjs, mjs->vals.this_obj);
-        break;
-      case OP_JMP: {
-        int llen, n = cs_varint_decode_unsafe(&code[i + 1], &llen);
-        i += n + llen;
-        break;
-      }
-      case OP_JMP_FALSE: {
-        int llen, n = cs_varint_decode_unsafe(&code[i + 1], &llen);
-        i += llen;
-        if (!mjs_is_truthy(mjs, mjs_pop(mjs))) {
-          mjs_push(mjs, MJS_UNDEFINED);
-          i += n;
+    opcode = code[i].opcode;
+    MJS_DISPATCH(opcode) {
+      MJS_OP(OP_BCODE_HEADER):
+        /* Header and filename are not decoded, so there's nothing to skip */
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_NULL):
+        exec_push(mjs, mjs_mk_null());
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_UNDEF):
+        exec_push(mjs, mjs_mk_undefined());
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_FALSE):
+        exec_push(mjs, mjs_mk_boolean(mjs, 0));
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_TRUE):
+        exec_push(mjs, mjs_mk_boolean(mjs, 1));
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_OBJ):
+        exec_push(mjs, mjs_mk_object(mjs));
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_ARRAY):
+        exec_push(mjs, mjs_mk_array(mjs));
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_FUNC):
+        exec_push(mjs, mjs_mk_function(mjs, code[i].v.i));
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_THIS):
+        exec_push(mjs, mjs->vals.this_obj);
+        MJS_NEXT_OP();
+      /*
+       * Jump target is an index of the decoded instruction; since `i` is
+       * incremented before the next dispatch, we set it to the previous one.
+       */
+      MJS_OP(OP_JMP):
+        i = code[i].a - 1;
+        MJS_NEXT_OP();
+      MJS_OP(OP_JMP_FALSE): {
+        if (!mjs_is_truthy(mjs, exec_pop(mjs))) {
+          exec_push(mjs, MJS_UNDEFINED);
+          i = code[i].a - 1;
         }
-        break;
+        MJS_NEXT_OP();
       }
+      MJS_OP_JMP_FALSE_CMP(OP_JMP_FALSE_LT, TOK_LT, a < b)
+      MJS_OP_JMP_FALSE_CMP(OP_JMP_FALSE_LE, TOK_LE, a <= b)
+      MJS_OP_JMP_FALSE_CMP(OP_JMP_FALSE_GT, TOK_GT, a > b)
+      MJS_OP_JMP_FALSE_CMP(OP_JMP_FALSE_GE, TOK_GE, a >= b)
+      MJS_OP_JMP_FALSE_CMP(OP_JMP_FALSE_EQ_EQ, TOK_EQ_EQ,
+                           num_strict_eq(a, b, sp[-2], sp[-1]))
+      MJS_OP_JMP_FALSE_CMP(OP_JMP_FALSE_NE_NE, TOK_NE_NE,
+                           !num_strict_eq(a, b, sp[-2], sp[-1]))
       /*
        * OP_JMP_NEUTRAL_... ops are like as OP_JMP_..., but they are completely
        * stack-neutral: they just check the TOS, and increment instruction
        * pointer if the TOS is truthy/falsy.
        */
-      case OP_JMP_NEUTRAL_TRUE: {
-        int llen, n = cs_varint_decode_unsafe(&code[i + 1], &llen);
-        i += llen;
+      MJS_OP(OP_JMP_NEUTRAL_TRUE): {
         if (mjs_is_truthy(mjs, vtop(&mjs->stack))) {
-          i += n;
+          i = code[i].a - 1;
         }
-        break;
+        MJS_NEXT_OP();
       }
-      case OP_JMP_NEUTRAL_FALSE: {
-        int llen, n = cs_varint_decode_unsafe(&code[i + 1], &llen);
-        i += llen;
+      MJS_OP(OP_JMP_NEUTRAL_FALSE): {
         if (!mjs_is_truthy(mjs, vtop(&mjs->stack))) {
-          i += n;
+          i = code[i].a - 1;
         }
-        break;
-      }
-      case OP_FIND_SCOPE: {
-        mjs_val_t key = vtop(&mjs->stack);
-        mjs_push(mjs, mjs_find_scope(mjs, key));
-        break;
+        MJS_NEXT_OP();
       }
-      case OP_CREATE: {
-        mjs_val_t obj = mjs_pop(mjs);
-        mjs_val_t key = mjs_pop(mjs);
+      MJS_OP(OP_FIND_SCOPE):
+        exec_find_scope(mjs);
+        MJS_NEXT_OP();
+      MJS_OP(OP_CREATE): {
+        mjs_val_t obj = exec_pop(mjs);
+        mjs_val_t key = exec_pop(mjs);
         if (mjs_get_own_node_v(mjs, obj, key) == NULL) {
           mjs_set_v(mjs, obj, key, MJS_UNDEFINED);
         }
-        break;
+        MJS_NEXT_OP();
       }
-      case OP_APPEND: {
-        mjs_val_t val = mjs_pop(mjs);
-        mjs_val_t arr = mjs_pop(mjs);
+      MJS_OP(OP_APPEND): {
+        mjs_val_t val = exec_pop(mjs);
+        mjs_val_t arr = exec_pop(mjs);
         mjs_err_t err = mjs_array_push(mjs, arr, val);
         if (err != MJS_OK) {
           mjs_set_errorf(mjs, MJS_TYPE_ERROR, "append to non-array");
         }
-        break;
+        MJS_NEXT_OP();
       }
-      case OP_GET: {
-        mjs_val_t obj = mjs_pop(mjs);
-        mjs_val_t key = mjs_pop(mjs);
-        mjs_val_t val = MJS_UNDEFINED;
-
-        if (!getprop_builtin(mjs, obj, key, &val)) {
-          if (mjs_is_object(obj)) {
-            val = mjs_get_v_proto(mjs, obj, key);
-          } else {
-            mjs_prepend_errorf(mjs, MJS_TYPE_ERROR, "type error");
-          }
+      MJS_OP(OP_GET):
+        exec_get(mjs, &bp.prop_caches[code[i].b], prev_opcode);
+        MJS_NEXT_OP();
+      MJS_OP(OP_GET_VAR):
+        exec_get_var(mjs, bp.consts[code[i].a]);
+        MJS_NEXT_OP();
+      MJS_OP(OP_SET_VAR):
+        exec_set_var(mjs, bp.consts[code[i].a]);
+        MJS_NEXT_OP();
+      MJS_OP(OP_CREATE_VAR):
+        exec_create_var(mjs, bp.consts[code[i].a]);
+        MJS_NEXT_OP();
+      MJS_OP(OP_GET_PROP_CONST):
+        exec_get_prop_const(mjs, bp.consts[code[i].a],
+                            &bp.prop_caches[code[i].b]);
+        MJS_NEXT_OP();
+      MJS_OP(OP_GET_LOCAL):
+        exec_push(mjs, ((mjs_val_t *) mjs->stack.buf)[frame_base + code[i].a]);
+        MJS_NEXT_OP();
+      MJS_OP(OP_SET_LOCAL):
+        ((mjs_val_t *) mjs->stack.buf)[frame_base + code[i].a] =
+            vtop(&mjs->stack);
+        MJS_NEXT_OP();
+      MJS_OP(OP_LOCALS): {
+        /*
+         * Make the data stack hold exactly `nslots` values after the called
+         * function: arguments beyond the declared ones are dropped, missing
+         * arguments and the rest of the slots are `undefined`.
+         */
+        size_t nparams = code[i].b, nslots = code[i].a;
+        if (mjs_stack_size(&mjs->stack) > frame_base + nparams) {
+          mjs->stack.len = (frame_base + nparams) * sizeof(mjs_val_t);
         }
-
-        mjs_push(mjs, val);
-        if (prev_opcode != OP_FIND_SCOPE) {
-          /*
-           * Previous opcode was not OP_FIND_SCOPE, so it's some "custom"
-           * object which might be used as `this`, so, save it
-           */
-          mjs->vals.last_getprop_obj = obj;
-        } else {
-          /*
-           * Previous opcode was OP_FIND_SCOPE, so we're getting value from
-           * the scope, and it should *not* be used as `this`
-           */
-          mjs->vals.last_getprop_obj = MJS_UNDEFINED;
+        while (mjs_stack_size(&mjs->stack) < frame_base + nslots) {
+          exec_push(mjs, MJS_UNDEFINED);
         }
-        break;
+        MJS_NEXT_OP();
       }
-      case OP_DEL_SCOPE:
+      MJS_OP(OP_SET_PROP_CONST):
+        exec_set_prop_const(mjs, bp.consts[code[i].a],
+                            &bp.prop_caches[code[i].b]);
+        MJS_NEXT_OP();
+      MJS_OP(OP_DEL_SCOPE):
         if (mjs->scopes.len <= 1) {
           mjs_set_errorf(mjs, MJS_INTERNAL_ERROR, "scopes underflow");
         } else {
-          mjs_pop_val(&mjs->scopes);
+          mjs_scopes_truncate(mjs, mjs_stack_size(&mjs->scopes) - 1);
         }
-        break;
-      case OP_NEW_SCOPE:
-        push_mjs_val(&mjs->scopes, mjs_mk_object(mjs));
-        break;
-      case OP_PUSH_SCOPE:
+        MJS_NEXT_OP();
+      MJS_OP(OP_NEW_SCOPE):
+        /* The object is created only if needed, see mjs_scopes_truncate() */
+        push_mjs_val(&mjs->scopes, MJS_UNDEFINED);
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_SCOPE):
         assert(mjs_stack_size(&mjs->scopes) > 0);
-        mjs_push(mjs, vtop(&mjs->scopes));
-        break;
-      case OP_PUSH_STR: {
-        int llen, n = cs_varint_decode_unsafe(&code[i + 1], &llen);
-        mjs_push(mjs, mjs_mk_string(mjs, (char *) code + i + 1 + llen, n, 1));
-        i += llen + n;
-        break;
-      }
-      case OP_PUSH_INT: {
-        int llen;
-        int64_t n = cs_varint_decode_unsafe(&code[i + 1], &llen);
-        mjs_push(mjs, mjs_mk_number(mjs, (double) n));
-        i += llen;
-        break;
-      }
-      case OP_PUSH_DBL: {
-        int llen, n = cs_varint_decode_unsafe(&code[i + 1], &llen);
-        mjs_push(mjs, mjs_mk_number(
-                          mjs, strtod((char *) code + i + 1 + llen, NULL)));
-        i += llen + n;
-        break;
-      }
-      case OP_FOR_IN_NEXT: {
+        exec_push(mjs,
+                  scope_materialise(mjs, mjs_stack_size(&mjs->scopes) - 1));
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_STR):
+        exec_push(mjs, bp.consts[code[i].a]);
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_INT):
+        exec_push(mjs, mjs_mk_number(mjs, (double) code[i].v.i));
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_DBL):
+        exec_push(mjs, mjs_mk_number(mjs, code[i].v.d));
+        MJS_NEXT_OP();
+      MJS_OP(OP_FOR_IN_NEXT): {
         /*
          * Data stack layout:
          * ...                                    <-- Bottom of the data stack
@@ -8760,86 +10649,87 @@ MJS_PRIVATE mjs_err_t mjs_execute(struct mjs *mjs, size_t off, mjs_val_t *res) {
           mjs_val_t var_name = *vptr(&mjs->stack, -3);
           mjs_val_t key = mjs_next_node(mjs, obj, iterator);
           if (key != MJS_UNDEFINED) {
-            mjs_val_t scope = mjs_find_scope(mjs, var_name);
-            mjs_set_v(mjs, scope, var_name, key);
+            scope_set(mjs, var_name, key);
           }
         } else {
           mjs_set_errorf(mjs, MJS_TYPE_ERROR,
                          "can't iterate over non-object value");
         }
-        break;
+        MJS_NEXT_OP();
       }
-      case OP_RETURN: {
+      MJS_OP(OP_RETURN): {
         /*
          * Return address is saved as a global bcode offset, so we need to
          * convert it to the local offset
          */
         size_t off_ret = call_stack_restore_frame(mjs);
+        frame_base = exec_frame_base(mjs);
+        exec_gc_check(mjs);
         if (off_ret != MJS_BCODE_OFFSET_EXIT) {
-          bp = *mjs_bcode_part_get_by_offset(mjs, off_ret);
-          code = (const uint8_t *) bp.data.p;
-          i = off_ret - bp.start_idx;
+          exec_part_switch(mjs, &bp, off_ret);
+          code = bp.insns;
+          i = mjs_bcode_part_insn_idx(&bp, off_ret - bp.start_idx);
+#if MJS_ENABLE_JIT
+          if (dispatch == dispatch_table) dispatch = jit_table;
+#endif
           LOG(LL_VERBOSE_DEBUG, ("RETURNING TO %d", (int) off_ret + 1));
         } else {
           goto clean;
         }
         // mjs_dump(mjs, 0, stdout);
-        break;
-      }
-      case OP_ARGS: {
-        /*
-         * If OP_ARGS follows OP_GET, then last_getprop_obj is set to `this`
-         * value; otherwise, last_getprop_obj is irrelevant and we have to
-         * reset it to `undefined`
-         */
-        if (prev_opcode != OP_GET) {
-          mjs->vals.last_getprop_obj = MJS_UNDEFINED;
-        }
-
-        /*
-         * Push last_getprop_obj, which is going to be used as `this`, see
-         * OP_CALL
-         */
-        push_mjs_val(&mjs->arg_stack, mjs->vals.last_getprop_obj);
-        /*
-         * Push current size of data stack, it's needed to place arguments
-         * properly
-         */
-        push_mjs_val(&mjs->arg_stack,
-                     mjs_mk_number(mjs, (double) mjs_stack_size(&mjs->stack)));
-        break;
+        MJS_NEXT_OP();
       }
-      case OP_CALL: {
+      MJS_OP(OP_ARGS):
+        exec_args(mjs, prev_opcode);
+        MJS_NEXT_OP();
+      MJS_OP(OP_CALL): {
         // LOG(LL_INFO, ("BEFORE CALL"));
         // mjs_dump(mjs, 0, stdout);
         int func_pos;
         mjs_val_t *func;
-        mjs_val_t retval_stack_idx = vtop(&mjs->arg_stack);
-        func_pos = mjs_get_int(mjs, retval_stack_idx) - 1;
+        size_t retval_stack_idx;
+        exec_gc_check(mjs);
+        if (!exec_budget_check(mjs)) {
+          /* The call is not started yet, so it's done again on resume */
+          if (exec_can_suspend(mjs)) goto suspend;
+          MJS_NEXT_OP();
+        }
+        retval_stack_idx = mjs_get_int(mjs, vtop(&mjs->arg_stack));
+        func_pos = retval_stack_idx - 1;
         func = vptr(&mjs->stack, func_pos);
 
         /* Drop data stack size (pushed by OP_ARGS) */
         mjs_pop_val(&mjs->arg_stack);
 
+        /* Let native code find out where it's called from */
+        mjs->cur_bcode_offset = bp.start_idx + code[i].off;
+
         if (mjs_is_function(*func)) {
           size_t off_call;
-          call_stack_push_frame(mjs, bp.start_idx + i, retval_stack_idx);
+          call_stack_push_frame(mjs, mjs->cur_bcode_offset, retval_stack_idx);
+          frame_base = exec_frame_base(mjs);
 
           /*
            * Function offset is a global bcode offset, so we need to convert it
-           * to the local offset
+           * to the index of the instruction in the part
            */
-          off_call = mjs_get_func_addr(*func) - 1;
-          bp = *mjs_bcode_part_get_by_offset(mjs, off_call);
-          code = (const uint8_t *) bp.data.p;
-          i = off_call - bp.start_idx;
+          off_call = mjs_get_func_addr(*func);
+          exec_part_switch(mjs, &bp, off_call);
+          code = bp.insns;
+          i = mjs_bcode_part_insn_idx(&bp, off_call - bp.start_idx) - 1;
+#if MJS_ENABLE_JIT
+          exec_jit_count(mjs, &bp, i + 1);
+          if (dispatch == dispatch_table) dispatch = jit_table;
+#endif
 
           *func = MJS_UNDEFINED;  // Return value
+          /* The OP_JMP over the body knows how much it pushes */
+          if (!exec_stack_reserve(mjs, code[i].b)) MJS_NEXT_OP();
           // LOG(LL_VERBOSE_DEBUG, ("CALLING  %d", i + 1));
         } else if (mjs_is_string(*func) || mjs_is_ffi_sig(*func)) {
           /* Call ffi-ed function */
 
-          call_stack_push_frame(mjs, bp.start_idx + i, retval_stack_idx);
+          call_stack_push_frame(mjs, mjs->cur_bcode_offset, retval_stack_idx);
 
           /* Perform the ffi-ed function call */
           mjs_ffi_call2(mjs);
@@ -8848,136 +10738,170 @@ MJS_PRIVATE mjs_err_t mjs_execute(struct mjs *mjs, size_t off, mjs_val_t *res) {
         } else if (mjs_is_foreign(*func)) {
           /* Call cfunction */
 
-          call_stack_push_frame(mjs, bp.start_idx + i, retval_stack_idx);
+          call_stack_push_frame(mjs, mjs->cur_bcode_offset, retval_stack_idx);
 
           /* Perform the cfunction call */
           ((void (*) (struct mjs *)) mjs_get_ptr(mjs, *func))(mjs);
 
           call_stack_restore_frame(mjs);
         } else {
-          mjs_set_errorf(mjs, MJS_TYPE_ERROR, "calling non-callable");
-        }
-        break;
-      }
-      case OP_SET_ARG: {
-        int llen1, llen2, n,
-            arg_no = cs_varint_decode_unsafe(&code[i + 1], &llen1);
-        mjs_val_t obj, key, v;
-        n = cs_varint_decode_unsafe(&code[i + llen1 + 1], &llen2);
-        key = mjs_mk_string(mjs, (char *) code + i + 1 + llen1 + llen2, n, 1);
-        obj = vtop(&mjs->scopes);
-        v = mjs_arg(mjs, arg_no);
-        mjs_set_v(mjs, obj, key, v);
-        i += llen1 + llen2 + n;
-        break;
-      }
-      case OP_SETRETVAL: {
-        if (mjs_stack_size(&mjs->call_stack) < CALL_STACK_FRAME_ITEMS_CNT) {
-          mjs_set_errorf(mjs, MJS_INTERNAL_ERROR, "cannot return");
-        } else {
-          size_t retval_pos = mjs_get_int(
-              mjs, *vptr(&mjs->call_stack,
-                         -1 - CALL_STACK_FRAME_ITEM_RETVAL_STACK_IDX));
-          *vptr(&mjs->stack, retval_pos - 1) = mjs_pop(mjs);
-        }
-        // LOG(LL_INFO, ("AFTER SETRETVAL"));
-        // mjs_dump(mjs, 0, stdout);
-        break;
-      }
-      case OP_EXPR: {
-        int op = code[i + 1];
-        exec_expr(mjs, op);
-        i++;
-        break;
+          mjs_set_errorf(mjs, MJS_TYPE_ERROR, "calling non-callable");
+        }
+        MJS_NEXT_OP();
       }
-      case OP_DROP: {
-        mjs_pop(mjs);
-        break;
+      MJS_OP(OP_SET_ARG): {
+        exec_set_args(mjs, bp.consts, &code[i]);
+        /* Skip the rest of the run, it's bound already */
+        i += code[i].op - 1;
+        MJS_NEXT_OP();
       }
-      case OP_DUP: {
-        mjs_push(mjs, vtop(&mjs->stack));
-        break;
+      MJS_OP(OP_SETRETVAL):
+        exec_setretval(mjs);
+        MJS_NEXT_OP();
+      MJS_OP(OP_EXPR):
+        if (code[i].op == TOK_ASSIGN) {
+          exec_assign(mjs, &bp.prop_caches[code[i].b]);
+        } else {
+          exec_expr(mjs, code[i].op);
+        }
+        MJS_NEXT_OP();
+      /* Division by zero gives NaN, see do_arith_op() */
+      MJS_OP_NUM_BINOP(OP_ADD, TOK_PLUS, 1, mjs_mk_number(mjs, a + b))
+      MJS_OP_NUM_BINOP(OP_SUB, TOK_MINUS, 1, mjs_mk_number(mjs, a - b))
+      MJS_OP_NUM_BINOP(OP_MUL, TOK_MUL, 1, mjs_mk_number(mjs, a * b))
+      MJS_OP_NUM_BINOP(OP_DIV, TOK_DIV, b != 0, mjs_mk_number(mjs, a / b))
+      MJS_OP_NUM_BINOP(OP_LT, TOK_LT, 1, mjs_mk_boolean(mjs, a < b))
+      MJS_OP_NUM_BINOP(OP_LE, TOK_LE, 1, mjs_mk_boolean(mjs, a <= b))
+      MJS_OP_NUM_BINOP(OP_GT, TOK_GT, 1, mjs_mk_boolean(mjs, a > b))
+      MJS_OP_NUM_BINOP(OP_GE, TOK_GE, 1, mjs_mk_boolean(mjs, a >= b))
+      MJS_OP_NUM_BINOP(OP_EQ_EQ, TOK_EQ_EQ, 1,
+                       mjs_mk_boolean(mjs, num_strict_eq(a, b, sp[-2], sp[-1])))
+      MJS_OP_NUM_BINOP(OP_NE_NE, TOK_NE_NE, 1,
+                       mjs_mk_boolean(mjs,
+                                      !num_strict_eq(a, b, sp[-2], sp[-1])))
+      MJS_OP(OP_DROP): {
+        exec_pop(mjs);
+        MJS_NEXT_OP();
       }
-      case OP_SWAP: {
-        mjs_val_t a = mjs_pop(mjs);
-        mjs_val_t b = mjs_pop(mjs);
-        mjs_push(mjs, a);
-        mjs_push(mjs, b);
-        break;
+      MJS_OP(OP_DUP): {
+        exec_push(mjs, vtop(&mjs->stack));
+        MJS_NEXT_OP();
       }
-      case OP_LOOP: {
-        int l1, l2, off = cs_varint_decode_unsafe(&code[i + 1], &l1);
-        /* push scope index */
-        push_mjs_val(&mjs->loop_addresses,
-                     mjs_mk_number(mjs, (double) mjs_stack_size(&mjs->scopes)));
-
-        /* push break offset */
-        push_mjs_val(
-            &mjs->loop_addresses,
-            mjs_mk_number(mjs, (double) (i + 1 /* OP_LOOP */ + l1 + off)));
-        off = cs_varint_decode_unsafe(&code[i + 1 + l1], &l2);
-
-        /* push continue offset */
-        push_mjs_val(
-            &mjs->loop_addresses,
-            mjs_mk_number(mjs, (double) (i + 1 /* OP_LOOP*/ + l1 + l2 + off)));
-        i += l1 + l2;
-        break;
+      MJS_OP(OP_SWAP): {
+        mjs_val_t a = exec_pop(mjs);
+        mjs_val_t b = exec_pop(mjs);
+        exec_push(mjs, a);
+        exec_push(mjs, b);
+        MJS_NEXT_OP();
       }
-      case OP_CONTINUE: {
-        if (mjs_stack_size(&mjs->loop_addresses) >= 3) {
-          size_t scopes_len = mjs_get_int(mjs, *vptr(&mjs->loop_addresses, -3));
-          assert(mjs_stack_size(&mjs->scopes) >= scopes_len);
-          mjs->scopes.len = scopes_len * sizeof(mjs_val_t);
+      MJS_OP(OP_LOOP):
+        exec_loop(mjs, code[i].a, code[i].b);
+        MJS_NEXT_OP();
+      MJS_OP(OP_CONTINUE): {
+        struct mjs_loop *loop = exec_loop_top(mjs);
+        if (!exec_budget_check(mjs)) {
+          if (exec_can_suspend(mjs)) goto suspend;
+        } else if (loop != NULL) {
+          assert(mjs_stack_size(&mjs->scopes) >= loop->scope_idx);
+          mjs_scopes_truncate(mjs, loop->scope_idx);
 
           /* jump to "continue" address */
-          i = mjs_get_int(mjs, vtop(&mjs->loop_addresses)) - 1;
+          i = loop->cont - 1;
+          exec_gc_check(mjs);
         } else {
           mjs_set_errorf(mjs, MJS_SYNTAX_ERROR, "misplaced 'continue'");
         }
-      } break;
-      case OP_BREAK: {
-        if (mjs_stack_size(&mjs->loop_addresses) >= 3) {
-          size_t scopes_len;
-          /* drop "continue" address */
-          mjs_pop_val(&mjs->loop_addresses);
-
-          /* pop "break" address and jump to it */
-          i = mjs_get_int(mjs, mjs_pop_val(&mjs->loop_addresses)) - 1;
+        MJS_NEXT_OP();
+      }
+      MJS_OP(OP_BREAK): {
+        struct mjs_loop *loop = exec_loop_top(mjs);
+        if (loop != NULL) {
+          mjs->loop_addresses.len -= sizeof(*loop);
 
-          /* restore scope index */
-          scopes_len = mjs_get_int(mjs, mjs_pop_val(&mjs->loop_addresses));
-          assert(mjs_stack_size(&mjs->scopes) >= scopes_len);
-          mjs->scopes.len = scopes_len * sizeof(mjs_val_t);
+          /* restore scope index, and jump to "break" address */
+          assert(mjs_stack_size(&mjs->scopes) >= loop->scope_idx);
+          mjs_scopes_truncate(mjs, loop->scope_idx);
+          i = loop->brk - 1;
 
           LOG(LL_VERBOSE_DEBUG, ("BREAKING TO %d", (int) i + 1));
         } else {
           mjs_set_errorf(mjs, MJS_SYNTAX_ERROR, "misplaced 'break'");
         }
-      } break;
-      case OP_NOP:
-        break;
-      case OP_EXIT:
-        i = bp.data.len;
-        break;
-      default:
+        MJS_NEXT_OP();
+      }
+      MJS_OP(OP_NOP):
+        MJS_NEXT_OP();
+      MJS_OP(OP_EXIT):
+        i = bp.insns_cnt;
+        MJS_NEXT_OP();
+#if MJS_ENABLE_COMPUTED_GOTO
+    op_trace:
+      MJS_EXEC_TRACE();
+      goto *dispatch_table[opcode];
+#if MJS_ENABLE_JIT
+    /*
+     * Entered after calls and returns, and after the instructions which the
+     * native code leaves to the interpreter: if there's native code of the
+     * next instruction, it's run until an instruction which is not compiled.
+     * That one is executed right here, and then we get back to `op_jit`.
+     */
+    op_jit: {
+      void *native = bp.jit->code[i];
+      if (native == NULL) {
+        /* Not a compiled function: keep interpreting it */
+        dispatch = dispatch_table;
+      } else if (native != MJS_JIT_EXIT) {
+        struct mjs_jit_ctx ctx;
+        ctx.frame_base = frame_base;
+        ctx.prev_opcode = prev_opcode;
+        i = mjs_jit_run(mjs, bp.jit, &ctx, native);
+        prev_opcode = ctx.prev_opcode;
+        opcode = code[i].opcode;
+        if (mjs->error != MJS_OK) goto op_error;
+      }
+      if (opcode >= OP_MAX) goto op_default;
+      goto *dispatch_table[opcode];
+    }
+#endif
+#endif
+      MJS_OP_DEFAULT:
+#if !MJS_ENABLE_COMPUTED_GOTO
+        if (sel & MJS_TRACE_FLAG) {
+          MJS_EXEC_TRACE();
+          sel = opcode;
+          goto op_dispatch;
+        }
+#endif
 #if MJS_ENABLE_DEBUG
         mjs_dump(mjs, 1);
 #endif
         mjs_set_errorf(mjs, MJS_INTERNAL_ERROR, "Unknown opcode: %d, off %d+%d",
-                       (int) opcode, (int) bp.start_idx, (int) i);
-        i = bp.data.len;
-        break;
+                       (int) opcode, (int) bp.start_idx, (int) code[i].off);
+        i = bp.insns_cnt;
+        MJS_NEXT_OP();
     }
     if (mjs->error != MJS_OK) {
-      mjs_gen_stack_trace(mjs, bp.start_idx + i - 1 /* undo the i++ */);
+#if MJS_ENABLE_COMPUTED_GOTO
+    op_error:
+#endif
+      if (mjs->error == MJS_SUSPENDED) {
+        /* See mjs_yield(): the call is done, so continue after it */
+        prev_opcode = opcode;
+        i++;
+        goto suspend;
+      }
+
+      /* Offset of the last byte of the failed instruction, minus one */
+      mjs_gen_stack_trace(
+          mjs, bp.start_idx - 2 +
+                   (i + 1 < bp.insns_cnt ? code[i + 1].off : bp.data.len));
 
       /* restore stack lenghts */
-      mjs->stack.len = stack_len;
-      mjs->call_stack.len = call_stack_len;
-      mjs->arg_stack.len = arg_stack_len;
-      mjs->scopes.len = scopes_len;
-      mjs->loop_addresses.len = loop_addresses_len;
+      mjs->stack.len = st->stack_len;
+      mjs->call_stack.len = st->call_stack_len;
+      mjs->arg_stack.len = st->arg_stack_len;
+      mjs_scopes_truncate(mjs, st->scopes_len / sizeof(mjs_val_t));
+      mjs->loop_addresses.len = st->loop_addresses_len;
 
       /* script will evaluate to `undefined` */
       mjs_push(mjs, MJS_UNDEFINED);
@@ -8987,10 +10911,55 @@ MJS_PRIVATE mjs_err_t mjs_execute(struct mjs *mjs, size_t off, mjs_val_t *res) {
 
 clean:
   /* Remember result of the evaluation of this bcode part */
-  mjs_bcode_part_get_by_offset(mjs, start_off)->exec_res = mjs->error;
+  mjs_bcode_part_get_by_offset(mjs, st->start_off)->exec_res = mjs->error;
 
+  mjs->exec_depth--;
+  mjs->stack_limit = prev_stack_limit;
   *res = mjs_pop(mjs);
   return mjs->error;
+
+suspend:
+  /* Instruction `i` is the next one to execute, everything else is kept */
+  mjs->exec_state = *st;
+  mjs->exec_state.off = bp.start_idx + code[i].off;
+  mjs->exec_state.prev_opcode = prev_opcode;
+  mjs->suspended = 1;
+
+  mjs->exec_depth--;
+  mjs->stack_limit = prev_stack_limit;
+  *res = MJS_UNDEFINED;
+  return mjs->error;
+}
+
+MJS_PRIVATE mjs_err_t mjs_execute(struct mjs *mjs, size_t off, mjs_val_t *res) {
+  struct mjs_exec_state st;
+  st.off = st.start_off = off;
+  st.prev_opcode = OP_MAX;
+  /* Remember lengths of all stacks, they will be restored in case of an error */
+  st.stack_len = mjs->stack.len;
+  st.call_stack_len = mjs->call_stack.len;
+  st.arg_stack_len = mjs->arg_stack.len;
+  st.scopes_len = mjs->scopes.len;
+  st.loop_addresses_len = mjs->loop_addresses.len;
+  return exec_run(mjs, &st, res);
+}
+
+mjs_err_t mjs_resume(struct mjs *mjs, mjs_val_t *res) {
+  struct mjs_exec_state st = mjs->exec_state;
+  mjs_val_t r = MJS_UNDEFINED;
+  if (!mjs->suspended) {
+    return mjs_set_errorf(mjs, MJS_BAD_ARGS_ERROR, "nothing to resume");
+  }
+  mjs->suspended = 0;
+  exec_run(mjs, &st, &r);
+  if (res != NULL) *res = r;
+  return mjs->error;
+}
+
+int mjs_yield(struct mjs *mjs) {
+  if (!exec_can_suspend(mjs)) return 0;
+  mjs_set_errorf(mjs, MJS_SUSPENDED, "execution suspended");
+  return 1;
 }
 
 MJS_PRIVATE mjs_err_t mjs_exec_internal(struct mjs *mjs, const char *path,
@@ -9124,6 +11093,13 @@ mjs_err_t mjs_exec_jsc(struct mjs *mjs, const char *path, mjs_val_t *res) {
   if (bytes == NULL) {
     error = MJS_FILE_READ_ERROR;
     mjs_prepend_errorf(mjs, error, "failed to read file \"%s\"", path);
+  } else if (size > 0 && bytes[0] == OP_BCODE_HEADER &&
+             mjs_bcode_version((uint8_t *) bytes) > MJS_BCODE_VERSION) {
+    /* The file was compiled by a newer mjs */
+    free(bytes);
+    error = MJS_NOT_IMPLEMENTED_ERROR;
+    mjs_prepend_errorf(mjs, error, "unsupported bcode version in \"%s\"",
+                       path);
   } else {
     mjs_val_t r = MJS_UNDEFINED;
     size_t off = mjs->bcode_len;
@@ -9134,7 +11110,7 @@ mjs_err_t mjs_exec_jsc(struct mjs *mjs, const char *path, mjs_val_t *res) {
     };
     mjs_bcode_part_add(mjs, &bp);
     mjs->bcode_len += size;
-    mjs_execute(mjs, off, &r);
+    error = mjs_execute(mjs, off, &r);
     if (res != NULL) {
       *res = r;
     }
@@ -9184,7 +11160,8 @@ mjs_err_t mjs_call(struct mjs *mjs, mjs_val_t *res, mjs_val_t func,
 
 mjs_err_t mjs_apply(struct mjs *mjs, mjs_val_t *res, mjs_val_t func,
                     mjs_val_t this_val, int nargs, mjs_val_t *args) {
-  mjs_val_t r, prev_this_val, retval_stack_idx, *resp;
+  mjs_val_t r, prev_this_val;
+  size_t retval_stack_idx;
   int i;
 
   if (!mjs_is_function(func) && !mjs_is_foreign(func) &&
@@ -9198,10 +11175,12 @@ mjs_err_t mjs_apply(struct mjs *mjs, mjs_val_t *res, mjs_val_t func,
 
   /* Push callable which will be later replaced with the return value */
   mjs_push(mjs, func);
-  resp = vptr(&mjs->stack, -1);
 
-  /* Remember index by which return value should be written */
-  retval_stack_idx = mjs_mk_number(mjs, (double) mjs_stack_size(&mjs->stack));
+  /*
+   * Remember index by which return value should be written: not a pointer,
+   * since the function can grow the stack
+   */
+  retval_stack_idx = mjs_stack_size(&mjs->stack);
 
   // Push all arguments
   for (i = 0; i < nargs; i++) {
@@ -9216,10 +11195,10 @@ mjs_err_t mjs_apply(struct mjs *mjs, mjs_val_t *res, mjs_val_t func,
 
   if (mjs_is_foreign(func)) {
     ((void (*) (struct mjs *)) mjs_get_ptr(mjs, func))(mjs);
-    if (res != NULL) *res = *resp;
+    if (res != NULL) *res = *vptr(&mjs->stack, retval_stack_idx - 1);
   } else if (mjs_is_ffi_sig(func)) {
     mjs_ffi_call2(mjs);
-    if (res != NULL) *res = *resp;
+    if (res != NULL) *res = *vptr(&mjs->stack, retval_stack_idx - 1);
   } else {
     size_t addr = mjs_get_func_addr(func);
     mjs_execute(mjs, addr, &r);
@@ -9227,10 +11206,10 @@ mjs_err_t mjs_apply(struct mjs *mjs, mjs_val_t *res, mjs_val_t func,
   }
 
   /*
-   * If there was an error, we need to restore frame and do the cleanup
-   * which is otherwise done by OP_RETURN
+   * If there was an error, or the function is native, we need to restore
+   * frame and do the cleanup which is otherwise done by OP_RETURN
    */
-  if (mjs->error != MJS_OK) {
+  if (mjs->error != MJS_OK || !mjs_is_function(func)) {
     call_stack_restore_frame(mjs);
 
     // Pop cell at which the returned value should've been written
@@ -9952,8 +11931,7 @@ MJS_PRIVATE mjs_err_t mjs_ffi_call2(struct mjs *mjs) {
   }
   res.v.i = 0;
 
-  nargs =
-      mjs_stack_size(&mjs->stack) - mjs_get_int(mjs, vtop(&mjs->call_stack));
+  nargs = mjs_stack_size(&mjs->stack) - mjs_call_frame(mjs, 0)->retval_idx;
 
   if (nargs != psig->args_cnt) {
     ret = MJS_TYPE_ERROR;
@@ -10424,6 +12402,7 @@ void *dlsym(void *handle, const char *name) {
 /* Amalgamated: #include "common/cs_varint.h" */
 /* Amalgamated: #include "common/mbuf.h" */
 
+/* Amalgamated: #include "mjs_bcode.h" */
 /* Amalgamated: #include "mjs_core.h" */
 /* Amalgamated: #include "mjs_ffi.h" */
 /* Amalgamated: #include "mjs_gc.h" */
@@ -10926,6 +12905,40 @@ static void gc_mark_mbuf_val(struct mjs *mjs, const struct mbuf *mbuf) {
                     mbuf->len / sizeof(mjs_val_t));
 }
 
+/*
+ * mark constant pools of the bcode parts
+ */
+static void gc_mark_bcode_consts(struct mjs *mjs) {
+  int i, parts_cnt = mjs_bcode_parts_cnt(mjs);
+  for (i = 0; i < parts_cnt; i++) {
+    struct mjs_bcode_part *bp = mjs_bcode_part_get(mjs, i);
+    gc_mark_val_array(mjs, bp->consts, bp->consts_cnt);
+  }
+}
+
+/*
+ * mark `this` values saved in the call stack frames
+ */
+static void gc_mark_call_stack(struct mjs *mjs) {
+  struct mjs_frame *f = (struct mjs_frame *) mjs->call_stack.buf;
+  size_t i, n = mjs_call_frames_cnt(mjs);
+  for (i = 0; i < n; i++) {
+    gc_mark(mjs, &f[i].this_obj);
+  }
+}
+
+/*
+ * mark variables of the scopes which are not materialised
+ */
+static void gc_mark_scope_vars(struct mjs *mjs) {
+  struct mjs_scope_var *v = (struct mjs_scope_var *) mjs->scope_vars.buf;
+  size_t i, n = mjs->scope_vars.len / sizeof(*v);
+  for (i = 0; i < n; i++) {
+    gc_mark(mjs, &v[i].key);
+    gc_mark(mjs, &v[i].value);
+  }
+}
+
 static void gc_mark_ffi_cbargs_list(struct mjs *mjs, ffi_cb_args_t *cbargs) {
   for (; cbargs != NULL; cbargs = cbargs->next) {
     gc_mark(mjs, &cbargs->func);
@@ -10940,8 +12953,10 @@ void mjs_gc(struct mjs *mjs, int full) {
 
   gc_mark_mbuf_pt(mjs, &mjs->owned_values);
   gc_mark_mbuf_val(mjs, &mjs->scopes);
+  gc_mark_scope_vars(mjs);
   gc_mark_mbuf_val(mjs, &mjs->stack);
-  gc_mark_mbuf_val(mjs, &mjs->call_stack);
+  gc_mark_call_stack(mjs);
+  gc_mark_bcode_consts(mjs);
 
   gc_mark_ffi_cbargs_list(mjs, mjs->ffi_cb_args);
 
@@ -10951,6 +12966,9 @@ void mjs_gc(struct mjs *mjs, int full) {
   gc_sweep(mjs, &mjs->node_arena, 0);
   gc_sweep(mjs, &mjs->ffi_sig_arena, 0);
 
+  /* Nodes might be freed, and strings have moved: drop inline caches */
+  mjs->prop_cache_epoch++;
+
   if (full) {
     /*
      * In case of full GC, we also resize strings buffer, but we still leave
@@ -10974,16 +12992,791 @@ MJS_PRIVATE int gc_check_val(struct mjs *mjs, mjs_val_t v) {
   return 1;
 }
 
-MJS_PRIVATE int gc_check_ptr(const struct gc_arena *a, const void *ptr) {
-  const struct gc_cell *p = (const struct gc_cell *) ptr;
-  struct gc_block *b;
-  for (b = a->blocks; b != NULL; b = b->next) {
-    if (p >= b->base && p < GC_CELL_OP(a, b->base, +, b->size)) {
-      return 1;
+MJS_PRIVATE int gc_check_ptr(const struct gc_arena *a, const void *ptr) {
+  const struct gc_cell *p = (const struct gc_cell *) ptr;
+  struct gc_block *b;
+  for (b = a->blocks; b != NULL; b = b->next) {
+    if (p >= b->base && p < GC_CELL_OP(a, b->base, +, b->size)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+#ifdef MJS_MODULE_LINES
+#line 1 "src/mjs_jit.c"
+#endif
+
+/* Amalgamated: #include "common/mbuf.h" */
+
+/* Amalgamated: #include "mjs_array.h" */
+/* Amalgamated: #include "mjs_bcode.h" */
+/* Amalgamated: #include "mjs_conversion.h" */
+/* Amalgamated: #include "mjs_core.h" */
+/* Amalgamated: #include "mjs_internal.h" */
+/* Amalgamated: #include "mjs_jit.h" */
+/* Amalgamated: #include "mjs_object.h" */
+/* Amalgamated: #include "mjs_primitive.h" */
+/* Amalgamated: #include "mjs_tok.h" */
+
+#if MJS_ENABLE_JIT
+
+#include <sys/mman.h>
+
+/* Hidden by the strict feature macros, but it's always the same on Linux */
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS 0x20
+#endif
+
+/* General purpose registers, numbered as in the instruction encoding */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI };
+/* SSE registers */
+enum { XMM0, XMM1, XMM2 };
+
+/*
+ * Registers which hold the arguments of mjs_jit_run() in the native code;
+ * both are callee-saved, so they survive calls of the helpers
+ */
+#define R_MJS RBX
+#define R_CTX RBP
+
+/* No index register in the memory operand, see jit_mem() */
+#define NO_INDEX (-1)
+
+/* Condition codes of `jcc` and `setcc`; `cc ^ 1` is the opposite condition */
+enum {
+  CC_B = 2,
+  CC_AE = 3,
+  CC_E = 4,
+  CC_NE = 5,
+  CC_BE = 6,
+  CC_A = 7,
+  CC_P = 10,
+  CC_NP = 11,
+};
+/* Unconditional jump, see jit_jcc() */
+#define CC_ALWAYS (-1)
+
+/* Opcodes, two-byte ones include the 0x0f escape */
+#define X86_OR_RM 0x09
+#define X86_CMP_R 0x3b
+#define X86_ALU_IMM8 0x83
+#define X86_TEST 0x85
+#define X86_MOV_RM 0x89
+#define X86_MOV_R 0x8b
+#define X86_LEA 0x8d
+#define X86_MOV_RM8_IMM 0xc6
+#define X86_GRP5 0xff /* /2: call, /4: jmp */
+#define X86_MOVSD_LOAD 0x0f10
+#define X86_MOVSD_STORE 0x0f11
+#define X86_UCOMISD 0x0f2e
+#define X86_XORPD 0x0f57
+#define X86_ADDSD 0x0f58
+#define X86_MULSD 0x0f59
+#define X86_SUBSD 0x0f5c
+#define X86_DIVSD 0x0f5e
+#define X86_MOVQ_XMM 0x0f6e
+#define X86_SETCC 0x0f90
+#define X86_MOVZX8 0x0fb6
+
+/* Prefixes of the SSE instructions */
+#define X86_PFX_66 0x66
+#define X86_PFX_F2 0xf2
+
+#define OFF_STACK_BUF (offsetof(struct mjs, stack) + offsetof(struct mbuf, buf))
+#define OFF_STACK_LEN (offsetof(struct mjs, stack) + offsetof(struct mbuf, len))
+#define OFF_THIS (offsetof(struct mjs, vals) + offsetof(struct mjs_vals, this_obj))
+#define OFF_ERROR offsetof(struct mjs, error)
+#define OFF_FRAME_BASE offsetof(struct mjs_jit_ctx, frame_base)
+#define OFF_PREV_OPCODE offsetof(struct mjs_jit_ctx, prev_opcode)
+
+#define VAL_SIZE ((int32_t) sizeof(mjs_val_t))
+
+/* Executable memory holding the code of one compiled function */
+struct mjs_jit_block {
+  struct mjs_jit_block *next;
+  size_t size;
+};
+
+/* Jump to an instruction which is not emitted yet */
+struct jit_fixup {
+  size_t pos; /* Position of the 32-bit displacement */
+  size_t idx; /* Target instruction */
+};
+
+/* Function being compiled */
+struct jit_emit {
+  struct mbuf buf;    /* Native code */
+  struct mbuf fixups; /* struct jit_fixup */
+  struct mjs *mjs;
+  const struct mjs_bcode_part *bp;
+  const struct mjs_jit_helpers *h;
+  size_t entry, end; /* Instructions of the function */
+  size_t exit;       /* Position of the code returning to the interpreter */
+};
+
+static void jit_byte(struct jit_emit *e, uint8_t b) {
+  mbuf_append(&e->buf, &b, sizeof(b));
+}
+
+static void jit_u32(struct jit_emit *e, uint32_t v) {
+  mbuf_append(&e->buf, &v, sizeof(v));
+}
+
+static void jit_u64(struct jit_emit *e, uint64_t v) {
+  mbuf_append(&e->buf, &v, sizeof(v));
+}
+
+/* REX prefix, if any, for the given registers; `w` selects 64-bit operands */
+static void jit_rex(struct jit_emit *e, int w, int reg, int index, int base) {
+  uint8_t rex = 0x40 | (w ? 8 : 0) | ((reg & 8) >> 1) |
+                (index == NO_INDEX ? 0 : (index & 8) >> 2) | ((base & 8) >> 3);
+  if (rex != 0x40) jit_byte(e, rex);
+}
+
+static void jit_opcode(struct jit_emit *e, int pfx, int w, unsigned op,
+                       int reg, int index, int base) {
+  if (pfx != 0) jit_byte(e, pfx);
+  jit_rex(e, w, reg, index, base);
+  if (op > 0xff) jit_byte(e, op >> 8);
+  jit_byte(e, op & 0xff);
+}
+
+/*
+ * Instruction `op` with a register (or an opcode extension) `reg`, and memory
+ * operand `[base + index * scale + disp]`
+ */
+static void jit_mem(struct jit_emit *e, int pfx, int w, unsigned op, int reg,
+                    int base, int index, int scale, int32_t disp) {
+  int mod = 2;
+  if (disp == 0 && (base & 7) != RBP) {
+    mod = 0;
+  } else if (disp >= -128 && disp <= 127) {
+    mod = 1;
+  }
+  jit_opcode(e, pfx, w, op, reg, index, base);
+  if (index == NO_INDEX && (base & 7) != RSP) {
+    jit_byte(e, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+  } else {
+    int ss = scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+    jit_byte(e, (mod << 6) | ((reg & 7) << 3) | RSP);
+    jit_byte(e, (ss << 6) | ((index == NO_INDEX ? RSP : index & 7) << 3) |
+                    (base & 7));
+  }
+  if (mod == 1) {
+    jit_byte(e, (uint8_t) disp);
+  } else if (mod == 2) {
+    jit_u32(e, (uint32_t) disp);
+  }
+}
+
+/* Instruction `op` with register operands `reg` and `rm` */
+static void jit_rr(struct jit_emit *e, int pfx, int w, unsigned op, int reg,
+                   int rm) {
+  jit_opcode(e, pfx, w, op, reg, NO_INDEX, rm);
+  jit_byte(e, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* ALU operation `ext` (0: add, 5: sub, 7: cmp) of a register and `imm` */
+static void jit_alu_imm(struct jit_emit *e, int ext, int reg, int32_t imm) {
+  if (imm >= -128 && imm <= 127) {
+    jit_rr(e, 0, 1, X86_ALU_IMM8, ext, reg);
+    jit_byte(e, (uint8_t) imm);
+  } else {
+    jit_rr(e, 0, 1, 0x81, ext, reg);
+    jit_u32(e, (uint32_t) imm);
+  }
+}
+
+static void jit_mov_imm(struct jit_emit *e, int reg, uint64_t imm) {
+  if (imm <= 0xffffffff) {
+    /* 32-bit moves clear the upper half */
+    jit_rex(e, 0, 0, NO_INDEX, reg);
+    jit_byte(e, 0xb8 + (reg & 7));
+    jit_u32(e, (uint32_t) imm);
+  } else {
+    jit_rex(e, 1, 0, NO_INDEX, reg);
+    jit_byte(e, 0xb8 + (reg & 7));
+    jit_u64(e, imm);
+  }
+}
+
+static void jit_mov_ptr(struct jit_emit *e, int reg, const void *p) {
+  jit_mov_imm(e, reg, (uint64_t) (uintptr_t) p);
+}
+
+/* Loads the value at address `p`, which is read when the code is executed */
+static void jit_load_abs(struct jit_emit *e, int reg, const void *p) {
+  jit_mov_ptr(e, reg, p);
+  jit_mem(e, 0, 1, X86_MOV_R, reg, reg, NO_INDEX, 1, 0);
+}
+
+/* Emits `jcc` or `jmp` with a displacement to be set by jit_patch() */
+static size_t jit_jcc(struct jit_emit *e, int cc) {
+  if (cc == CC_ALWAYS) {
+    jit_byte(e, 0xe9);
+  } else {
+    jit_byte(e, 0x0f);
+    jit_byte(e, 0x80 + cc);
+  }
+  jit_u32(e, 0);
+  return e->buf.len - sizeof(uint32_t);
+}
+
+/* Sets the jump at `pos` to jump to `target` */
+static void jit_patch(struct jit_emit *e, size_t pos, size_t target) {
+  int32_t rel = (int32_t) (target - (pos + sizeof(rel)));
+  memcpy(e->buf.buf + pos, &rel, sizeof(rel));
+}
+
+/* Jumps to the current position from `pos`, see jit_jcc() */
+static void jit_here(struct jit_emit *e, size_t pos) {
+  jit_patch(e, pos, e->buf.len);
+}
+
+/* Returns to the interpreter, which is to execute instruction `idx` */
+static void jit_exit(struct jit_emit *e, size_t idx) {
+  jit_mov_imm(e, RAX, idx);
+  jit_patch(e, jit_jcc(e, CC_ALWAYS), e->exit);
+}
+
+static void jit_exit_if(struct jit_emit *e, int cc, size_t idx) {
+  size_t skip = jit_jcc(e, cc ^ 1);
+  jit_exit(e, idx);
+  jit_here(e, skip);
+}
+
+/* Jumps to instruction `idx` if condition `cc` holds */
+static void jit_goto(struct jit_emit *e, int cc, size_t idx) {
+  if (idx >= e->entry && idx < e->end) {
+    struct jit_fixup f;
+    f.pos = jit_jcc(e, cc);
+    f.idx = idx;
+    mbuf_append(&e->fixups, &f, sizeof(f));
+  } else if (cc == CC_ALWAYS) {
+    jit_exit(e, idx);
+  } else {
+    jit_exit_if(e, cc, idx);
+  }
+}
+
+/* Calls `fn` with `mjs` as the first argument; others should be set already */
+static void jit_call(struct jit_emit *e, const void *fn) {
+  jit_rr(e, 0, 1, X86_MOV_RM, R_MJS, RDI);
+  jit_mov_ptr(e, RAX, fn);
+  jit_rr(e, 0, 0, X86_GRP5, 2, RAX);
+}
+
+#define JIT_CALL(e, fn) jit_call(e, (const void *) (uintptr_t)(fn))
+
+/* Returns to the interpreter if a helper has set an error */
+static void jit_check_error(struct jit_emit *e, size_t idx) {
+  jit_mem(e, 0, 0, X86_ALU_IMM8, 7, R_MJS, NO_INDEX, 1, OFF_ERROR);
+  jit_byte(e, 0);
+  jit_exit_if(e, CC_NE, idx);
+}
+
+/* Remembers the opcode of the instruction as executed, for the next one */
+static void jit_set_prev(struct jit_emit *e, uint8_t opcode) {
+  jit_mem(e, 0, 0, X86_MOV_RM8_IMM, 0, R_CTX, NO_INDEX, 1, OFF_PREV_OPCODE);
+  jit_byte(e, opcode);
+}
+
+/*
+ * Loads the data stack: length into rdx, buffer into rcx. If there are less
+ * than `n` values, the instruction `idx` is left to the interpreter.
+ */
+static void jit_stack(struct jit_emit *e, int n, size_t idx) {
+  jit_mem(e, 0, 1, X86_MOV_R, RDX, R_MJS, NO_INDEX, 1, OFF_STACK_LEN);
+  if (n > 0) {
+    jit_alu_imm(e, 7, RDX, n * VAL_SIZE);
+    jit_exit_if(e, CC_B, idx);
+  }
+  jit_mem(e, 0, 1, X86_MOV_R, RCX, R_MJS, NO_INDEX, 1, OFF_STACK_BUF);
+}
+
+/* Drops `n` values from the stack loaded by jit_stack() */
+static void jit_drop(struct jit_emit *e, int n) {
+  jit_alu_imm(e, 5, RDX, n * VAL_SIZE);
+  jit_mem(e, 0, 1, X86_MOV_RM, RDX, R_MJS, NO_INDEX, 1, OFF_STACK_LEN);
+}
+
+/*
+ * Pushes rax. Like exec_push(), it doesn't grow the stack: the room is
+ * reserved when the function is called.
+ */
+static void jit_push(struct jit_emit *e) {
+  jit_mem(e, 0, 1, X86_MOV_R, RDX, R_MJS, NO_INDEX, 1, OFF_STACK_LEN);
+  jit_mem(e, 0, 1, X86_MOV_R, RCX, R_MJS, NO_INDEX, 1, OFF_STACK_BUF);
+  jit_mem(e, 0, 1, X86_MOV_RM, RAX, RCX, RDX, 1, 0);
+  jit_mem(e, 0, 1, X86_LEA, RDX, RDX, NO_INDEX, 1, VAL_SIZE);
+  jit_mem(e, 0, 1, X86_MOV_RM, RDX, R_MJS, NO_INDEX, 1, OFF_STACK_LEN);
+}
+
+static void jit_push_imm(struct jit_emit *e, mjs_val_t v) {
+  jit_mov_imm(e, RAX, v);
+  jit_push(e);
+}
+
+/* Loads the TOS into rax */
+static void jit_top(struct jit_emit *e, size_t idx) {
+  jit_stack(e, 1, idx);
+  jit_mem(e, 0, 1, X86_MOV_R, RAX, RCX, RDX, 1, -VAL_SIZE);
+}
+
+/* Pops the TOS into rax */
+static void jit_pop(struct jit_emit *e, size_t idx) {
+  jit_top(e, idx);
+  jit_drop(e, 1);
+}
+
+/* Calls mjs_is_truthy() for rax */
+static void jit_truthy(struct jit_emit *e) {
+  jit_rr(e, 0, 1, X86_MOV_RM, RAX, RSI);
+  JIT_CALL(e, mjs_is_truthy);
+}
+
+/*
+ * Conditional jump of instruction `k` to `idx`, by truthiness in eax: if
+ * `on_false`, it jumps if eax is 0, pushing `undefined` first if `push_undef`.
+ */
+static void jit_branch(struct jit_emit *e, size_t k, size_t idx, int on_false,
+                       int push_undef) {
+  jit_set_prev(e, e->bp->insns[k].opcode);
+  jit_rr(e, 0, 0, X86_TEST, RAX, RAX);
+  if (push_undef) {
+    size_t skip = jit_jcc(e, CC_NE);
+    jit_push_imm(e, MJS_UNDEFINED);
+    jit_goto(e, CC_ALWAYS, idx);
+    jit_here(e, skip);
+  } else {
+    jit_goto(e, on_false ? CC_E : CC_NE, idx);
+  }
+}
+
+/*
+ * Loads two numbers from the top of the stack into xmm0 and xmm1. Returns
+ * position of the jump to be taken if they're not numbers (or NaN, which is
+ * left to the slow path too): jit_stack() is done already.
+ */
+static void jit_load_numbers(struct jit_emit *e, size_t *slow) {
+  jit_mem(e, X86_PFX_F2, 0, X86_MOVSD_LOAD, XMM0, RCX, RDX, 1, -2 * VAL_SIZE);
+  jit_mem(e, X86_PFX_F2, 0, X86_MOVSD_LOAD, XMM1, RCX, RDX, 1, -VAL_SIZE);
+  jit_rr(e, X86_PFX_66, 0, X86_UCOMISD, XMM0, XMM0);
+  slow[0] = jit_jcc(e, CC_P);
+  jit_rr(e, X86_PFX_66, 0, X86_UCOMISD, XMM1, XMM1);
+  slow[1] = jit_jcc(e, CC_P);
+}
+
+/*
+ * Compares the numbers loaded by jit_load_numbers() as the given opcode does,
+ * leaving the boolean result in eax
+ */
+static void jit_compare(struct jit_emit *e, int opcode) {
+  int cc;
+  switch (opcode) {
+    case OP_LT:
+      cc = CC_B;
+      break;
+    case OP_LE:
+      cc = CC_BE;
+      break;
+    case OP_GT:
+      cc = CC_A;
+      break;
+    case OP_GE:
+      cc = CC_AE;
+      break;
+    default:
+      /* Like num_strict_eq(): since there are no NaNs, compare the bits */
+      jit_mem(e, 0, 1, X86_MOV_R, RAX, RCX, RDX, 1, -2 * VAL_SIZE);
+      jit_mem(e, 0, 1, X86_CMP_R, RAX, RCX, RDX, 1, -VAL_SIZE);
+      cc = opcode == OP_EQ_EQ ? CC_E : CC_NE;
+      break;
+  }
+  if (opcode >= OP_LT && opcode <= OP_GE) {
+    jit_rr(e, X86_PFX_66, 0, X86_UCOMISD, XMM0, XMM1);
+  }
+  jit_rr(e, 0, 0, X86_SETCC + cc, 0, RAX);
+  jit_rr(e, 0, 0, X86_MOVZX8, RAX, RAX);
+}
+
+/* Token of the operator of OP_ADD ... OP_NE_NE */
+static int jit_binop_tok(int opcode) {
+  static const int toks[] = {TOK_PLUS, TOK_MINUS, TOK_MUL,   TOK_DIV,
+                             TOK_LT,   TOK_LE,    TOK_GT,    TOK_GE,
+                             TOK_EQ_EQ, TOK_NE_NE};
+  return toks[opcode - OP_ADD];
+}
+
+/* OP_ADD ... OP_NE_NE, like MJS_OP_NUM_BINOP() */
+static void jit_binop(struct jit_emit *e, size_t k) {
+  int opcode = e->bp->insns[k].opcode;
+  size_t slow[4], done;
+  int nslow = 3, j;
+  jit_mem(e, 0, 1, X86_MOV_R, RDX, R_MJS, NO_INDEX, 1, OFF_STACK_LEN);
+  jit_alu_imm(e, 7, RDX, 2 * VAL_SIZE);
+  slow[2] = jit_jcc(e, CC_B);
+  jit_mem(e, 0, 1, X86_MOV_R, RCX, R_MJS, NO_INDEX, 1, OFF_STACK_BUF);
+  jit_load_numbers(e, slow);
+  if (opcode <= OP_DIV) {
+    static const unsigned ops[] = {X86_ADDSD, X86_SUBSD, X86_MULSD, X86_DIVSD};
+    size_t num;
+    if (opcode == OP_DIV) {
+      /* Division by zero is left to exec_expr(), like the interpreter does */
+      jit_rr(e, X86_PFX_66, 0, X86_XORPD, XMM2, XMM2);
+      jit_rr(e, X86_PFX_66, 0, X86_UCOMISD, XMM1, XMM2);
+      slow[nslow++] = jit_jcc(e, CC_E);
+    }
+    jit_rr(e, X86_PFX_F2, 0, ops[opcode - OP_ADD], XMM0, XMM1);
+    /* Like mjs_mk_number(), NaN results are canonical */
+    jit_rr(e, X86_PFX_66, 0, X86_UCOMISD, XMM0, XMM0);
+    num = jit_jcc(e, CC_NP);
+    jit_mov_imm(e, RAX, MJS_TAG_NAN);
+    jit_rr(e, X86_PFX_66, 1, X86_MOVQ_XMM, XMM0, RAX);
+    jit_here(e, num);
+    jit_mem(e, X86_PFX_F2, 0, X86_MOVSD_STORE, XMM0, RCX, RDX, 1,
+            -2 * VAL_SIZE);
+  } else {
+    jit_compare(e, opcode);
+    jit_mov_imm(e, RSI, MJS_TAG_BOOLEAN);
+    jit_rr(e, 0, 1, X86_OR_RM, RSI, RAX);
+    jit_mem(e, 0, 1, X86_MOV_RM, RAX, RCX, RDX, 1, -2 * VAL_SIZE);
+  }
+  jit_drop(e, 1);
+  done = jit_jcc(e, CC_ALWAYS);
+  for (j = 0; j < nslow; j++) jit_here(e, slow[j]);
+  jit_mov_imm(e, RSI, jit_binop_tok(opcode));
+  JIT_CALL(e, e->h->expr);
+  jit_check_error(e, k);
+  jit_here(e, done);
+  jit_set_prev(e, opcode);
+}
+
+/* OP_JMP_FALSE_LT ... OP_JMP_FALSE_NE_NE, like MJS_OP_JMP_FALSE_CMP() */
+static void jit_cmp_jmp(struct jit_emit *e, size_t k) {
+  int opcode = e->bp->insns[k].opcode - OP_JMP_FALSE_LT + OP_LT;
+  size_t slow[3], done;
+  int j;
+  jit_mem(e, 0, 1, X86_MOV_R, RDX, R_MJS, NO_INDEX, 1, OFF_STACK_LEN);
+  jit_alu_imm(e, 7, RDX, 2 * VAL_SIZE);
+  slow[2] = jit_jcc(e, CC_B);
+  jit_mem(e, 0, 1, X86_MOV_R, RCX, R_MJS, NO_INDEX, 1, OFF_STACK_BUF);
+  jit_load_numbers(e, slow);
+  jit_compare(e, opcode);
+  jit_drop(e, 2);
+  done = jit_jcc(e, CC_ALWAYS);
+  for (j = 0; j < 3; j++) jit_here(e, slow[j]);
+  jit_mov_imm(e, RSI, jit_binop_tok(opcode));
+  JIT_CALL(e, e->h->cmp);
+  jit_check_error(e, k);
+  jit_here(e, done);
+  jit_branch(e, k, e->bp->insns[k].a, 1, 1);
+}
+
+/*
+ * OP_CONTINUE and OP_BREAK: `fn` returns index of the target instruction,
+ * whose native code is looked up at run time
+ */
+static void jit_loop_jump(struct jit_emit *e, size_t k, size_t (*fn)(struct mjs *)) {
+  size_t interp;
+  JIT_CALL(e, fn);
+  jit_alu_imm(e, 7, RAX, -1);
+  jit_exit_if(e, CC_E, k);
+  jit_set_prev(e, e->bp->insns[k].opcode);
+  jit_mov_ptr(e, RCX, e->bp->jit->code);
+  jit_mem(e, 0, 1, X86_MOV_R, RCX, RCX, RAX, 8, 0);
+  jit_alu_imm(e, 7, RCX, (int32_t) (uintptr_t) MJS_JIT_EXIT);
+  interp = jit_jcc(e, CC_BE);
+  jit_rr(e, 0, 0, X86_GRP5, 4, RCX);
+  /* The target is not compiled: rax is its index already */
+  jit_here(e, interp);
+  jit_patch(e, jit_jcc(e, CC_ALWAYS), e->exit);
+}
+
+/*
+ * Emits native code of instruction `k`. Returns 0 if the instruction is left
+ * to the interpreter.
+ */
+static int jit_insn(struct jit_emit *e, size_t k) {
+  const struct mjs_insn *in = &e->bp->insns[k];
+  const struct mjs_jit_helpers *h = e->h;
+  switch (in->opcode) {
+    case OP_NOP:
+      break;
+    case OP_DROP:
+      jit_stack(e, 1, k);
+      jit_drop(e, 1);
+      break;
+    case OP_DUP:
+      jit_top(e, k);
+      jit_push(e);
+      break;
+    case OP_SWAP:
+      jit_stack(e, 2, k);
+      jit_mem(e, 0, 1, X86_MOV_R, RAX, RCX, RDX, 1, -VAL_SIZE);
+      jit_mem(e, 0, 1, X86_MOV_R, RSI, RCX, RDX, 1, -2 * VAL_SIZE);
+      jit_mem(e, 0, 1, X86_MOV_RM, RAX, RCX, RDX, 1, -2 * VAL_SIZE);
+      jit_mem(e, 0, 1, X86_MOV_RM, RSI, RCX, RDX, 1, -VAL_SIZE);
+      break;
+    case OP_PUSH_NULL:
+      jit_push_imm(e, MJS_NULL);
+      break;
+    case OP_PUSH_UNDEF:
+      jit_push_imm(e, MJS_UNDEFINED);
+      break;
+    case OP_PUSH_FALSE:
+      jit_push_imm(e, mjs_mk_boolean(e->mjs, 0));
+      break;
+    case OP_PUSH_TRUE:
+      jit_push_imm(e, mjs_mk_boolean(e->mjs, 1));
+      break;
+    case OP_PUSH_INT:
+      jit_push_imm(e, mjs_mk_number(e->mjs, (double) in->v.i));
+      break;
+    case OP_PUSH_DBL:
+      jit_push_imm(e, mjs_mk_number(e->mjs, in->v.d));
+      break;
+    case OP_PUSH_STR:
+      /* Constants are loaded at run time: GC can move the strings */
+      jit_load_abs(e, RAX, &e->bp->consts[in->a]);
+      jit_push(e);
+      break;
+    case OP_PUSH_THIS:
+      jit_mem(e, 0, 1, X86_MOV_R, RAX, R_MJS, NO_INDEX, 1, OFF_THIS);
+      jit_push(e);
+      break;
+    case OP_PUSH_OBJ:
+      JIT_CALL(e, mjs_mk_object);
+      jit_push(e);
+      break;
+    case OP_PUSH_ARRAY:
+      JIT_CALL(e, mjs_mk_array);
+      jit_push(e);
+      break;
+    case OP_GET_LOCAL:
+      jit_mem(e, 0, 1, X86_MOV_R, RAX, R_CTX, NO_INDEX, 1, OFF_FRAME_BASE);
+      jit_mem(e, 0, 1, X86_MOV_R, RCX, R_MJS, NO_INDEX, 1, OFF_STACK_BUF);
+      jit_mem(e, 0, 1, X86_MOV_R, RAX, RCX, RAX, 8, in->a * VAL_SIZE);
+      jit_push(e);
+      break;
+    case OP_SET_LOCAL:
+      jit_top(e, k);
+      jit_mem(e, 0, 1, X86_MOV_R, RSI, R_CTX, NO_INDEX, 1, OFF_FRAME_BASE);
+      jit_mem(e, 0, 1, X86_MOV_RM, RAX, RCX, RSI, 8, in->a * VAL_SIZE);
+      break;
+    case OP_JMP:
+      jit_set_prev(e, in->opcode);
+      jit_goto(e, CC_ALWAYS, in->a);
+      return 1;
+    case OP_JMP_FALSE:
+      jit_pop(e, k);
+      jit_truthy(e);
+      jit_branch(e, k, in->a, 1, 1);
+      return 1;
+    case OP_JMP_NEUTRAL_TRUE:
+    case OP_JMP_NEUTRAL_FALSE:
+      jit_top(e, k);
+      jit_truthy(e);
+      jit_branch(e, k, in->a, in->opcode == OP_JMP_NEUTRAL_FALSE, 0);
+      return 1;
+    case OP_JMP_FALSE_LT:
+    case OP_JMP_FALSE_LE:
+    case OP_JMP_FALSE_GT:
+    case OP_JMP_FALSE_GE:
+    case OP_JMP_FALSE_EQ_EQ:
+    case OP_JMP_FALSE_NE_NE:
+      jit_cmp_jmp(e, k);
+      return 1;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE:
+    case OP_EQ_EQ:
+    case OP_NE_NE:
+      jit_binop(e, k);
+      return 1;
+    case OP_EXPR:
+      if (in->op == TOK_ASSIGN) {
+        jit_mov_ptr(e, RSI, &e->bp->prop_caches[in->b]);
+        JIT_CALL(e, h->assign);
+      } else {
+        jit_mov_imm(e, RSI, in->op);
+        JIT_CALL(e, h->expr);
+      }
+      jit_check_error(e, k);
+      break;
+    case OP_GET:
+      jit_mov_ptr(e, RSI, &e->bp->prop_caches[in->b]);
+      jit_mem(e, 0, 0, X86_MOVZX8, RDX, R_CTX, NO_INDEX, 1, OFF_PREV_OPCODE);
+      JIT_CALL(e, h->get);
+      jit_check_error(e, k);
+      break;
+    case OP_GET_VAR:
+    case OP_SET_VAR:
+    case OP_CREATE_VAR:
+      jit_load_abs(e, RSI, &e->bp->consts[in->a]);
+      JIT_CALL(e, in->opcode == OP_GET_VAR
+                      ? h->get_var
+                      : in->opcode == OP_SET_VAR ? h->set_var : h->create_var);
+      jit_check_error(e, k);
+      break;
+    case OP_GET_PROP_CONST:
+    case OP_SET_PROP_CONST:
+      jit_load_abs(e, RSI, &e->bp->consts[in->a]);
+      jit_mov_ptr(e, RDX, &e->bp->prop_caches[in->b]);
+      JIT_CALL(e, in->opcode == OP_GET_PROP_CONST ? h->get_prop_const
+                                                  : h->set_prop_const);
+      jit_check_error(e, k);
+      break;
+    case OP_FIND_SCOPE:
+      JIT_CALL(e, h->find_scope);
+      jit_check_error(e, k);
+      break;
+    case OP_ARGS:
+      jit_mem(e, 0, 0, X86_MOVZX8, RSI, R_CTX, NO_INDEX, 1, OFF_PREV_OPCODE);
+      JIT_CALL(e, h->args);
+      break;
+    case OP_SETRETVAL:
+      JIT_CALL(e, h->setretval);
+      jit_check_error(e, k);
+      break;
+    case OP_LOOP:
+      jit_mov_imm(e, RSI, in->a);
+      jit_mov_imm(e, RDX, in->b);
+      JIT_CALL(e, h->loop);
+      break;
+    case OP_CONTINUE:
+      jit_loop_jump(e, k, h->cont);
+      return 1;
+    case OP_BREAK:
+      jit_loop_jump(e, k, h->brk);
+      return 1;
+    default:
+      /* Calls, returns, scopes and the rare ones */
+      jit_exit(e, k);
+      return 0;
+  }
+  jit_set_prev(e, in->opcode);
+  return 1;
+}
+
+MJS_PRIVATE struct mjs_jit *mjs_jit_create(size_t insns_cnt) {
+  struct mjs_jit *jit = (struct mjs_jit *) calloc(1, sizeof(*jit));
+  jit->calls = (uint32_t *) calloc(insns_cnt, sizeof(*jit->calls));
+  jit->code = (void **) calloc(insns_cnt, sizeof(*jit->code));
+  return jit;
+}
+
+MJS_PRIVATE void mjs_jit_free(struct mjs_jit *jit) {
+  if (jit == NULL) return;
+  while (jit->blocks != NULL) {
+    struct mjs_jit_block *b = jit->blocks;
+    jit->blocks = b->next;
+    munmap(b, b->size);
+  }
+  free(jit->calls);
+  free(jit->code);
+  free(jit);
+}
+
+MJS_PRIVATE void mjs_jit_compile(struct mjs *mjs,
+                                 const struct mjs_bcode_part *bp, size_t entry,
+                                 const struct mjs_jit_helpers *h) {
+  struct mjs_jit *jit = bp->jit;
+  struct jit_emit e;
+  struct mjs_jit_block *block;
+  size_t *pos, k, size, enter;
+  char *compiled;
+
+  /* Functions are preceded with a jump over them, see parse_function() */
+  if (entry == 0 || bp->insns[entry - 1].opcode != OP_JMP ||
+      bp->insns[entry - 1].a <= entry ||
+      bp->insns[entry - 1].a > bp->insns_cnt) {
+    return;
+  }
+  memset(&e, 0, sizeof(e));
+  mbuf_init(&e.buf, 0);
+  mbuf_init(&e.fixups, 0);
+  e.mjs = mjs;
+  e.bp = bp;
+  e.h = h;
+  e.entry = entry;
+  e.end = bp->insns[entry - 1].a;
+  pos = (size_t *) calloc(e.end - e.entry, sizeof(*pos));
+  compiled = (char *) calloc(e.end - e.entry, 1);
+
+  /*
+   * Entry: push rbx, rbp and align the stack; mjs and ctx are kept in them,
+   * see mjs_jit_run()
+   */
+  enter = e.buf.len;
+  jit_byte(&e, 0x50 + RBX);
+  jit_byte(&e, 0x50 + RBP);
+  jit_alu_imm(&e, 5, RSP, 8);
+  jit_rr(&e, 0, 1, X86_MOV_RM, RDI, R_MJS);
+  jit_rr(&e, 0, 1, X86_MOV_RM, RSI, R_CTX);
+  jit_rr(&e, 0, 0, X86_GRP5, 4, RDX);
+
+  /* Exit: rax is the index of the instruction to be interpreted */
+  e.exit = e.buf.len;
+  jit_alu_imm(&e, 0, RSP, 8);
+  jit_byte(&e, 0x58 + RBP);
+  jit_byte(&e, 0x58 + RBX);
+  jit_byte(&e, 0xc3);
+
+  for (k = e.entry; k < e.end; k++) {
+    pos[k - e.entry] = e.buf.len;
+    compiled[k - e.entry] = (char) jit_insn(&e, k);
+  }
+  jit_exit(&e, e.end);
+  for (k = 0; k < e.fixups.len / sizeof(struct jit_fixup); k++) {
+    const struct jit_fixup *f = &((struct jit_fixup *) e.fixups.buf)[k];
+    jit_patch(&e, f->pos, pos[f->idx - e.entry]);
+  }
+
+  size = sizeof(*block) + e.buf.len;
+  block = (struct mjs_jit_block *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (block != MAP_FAILED) {
+    char *code = (char *) (block + 1);
+    memcpy(code, e.buf.buf, e.buf.len);
+    block->next = jit->blocks;
+    block->size = size;
+    if (mprotect(block, size, PROT_READ | PROT_EXEC) == 0) {
+      jit->blocks = block;
+      if (jit->enter == NULL) jit->enter = code + enter;
+      /* Code of the nested functions might be compiled already */
+      for (k = e.entry; k < e.end; k++) {
+        if (jit->code[k] == NULL) {
+          jit->code[k] =
+              compiled[k - e.entry] ? code + pos[k - e.entry] : MJS_JIT_EXIT;
+        }
+      }
+      LOG(LL_DEBUG, ("compiled %d instructions at %d+%d: %d bytes",
+                     (int) (e.end - e.entry), (int) bp->start_idx,
+                     (int) bp->insns[entry].off, (int) e.buf.len));
+    } else {
+      munmap(block, size);
     }
   }
-  return 0;
+  free(pos);
+  free(compiled);
+  mbuf_free(&e.buf);
+  mbuf_free(&e.fixups);
+}
+
+MJS_PRIVATE size_t mjs_jit_run(struct mjs *mjs, const struct mjs_jit *jit,
+                               struct mjs_jit_ctx *ctx, void *code) {
+  size_t (*enter)(struct mjs *, struct mjs_jit_ctx *, void *);
+  memcpy(&enter, &jit->enter, sizeof(enter));
+  return enter(mjs, ctx, code);
 }
+
+#endif /* MJS_ENABLE_JIT */
 #ifdef MJS_MODULE_LINES
 #line 1 "src/mjs_json.c"
 #endif
@@ -11518,6 +14311,16 @@ MJS_PRIVATE void mjs_op_json_parse(struct mjs *mjs) {
 /* Amalgamated: #include "mjs_primitive.h" */
 /* Amalgamated: #include "mjs_util.h" */
 
+#if MJS_ENABLE_DEBUG
+/* Trace hook which disassembles every instruction being executed */
+static void trace_disasm(struct mjs *mjs, const uint8_t *bcode, size_t offset,
+                         void *user_data) {
+  (void) mjs;
+  (void) user_data;
+  mjs_disasm_single(bcode, offset);
+}
+#endif
+
 int main(int argc, char *argv[]) {
   if (argc == 1) {
     printf("mJS (c) Cesanta, built: " __DATE__ "\n");
@@ -11611,6 +14414,11 @@ int main(int argc, char *argv[]) {
 
     /* Execute expression. */
     mjs = mjs_create();
+#if MJS_ENABLE_DEBUG
+    if (debug_level >= LL_VERBOSE_DEBUG) {
+      mjs_set_trace(mjs, trace_disasm, NULL);
+    }
+#endif
     err = mjs_exec(mjs, expr, &res);
   } else {
     /* Search for '-c', '-r' and '-j' options. */
@@ -11706,6 +14514,11 @@ int main(int argc, char *argv[]) {
 
     /* Process files. */
     mjs = mjs_create();
+#if MJS_ENABLE_DEBUG
+    if (debug_level >= LL_VERBOSE_DEBUG) {
+      mjs_set_trace(mjs, trace_disasm, NULL);
+    }
+#endif
     if (precompile) {
       mjs_set_generate_jsc(mjs, 1);
     }
@@ -12067,6 +14880,8 @@ int mjs_del(struct mjs *mjs, mjs_val_t obj, const char *name, size_t len) {
     z->parent = parent;
   }
   o->prop_count--;
+  /* The node is detached: drop inline caches, see `struct mjs_prop_cache` */
+  mjs->prop_cache_epoch++;
   return 0;
 }
 
@@ -12265,6 +15080,7 @@ mjs_val_t mjs_struct_to_obj(struct mjs *mjs, const void *base,
 
 /* Amalgamated: #include "mjs_bcode.h" */
 /* Amalgamated: #include "mjs_core.h" */
+/* Amalgamated: #include "mjs_exec.h" */
 /* Amalgamated: #include "mjs_internal.h" */
 /* Amalgamated: #include "mjs_parser.h" */
 /* Amalgamated: #include "mjs_string.h" */
@@ -12322,10 +15138,156 @@ static int findtok(int *toks, int tok) {
   return toks[i];
 }
 
+/* Emits a number literal */
+static void emit_num(struct pstate *p, double d) {
+  double iv;
+  if (modf(d, &iv) == 0 && fabs(d) < 9007199254740992.0 /* 2^53 */ &&
+      !(d == 0 && signbit(d))) {
+    emit_byte(p, OP_PUSH_INT);
+    emit_int(p, (int64_t) d);
+  } else {
+    emit_byte(p, OP_PUSH_DBL);
+    emit_dbl(p, d);
+  }
+}
+
+/*
+ * Remembers the literal which was just emitted at `start`; `map_len` is size
+ * of the line numbers map before it was emitted. Literals are remembered while
+ * they follow each other, see fold_op().
+ */
+static void lit_add(struct pstate *p, int start, size_t map_len) {
+  if (p->lits_cnt == 0 || start != p->lits_end ||
+      map_len != p->lits_map_len) {
+    p->lits_cnt = 0;
+  } else if (p->lits_cnt == (int) ARRAY_SIZE(p->lits)) {
+    memmove(p->lits, p->lits + 1, sizeof(p->lits) - sizeof(p->lits[0]));
+    p->lits_cnt--;
+  }
+  p->lits[p->lits_cnt++] = start;
+  p->lits_end = p->cur_idx;
+  p->lits_map_len = p->offset_lineno_map.len;
+}
+
+/*
+ * Decodes the literal at `off`: sets either `d`, or `s` and `len`. Returns
+ * opcode of the literal.
+ */
+static uint8_t lit_get(struct pstate *p, int off, double *d, const char **s,
+                       size_t *len) {
+  const uint8_t *code = (const uint8_t *) p->mjs->bcode_gen.buf + off;
+  int llen;
+  switch (code[0]) {
+    case OP_PUSH_INT:
+      *d = (double) (int64_t) cs_varint_decode_unsafe(code + 1, &llen);
+      break;
+    case OP_PUSH_DBL:
+      memcpy(d, code + 1, sizeof(*d));
+      break;
+    case OP_PUSH_STR:
+      *len = cs_varint_decode_unsafe(code + 1, &llen);
+      *s = (const char *) code + 1 + llen;
+      break;
+  }
+  return code[0];
+}
+
+/*
+ * Constant folding: if the operands of the binary operator `tok` are the two
+ * literals emitted right before, replaces them with the literal result,
+ * computed just like mjs_execute() would. Returns whether it's done.
+ */
+static int fold_op(struct pstate *p, int tok) {
+  struct mbuf *b = &p->mjs->bcode_gen;
+  int start, res = 1;
+  uint8_t op1, op2;
+  double d1 = 0, d2 = 0;
+  const char *s1 = NULL, *s2 = NULL;
+  size_t len1 = 0, len2 = 0;
+  char *s = NULL;
+  bool resnan = false;
+
+  if (p->lits_cnt < 2 || p->lits_end != p->cur_idx ||
+      p->lits_map_len != p->offset_lineno_map.len) {
+    return 0;
+  }
+  start = p->lits[p->lits_cnt - 2];
+  op1 = lit_get(p, start, &d1, &s1, &len1);
+  op2 = lit_get(p, p->lits[p->lits_cnt - 1], &d2, &s2, &len2);
+
+  if (op1 != OP_PUSH_STR && op2 != OP_PUSH_STR) {
+    switch (tok) {
+      case TOK_PLUS:
+      case TOK_MINUS:
+      case TOK_MUL:
+      case TOK_DIV:
+      case TOK_REM:
+      case TOK_AND:
+      case TOK_OR:
+      case TOK_XOR:
+      case TOK_LSHIFT:
+      case TOK_RSHIFT:
+      case TOK_URSHIFT:
+        d1 = do_arith_op(d1, d2, tok, &resnan);
+        if (resnan) d1 = NAN;
+        break;
+      default:
+        res = 0;
+    }
+  } else if (op1 == OP_PUSH_STR && op2 == OP_PUSH_STR && tok == TOK_PLUS) {
+    /* The strings are about to be overwritten, so make a copy */
+    s = (char *) malloc(len1 + len2 + 1);
+    memcpy(s, s1, len1);
+    memcpy(s + len1, s2, len2);
+  } else {
+    res = 0;
+  }
+  if (!res) return 0;
+
+  /* Remove both literals, and emit the result in their place */
+  memmove(b->buf + start, b->buf + p->cur_idx, b->len - p->cur_idx);
+  b->len -= p->cur_idx - start;
+  p->cur_idx = start;
+  p->lits_cnt -= 2;
+  if (s != NULL) {
+    emit_byte(p, OP_PUSH_STR);
+    emit_str(p, s, len1 + len2);
+    free(s);
+  } else {
+    emit_num(p, d1);
+  }
+  p->lits[p->lits_cnt++] = start;
+  p->lits_end = p->cur_idx;
+  p->lits_map_len = p->offset_lineno_map.len;
+  return 1;
+}
+
 static void emit_op(struct pstate *pstate, int tok) {
-  assert(tok >= 0 && tok <= 255);
-  emit_byte(pstate, OP_EXPR);
-  emit_byte(pstate, (uint8_t) tok);
+  uint8_t opcode;
+  if (fold_op(pstate, tok)) return;
+  /* Operators which have their own opcodes */
+  switch (tok) {
+    /* clang-format off */
+    case TOK_PLUS:  opcode = OP_ADD; break;
+    case TOK_MINUS: opcode = OP_SUB; break;
+    case TOK_MUL:   opcode = OP_MUL; break;
+    case TOK_DIV:   opcode = OP_DIV; break;
+    case TOK_LT:    opcode = OP_LT; break;
+    case TOK_LE:    opcode = OP_LE; break;
+    case TOK_GT:    opcode = OP_GT; break;
+    case TOK_GE:    opcode = OP_GE; break;
+    case TOK_EQ_EQ: opcode = OP_EQ_EQ; break;
+    case TOK_NE_NE: opcode = OP_NE_NE; break;
+    /* clang-format on */
+    default:
+      assert(tok >= 0 && tok <= 255);
+      emit_byte(pstate, OP_EXPR);
+      emit_byte(pstate, (uint8_t) tok);
+      return;
+  }
+  /* Comparison can be fused with the jump which follows, see emit_cond_jmp() */
+  if (opcode >= OP_LT && opcode <= OP_NE_NE) pstate->cmp_idx = pstate->cur_idx;
+  emit_byte(pstate, opcode);
 }
 
 #define BINOP_STACK_FRAME_SIZE 16
@@ -12365,6 +15327,8 @@ static void emit_op(struct pstate *pstate, int tok) {
       if (off_if != 0) {                                                       \
         mjs_bcode_insert_offset(p, p->mjs, off_if,                             \
                                 p->cur_idx - off_if - MJS_INIT_OFFSET_SIZE);   \
+        /* The jump lands after the last comparison: it can't be fused */      \
+        p->cmp_idx = -1;                                                       \
       }                                                                        \
     }                                                                          \
   binop_clean:                                                                 \
@@ -12372,20 +15336,6 @@ static void emit_op(struct pstate *pstate, int tok) {
     return res;                                                                \
   } while (0)
 
-#define PARSE_RTL_BINOP(p, f1, f2, ops, prev_op)        \
-  do {                                                  \
-    mjs_err_t res = MJS_OK;                             \
-    (void) prev_op;                                     \
-    if ((res = f1(p, TOK_EOF)) != MJS_OK) return res;   \
-    if (findtok(ops, p->tok.tok) != TOK_EOF) {          \
-      int op = p->tok.tok;                              \
-      pnext1(p);                                        \
-      if ((res = f2(p, TOK_EOF)) != MJS_OK) return res; \
-      emit_op(p, op);                                   \
-    }                                                   \
-    return res;                                         \
-  } while (0)
-
 #if MJS_INIT_OFFSET_SIZE > 0
 static void emit_init_offset(struct pstate *p) {
   size_t i;
@@ -12399,6 +15349,211 @@ static void emit_init_offset(struct pstate *p) {
 }
 #endif
 
+/*
+ * Parses condition of a loop or `if`. Sets `cmp` to whether the condition
+ * ends with a comparison opcode, which can be fused with the jump: see
+ * emit_cond_jmp().
+ */
+static mjs_err_t parse_cond(struct pstate *p, int *cmp) {
+  mjs_err_t res;
+  p->cmp_idx = -1;
+  res = parse_expr(p);
+  *cmp = (p->cmp_idx >= 0 && p->cmp_idx == p->cur_idx - 1);
+  return res;
+}
+
+/*
+ * Emits a jump which is taken if the condition parsed by parse_cond() is
+ * falsy, like OP_JMP_FALSE, right after the condition. If the condition ends
+ * with a comparison, the latter is replaced with a fused compare-and-jump.
+ *
+ * Returns offset of the jump offset, to be set by mjs_bcode_insert_offset().
+ */
+static size_t emit_cond_jmp(struct pstate *p, int cmp) {
+  size_t off;
+  if (cmp) {
+    uint8_t *op = (uint8_t *) &p->mjs->bcode_gen.buf[p->cur_idx - 1];
+    *op = (uint8_t)(OP_JMP_FALSE_LT + (*op - OP_LT));
+  } else {
+    emit_byte(p, OP_JMP_FALSE);
+  }
+  off = p->cur_idx;
+  emit_init_offset(p);
+  return off;
+}
+
+/*
+ * Local slots. In a function which calls nothing, defines no other functions,
+ * and has no for..in loops (they assign the iterator variable by name),
+ * parameters and `let` variables are resolved at parse time to slots of the
+ * function frame, and accessed with OP_GET_LOCAL / OP_SET_LOCAL instead of
+ * being looked up in the scope objects at runtime. Other names are still
+ * looked up by name. Calls rule slots out since scoping is dynamic: a called
+ * function sees the variables of its caller, and load() declares the
+ * variables of the module in the caller's scope.
+ *
+ * The slot of a name is its index in p->locals; names are removed from
+ * there at the end of the block which declares them, so their slots are
+ * reused by the subsequent blocks.
+ */
+static int local_find(struct pstate *p, const struct tok *t) {
+  const struct tok *locals = (const struct tok *) p->locals.buf;
+  int i = p->locals.len / sizeof(*locals);
+  if (!p->use_locals) return -1;
+  while (--i >= 0) {
+    if (locals[i].len == t->len && memcmp(locals[i].ptr, t->ptr, t->len) == 0) {
+      break;
+    }
+  }
+  return i;
+}
+
+static int local_add(struct pstate *p, const struct tok *t) {
+  int slot = p->locals.len / sizeof(*t);
+  mbuf_append(&p->locals, t, sizeof(*t));
+  if (slot >= p->locals_max) p->locals_max = slot + 1;
+  return slot;
+}
+
+/* Returns slot of the `let` variable, which is reused if declared twice */
+static int local_declare(struct pstate *p, const struct tok *t) {
+  int slot = local_find(p, t);
+  if (slot < p->locals_block) slot = local_add(p, t);
+  return slot;
+}
+
+static int locals_block_begin(struct pstate *p) {
+  int prev = p->locals_block;
+  p->locals_block = p->locals.len / sizeof(struct tok);
+  return prev;
+}
+
+static void locals_block_end(struct pstate *p, int prev) {
+  p->locals.len = p->locals_block * sizeof(struct tok);
+  p->locals_block = prev;
+}
+
+/* Returns whether `(` after the token `tok` starts arguments of a call */
+static int tok_ends_callee(int tok) {
+  return tok == TOK_IDENT || tok == TOK_CLOSE_PAREN ||
+         tok == TOK_CLOSE_BRACKET;
+}
+
+/*
+ * Returns whether the function, which parameters start at the current token,
+ * can use local slots: see above.
+ */
+static int function_uses_locals(struct pstate *p) {
+  struct pstate saved = *p;
+  int depth = 0, res = 1, prev = TOK_EOF;
+  while (p->tok.tok != TOK_EOF) {
+    int tok = p->tok.tok;
+    if (tok == TOK_KEYWORD_FUNCTION || tok == TOK_KEYWORD_IN ||
+        (tok == TOK_OPEN_PAREN && tok_ends_callee(prev))) {
+      res = 0;
+      break;
+    } else if (tok == TOK_OPEN_CURLY) {
+      depth++;
+    } else if (tok == TOK_CLOSE_CURLY && --depth == 0) {
+      break;
+    }
+    prev = tok;
+    pnext(p);
+  }
+  *p = saved;
+  return res;
+}
+
+/*
+ * Returns whether the code from the current token to the end of the current
+ * statement needs a scope of its own: that is, whether it declares variables,
+ * which are created in the innermost scope (see OP_CREATE_VAR). `let` in a
+ * nested block goes to the scope of that block, but function declarations are
+ * looked for everywhere, and so are calls: the called function can be load(),
+ * or a native one which runs code, and that declares variables in the
+ * innermost scope too. `depth` is the number of brackets the current token is
+ * inside of, e.g. 1 in a loop header. Variables of functions which use local
+ * slots are never kept in scopes.
+ */
+static int scope_needed(struct pstate *p, int depth) {
+  struct pstate saved = *p;
+  /* A block ends with its `}`, even if it's the body of `if` with `else` */
+  int block = depth == 0 && p->tok.tok == TOK_OPEN_CURLY;
+  int curly = 0, res = 0, prev = TOK_EOF;
+  if (p->use_locals) return 0;
+  while (p->tok.tok != TOK_EOF) {
+    int tok = p->tok.tok;
+    if ((tok == TOK_KEYWORD_LET && curly <= 1) ||
+        tok == TOK_KEYWORD_FUNCTION ||
+        (tok == TOK_OPEN_PAREN && tok_ends_callee(prev))) {
+      res = 1;
+      break;
+    } else if (tok == TOK_OPEN_CURLY || tok == TOK_OPEN_PAREN ||
+               tok == TOK_OPEN_BRACKET) {
+      depth++;
+      if (tok == TOK_OPEN_CURLY) curly++;
+    } else if (tok == TOK_CLOSE_CURLY || tok == TOK_CLOSE_PAREN ||
+               tok == TOK_CLOSE_BRACKET) {
+      if (--depth < 0) break;
+      if (tok == TOK_CLOSE_CURLY) curly--;
+    }
+    prev = tok;
+    pnext(p);
+    if (depth == 0 && (tok == TOK_CLOSE_CURLY || tok == TOK_SEMICOLON) &&
+        (block || p->tok.tok != TOK_KEYWORD_ELSE)) {
+      break;
+    }
+  }
+  *p = saved;
+  return res;
+}
+
+static void emit_local(struct pstate *p, int opcode, int slot) {
+  emit_byte(p, (uint8_t) opcode);
+  emit_int(p, slot);
+}
+
+/*
+ * Emits increment (op is TOK_PLUS) or decrement (TOK_MINUS) of the slot which
+ * value is on top of the stack, and replaces it with the new value.
+ */
+static void emit_local_incr(struct pstate *p, int slot, int op) {
+  emit_byte(p, OP_PUSH_INT);
+  emit_int(p, 1);
+  emit_op(p, op);
+  emit_local(p, OP_SET_LOCAL, slot);
+}
+
+/*
+ * If the operand just parsed is a local slot pushed by parse_literal() for
+ * increment or decrement, returns the slot; otherwise returns -1.
+ */
+static int local_ref_get(struct pstate *p) {
+  int slot = p->local_ref_idx == p->cur_idx ? p->local_ref : -1;
+  p->local_ref = -1;
+  return slot;
+}
+
+/* Returns binary operator of the compound assignment operator */
+static int assign_binop(int op) {
+  /* clang-format off */
+  switch (op) {
+    case TOK_MINUS_ASSIGN:    return TOK_MINUS;
+    case TOK_PLUS_ASSIGN:     return TOK_PLUS;
+    case TOK_MUL_ASSIGN:      return TOK_MUL;
+    case TOK_DIV_ASSIGN:      return TOK_DIV;
+    case TOK_REM_ASSIGN:      return TOK_REM;
+    case TOK_AND_ASSIGN:      return TOK_AND;
+    case TOK_OR_ASSIGN:       return TOK_OR;
+    case TOK_XOR_ASSIGN:      return TOK_XOR;
+    case TOK_LSHIFT_ASSIGN:   return TOK_LSHIFT;
+    case TOK_RSHIFT_ASSIGN:   return TOK_RSHIFT;
+    case TOK_URSHIFT_ASSIGN:  return TOK_URSHIFT;
+    default:                  return op;
+  }
+  /* clang-format on */
+}
+
 static mjs_err_t parse_statement_list(struct pstate *p, int et) {
   mjs_err_t res = MJS_OK;
   int drop = 0;
@@ -12422,6 +15577,7 @@ static mjs_err_t parse_statement_list(struct pstate *p, int et) {
 
 static mjs_err_t parse_block(struct pstate *p, int mkscope) {
   mjs_err_t res = MJS_OK;
+  int locals_block;
   p->depth++;
   if (p->depth > (STACK_LIMIT / BINOP_STACK_FRAME_SIZE)) {
     mjs_set_errorf(p->mjs, MJS_SYNTAX_ERROR, "parser stack overflow");
@@ -12429,32 +15585,34 @@ static mjs_err_t parse_block(struct pstate *p, int mkscope) {
     return res;
   }
   LOG(LL_VERBOSE_DEBUG, ("[%.*s]", 10, p->tok.ptr));
+  if (mkscope) mkscope = scope_needed(p, 0);
   if (mkscope) emit_byte(p, OP_NEW_SCOPE);
+  locals_block = locals_block_begin(p);
   res = parse_statement_list(p, TOK_CLOSE_CURLY);
+  locals_block_end(p, locals_block);
+  if (res != MJS_OK) return res;
   EXPECT(p, TOK_CLOSE_CURLY);
   if (mkscope) emit_byte(p, OP_DEL_SCOPE);
   return res;
 }
 
 static mjs_err_t parse_function(struct pstate *p) {
-  size_t prologue, off;
+  size_t prologue, off, off_locals = 0;
   int arg_no = 0;
   int name_provided = 0;
+  int use_locals = p->use_locals, locals_max = p->locals_max, locals_block;
+  int loops = p->loops;
+  struct tok name;
   mjs_err_t res = MJS_OK;
 
   EXPECT(p, TOK_KEYWORD_FUNCTION);
 
   if (p->tok.tok == TOK_IDENT) {
     /* Function name was provided */
-    struct tok tmp = p->tok;
+    name = p->tok;
     name_provided = 1;
-    emit_byte(p, OP_PUSH_STR);
-    emit_str(p, tmp.ptr, tmp.len);
-    emit_byte(p, OP_PUSH_SCOPE);
-    emit_byte(p, OP_CREATE);
-    emit_byte(p, OP_PUSH_STR);
-    emit_str(p, tmp.ptr, tmp.len);
-    emit_byte(p, OP_FIND_SCOPE);
+    emit_byte(p, OP_CREATE_VAR);
+    emit_str(p, name.ptr, name.len);
     pnext1(p);
   }
 
@@ -12464,27 +15622,52 @@ static mjs_err_t parse_function(struct pstate *p) {
 
   prologue = p->cur_idx;
 
+  p->use_locals = function_uses_locals(p);
+  p->locals_max = 0;
+  /* break and continue can't reach loops outside of the function */
+  p->loops = 0;
+  locals_block = locals_block_begin(p);
+
   EXPECT(p, TOK_OPEN_PAREN);
-  emit_byte(p, OP_NEW_SCOPE);
-  // Emit names of function arguments
+  if (!p->use_locals) emit_byte(p, OP_NEW_SCOPE);
+  // Emit names of function arguments, or give them the first slots
   while (p->tok.tok != TOK_CLOSE_PAREN) {
     if (p->tok.tok != TOK_IDENT) SYNTAX_ERROR(p);
-    emit_byte(p, OP_SET_ARG);
-    emit_int(p, arg_no);
+    if (p->use_locals) {
+      local_add(p, &p->tok);
+    } else {
+      emit_byte(p, OP_SET_ARG);
+      emit_int(p, arg_no);
+      emit_str(p, p->tok.ptr, p->tok.len);
+    }
     arg_no++;
-    emit_str(p, p->tok.ptr, p->tok.len);
     if (ptest(p) == TOK_COMMA) pnext1(p);
     pnext1(p);
   }
   EXPECT(p, TOK_CLOSE_PAREN);
+  if (p->use_locals) {
+    /* Number of slots is known after the body is parsed */
+    emit_byte(p, OP_LOCALS);
+    emit_int(p, arg_no);
+    off_locals = p->cur_idx;
+    emit_init_offset(p);
+  }
   if ((res = parse_block(p, 0)) != MJS_OK) return res;
   emit_byte(p, OP_RETURN);
+  if (p->use_locals) {
+    mjs_bcode_insert_offset(p, p->mjs, off_locals, p->locals_max);
+  }
+  locals_block_end(p, locals_block);
+  p->use_locals = use_locals;
+  p->locals_max = locals_max;
+  p->loops = loops;
   prologue += mjs_bcode_insert_offset(p, p->mjs, off,
                                       p->cur_idx - off - MJS_INIT_OFFSET_SIZE);
   emit_byte(p, OP_PUSH_FUNC);
   emit_int(p, p->cur_idx - 1 /* OP_PUSH_FUNC */ - prologue);
   if (name_provided) {
-    emit_op(p, TOK_ASSIGN);
+    emit_byte(p, OP_SET_VAR);
+    emit_str(p, name.ptr, name.len);
   }
 
   return res;
@@ -12548,36 +15731,71 @@ static enum mjs_err parse_literal(struct pstate *p, const struct tok *t) {
     case TOK_IDENT: {
       int prev_tok = p->prev_tok;
       int next_tok = ptest(p);
-      emit_byte(p, OP_PUSH_STR);
-      emit_str(p, t->ptr, t->len);
-      emit_byte(p, (uint8_t)(prev_tok == TOK_DOT ? OP_SWAP : OP_FIND_SCOPE));
-      if (!findtok(s_assign_ops, next_tok) &&
-          !findtok(s_postfix_ops, next_tok) &&
-          /* TODO(dfrank): fix: it doesn't work for prefix ops */
-          !findtok(s_postfix_ops, prev_tok)) {
-        emit_byte(p, OP_GET);
+      int slot = prev_tok == TOK_DOT ? -1 : local_find(p, t);
+      int get = !findtok(s_assign_ops, next_tok) &&
+                !findtok(s_postfix_ops, next_tok) &&
+                /* TODO(dfrank): fix: it doesn't work for prefix ops */
+                !findtok(s_postfix_ops, prev_tok);
+      if (get && slot >= 0) {
+        emit_local(p, OP_GET_LOCAL, slot);
+      } else if (get) {
+        emit_byte(p, (uint8_t)(prev_tok == TOK_DOT ? OP_GET_PROP_CONST
+                                                   : OP_GET_VAR));
+        emit_str(p, t->ptr, t->len);
+      } else if (prev_tok == TOK_DOT && next_tok == TOK_ASSIGN) {
+        /*
+         * Property with a constant name is assigned: the object is already on
+         * the stack, parse_assignment() will emit OP_SET_PROP_CONST after the
+         * right side.
+         */
+        p->assign_var = *t;
+        p->assign_prop = p->cur_idx;
+      } else if (prev_tok != TOK_DOT && p->cur_idx == p->expr_start_idx &&
+                 !findtok(s_unary_ops, prev_tok) &&
+                 (next_tok == TOK_ASSIGN ||
+                  (slot >= 0 && findtok(s_assign_ops, next_tok)))) {
+        /*
+         * The whole left side of an assignment is a variable name: emit
+         * nothing here, parse_assignment() will emit OP_SET_VAR or
+         * OP_SET_LOCAL after the right side. A compound assignment to a slot
+         * also needs its value, and evaluates to the old one, like op_assign().
+         */
+        p->assign_var = *t;
+        p->assign_slot = slot;
+        if (next_tok != TOK_ASSIGN) {
+          emit_local(p, OP_GET_LOCAL, slot);
+          emit_byte(p, OP_DUP);
+        }
+      } else if (slot >= 0) {
+        /* Increment or decrement, see parse_postfix() and parse_unary() */
+        emit_local(p, OP_GET_LOCAL, slot);
+        p->local_ref = slot;
+        p->local_ref_idx = p->cur_idx;
+      } else {
+        emit_byte(p, OP_PUSH_STR);
+        emit_str(p, t->ptr, t->len);
+        emit_byte(p, (uint8_t)(prev_tok == TOK_DOT ? OP_SWAP : OP_FIND_SCOPE));
       }
       break;
     }
     case TOK_NUM: {
-      double iv, d = strtod(t->ptr, NULL);
+      int start = p->cur_idx;
+      size_t map_len = p->offset_lineno_map.len;
+      double d = strtod(t->ptr, NULL);
       unsigned long uv = strtoul(t->ptr + 2, NULL, 16);
       if (t->ptr[0] == '0' && t->ptr[1] == 'x') d = uv;
-      if (modf(d, &iv) == 0) {
-        emit_byte(p, OP_PUSH_INT);
-        emit_int(p, (int64_t) d);
-      } else {
-        emit_byte(p, OP_PUSH_DBL);
-        emit_str(p, t->ptr, t->len);
-      }
+      emit_num(p, d);
+      lit_add(p, start, map_len);
       break;
     }
     case TOK_STR: {
-      size_t oldlen;
+      int start = p->cur_idx;
+      size_t oldlen, map_len = p->offset_lineno_map.len;
       emit_byte(p, OP_PUSH_STR);
       oldlen = bcode_gen->len;
       embed_string(bcode_gen, p->cur_idx, t->ptr, t->len, EMBSTR_UNESCAPE);
       p->cur_idx += bcode_gen->len - oldlen;
+      lit_add(p, start, map_len);
     } break;
     case TOK_OPEN_BRACKET:
       res = parse_array_literal(p);
@@ -12643,7 +15861,15 @@ static mjs_err_t parse_postfix(struct pstate *p, int prev_op) {
   if ((res = parse_call_dot_mem(p, prev_op)) != MJS_OK) return res;
   if (p->tok.tok == TOK_PLUS_PLUS || p->tok.tok == TOK_MINUS_MINUS) {
     int op = p->tok.tok == TOK_PLUS_PLUS ? TOK_POSTFIX_PLUS : TOK_POSTFIX_MINUS;
-    emit_op(p, op);
+    int slot = local_ref_get(p);
+    if (slot >= 0) {
+      /* Keep the old value as a result */
+      emit_byte(p, OP_DUP);
+      emit_local_incr(p, slot, op == TOK_POSTFIX_PLUS ? TOK_PLUS : TOK_MINUS);
+      emit_byte(p, OP_DROP);
+    } else {
+      emit_op(p, op);
+    }
     pnext1(p);
   }
   return res;
@@ -12662,7 +15888,14 @@ static mjs_err_t parse_unary(struct pstate *p, int prev_op) {
     res = parse_postfix(p, prev_op);
   }
   if (res != MJS_OK) return res;
-  if (op != TOK_EOF) {
+  if (op == TOK_PLUS_PLUS || op == TOK_MINUS_MINUS) {
+    int slot = local_ref_get(p);
+    if (slot >= 0) {
+      emit_local_incr(p, slot, op == TOK_PLUS_PLUS ? TOK_PLUS : TOK_MINUS);
+    } else {
+      emit_op(p, op);
+    }
+  } else if (op != TOK_EOF) {
     if (op == TOK_MINUS) op = TOK_UNARY_MINUS;
     if (op == TOK_PLUS) op = TOK_UNARY_PLUS;
     emit_op(p, op);
@@ -12752,13 +15985,55 @@ static mjs_err_t parse_ternary(struct pstate *p, int prev_op) {
 
     mjs_bcode_insert_offset(p, p->mjs, off_if,
                             off_endif - off_if - MJS_INIT_OFFSET_SIZE);
+    /* The jump lands after the last comparison: it can't be fused */
+    p->cmp_idx = -1;
   }
 
   return res;
 }
 
 static mjs_err_t parse_assignment(struct pstate *p, int prev_op) {
-  PARSE_RTL_BINOP(p, parse_ternary, parse_assignment, s_assign_ops, prev_op);
+  mjs_err_t res = MJS_OK;
+  int saved_start_idx = p->expr_start_idx;
+  int slot, prop;
+  struct tok var;
+  (void) prev_op;
+
+  p->expr_start_idx = p->cur_idx;
+  p->assign_var.tok = TOK_EOF;
+  res = parse_ternary(p, TOK_EOF);
+  var = p->assign_var;
+  slot = p->assign_slot;
+  prop = p->assign_prop;
+  p->assign_var.tok = TOK_EOF;
+  p->assign_slot = p->assign_prop = -1;
+  p->expr_start_idx = saved_start_idx;
+  if (res != MJS_OK) return res;
+
+  if (findtok(s_assign_ops, p->tok.tok) != TOK_EOF) {
+    int op = p->tok.tok;
+    /* Something was emitted after the property name: not an lvalue */
+    if (prop >= 0 && prop != p->cur_idx) SYNTAX_ERROR(p);
+    pnext1(p);
+    if ((res = parse_assignment(p, TOK_EOF)) != MJS_OK) return res;
+    if (prop >= 0) {
+      /* Property name was not emitted by parse_literal(), see there */
+      emit_byte(p, OP_SET_PROP_CONST);
+      emit_str(p, var.ptr, var.len);
+    } else if (var.tok == TOK_IDENT && slot >= 0) {
+      /* Local slot, see parse_literal() */
+      if (op != TOK_ASSIGN) emit_op(p, assign_binop(op));
+      emit_local(p, OP_SET_LOCAL, slot);
+      if (op != TOK_ASSIGN) emit_byte(p, OP_DROP);
+    } else if (var.tok == TOK_IDENT) {
+      /* Variable name was not emitted by parse_literal(), see there */
+      emit_byte(p, OP_SET_VAR);
+      emit_str(p, var.ptr, var.len);
+    } else {
+      emit_op(p, op);
+    }
+  }
+  return res;
 }
 
 static mjs_err_t parse_expr(struct pstate *p) {
@@ -12773,19 +16048,28 @@ static mjs_err_t parse_let(struct pstate *p) {
     struct tok tmp = p->tok;
     EXPECT(p, TOK_IDENT);
 
-    emit_byte(p, OP_PUSH_STR);
-    emit_str(p, tmp.ptr, tmp.len);
-    emit_byte(p, OP_PUSH_SCOPE);
-    emit_byte(p, OP_CREATE);
-
-    if (p->tok.tok == TOK_ASSIGN) {
-      pnext1(p);
-      emit_byte(p, OP_PUSH_STR);
+    if (p->use_locals) {
+      /*
+       * The slot is declared after the initializer, so that the initializer
+       * can't see its stale value
+       */
+      if (p->tok.tok == TOK_ASSIGN) {
+        pnext1(p);
+        if ((res = parse_expr(p)) != MJS_OK) return res;
+      } else {
+        emit_byte(p, OP_PUSH_UNDEF);
+      }
+      emit_local(p, OP_SET_LOCAL, local_declare(p, &tmp));
+    } else if (p->tok.tok == TOK_ASSIGN) {
+      emit_byte(p, OP_CREATE_VAR);
       emit_str(p, tmp.ptr, tmp.len);
-      emit_byte(p, OP_FIND_SCOPE);
+      pnext1(p);
       if ((res = parse_expr(p)) != MJS_OK) return res;
-      emit_op(p, TOK_ASSIGN);
+      emit_byte(p, OP_SET_VAR);
+      emit_str(p, tmp.ptr, tmp.len);
     } else {
+      emit_byte(p, OP_CREATE_VAR);
+      emit_str(p, tmp.ptr, tmp.len);
       emit_byte(p, OP_PUSH_UNDEF);
     }
     if (p->tok.tok == TOK_COMMA) {
@@ -12808,17 +16092,16 @@ static mjs_err_t parse_block_or_stmt(struct pstate *p, int cs) {
 static mjs_err_t parse_for_in(struct pstate *p) {
   mjs_err_t res = MJS_OK;
   size_t off_b, off_check_end;
+  int mkscope = scope_needed(p, 1);
 
   /* new scope should be pushed before OP_LOOP instruction */
-  emit_byte(p, OP_NEW_SCOPE);
+  if (mkscope) emit_byte(p, OP_NEW_SCOPE);
 
   /* Put iterator variable name to the stack */
   if (p->tok.tok == TOK_KEYWORD_LET) {
     EXPECT(p, TOK_KEYWORD_LET);
-    emit_byte(p, OP_PUSH_STR);
+    emit_byte(p, OP_CREATE_VAR);
     emit_str(p, p->tok.ptr, p->tok.len);
-    emit_byte(p, OP_PUSH_SCOPE);
-    emit_byte(p, OP_CREATE);
   }
   emit_byte(p, OP_PUSH_STR);
   emit_str(p, p->tok.ptr, p->tok.len);
@@ -12844,12 +16127,14 @@ static mjs_err_t parse_for_in(struct pstate *p) {
   emit_init_offset(p);
 
   // Parse loop body
+  p->loops++;
   if (p->tok.tok == TOK_OPEN_CURLY) {
     if ((res = parse_statement_list(p, TOK_CLOSE_CURLY)) != MJS_OK) return res;
     pnext1(p);
   } else {
     if ((res = parse_statement(p)) != MJS_OK) return res;
   }
+  p->loops--;
   emit_byte(p, OP_DROP);
   emit_byte(p, OP_CONTINUE);
 
@@ -12868,7 +16153,7 @@ static mjs_err_t parse_for_in(struct pstate *p) {
   emit_byte(p, OP_DROP);
   emit_byte(p, OP_DROP);
   emit_byte(p, OP_DROP);
-  emit_byte(p, OP_DEL_SCOPE);
+  if (mkscope) emit_byte(p, OP_DEL_SCOPE);
 
   return res;
 }
@@ -12889,7 +16174,7 @@ static mjs_err_t parse_for(struct pstate *p) {
   mjs_err_t res = MJS_OK;
   size_t off_b, off_c, off_init_end;
   size_t off_incr_begin, off_cond_begin, off_cond_end;
-  int buf_cur_idx;
+  int buf_cur_idx, locals_block, cmp, mkscope;
 
   LOG(LL_VERBOSE_DEBUG, ("[%.*s]", 10, p->tok.ptr));
   EXPECT(p, TOK_KEYWORD_FOR);
@@ -12916,7 +16201,9 @@ static mjs_err_t parse_for(struct pstate *p) {
    */
 
   /* new scope should be pushed before OP_LOOP instruction */
-  emit_byte(p, OP_NEW_SCOPE);
+  mkscope = scope_needed(p, 1);
+  if (mkscope) emit_byte(p, OP_NEW_SCOPE);
+  locals_block = locals_block_begin(p);
 
   /* Before parsing condition statement, push break/continue offsets  */
   emit_byte(p, OP_LOOP);
@@ -12942,13 +16229,14 @@ static mjs_err_t parse_for(struct pstate *p) {
   off_cond_begin = p->cur_idx;
 
   /* Parse cond statement */
-  if ((res = parse_expr(p)) != MJS_OK) return res;
+  if ((res = parse_cond(p, &cmp)) != MJS_OK) return res;
   EXPECT(p, TOK_SEMICOLON);
 
   /* Parse incr statement */
   /* Incr statement should be placed before cond, so, adjust cur_idx */
   buf_cur_idx = p->cur_idx;
   p->cur_idx = off_incr_begin;
+  p->lits_cnt = 0;
 
   if ((res = parse_expr(p)) != MJS_OK) return res;
   EXPECT(p, TOK_CLOSE_PAREN);
@@ -12962,21 +16250,22 @@ static mjs_err_t parse_for(struct pstate *p) {
     int incr_size = p->cur_idx - off_incr_begin;
     off_cond_begin += incr_size;
     p->cur_idx = buf_cur_idx + incr_size;
+    p->lits_cnt = 0;
   }
 
   /* p->cur_idx is now at the end of "cond" */
   /* Exit the loop if false */
-  emit_byte(p, OP_JMP_FALSE);
-  off_cond_end = p->cur_idx;
-  emit_init_offset(p);
+  off_cond_end = emit_cond_jmp(p, cmp);
 
   /* Parse loop body */
+  p->loops++;
   if (p->tok.tok == TOK_OPEN_CURLY) {
     if ((res = parse_statement_list(p, TOK_CLOSE_CURLY)) != MJS_OK) return res;
     pnext1(p);
   } else {
     if ((res = parse_statement(p)) != MJS_OK) return res;
   }
+  p->loops--;
   emit_byte(p, OP_DROP);
   emit_byte(p, OP_CONTINUE);
 
@@ -13001,20 +16290,24 @@ static mjs_err_t parse_for(struct pstate *p) {
   mjs_bcode_insert_offset(p, p->mjs, off_b,
                           p->cur_idx - off_b - MJS_INIT_OFFSET_SIZE);
 
-  emit_byte(p, OP_DEL_SCOPE);
+  if (mkscope) emit_byte(p, OP_DEL_SCOPE);
+  locals_block_end(p, locals_block);
 
   return res;
 }
 
 static mjs_err_t parse_while(struct pstate *p) {
   size_t off_cond_end, off_b;
+  int locals_block, cmp, mkscope;
   mjs_err_t res = MJS_OK;
 
   EXPECT(p, TOK_KEYWORD_WHILE);
   EXPECT(p, TOK_OPEN_PAREN);
 
   /* new scope should be pushed before OP_LOOP instruction */
-  emit_byte(p, OP_NEW_SCOPE);
+  mkscope = scope_needed(p, 1);
+  if (mkscope) emit_byte(p, OP_NEW_SCOPE);
+  locals_block = locals_block_begin(p);
 
   /*
    * BC is a break+continue offsets (a part of OP_LOOP opcode)
@@ -13038,21 +16331,21 @@ static mjs_err_t parse_while(struct pstate *p) {
   emit_byte(p, 0); /* Point OP_CONTINUE to the next instruction */
 
   // parse condition statement
-  if ((res = parse_expr(p)) != MJS_OK) return res;
+  if ((res = parse_cond(p, &cmp)) != MJS_OK) return res;
   EXPECT(p, TOK_CLOSE_PAREN);
 
   // Exit the loop if false
-  emit_byte(p, OP_JMP_FALSE);
-  off_cond_end = p->cur_idx;
-  emit_init_offset(p);
+  off_cond_end = emit_cond_jmp(p, cmp);
 
   // Parse loop body
+  p->loops++;
   if (p->tok.tok == TOK_OPEN_CURLY) {
     if ((res = parse_statement_list(p, TOK_CLOSE_CURLY)) != MJS_OK) return res;
     pnext1(p);
   } else {
     if ((res = parse_statement(p)) != MJS_OK) return res;
   }
+  p->loops--;
   emit_byte(p, OP_DROP);
   emit_byte(p, OP_CONTINUE);
 
@@ -13068,21 +16361,21 @@ static mjs_err_t parse_while(struct pstate *p) {
   mjs_bcode_insert_offset(p, p->mjs, off_b,
                           p->cur_idx - off_b - MJS_INIT_OFFSET_SIZE);
 
-  emit_byte(p, OP_DEL_SCOPE);
+  if (mkscope) emit_byte(p, OP_DEL_SCOPE);
+  locals_block_end(p, locals_block);
   return res;
 }
 
 static mjs_err_t parse_if(struct pstate *p) {
   size_t off_if, off_endif;
+  int cmp;
   mjs_err_t res = MJS_OK;
   LOG(LL_VERBOSE_DEBUG, ("[%.*s]", 10, p->tok.ptr));
   EXPECT(p, TOK_KEYWORD_IF);
   EXPECT(p, TOK_OPEN_PAREN);
-  if ((res = parse_expr(p)) != MJS_OK) return res;
+  if ((res = parse_cond(p, &cmp)) != MJS_OK) return res;
 
-  emit_byte(p, OP_JMP_FALSE);
-  off_if = p->cur_idx;
-  emit_init_offset(p);
+  off_if = emit_cond_jmp(p, cmp);
 
   EXPECT(p, TOK_CLOSE_PAREN);
   if ((res = parse_block_or_stmt(p, 1)) != MJS_OK) return res;
@@ -13172,11 +16465,19 @@ static mjs_err_t parse_statement(struct pstate *p) {
     case TOK_KEYWORD_WHILE:
       return parse_while(p);
     case TOK_KEYWORD_BREAK:
+      if (p->loops == 0) {
+        mjs_set_errorf(p->mjs, MJS_SYNTAX_ERROR, "misplaced 'break'");
+        return MJS_SYNTAX_ERROR;
+      }
       emit_byte(p, OP_PUSH_UNDEF);
       emit_byte(p, OP_BREAK);
       pnext1(p);
       return MJS_OK;
     case TOK_KEYWORD_CONTINUE:
+      if (p->loops == 0) {
+        mjs_set_errorf(p->mjs, MJS_SYNTAX_ERROR, "misplaced 'continue'");
+        return MJS_SYNTAX_ERROR;
+      }
       emit_byte(p, OP_CONTINUE);
       pnext1(p);
       return MJS_OK;
@@ -13217,6 +16518,7 @@ mjs_parse(const char *path, const char *buf, struct mjs *mjs) {
   size_t start_idx, llen;
   int map_len;
   mjs_header_item_t bcode_offset, map_offset, total_size;
+  mjs_header_item_t version = MJS_BCODE_VERSION;
 
   pinit(path, buf, &p);
   p.mjs = mjs;
@@ -13232,6 +16534,9 @@ mjs_parse(const char *path, const char *buf, struct mjs *mjs) {
   start_idx = p.mjs->bcode_gen.len;
   mbuf_append(&p.mjs->bcode_gen, NULL,
               sizeof(mjs_header_item_t) * MJS_HDR_ITEMS_CNT);
+  memcpy(p.mjs->bcode_gen.buf + start_idx +
+             sizeof(mjs_header_item_t) * MJS_HDR_ITEM_VERSION,
+         &version, sizeof(mjs_header_item_t));
 
   /* Append NULL-terminated filename */
   mbuf_append(&p.mjs->bcode_gen, path, strlen(path) + 1 /* null-terminate */);
@@ -13246,6 +16551,7 @@ mjs_parse(const char *path, const char *buf, struct mjs *mjs) {
 
   res = parse_statement_list(&p, TOK_EOF);
   emit_byte(&p, OP_EXIT);
+  if (res == MJS_OK) mjs_bcode_optimize(&p);
 
   /* remember map offset */
   map_offset = p.mjs->bcode_gen.len - start_idx;
@@ -13271,6 +16577,7 @@ mjs_parse(const char *path, const char *buf, struct mjs *mjs) {
          &total_size, sizeof(mjs_header_item_t));
 
   mbuf_free(&p.offset_lineno_map);
+  mbuf_free(&p.locals);
 
   /*
    * If parsing was successful, commit the bcode; otherwise drop generated
@@ -14057,6 +17364,8 @@ MJS_PRIVATE void pinit(const char *file_name, const char *buf,
   p->file_name = file_name;
   p->buf = p->pos = buf;
   mbuf_init(&p->offset_lineno_map, 0);
+  mbuf_init(&p->locals, 0);
+  p->assign_slot = p->assign_prop = p->local_ref = p->cmp_idx = -1;
 }
 
 // We're not relying on the target libc ctype, as it may incorrectly
@@ -14396,7 +17705,11 @@ MJS_PRIVATE const char *opcodetostr(uint8_t opcode) {
       "PUSH_UNDEF", "PUSH_OBJ", "PUSH_ARRAY", "PUSH_FUNC", "PUSH_THIS", "GET",
       "CREATE", "EXPR", "APPEND", "SET_ARG", "NEW_SCOPE", "DEL_SCOPE", "CALL",
       "RETURN", "LOOP", "BREAK", "CONTINUE", "SETRETVAL", "EXIT", "BCODE_HDR",
-      "ARGS", "FOR_IN_NEXT",
+      "ARGS", "FOR_IN_NEXT", "GET_VAR", "SET_VAR", "CREATE_VAR", "GET_PROP",
+      "GET_LOCAL", "SET_LOCAL", "LOCALS", "SET_PROP", "ADD", "SUB", "MUL",
+      "DIV", "LT", "LE", "GT", "GE", "EQ_EQ", "NE_NE", "JMP_FALSE_LT",
+      "JMP_FALSE_LE", "JMP_FALSE_GT", "JMP_FALSE_GE", "JMP_FALSE_EQ_EQ",
+      "JMP_FALSE_NE_NE",
   };
   const char *name = "???";
   assert(ARRAY_SIZE(names) == OP_MAX);
@@ -14425,6 +17738,23 @@ MJS_PRIVATE size_t mjs_disasm_single(const uint8_t *code, size_t i) {
       i += llen;
       break;
     }
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL: {
+      cs_varint_decode(&code[i + 1], ~0, &n, &llen);
+      LOG(LL_VERBOSE_DEBUG, ("%s\t%u", buf, (unsigned) n));
+      i += llen;
+      break;
+    }
+    case OP_LOCALS: {
+      size_t llen2;
+      uint64_t nslots;
+      cs_varint_decode(&code[i + 1], ~0, &n, &llen);
+      cs_varint_decode(&code[i + llen + 1], ~0, &nslots, &llen2);
+      LOG(LL_VERBOSE_DEBUG,
+          ("%s\t%u %u", buf, (unsigned) n, (unsigned) nslots));
+      i += llen + llen2;
+      break;
+    }
     case OP_SET_ARG: {
       size_t llen2;
       uint64_t arg_no;
@@ -14435,8 +17765,28 @@ MJS_PRIVATE size_t mjs_disasm_single(const uint8_t *code, size_t i) {
       i += llen + llen2 + n;
       break;
     }
-    case OP_PUSH_STR:
     case OP_PUSH_DBL: {
+      /* `code` is the whole bcode part, starting with the header */
+      if (code[0] != OP_BCODE_HEADER || mjs_bcode_version(code) >= 1) {
+        double d;
+        memcpy(&d, &code[i + 1], sizeof(d));
+        LOG(LL_VERBOSE_DEBUG, ("%s\t%g", buf, d));
+        i += sizeof(d);
+      } else {
+        /* Version 0 bcode: the number is a decimal string */
+        cs_varint_decode(&code[i + 1], ~0, &n, &llen);
+        LOG(LL_VERBOSE_DEBUG,
+            ("%s\t[%.*s]", buf, (int) n, code + i + 1 + llen));
+        i += llen + n;
+      }
+      break;
+    }
+    case OP_PUSH_STR:
+    case OP_GET_VAR:
+    case OP_SET_VAR:
+    case OP_CREATE_VAR:
+    case OP_GET_PROP_CONST:
+    case OP_SET_PROP_CONST: {
       cs_varint_decode(&code[i + 1], ~0, &n, &llen);
       LOG(LL_VERBOSE_DEBUG, ("%s\t[%.*s]", buf, (int) n, code + i + 1 + llen));
       i += llen + n;
@@ -14446,7 +17796,13 @@ MJS_PRIVATE size_t mjs_disasm_single(const uint8_t *code, size_t i) {
     case OP_JMP_TRUE:
     case OP_JMP_NEUTRAL_TRUE:
     case OP_JMP_FALSE:
-    case OP_JMP_NEUTRAL_FALSE: {
+    case OP_JMP_NEUTRAL_FALSE:
+    case OP_JMP_FALSE_LT:
+    case OP_JMP_FALSE_LE:
+    case OP_JMP_FALSE_GT:
+    case OP_JMP_FALSE_GE:
+    case OP_JMP_FALSE_EQ_EQ:
+    case OP_JMP_FALSE_NE_NE: {
       cs_varint_decode(&code[i + 1], ~0, &n, &llen);
       LOG(LL_VERBOSE_DEBUG,
           ("%s\t%u", buf,
@@ -14529,7 +17885,7 @@ MJS_PRIVATE size_t mjs_disasm_single(const uint8_t *code, size_t i) {
       memcpy(&map_offset,
              &code[i + 1 + MJS_HDR_ITEM_MAP_OFFSET * sizeof(total_size)],
              sizeof(map_offset));
-      i += sizeof(mjs_header_item_t) * MJS_HDR_ITEMS_CNT;
+      i += mjs_bcode_header_size(code + i);
       LOG(LL_VERBOSE_DEBUG, ("%s\t[%s] end:%lu map_offset: %lu", buf,
                              &code[i + 1], (unsigned long) start + total_size,
                              (unsigned long) start + map_offset));
@@ -14578,12 +17934,36 @@ static void mjs_dump_obj_stack(const char *name, const struct mbuf *m,
   }
 }
 
+static void mjs_dump_call_stack(struct mjs *mjs) {
+  char buf[50];
+  size_t i, n = mjs_call_frames_cnt(mjs);
+  LOG(LL_VERBOSE_DEBUG, ("%12s (%d frames): ", "CALL_STACK", (int) n));
+  for (i = 0; i < n; i++) {
+    struct mjs_frame *f = mjs_call_frame(mjs, n - 1 - i);
+    mjs_sprintf(f->this_obj, mjs, buf, sizeof(buf));
+    LOG(LL_VERBOSE_DEBUG,
+        ("%14s ret %d scopes %d loops %d retval %d this %s", "",
+         (int) f->ret_addr, (int) f->scope_idx, (int) f->loop_idx,
+         (int) f->retval_idx, buf));
+  }
+}
+
+static void mjs_dump_loops(struct mjs *mjs) {
+  size_t i, n = mjs->loop_addresses.len / sizeof(struct mjs_loop);
+  LOG(LL_VERBOSE_DEBUG, ("%12s (%d loops): ", "LOOPS", (int) n));
+  for (i = 0; i < n; i++) {
+    struct mjs_loop *l = (struct mjs_loop *) mjs->loop_addresses.buf + i;
+    LOG(LL_VERBOSE_DEBUG, ("%14s scopes %d break %d continue %d", "",
+                           (int) l->scope_idx, (int) l->brk, (int) l->cont));
+  }
+}
+
 void mjs_dump(struct mjs *mjs, int do_disasm) {
   LOG(LL_VERBOSE_DEBUG, ("------- MJS VM DUMP BEGIN"));
   mjs_dump_obj_stack("DATA_STACK", &mjs->stack, mjs);
-  mjs_dump_obj_stack("CALL_STACK", &mjs->call_stack, mjs);
+  mjs_dump_call_stack(mjs);
   mjs_dump_obj_stack("SCOPES", &mjs->scopes, mjs);
-  mjs_dump_obj_stack("LOOP_OFFSETS", &mjs->loop_addresses, mjs);
+  mjs_dump_loops(mjs);
   mjs_dump_obj_stack("ARG_STACK", &mjs->arg_stack, mjs);
   if (do_disasm) {
     int parts_cnt = mjs_bcode_parts_cnt(mjs);
@@ -14650,7 +18030,7 @@ MJS_PRIVATE const char *mjs_get_bcode_filename(struct mjs *mjs,
                                                struct mjs_bcode_part *bp) {
   (void) mjs;
   return bp->data.p + 1 /* OP_BCODE_HEADER */ +
-         sizeof(mjs_header_item_t) * MJS_HDR_ITEMS_CNT;
+         mjs_bcode_header_size((const uint8_t *) bp->data.p);
 }
 
 const char *mjs_get_bcode_filename_by_offset(struct mjs *mjs, int offset) {
@@ -14711,14 +18091,9 @@ int mjs_get_offset_by_call_frame_num(struct mjs *mjs, int cf_num) {
   if (cf_num == 0) {
     /* Return current bcode offset */
     ret = mjs->cur_bcode_offset;
-  } else if (cf_num > 0 &&
-             mjs->call_stack.len >=
-                 sizeof(mjs_val_t) * CALL_STACK_FRAME_ITEMS_CNT * cf_num) {
+  } else if (cf_num > 0 && mjs_call_frame(mjs, cf_num - 1) != NULL) {
     /* Get offset from the call_stack */
-    int pos = CALL_STACK_FRAME_ITEM_RETURN_ADDR +
-              CALL_STACK_FRAME_ITEMS_CNT * (cf_num - 1);
-    mjs_val_t val = *vptr(&mjs->call_stack, -1 - pos);
-    ret = mjs_get_int(mjs, val);
+    ret = mjs_call_frame(mjs, cf_num - 1)->ret_addr;
   }
   return ret;
 }
@@ -47,6 +47,52 @@
 #endif
 #endif
 
+/*
+ * MJS_ENABLE_COMPUTED_GOTO: if enabled, the interpreter loop dispatches
+ * opcodes through a table of label addresses (the "labels as values"
+ * extension of GCC and Clang), so that every opcode handler jumps directly to
+ * the next one. Otherwise, a portable `switch` is used.
+ *
+ * By default it's enabled for compilers which support the extension.
+ */
+#if !defined(MJS_ENABLE_COMPUTED_GOTO)
+#if defined(__GNUC__) || defined(__clang__)
+#define MJS_ENABLE_COMPUTED_GOTO 1
+#else
+#define MJS_ENABLE_COMPUTED_GOTO 0
+#endif
+#endif
+
+/*
+ * MJS_ENABLE_JIT: if enabled, functions called MJS_JIT_THRESHOLD times are
+ * compiled into native code, see mjs_jit.h. The interpreter executes the rest,
+ * and the instructions which are not compiled.
+ *
+ * Only x86-64 Linux is supported, along with MJS_ENABLE_COMPUTED_GOTO. By
+ * default it's disabled.
+ */
+#if !defined(MJS_ENABLE_JIT)
+#define MJS_ENABLE_JIT 0
+#endif
+
+#if MJS_ENABLE_JIT &&                                          \
+    !(defined(__x86_64__) && defined(__linux__) && MJS_ENABLE_COMPUTED_GOTO)
+#undef MJS_ENABLE_JIT
+#define MJS_ENABLE_JIT 0
+#endif
+
+#if !defined(MJS_JIT_THRESHOLD)
+#define MJS_JIT_THRESHOLD 1000
+#endif
+
+/*
+ * MJS_PROP_CACHE_SIZE: number of objects remembered by the inline cache of
+ * each property access site, see `struct mjs_prop_cache`. Must be at least 1.
+ */
+#if !defined(MJS_PROP_CACHE_SIZE)
+#define MJS_PROP_CACHE_SIZE 4
+#endif
+
 #endif /* MJS_FEATURES_H_ */
 #ifdef MJS_MODULE_LINES
 #line 1 "src/mjs_core_public.h"
@@ -125,6 +171,8 @@ typedef enum mjs_err {
   MJS_FILE_READ_ERROR,
   MJS_FILE_WRITE_ERROR,
   MJS_BAD_ARGS_ERROR,
+  MJS_BUDGET_EXHAUSTED, /* See mjs_set_exec_budget() */
+  MJS_SUSPENDED,        /* See mjs_yield() */
 
   MJS_ERRS_CNT
 } mjs_err_t;
@@ -443,6 +491,8 @@ typedef enum mjs_err {
   MJS_FILE_READ_ERROR,
   MJS_FILE_WRITE_ERROR,
   MJS_BAD_ARGS_ERROR,
+  MJS_BUDGET_EXHAUSTED, /* See mjs_set_exec_budget() */
+  MJS_SUSPENDED,        /* See mjs_yield() */
 
   MJS_ERRS_CNT
 } mjs_err_t;
@@ -626,6 +676,55 @@ mjs_err_t mjs_call(struct mjs *mjs, mjs_val_t *res, mjs_val_t func,
                    mjs_val_t this_val, int nargs, ...);
 mjs_val_t mjs_get_this(struct mjs *mjs);
 
+/*
+ * Execution trace hook: it's called before each instruction is executed, with
+ * the bcode part being executed and the offset of the instruction in it.
+ */
+typedef void(mjs_trace_cb_t)(struct mjs *mjs, const uint8_t *bcode,
+                             size_t offset, void *user_data);
+
+/*
+ * Installs the execution trace hook, or removes it if `cb` is NULL. The change
+ * takes effect the next time the interpreter is entered, e.g. by `mjs_exec()`
+ * or `mjs_call()`. Without a hook installed, execution doesn't pay for it.
+ */
+void mjs_set_trace(struct mjs *mjs, mjs_trace_cb_t *cb, void *user_data);
+
+/*
+ * Limits further execution to `budget` function calls and loop iterations,
+ * so that a script can't run forever: once the budget is spent, execution
+ * stops with `MJS_BUDGET_EXHAUSTED`, and keeps doing so until the budget is
+ * set again. Negative `budget` means no limit, which is the default.
+ *
+ * If possible, the execution is suspended rather than aborted, so it can be
+ * continued by `mjs_resume()` after the budget is set again.
+ */
+void mjs_set_exec_budget(struct mjs *mjs, long budget);
+
+/*
+ * Requests suspension of the script being executed: to be called by a
+ * cfunction, and the script is suspended as soon as the cfunction returns.
+ * `mjs_exec()` (or whichever function has started the script) then returns
+ * `MJS_SUSPENDED`, and the script can be continued by `mjs_resume()`.
+ *
+ * Only a script started by `mjs_exec()`, `mjs_exec_file()` or
+ * `mjs_exec_jsc()` can be suspended, when it calls the cfunction directly,
+ * and while no other execution is suspended. Returns 1 if the suspension is
+ * requested, 0 if it's not possible.
+ */
+int mjs_yield(struct mjs *mjs);
+
+/*
+ * Continues execution of the script which was suspended by `mjs_yield()`, or
+ * because of the exhausted budget. Returns the same as the function which has
+ * started the script, and may suspend again. If nothing is suspended, returns
+ * `MJS_BAD_ARGS_ERROR`.
+ *
+ * While a script is suspended, other code can be executed as usual, except
+ * that it can't be suspended itself.
+ */
+mjs_err_t mjs_resume(struct mjs *mjs, mjs_val_t *res);
+
 #if defined(__cplusplus)
 }
 #endif /* __cplusplus */
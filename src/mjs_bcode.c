@@ -8,6 +8,8 @@
 #include "mjs_internal.h"
 #include "mjs_bcode.h"
 #include "mjs_core.h"
+#include "mjs_jit.h"
+#include "mjs_string.h"
 #include "mjs_tok.h"
 
 static void add_lineno_map_item(struct pstate *pstate) {
@@ -60,6 +62,39 @@ MJS_PRIVATE void emit_str(struct pstate *pstate, const char *ptr, size_t len) {
   pstate->cur_idx += llen + len;
 }
 
+MJS_PRIVATE void emit_dbl(struct pstate *pstate, double d) {
+  add_lineno_map_item(pstate);
+  mbuf_insert(&pstate->mjs->bcode_gen, pstate->cur_idx, &d, sizeof(d));
+  pstate->cur_idx += sizeof(d);
+}
+
+MJS_PRIVATE mjs_header_item_t mjs_bcode_version(const uint8_t *data) {
+  const char *items = (const char *) data + 1 /* OP_BCODE_HEADER */;
+  const char *v0_filename =
+      items + sizeof(mjs_header_item_t) * MJS_HDR_ITEM_VERSION;
+  mjs_header_item_t bcode_offset, version;
+  memcpy(&bcode_offset,
+         items + sizeof(mjs_header_item_t) * MJS_HDR_ITEM_BCODE_OFFSET,
+         sizeof(bcode_offset));
+  /*
+   * Version 0 header has no version item, and the NUL-terminated filename
+   * follows the map offset, right up to the bcode. In later versions, there's
+   * a version item which contains zero bytes in place of the filename, so
+   * it can't span up to the bcode.
+   */
+  if (v0_filename + strlen(v0_filename) + 1 == items + bcode_offset) {
+    return 0;
+  }
+  memcpy(&version, v0_filename, sizeof(version));
+  return version;
+}
+
+MJS_PRIVATE size_t mjs_bcode_header_size(const uint8_t *data) {
+  return sizeof(mjs_header_item_t) *
+         (mjs_bcode_version(data) == 0 ? MJS_HDR_ITEM_VERSION
+                                       : MJS_HDR_ITEMS_CNT);
+}
+
 MJS_PRIVATE int mjs_bcode_insert_offset(struct pstate *p, struct mjs *mjs,
                                         size_t offset, size_t v) {
   int llen = (int) cs_varint_llen(v);
@@ -85,6 +120,8 @@ MJS_PRIVATE int mjs_bcode_insert_offset(struct pstate *p, struct mjs *mjs,
   if (p->cur_idx >= (int) offset) {
     p->cur_idx += diff;
   }
+  /* The code moves, and the jump target is here: no folding across it */
+  p->lits_cnt = 0;
   return diff;
 }
 
@@ -102,27 +139,677 @@ MJS_PRIVATE struct mjs_bcode_part *mjs_bcode_part_get(struct mjs *mjs,
 
 MJS_PRIVATE struct mjs_bcode_part *mjs_bcode_part_get_by_offset(struct mjs *mjs,
                                                                 size_t offset) {
-  int i;
-  int parts_cnt = mjs_bcode_parts_cnt(mjs);
+  int lo = 0, hi = mjs_bcode_parts_cnt(mjs) - 1;
   struct mjs_bcode_part *bp = NULL;
 
   if (offset >= mjs->bcode_len) {
     return NULL;
   }
 
-  for (i = 0; i < parts_cnt; i++) {
-    bp = mjs_bcode_part_get(mjs, i);
-    if (offset < bp->start_idx + bp->data.len) {
-      break;
+  /*
+   * Parts are only appended, each one right after the previous, so they are
+   * sorted by `start_idx`: find the last one starting at or before the offset
+   */
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (mjs_bcode_part_get(mjs, mid)->start_idx <= offset) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
     }
   }
+  bp = mjs_bcode_part_get(mjs, lo);
 
   /* given the non-corrupted data, the needed part must be found */
-  assert(i < parts_cnt);
+  assert(offset - bp->start_idx < bp->data.len);
 
   return bp;
 }
 
+MJS_PRIVATE size_t mjs_bcode_part_insn_idx(const struct mjs_bcode_part *bp,
+                                           size_t offset) {
+  size_t lo = 0, hi = bp->insns_cnt - 1;
+  /* Find the first instruction at or after the given offset */
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (bp->insns[mid].off < offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/*
+ * Returns index of the string `p`, `len` in the constant pool of the part,
+ * adding it to the pool if it's not there yet. `tab` is a hash table of pool
+ * indices plus one, of size `tab_size` (a power of two), which should be
+ * larger than the pool.
+ */
+static size_t bcode_part_intern(struct mjs *mjs, struct mjs_bcode_part *bp,
+                                size_t *tab, size_t tab_size, const char *p,
+                                size_t len) {
+  size_t h = 2166136261u, j;
+  for (j = 0; j < len; j++) {
+    h = (h ^ (uint8_t) p[j]) * 16777619u;
+  }
+  for (h &= tab_size - 1; tab[h] != 0; h = (h + 1) & (tab_size - 1)) {
+    size_t n;
+    const char *s = mjs_get_string(mjs, &bp->consts[tab[h] - 1], &n);
+    if (n == len && memcmp(s, p, len) == 0) return tab[h] - 1;
+  }
+  bp->consts[bp->consts_cnt] = mjs_mk_string(mjs, p, len, 1);
+  tab[h] = ++bp->consts_cnt;
+  return tab[h] - 1;
+}
+
+/*
+ * Returns the number of values the instructions `from` ... `to` - 1 can push
+ * to the data stack. No instruction pushes more than one value, except
+ * OP_LOCALS which pushes the slots; a loop leaves the stack as it was, so
+ * each instruction is counted once. Bodies of nested functions are skipped,
+ * the room for them is reserved when they are called.
+ */
+static size_t bcode_stack_need(const struct mjs_insn *insns, size_t from,
+                               size_t to) {
+  size_t k, need = 0;
+  for (k = from; k < to; k++) {
+    if (insns[k].opcode == OP_JMP && insns[k].b != 0 && insns[k].a > k) {
+      /* Continue at OP_PUSH_FUNC of the nested function */
+      k = insns[k].a - 1;
+    } else {
+      need += insns[k].opcode == OP_LOCALS ? insns[k].a : 1;
+    }
+  }
+  return need;
+}
+
+MJS_PRIVATE void mjs_bcode_part_decode(struct mjs *mjs,
+                                       struct mjs_bcode_part *bp) {
+  const uint8_t *code = (const uint8_t *) bp->data.p;
+  size_t i = 0, end = bp->data.len, k, ncaches = 0, nstrs = 0, tab_size = 1;
+  size_t *tab;
+  mjs_header_item_t version = MJS_BCODE_VERSION;
+  struct mbuf insns;
+  struct mjs_insn in;
+
+  if (bp->insns != NULL) return;
+
+  mbuf_init(&insns, 0);
+  memset(&in, 0, sizeof(in));
+
+  if (end > 0 && code[0] == OP_BCODE_HEADER) {
+    /* Skip the header and the filename, and don't decode the line map */
+    mjs_header_item_t bcode_offset, map_offset;
+    memcpy(&bcode_offset, code + 1 + sizeof(mjs_header_item_t) *
+                                         MJS_HDR_ITEM_BCODE_OFFSET,
+           sizeof(bcode_offset));
+    memcpy(&map_offset,
+           code + 1 + sizeof(mjs_header_item_t) * MJS_HDR_ITEM_MAP_OFFSET,
+           sizeof(map_offset));
+    version = mjs_bcode_version(code);
+    in.opcode = OP_BCODE_HEADER;
+    mbuf_append(&insns, &in, sizeof(in));
+    i = 1 + bcode_offset;
+    end = 1 + map_offset;
+  }
+
+  while (i < end) {
+    int llen, llen2;
+    memset(&in, 0, sizeof(in));
+    in.opcode = code[i];
+    in.off = i;
+    i++;
+    switch (in.opcode) {
+      case OP_JMP:
+      case OP_JMP_TRUE:
+      case OP_JMP_NEUTRAL_TRUE:
+      case OP_JMP_FALSE:
+      case OP_JMP_NEUTRAL_FALSE:
+      case OP_JMP_FALSE_LT:
+      case OP_JMP_FALSE_LE:
+      case OP_JMP_FALSE_GT:
+      case OP_JMP_FALSE_GE:
+      case OP_JMP_FALSE_EQ_EQ:
+      case OP_JMP_FALSE_NE_NE: {
+        /* Jump targets are resolved to instruction indices below */
+        uint64_t n = cs_varint_decode_unsafe(&code[i], &llen);
+        i += llen;
+        in.a = i + n;
+        break;
+      }
+      case OP_LOOP: {
+        uint64_t n1 = cs_varint_decode_unsafe(&code[i], &llen);
+        uint64_t n2 = cs_varint_decode_unsafe(&code[i + llen], &llen2);
+        in.a = i + llen + n1;
+        in.b = i + llen + llen2 + n2;
+        i += llen + llen2;
+        break;
+      }
+      case OP_PUSH_FUNC: {
+        uint64_t n = cs_varint_decode_unsafe(&code[i], &llen);
+        in.v.i = bp->start_idx + in.off - n;
+        i += llen;
+        break;
+      }
+      case OP_PUSH_INT:
+        in.v.i = cs_varint_decode_unsafe(&code[i], &llen);
+        i += llen;
+        break;
+      case OP_PUSH_DBL:
+        if (version >= 1) {
+          memcpy(&in.v.d, code + i, sizeof(in.v.d));
+          i += sizeof(in.v.d);
+        } else {
+          /* Version 0 bcode: the number is a decimal string */
+          char buf[50];
+          size_t n = cs_varint_decode_unsafe(&code[i], &llen);
+          i += llen;
+          if (n >= sizeof(buf)) n = sizeof(buf) - 1;
+          memcpy(buf, code + i, n);
+          buf[n] = '\0';
+          in.v.d = strtod(buf, NULL);
+          i += n;
+        }
+        break;
+      case OP_PUSH_STR:
+      case OP_GET_VAR:
+      case OP_SET_VAR:
+      case OP_CREATE_VAR:
+      case OP_GET_PROP_CONST:
+      case OP_SET_PROP_CONST:
+        /* The string is interned below, keep its offset for now */
+        in.a = cs_varint_decode_unsafe(&code[i], &llen);
+        in.v.i = i + llen;
+        i += llen + in.a;
+        nstrs++;
+        break;
+      case OP_SET_ARG:
+        in.b = cs_varint_decode_unsafe(&code[i], &llen);
+        in.a = cs_varint_decode_unsafe(&code[i + llen], &llen2);
+        in.v.i = i + llen + llen2;
+        i += llen + llen2 + in.a;
+        nstrs++;
+        break;
+      case OP_GET_LOCAL:
+      case OP_SET_LOCAL:
+        in.a = cs_varint_decode_unsafe(&code[i], &llen);
+        i += llen;
+        break;
+      case OP_LOCALS:
+        in.b = cs_varint_decode_unsafe(&code[i], &llen);
+        in.a = cs_varint_decode_unsafe(&code[i + llen], &llen2);
+        i += llen + llen2;
+        break;
+      case OP_EXPR:
+        in.op = code[i];
+        i++;
+        break;
+      default:
+        break;
+    }
+    mbuf_append(&insns, &in, sizeof(in));
+  }
+
+  /* Terminate the stream, so that falling off the end exits */
+  memset(&in, 0, sizeof(in));
+  in.opcode = OP_EXIT;
+  in.off = end;
+  mbuf_append(&insns, &in, sizeof(in));
+
+  mbuf_trim(&insns);
+  bp->insns = (struct mjs_insn *) insns.buf;
+  bp->insns_cnt = insns.len / sizeof(in);
+
+  /*
+   * Convert jump targets from bcode offsets to instruction indices, give each
+   * property access site its inline cache, and turn string operands into
+   * values of the constant pool, so that they're not created every time the
+   * instruction is executed.
+   */
+  while (tab_size <= nstrs * 2) tab_size <<= 1;
+  tab = (size_t *) calloc(tab_size, sizeof(*tab));
+  bp->consts = (mjs_val_t *) calloc(nstrs > 0 ? nstrs : 1, sizeof(mjs_val_t));
+  for (k = 0; k < bp->insns_cnt; k++) {
+    struct mjs_insn *p = &bp->insns[k];
+    switch (p->opcode) {
+      case OP_PUSH_STR:
+      case OP_GET_VAR:
+      case OP_SET_VAR:
+      case OP_CREATE_VAR:
+      case OP_SET_ARG:
+        p->a = bcode_part_intern(mjs, bp, tab, tab_size,
+                                 (const char *) code + p->v.i, p->a);
+        break;
+      case OP_EXPR:
+        if (p->op == TOK_ASSIGN) p->b = ncaches++;
+        break;
+      case OP_GET_PROP_CONST:
+      case OP_SET_PROP_CONST:
+        p->a = bcode_part_intern(mjs, bp, tab, tab_size,
+                                 (const char *) code + p->v.i, p->a);
+        p->b = ncaches++;
+        break;
+      case OP_GET:
+        p->b = ncaches++;
+        break;
+      case OP_JMP:
+      case OP_JMP_TRUE:
+      case OP_JMP_NEUTRAL_TRUE:
+      case OP_JMP_FALSE:
+      case OP_JMP_NEUTRAL_FALSE:
+      case OP_JMP_FALSE_LT:
+      case OP_JMP_FALSE_LE:
+      case OP_JMP_FALSE_GT:
+      case OP_JMP_FALSE_GE:
+      case OP_JMP_FALSE_EQ_EQ:
+      case OP_JMP_FALSE_NE_NE:
+        p->a = mjs_bcode_part_insn_idx(bp, p->a);
+        break;
+      case OP_LOOP:
+        p->a = mjs_bcode_part_insn_idx(bp, p->a);
+        p->b = mjs_bcode_part_insn_idx(bp, p->b);
+        break;
+      default:
+        break;
+    }
+  }
+  free(tab);
+
+  /*
+   * Parameters of a function which doesn't use local slots are bound by a run
+   * of OP_SET_ARG, and the first one of them binds all the run at once. The
+   * run is cut before a repeated name, which has to be bound on its own.
+   */
+  for (k = bp->insns_cnt; k-- > 0;) {
+    struct mjs_insn *p = &bp->insns[k];
+    if (p->opcode == OP_SET_ARG) {
+      size_t j, n = p[1].opcode == OP_SET_ARG && p[1].op < 255 ? p[1].op : 0;
+      for (j = 1; j <= n; j++) {
+        if (p[j].a == p->a) break;
+      }
+      p->op = j > n ? n + 1 : 1;
+    }
+  }
+
+  /*
+   * A function body is preceded by OP_JMP over it, which keeps the number of
+   * values the function can push: OP_CALL leaves the index of the OP_JMP as
+   * the current one, and reserves the room before running the body. Nested
+   * functions come before the outer ones' OP_PUSH_FUNC, so they are counted
+   * first.
+   */
+  bp->stack_max = 0;
+  for (k = 0; k < bp->insns_cnt; k++) {
+    struct mjs_insn *p = &bp->insns[k];
+    if (p->opcode == OP_PUSH_FUNC) {
+      size_t entry =
+          mjs_bcode_part_insn_idx(bp, (size_t) p->v.i - bp->start_idx);
+      assert(entry > 0 && entry < k);
+      assert(bp->insns[entry - 1].opcode == OP_JMP);
+      bp->insns[entry - 1].b = bcode_stack_need(bp->insns, entry, k);
+      if (bp->insns[entry - 1].b > bp->stack_max) {
+        bp->stack_max = bp->insns[entry - 1].b;
+      }
+    }
+  }
+  k = bcode_stack_need(bp->insns, 0, bp->insns_cnt);
+  if (k > bp->stack_max) bp->stack_max = k;
+
+  bp->prop_caches = (struct mjs_prop_cache *) calloc(
+      ncaches > 0 ? ncaches : 1, sizeof(struct mjs_prop_cache));
+#if MJS_ENABLE_JIT
+  bp->jit = mjs_jit_create(bp->insns_cnt);
+#endif
+}
+
+/*
+ * Instruction of the code being optimized, see mjs_bcode_optimize()
+ */
+struct bcode_opt_insn {
+  size_t off;     /* Offset in the original code */
+  size_t len;     /* Length in the original code */
+  size_t noff;    /* Offset in the optimized code */
+  size_t tgt[2];  /* Instructions which the offset operands refer to */
+  size_t olen[2]; /* Lengths of the offset operands in the original code */
+  size_t llen[2]; /* Lengths of the offset operands in the optimized code */
+  int ntgt;       /* Number of offset operands */
+  uint8_t opcode;
+  int removed;
+  int is_target; /* Whether some offset operand refers to the instruction */
+};
+
+static int bcode_opt_is_jump(uint8_t opcode) {
+  switch (opcode) {
+    case OP_JMP:
+    case OP_JMP_TRUE:
+    case OP_JMP_NEUTRAL_TRUE:
+    case OP_JMP_FALSE:
+    case OP_JMP_NEUTRAL_FALSE:
+    case OP_JMP_FALSE_LT:
+    case OP_JMP_FALSE_LE:
+    case OP_JMP_FALSE_GT:
+    case OP_JMP_FALSE_GE:
+    case OP_JMP_FALSE_EQ_EQ:
+    case OP_JMP_FALSE_NE_NE:
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Whether the instruction just pushes a value, so that it can be removed
+ * together with OP_DROP which follows.
+ */
+static int bcode_opt_is_push(uint8_t opcode) {
+  switch (opcode) {
+    case OP_DUP:
+    case OP_PUSH_SCOPE:
+    case OP_PUSH_STR:
+    case OP_PUSH_TRUE:
+    case OP_PUSH_FALSE:
+    case OP_PUSH_INT:
+    case OP_PUSH_DBL:
+    case OP_PUSH_NULL:
+    case OP_PUSH_UNDEF:
+    case OP_PUSH_THIS:
+    case OP_GET_LOCAL:
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Decodes the instruction at `code[i]` into `in`. Offset operands (of jumps,
+ * OP_LOOP and OP_PUSH_FUNC) are stored as bcode offsets of the instructions
+ * they refer to.
+ */
+static void bcode_opt_decode(const uint8_t *code, size_t i,
+                             struct bcode_opt_insn *in) {
+  int llen, llen2;
+  size_t n;
+  memset(in, 0, sizeof(*in));
+  in->opcode = code[i];
+  in->off = i++;
+  if (bcode_opt_is_jump(in->opcode)) {
+    n = cs_varint_decode_unsafe(&code[i], &llen);
+    in->olen[0] = llen;
+    in->tgt[0] = i + llen + n;
+    in->ntgt = 1;
+    i += llen;
+  } else {
+    switch (in->opcode) {
+      case OP_LOOP:
+        n = cs_varint_decode_unsafe(&code[i], &llen);
+        in->olen[0] = llen;
+        in->tgt[0] = i + llen + n;
+        i += llen;
+        n = cs_varint_decode_unsafe(&code[i], &llen);
+        in->olen[1] = llen;
+        in->tgt[1] = i + llen + n;
+        in->ntgt = 2;
+        i += llen;
+        break;
+      case OP_PUSH_FUNC:
+        n = cs_varint_decode_unsafe(&code[i], &llen);
+        in->olen[0] = llen;
+        in->tgt[0] = in->off - n;
+        in->ntgt = 1;
+        i += llen;
+        break;
+      case OP_PUSH_INT:
+      case OP_GET_LOCAL:
+      case OP_SET_LOCAL:
+        cs_varint_decode_unsafe(&code[i], &llen);
+        i += llen;
+        break;
+      case OP_LOCALS:
+        cs_varint_decode_unsafe(&code[i], &llen);
+        cs_varint_decode_unsafe(&code[i + llen], &llen2);
+        i += llen + llen2;
+        break;
+      case OP_PUSH_DBL:
+        i += sizeof(double);
+        break;
+      case OP_PUSH_STR:
+      case OP_GET_VAR:
+      case OP_SET_VAR:
+      case OP_CREATE_VAR:
+      case OP_GET_PROP_CONST:
+      case OP_SET_PROP_CONST:
+        n = cs_varint_decode_unsafe(&code[i], &llen);
+        i += llen + n;
+        break;
+      case OP_SET_ARG:
+        cs_varint_decode_unsafe(&code[i], &llen);
+        n = cs_varint_decode_unsafe(&code[i + llen], &llen2);
+        i += llen + llen2 + n;
+        break;
+      case OP_EXPR:
+        i++;
+        break;
+      default:
+        break;
+    }
+  }
+  in->len = i - in->off;
+  in->llen[0] = in->olen[0];
+  in->llen[1] = in->olen[1];
+}
+
+/* Returns index of the instruction which starts at or contains `off` */
+static size_t bcode_opt_find(const struct bcode_opt_insn *insns, size_t cnt,
+                             size_t off) {
+  size_t lo = 0, hi = cnt - 1;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo + 1) / 2;
+    if (insns[mid].off <= off) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+/* Returns the first instruction which is not removed, starting from `k` */
+static size_t bcode_opt_live(const struct bcode_opt_insn *insns, size_t k) {
+  while (insns[k].removed) k++;
+  return k;
+}
+
+/* Returns length of the instruction in the optimized code */
+static size_t bcode_opt_len(const struct bcode_opt_insn *in) {
+  return in->len - in->olen[0] - in->olen[1] + in->llen[0] + in->llen[1];
+}
+
+/*
+ * Returns value of the offset operand `j` of the instruction `k` in the
+ * optimized code. Like in the original code, it's the distance from the end
+ * of the varint to the target, or, for OP_PUSH_FUNC, back from the opcode.
+ */
+static size_t bcode_opt_operand(const struct bcode_opt_insn *insns, size_t k,
+                                int j) {
+  const struct bcode_opt_insn *in = &insns[k];
+  if (in->opcode == OP_PUSH_FUNC) {
+    return in->noff - insns[in->tgt[0]].noff;
+  } else if (in->opcode == OP_LOOP) {
+    return insns[in->tgt[j]].noff -
+           (in->noff + 1 + in->llen[0] + (j == 1 ? in->llen[1] : 0));
+  }
+  return insns[in->tgt[0]].noff - (in->noff + bcode_opt_len(in));
+}
+
+/*
+ * Encodes varint into exactly `llen` bytes, which might be more than needed:
+ * then the extra bytes are zeros with the continuation bit set before them.
+ */
+static void bcode_opt_encode(uint64_t v, uint8_t *buf, size_t llen) {
+  size_t j;
+  for (j = 0; j < llen; j++) {
+    buf[j] = (uint8_t)((v & 0x7f) | (j + 1 < llen ? 0x80 : 0));
+    v >>= 7;
+  }
+}
+
+/* Maps offset in the original code to the offset in the optimized code */
+static size_t bcode_opt_map(const struct bcode_opt_insn *insns, size_t cnt,
+                            size_t off) {
+  size_t k = bcode_opt_find(insns, cnt, off);
+  if (off >= insns[k].off + insns[k].len) {
+    return insns[k].noff + bcode_opt_len(&insns[k]);
+  } else if (insns[k].removed || off == insns[k].off) {
+    /* Removed instructions are at the offset of the next live one */
+    return insns[k].noff;
+  }
+  /* Offset within the instruction stays within it */
+  return insns[k].noff + 1;
+}
+
+MJS_PRIVATE void mjs_bcode_optimize(struct pstate *p) {
+  struct mbuf *b = &p->mjs->bcode_gen;
+  const uint8_t *code = (const uint8_t *) b->buf + p->start_bcode_idx;
+  size_t size = p->cur_idx - p->start_bcode_idx, cnt = 0, i, k, j, t, n;
+  struct bcode_opt_insn *insns, in;
+  struct mbuf out, map;
+  int changed;
+
+  if (size == 0) return;
+
+  for (i = 0; i < size; i += in.len, cnt++) {
+    bcode_opt_decode(code, i, &in);
+  }
+  insns = (struct bcode_opt_insn *) calloc(cnt, sizeof(*insns));
+  for (i = 0, k = 0; k < cnt; i += insns[k++].len) {
+    bcode_opt_decode(code, i, &insns[k]);
+  }
+  /* Code ends with OP_EXIT, which is never removed */
+  assert(insns[cnt - 1].opcode == OP_EXIT);
+
+  /* Offset operands now refer to instruction indices */
+  for (k = 0; k < cnt; k++) {
+    for (j = 0; j < (size_t) insns[k].ntgt; j++) {
+      insns[k].tgt[j] = bcode_opt_find(insns, cnt, insns[k].tgt[j]);
+    }
+  }
+
+  do {
+    changed = 0;
+
+    /*
+     * Jump threading: a jump to OP_JMP can go right where OP_JMP leads to;
+     * the same for OP_JMP_NEUTRAL_... to the jump of the same kind, since the
+     * value being checked is the same.
+     */
+    for (k = 0; k < cnt; k++) {
+      uint8_t op = insns[k].opcode;
+      if (insns[k].removed || !bcode_opt_is_jump(op)) continue;
+      for (n = 0; n < cnt; n++) {
+        uint8_t top;
+        t = bcode_opt_live(insns, insns[k].tgt[0]);
+        top = insns[t].opcode;
+        if (t == k ||
+            !(top == OP_JMP || (top == op && (op == OP_JMP_NEUTRAL_TRUE ||
+                                              op == OP_JMP_NEUTRAL_FALSE)))) {
+          break;
+        }
+        insns[k].tgt[0] = insns[t].tgt[0];
+        changed = 1;
+      }
+    }
+
+    for (k = 0; k < cnt; k++) insns[k].is_target = 0;
+    for (k = 0; k < cnt; k++) {
+      if (insns[k].removed) continue;
+      for (j = 0; j < (size_t) insns[k].ntgt; j++) {
+        insns[bcode_opt_live(insns, insns[k].tgt[j])].is_target = 1;
+      }
+    }
+
+    for (k = 0; k + 1 < cnt; k++) {
+      uint8_t op = insns[k].opcode;
+      if (insns[k].removed) continue;
+      j = bcode_opt_live(insns, k + 1);
+      if (op == OP_NOP ||
+          (op == OP_JMP && bcode_opt_live(insns, insns[k].tgt[0]) == j)) {
+        /* Does nothing, or jumps to the next instruction */
+        insns[k].removed = 1;
+        changed = 1;
+      } else if (bcode_opt_is_push(op) && insns[j].opcode == OP_DROP &&
+                 !insns[j].is_target) {
+        /* Pushes a value which is dropped right away */
+        insns[k].removed = insns[j].removed = 1;
+        changed = 1;
+      }
+    }
+  } while (changed);
+
+  /*
+   * Lay out the optimized code. Offset operands can only shrink, since the
+   * code between instructions does, so repeat until the layout is stable.
+   * Note that removed instructions get offset of the next live one.
+   */
+  do {
+    changed = 0;
+    for (k = 0, i = 0; k < cnt; k++) {
+      insns[k].noff = i;
+      if (!insns[k].removed) i += bcode_opt_len(&insns[k]);
+    }
+    for (k = 0; k < cnt; k++) {
+      if (insns[k].removed) continue;
+      for (j = 0; j < (size_t) insns[k].ntgt; j++) {
+        size_t llen = cs_varint_llen(bcode_opt_operand(insns, k, j));
+        if (llen < insns[k].llen[j]) {
+          insns[k].llen[j] = llen;
+          changed = 1;
+        }
+      }
+    }
+  } while (changed);
+
+  mbuf_init(&out, size);
+  for (k = 0; k < cnt; k++) {
+    if (insns[k].removed) continue;
+    if (insns[k].ntgt == 0) {
+      mbuf_append(&out, code + insns[k].off, insns[k].len);
+      continue;
+    }
+    /* Instructions with offset operands have no other operands */
+    mbuf_append(&out, &insns[k].opcode, 1);
+    for (j = 0; j < (size_t) insns[k].ntgt; j++) {
+      mbuf_append(&out, NULL, insns[k].llen[j]);
+      bcode_opt_encode(bcode_opt_operand(insns, k, j),
+                       (uint8_t *) out.buf + out.len - insns[k].llen[j],
+                       insns[k].llen[j]);
+    }
+  }
+
+  /* Offsets of the line numbers map, see add_lineno_map_item() */
+  mbuf_init(&map, p->offset_lineno_map.len);
+  for (i = 0; i < p->offset_lineno_map.len;) {
+    int llen, llen2;
+    const uint8_t *m = (const uint8_t *) p->offset_lineno_map.buf + i;
+    size_t off = cs_varint_decode_unsafe(m, &llen);
+    size_t line_no = cs_varint_decode_unsafe(m + llen, &llen2);
+    off = bcode_opt_map(insns, cnt, off);
+    mbuf_append(&map, NULL, cs_varint_llen(off) + llen2);
+    cs_varint_encode(off, (uint8_t *) map.buf + map.len - llen2 -
+                              cs_varint_llen(off),
+                     cs_varint_llen(off));
+    cs_varint_encode(line_no, (uint8_t *) map.buf + map.len - llen2, llen2);
+    i += llen + llen2;
+  }
+  mbuf_free(&p->offset_lineno_map);
+  p->offset_lineno_map = map;
+
+  b->len = p->start_bcode_idx;
+  mbuf_append(b, out.buf, out.len);
+  p->cur_idx = b->len;
+  mbuf_free(&out);
+  free(insns);
+}
+
 MJS_PRIVATE int mjs_bcode_parts_cnt(struct mjs *mjs) {
   return mjs->bcode_parts.len / sizeof(struct mjs_bcode_part);
 }
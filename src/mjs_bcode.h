@@ -54,6 +54,48 @@ enum mjs_opcode {
   OP_BCODE_HEADER, /* ( -- ) */
   OP_ARGS,         /* ( -- ) Mark the beginning of function call arguments */
   OP_FOR_IN_NEXT,  /* ( name obj iter_ptr -- name obj iter_ptr_next ) */
+  /*
+   * Superinstructions for the common sequences, all of them take a string
+   * operand (the name):
+   */
+  OP_GET_VAR,        /* ( -- a ) Like PUSH_STR FIND_SCOPE GET */
+  OP_SET_VAR,        /* ( a -- a ) Like PUSH_STR FIND_SCOPE ... EXPR = */
+  OP_CREATE_VAR,     /* ( -- ) Like PUSH_STR PUSH_SCOPE CREATE */
+  OP_GET_PROP_CONST, /* ( obj -- obj[name] ) Like PUSH_STR SWAP GET */
+  /*
+   * Local variables resolved by the parser to slots of the function frame,
+   * see parse_function(). Slots live on the data stack, right after the
+   * function being called: the first ones are the arguments.
+   */
+  OP_GET_LOCAL, /* ( -- a ) Push the value of the slot */
+  OP_SET_LOCAL, /* ( a -- a ) Set the slot to the TOS */
+  OP_LOCALS,    /* ( -- ) Reserve slots: nparams nslots */
+  /* One more superinstruction with a string operand, like the ones above */
+  OP_SET_PROP_CONST, /* ( obj a -- a ) Like PUSH_STR SWAP ... EXPR = */
+  /*
+   * Binary operators with their own opcodes, so that numbers can be handled
+   * right away. Each one is like EXPR with the corresponding operator.
+   */
+  OP_ADD,   /* ( a b -- a+b ) */
+  OP_SUB,   /* ( a b -- a-b ) */
+  OP_MUL,   /* ( a b -- a*b ) */
+  OP_DIV,   /* ( a b -- a/b ) */
+  OP_LT,    /* ( a b -- a<b ) */
+  OP_LE,    /* ( a b -- a<=b ) */
+  OP_GT,    /* ( a b -- a>b ) */
+  OP_GE,    /* ( a b -- a>=b ) */
+  OP_EQ_EQ, /* ( a b -- a===b ) */
+  OP_NE_NE, /* ( a b -- a!==b ) */
+  /*
+   * Comparisons fused with OP_JMP_FALSE, for conditions of loops and `if`;
+   * the order is the same as of the comparison opcodes above.
+   */
+  OP_JMP_FALSE_LT,    /* ( a b -- ) Like LT JMP_FALSE */
+  OP_JMP_FALSE_LE,    /* ( a b -- ) Like LE JMP_FALSE */
+  OP_JMP_FALSE_GT,    /* ( a b -- ) Like GT JMP_FALSE */
+  OP_JMP_FALSE_GE,    /* ( a b -- ) Like GE JMP_FALSE */
+  OP_JMP_FALSE_EQ_EQ, /* ( a b -- ) Like EQ_EQ JMP_FALSE */
+  OP_JMP_FALSE_NE_NE, /* ( a b -- ) Like NE_NE JMP_FALSE */
   OP_MAX
 };
 
@@ -63,6 +105,20 @@ struct mjs;
 MJS_PRIVATE void emit_byte(struct pstate *pstate, uint8_t byte);
 MJS_PRIVATE void emit_int(struct pstate *pstate, int64_t n);
 MJS_PRIVATE void emit_str(struct pstate *pstate, const char *ptr, size_t len);
+MJS_PRIVATE void emit_dbl(struct pstate *pstate, double d);
+
+/*
+ * Returns bcode format version of the bcode part which starts with
+ * OP_BCODE_HEADER at `data`.
+ */
+MJS_PRIVATE mjs_header_item_t mjs_bcode_version(const uint8_t *data);
+
+/*
+ * Returns size of the header items of the bcode part which starts with
+ * OP_BCODE_HEADER at `data`, i.e. the offset of the filename after the
+ * OP_BCODE_HEADER byte.
+ */
+MJS_PRIVATE size_t mjs_bcode_header_size(const uint8_t *data);
 
 /*
  * Inserts provided offset `v` at the offset `offset`.
@@ -85,11 +141,37 @@ MJS_PRIVATE void mjs_bcode_part_add(struct mjs *mjs,
 MJS_PRIVATE struct mjs_bcode_part *mjs_bcode_part_get(struct mjs *mjs, int num);
 
 /*
- * Returns bcode part by the global bcode offset
+ * Returns bcode part by the global bcode offset, or NULL if there is no such
+ * offset. Takes O(log n) of the number of parts.
  */
 MJS_PRIVATE struct mjs_bcode_part *mjs_bcode_part_get_by_offset(struct mjs *mjs,
                                                                 size_t offset);
 
+/*
+ * Decodes instructions of the given bcode part into `bp->insns`, unless it's
+ * already done. The interpreter executes decoded instructions, so that
+ * operands are decoded only once per part, and not every time the instruction
+ * is executed. String operands are interned into `bp->consts`.
+ */
+MJS_PRIVATE void mjs_bcode_part_decode(struct mjs *mjs,
+                                       struct mjs_bcode_part *bp);
+
+/*
+ * Returns index of the decoded instruction at the given offset in the bcode
+ * part. The part should be already decoded.
+ */
+MJS_PRIVATE size_t mjs_bcode_part_insn_idx(const struct mjs_bcode_part *bp,
+                                           size_t offset);
+
+/*
+ * Peephole optimizer of the code generated by the parser: from
+ * `p->start_bcode_idx` up to `p->cur_idx`, which should end with OP_EXIT.
+ * Threads jumps to unconditional jumps, and removes jumps to the next
+ * instruction, as well as values which are pushed and dropped right away.
+ * Offset operands, `p->cur_idx` and the line numbers map are adjusted.
+ */
+MJS_PRIVATE void mjs_bcode_optimize(struct pstate *p);
+
 /*
  * Returns a number of bcode parts
  */
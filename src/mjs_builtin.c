@@ -95,7 +95,7 @@ static void mjs_load(struct mjs *mjs) {
 
   clean:
     if (custom_global) {
-      mjs_pop_val(&mjs->scopes);
+      mjs_scopes_truncate(mjs, mjs_stack_size(&mjs->scopes) - 1);
     }
   }
   mjs_return(mjs, res);
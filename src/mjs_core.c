@@ -12,6 +12,7 @@
 #include "mjs_exec.h"
 #include "mjs_ffi.h"
 #include "mjs_internal.h"
+#include "mjs_jit.h"
 #include "mjs_object.h"
 #include "mjs_primitive.h"
 #include "mjs_string.h"
@@ -37,6 +38,10 @@
 #define MJS_FUNC_FFI_ARENA_INC_SIZE 10
 #endif
 
+#ifndef MJS_CALL_STACK_INIT_FRAMES
+#define MJS_CALL_STACK_INIT_FRAMES 16
+#endif
+
 void mjs_destroy(struct mjs *mjs) {
   {
     int parts_cnt = mjs_bcode_parts_cnt(mjs);
@@ -46,6 +51,12 @@ void mjs_destroy(struct mjs *mjs) {
       if (!bp->in_rom) {
         free((void *) bp->data.p);
       }
+      free(bp->insns);
+      free(bp->prop_caches);
+      free(bp->consts);
+#if MJS_ENABLE_JIT
+      mjs_jit_free(bp->jit);
+#endif
     }
   }
 
@@ -58,6 +69,7 @@ void mjs_destroy(struct mjs *mjs) {
   mbuf_free(&mjs->foreign_strings);
   mbuf_free(&mjs->owned_values);
   mbuf_free(&mjs->scopes);
+  mbuf_free(&mjs->scope_vars);
   mbuf_free(&mjs->loop_addresses);
   mbuf_free(&mjs->json_visited_stack);
   free(mjs->error_msg);
@@ -73,7 +85,8 @@ struct mjs *mjs_create(void) {
   mjs_val_t global_object;
   struct mjs *mjs = calloc(1, sizeof(*mjs));
   mbuf_init(&mjs->stack, 0);
-  mbuf_init(&mjs->call_stack, 0);
+  mbuf_init(&mjs->call_stack,
+            sizeof(struct mjs_frame) * MJS_CALL_STACK_INIT_FRAMES);
   mbuf_init(&mjs->arg_stack, 0);
   mbuf_init(&mjs->owned_strings, 0);
   mbuf_init(&mjs->foreign_strings, 0);
@@ -81,6 +94,7 @@ struct mjs *mjs_create(void) {
   mbuf_init(&mjs->bcode_parts, 0);
   mbuf_init(&mjs->owned_values, 0);
   mbuf_init(&mjs->scopes, 0);
+  mbuf_init(&mjs->scope_vars, 0);
   mbuf_init(&mjs->loop_addresses, 0);
   mbuf_init(&mjs->json_visited_stack, 0);
 
@@ -108,6 +122,7 @@ struct mjs *mjs_create(void) {
   mjs_set_ffi_resolver(mjs, dlsym);
   push_mjs_val(&mjs->scopes, global_object);
   mjs->vals.this_obj = MJS_UNDEFINED;
+  mjs->exec_budget = -1;
   mjs->vals.dataview_proto = MJS_UNDEFINED;
 
   return mjs;
@@ -191,7 +206,7 @@ const char *mjs_strerror(struct mjs *mjs, enum mjs_err err) {
       "NO_ERROR",        "SYNTAX_ERROR",    "REFERENCE_ERROR",
       "TYPE_ERROR",      "OUT_OF_MEMORY",   "INTERNAL_ERROR",
       "NOT_IMPLEMENTED", "FILE_READ_ERROR", "FILE_WRITE_ERROR",
-      "BAD_ARGUMENTS"};
+      "BAD_ARGUMENTS",   "BUDGET_EXHAUSTED", "SUSPENDED"};
   return mjs->error_msg == NULL || mjs->error_msg[0] == '\0' ? err_names[err]
                                                              : mjs->error_msg;
 }
@@ -264,23 +279,35 @@ static void mjs_append_stack_trace_line(struct mjs *mjs, size_t offset) {
 
 MJS_PRIVATE void mjs_gen_stack_trace(struct mjs *mjs, size_t offset) {
   mjs_append_stack_trace_line(mjs, offset);
-  while (mjs->call_stack.len >=
-         sizeof(mjs_val_t) * CALL_STACK_FRAME_ITEMS_CNT) {
-    int i;
-
+  while (mjs_call_frames_cnt(mjs) > 0) {
     /* set current offset to it to the offset stored in the frame */
-    offset = mjs_get_int(
-        mjs, *vptr(&mjs->call_stack, -1 - CALL_STACK_FRAME_ITEM_RETURN_ADDR));
+    offset = mjs_call_frame(mjs, 0)->ret_addr;
 
     /* pop frame from the call stack */
-    for (i = 0; i < CALL_STACK_FRAME_ITEMS_CNT; i++) {
-      mjs_pop_val(&mjs->call_stack);
-    }
+    mjs->call_stack.len -= sizeof(struct mjs_frame);
 
     mjs_append_stack_trace_line(mjs, offset);
   }
 }
 
+MJS_PRIVATE void mjs_scopes_truncate(struct mjs *mjs, size_t n) {
+  struct mjs_scope_var *vars = (struct mjs_scope_var *) mjs->scope_vars.buf;
+  size_t cnt = mjs->scope_vars.len / sizeof(*vars);
+  while (cnt > 0 && vars[cnt - 1].scope_idx >= n) cnt--;
+  mjs->scope_vars.len = cnt * sizeof(*vars);
+  mjs->scopes.len = n * sizeof(mjs_val_t);
+}
+
+MJS_PRIVATE size_t mjs_call_frames_cnt(struct mjs *mjs) {
+  return mjs->call_stack.len / sizeof(struct mjs_frame);
+}
+
+MJS_PRIVATE struct mjs_frame *mjs_call_frame(struct mjs *mjs, size_t n) {
+  size_t cnt = mjs_call_frames_cnt(mjs);
+  if (n >= cnt) return NULL;
+  return (struct mjs_frame *) mjs->call_stack.buf + cnt - 1 - n;
+}
+
 void mjs_own(struct mjs *mjs, mjs_val_t *v) {
   mbuf_append(&mjs->owned_values, &v, sizeof(v));
 }
@@ -307,10 +334,9 @@ int mjs_disown(struct mjs *mjs, mjs_val_t *v) {
  */
 MJS_PRIVATE int mjs_getretvalpos(struct mjs *mjs) {
   int pos;
-  mjs_val_t *ppos = vptr(&mjs->call_stack, -1);
-  // LOG(LL_INFO, ("ppos: %p %d", ppos, mjs_stack_size(&mjs->call_stack)));
-  assert(ppos != NULL && mjs_is_number(*ppos));
-  pos = mjs_get_int(mjs, *ppos) - 1;
+  struct mjs_frame *frame = mjs_call_frame(mjs, 0);
+  assert(frame != NULL);
+  pos = (int) frame->retval_idx - 1;
   assert(pos < (int) mjs_stack_size(&mjs->stack));
   return pos;
 }
@@ -6,6 +6,7 @@
 #ifndef MJS_CORE_H
 #define MJS_CORE_H
 
+#include "mjs_exec_public.h"
 #include "mjs_ffi.h"
 #include "mjs_gc.h"
 #include "mjs_internal.h"
@@ -36,14 +37,53 @@ enum mjs_type {
   MJS_TYPES_CNT
 };
 
-enum mjs_call_stack_frame_item {
-  CALL_STACK_FRAME_ITEM_RETVAL_STACK_IDX, /* TOS */
-  CALL_STACK_FRAME_ITEM_LOOP_ADDR_IDX,
-  CALL_STACK_FRAME_ITEM_SCOPE_IDX,
-  CALL_STACK_FRAME_ITEM_RETURN_ADDR,
-  CALL_STACK_FRAME_ITEM_THIS,
+/*
+ * Call stack frame, see `call_stack_push_frame()`. `mjs->call_stack` is an
+ * array of them.
+ */
+struct mjs_frame {
+  size_t ret_addr;    /* Global bcode offset to return to */
+  size_t scope_idx;   /* Size of `mjs->scopes` at the time of the call */
+  size_t loop_idx;    /* Loops count in `mjs->loop_addresses` at the call */
+  size_t retval_idx;  /* Data stack index right after the called function */
+  size_t stack_limit; /* `mjs->stack_limit` of the caller */
+  mjs_val_t this_obj; /* `this` of the caller */
+};
+
+/*
+ * Variable of a scope which is not materialised, see mjs_scopes_truncate().
+ * `mjs->scope_vars` is an array of them.
+ */
+struct mjs_scope_var {
+  mjs_val_t key;    /* Variable name */
+  mjs_val_t value;  /* Variable value */
+  size_t scope_idx; /* Index of the scope in `mjs->scopes` */
+};
 
-  CALL_STACK_FRAME_ITEMS_CNT
+/*
+ * Loop record pushed by OP_LOOP. `mjs->loop_addresses` is an array of them.
+ */
+struct mjs_loop {
+  size_t scope_idx; /* Size of `mjs->scopes` when the loop was entered */
+  uint32_t brk;     /* Index of the "break" target instruction in the part */
+  uint32_t cont;    /* Index of the "continue" target instruction */
+};
+
+/*
+ * State of mjs_execute() which is not kept on the stacks of `struct mjs`. It's
+ * saved into `mjs->exec_state` when the execution is suspended, and picked up
+ * from there by mjs_resume().
+ */
+struct mjs_exec_state {
+  size_t off;          /* Global bcode offset of the next instruction */
+  size_t start_off;    /* Offset at which the execution was started */
+  uint8_t prev_opcode; /* Opcode executed before the next one */
+  /* Lengths of the stacks at the start, restored in case of an error */
+  size_t stack_len;
+  size_t call_stack_len;
+  size_t arg_stack_len;
+  size_t scopes_len;
+  size_t loop_addresses_len;
 };
 
 /*
@@ -86,6 +126,54 @@ struct mjs_vals {
   mjs_val_t last_getprop_obj;
 };
 
+/*
+ * Bcode instruction with all its operands decoded, see
+ * `mjs_bcode_part_decode()`.
+ */
+struct mjs_insn {
+  uint8_t opcode;
+  /*
+   * OP_EXPR: operator token; OP_SET_ARG: number of OP_SET_ARG, starting from
+   * this one, which bind arguments at once, see mjs_bcode_part_decode()
+   */
+  uint8_t op;
+  uint32_t off; /* Offset of the instruction in the bcode part */
+  /*
+   * Jumps: index of the target instruction; OP_LOOP: index of the "break"
+   * target; opcodes with a string operand: index of the string in `consts`
+   * of the part; OP_GET_LOCAL, OP_SET_LOCAL: slot index; OP_LOCALS: number of
+   * slots
+   */
+  uint32_t a;
+  /*
+   * OP_LOOP: index of the "continue" target; OP_SET_ARG: argument number;
+   * OP_LOCALS: number of parameters; property access sites: index of the
+   * inline cache in `prop_caches` of the part; OP_JMP over a function body:
+   * number of values the function can push, see mjs_bcode_part_decode()
+   */
+  uint32_t b;
+  union {
+    int64_t i; /* OP_PUSH_INT; OP_PUSH_FUNC: global function offset */
+    double d;  /* OP_PUSH_DBL */
+  } v;
+};
+
+/*
+ * Inline cache of a property access site: the property nodes found for the
+ * last few objects (and keys, for computed ones). Entries are only valid while
+ * `epoch` equals `mjs->prop_cache_epoch`, which is advanced whenever a node can
+ * be detached from its object or reused: on property deletion and on GC.
+ */
+struct mjs_prop_cache {
+  unsigned int epoch;
+  unsigned int next; /* Entry to replace on the next miss */
+  struct {
+    mjs_val_t obj;
+    mjs_val_t key; /* MJS_UNDEFINED for the sites with a constant name */
+    struct mjs_node *node;
+  } entries[MJS_PROP_CACHE_SIZE];
+};
+
 struct mjs_bcode_part {
   /* Global index of the bcode part */
   size_t start_idx;
@@ -96,6 +184,34 @@ struct mjs_bcode_part {
     size_t len;    /* Memory chunk length */
   } data;
 
+  /*
+   * Decoded instructions, terminated with OP_EXIT. NULL until the part is
+   * executed for the first time.
+   */
+  struct mjs_insn *insns;
+  size_t insns_cnt;
+
+  /* Inline caches of the property access sites, see `struct mjs_insn` */
+  struct mjs_prop_cache *prop_caches;
+
+  /*
+   * Constant pool: string operands of the instructions, each distinct string
+   * is created once. The strings are owned, so the pool is a GC root.
+   */
+  mjs_val_t *consts;
+  size_t consts_cnt;
+
+  /*
+   * Number of values the code of the part, or any function of it, can push
+   * to the data stack; the room for them is reserved before running the part
+   */
+  size_t stack_max;
+
+#if MJS_ENABLE_JIT
+  /* Call counters and native code of the functions, see mjs_jit.h */
+  struct mjs_jit *jit;
+#endif
+
   /*
    * Result of evaluation (not parsing: if there is an error during parsing,
    * the bcode is not even committed). It is used to determine whether we
@@ -113,10 +229,16 @@ struct mjs {
   struct mbuf bcode_parts;
   size_t bcode_len;
   struct mbuf stack;
-  struct mbuf call_stack;
+  /*
+   * Length of the data stack up to which the running code can push, see
+   * exec_stack_reserve()
+   */
+  size_t stack_limit;
+  struct mbuf call_stack; /* Call frames (struct mjs_frame) */
   struct mbuf arg_stack;
   struct mbuf scopes;          /* Scope objects */
-  struct mbuf loop_addresses;  /* Addresses for breaks & continues */
+  struct mbuf scope_vars;      /* Variables of scopes (struct mjs_scope_var) */
+  struct mbuf loop_addresses;  /* Loops being executed (struct mjs_loop) */
   struct mbuf owned_strings;   /* Sequence of (varint len, char data[]) */
   struct mbuf foreign_strings; /* Sequence of (varint len, char *data) */
   struct mbuf owned_values;
@@ -127,15 +249,24 @@ struct mjs {
   enum mjs_err error;
   mjs_ffi_resolver_t *dlsym;  /* Symbol resolver function for FFI */
   ffi_cb_args_t *ffi_cb_args; /* List of FFI args descriptors */
+  mjs_trace_cb_t *trace_cb;   /* Execution trace hook, see mjs_set_trace() */
+  void *trace_user_data;
+  long exec_budget; /* Calls and loop iterations left, or -1 if unlimited */
+  struct mjs_exec_state exec_state; /* Suspended execution, see mjs_resume() */
+  int exec_depth; /* Number of nested mjs_execute() calls being run */
   size_t cur_bcode_offset;
 
   struct gc_arena object_arena;
   struct gc_arena node_arena;
   struct gc_arena ffi_sig_arena;
 
+  unsigned int prop_cache_epoch; /* See `struct mjs_prop_cache` */
+
   unsigned inhibit_gc : 1;
   unsigned need_gc : 1;
   unsigned generate_jsc : 1;
+  unsigned can_suspend : 1; /* Whether the outermost execution can suspend */
+  unsigned suspended : 1;   /* Whether `exec_state` is valid */
 };
 
 /*
@@ -149,14 +280,48 @@ enum mjs_header_items {
                                 counting the OP_BCODE_HEADER byte) */
   MJS_HDR_ITEM_MAP_OFFSET,   /* Offset to the start of offset-to-line_no mapping
                                 k*/
+  MJS_HDR_ITEM_VERSION,      /* Bcode format version, see MJS_BCODE_VERSION.
+                                Version 0 bcode does not have this item */
 
   MJS_HDR_ITEMS_CNT
 };
 
+/*
+ * Version of the bcode format generated by the parser. Bcode of all the
+ * versions up to this one can be executed.
+ *
+ * 0: initial format;
+ * 1: OP_PUSH_DBL operand is a binary double instead of a decimal string.
+ */
+#define MJS_BCODE_VERSION 1
+
 MJS_PRIVATE size_t mjs_get_func_addr(mjs_val_t v);
 
 MJS_PRIVATE int mjs_getretvalpos(struct mjs *mjs);
 
+/*
+ * Returns the number of frames in the call stack
+ */
+MJS_PRIVATE size_t mjs_call_frames_cnt(struct mjs *mjs);
+
+/*
+ * Returns the call frame `n` frames below the top one, or NULL if there's no
+ * such frame
+ */
+MJS_PRIVATE struct mjs_frame *mjs_call_frame(struct mjs *mjs, size_t n);
+
+/*
+ * Pops scopes from `mjs->scopes`, leaving `n` of them, and drops variables of
+ * the popped scopes.
+ *
+ * Scopes of blocks and function calls are pushed by OP_NEW_SCOPE as
+ * `undefined` rather than as new objects: their variables are kept in
+ * `mjs->scope_vars` instead, in the order they are created, so all variables
+ * of a scope are released at once here. Such a scope is turned into an object
+ * only when the object itself is needed, see OP_FIND_SCOPE.
+ */
+MJS_PRIVATE void mjs_scopes_truncate(struct mjs *mjs, size_t n);
+
 MJS_PRIVATE enum mjs_type mjs_get_type(mjs_val_t v);
 
 /*
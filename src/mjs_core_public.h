@@ -76,6 +76,8 @@ typedef enum mjs_err {
   MJS_FILE_READ_ERROR,
   MJS_FILE_WRITE_ERROR,
   MJS_BAD_ARGS_ERROR,
+  MJS_BUDGET_EXHAUSTED, /* See mjs_set_exec_budget() */
+  MJS_SUSPENDED,        /* See mjs_yield() */
 
   MJS_ERRS_CNT
 } mjs_err_t;
@@ -4,7 +4,6 @@
  */
 
 #include "common/cs_file.h"
-#include "common/cs_varint.h"
 
 #include "mjs_array.h"
 #include "mjs_bcode.h"
@@ -12,6 +11,7 @@
 #include "mjs_core.h"
 #include "mjs_exec.h"
 #include "mjs_internal.h"
+#include "mjs_jit.h"
 #include "mjs_object.h"
 #include "mjs_parser.h"
 #include "mjs_primitive.h"
@@ -23,80 +23,222 @@
 #include <sys/mman.h>
 #endif
 
+/*
+ * Makes room for `n` more values on the data stack. It's done when a bcode
+ * part starts running, and when a function is called, for as many values as
+ * the code can push (see `stack_max` of `struct mjs_bcode_part`), so that the
+ * interpreter pushes with exec_push() and never grows the stack itself.
+ * Returns 0 and sets an error if there's no memory for that.
+ */
+static int exec_stack_reserve(struct mjs *mjs, size_t n) {
+  struct mbuf *m = &mjs->stack;
+  size_t limit = m->len + n * sizeof(mjs_val_t);
+  if (limit > m->size) mbuf_resize(m, m->size * 2 + n * sizeof(mjs_val_t));
+  if (limit > m->size) {
+    mjs_set_errorf(mjs, MJS_OUT_OF_MEMORY, "out of memory");
+    return 0;
+  }
+  mjs->stack_limit = limit;
+  return 1;
+}
+
+/*
+ * Pushes to the data stack, the room is reserved by exec_stack_reserve().
+ * Debug builds check that the code stays within `stack_max` it was given.
+ */
+static void exec_push(struct mjs *mjs, mjs_val_t v) {
+  assert(mjs->stack.len + sizeof(v) <= mjs->stack_limit);
+  memcpy(mjs->stack.buf + mjs->stack.len, &v, sizeof(v));
+  mjs->stack.len += sizeof(v);
+}
+
+/*
+ * Pops from the data stack. Unlike pushes, pops are still checked: code like
+ * `(a) = 1` pops more than it pushes.
+ */
+static mjs_val_t exec_pop(struct mjs *mjs) {
+  mjs_val_t v;
+  if (mjs->stack.len < sizeof(v)) {
+    mjs_set_errorf(mjs, MJS_INTERNAL_ERROR, "stack underflow");
+    return MJS_UNDEFINED;
+  }
+  mjs->stack.len -= sizeof(v);
+  memcpy(&v, mjs->stack.buf + mjs->stack.len, sizeof(v));
+  return v;
+}
+
 /*
  * Pushes call stack frame. Offset is a global bcode offset. Retval_stack_idx
  * is an index in mjs->stack at which return value should be written later.
  */
 static void call_stack_push_frame(struct mjs *mjs, size_t offset,
-                                  mjs_val_t retval_stack_idx) {
-  /* Pop `this` value, and apply it */
-  mjs_val_t this_obj = mjs_pop_val(&mjs->arg_stack);
+                                  size_t retval_stack_idx) {
+  struct mbuf *m = &mjs->call_stack;
+  struct mjs_frame *frame;
 
-  /*
-   * NOTE: the layout is described by enum mjs_call_stack_frame_item
-   */
-  push_mjs_val(&mjs->call_stack, mjs->vals.this_obj);
-  mjs->vals.this_obj = this_obj;
+  /* The stack is preallocated, so it's rarely grown */
+  if (m->len + sizeof(*frame) > m->size) {
+    mbuf_resize(m, m->size * 2 + sizeof(*frame));
+  }
+  frame = (struct mjs_frame *) (m->buf + m->len);
+  m->len += sizeof(*frame);
+
+  frame->ret_addr = offset;
+  frame->scope_idx = mjs_stack_size(&mjs->scopes);
+  frame->loop_idx = mjs->loop_addresses.len / sizeof(struct mjs_loop);
+  frame->retval_idx = retval_stack_idx;
+  frame->stack_limit = mjs->stack_limit;
 
-  push_mjs_val(&mjs->call_stack, mjs_mk_number(mjs, (double) offset));
-  push_mjs_val(&mjs->call_stack,
-               mjs_mk_number(mjs, (double) mjs_stack_size(&mjs->scopes)));
-  push_mjs_val(
-      &mjs->call_stack,
-      mjs_mk_number(mjs, (double) mjs_stack_size(&mjs->loop_addresses)));
-  push_mjs_val(&mjs->call_stack, retval_stack_idx);
+  /* Pop `this` value, and apply it */
+  frame->this_obj = mjs->vals.this_obj;
+  mjs->vals.this_obj = mjs_pop_val(&mjs->arg_stack);
 }
 
 /*
  * Restores call stack frame. Returns the return address.
  */
 static size_t call_stack_restore_frame(struct mjs *mjs) {
-  size_t retval_stack_idx, return_address, scope_index, loop_addr_index;
-  assert(mjs_stack_size(&mjs->call_stack) >= CALL_STACK_FRAME_ITEMS_CNT);
+  struct mjs_frame *frame = mjs_call_frame(mjs, 0);
+  assert(frame != NULL);
+  mjs->call_stack.len -= sizeof(*frame);
 
-  /*
-   * NOTE: the layout is described by enum mjs_call_stack_frame_item
-   */
-  retval_stack_idx = mjs_get_int(mjs, mjs_pop_val(&mjs->call_stack));
-  loop_addr_index = mjs_get_int(mjs, mjs_pop_val(&mjs->call_stack));
-  scope_index = mjs_get_int(mjs, mjs_pop_val(&mjs->call_stack));
-  return_address = mjs_get_int(mjs, mjs_pop_val(&mjs->call_stack));
-  mjs->vals.this_obj = mjs_pop_val(&mjs->call_stack);
-
-  /* Remove created scopes */
-  while (mjs_stack_size(&mjs->scopes) > scope_index) {
-    mjs_pop_val(&mjs->scopes);
+  mjs->vals.this_obj = frame->this_obj;
+
+  /* Remove created scopes, along with their variables */
+  if (mjs_stack_size(&mjs->scopes) > frame->scope_idx) {
+    mjs_scopes_truncate(mjs, frame->scope_idx);
   }
 
-  /* Remove loop addresses */
-  while (mjs_stack_size(&mjs->loop_addresses) > loop_addr_index) {
-    mjs_pop_val(&mjs->loop_addresses);
+  /* Remove loop records */
+  if (mjs->loop_addresses.len > frame->loop_idx * sizeof(struct mjs_loop)) {
+    mjs->loop_addresses.len = frame->loop_idx * sizeof(struct mjs_loop);
   }
 
   /* Shrink stack, leave return value on top */
-  mjs->stack.len = retval_stack_idx * sizeof(mjs_val_t);
+  mjs->stack.len = frame->retval_idx * sizeof(mjs_val_t);
+  mjs->stack_limit = frame->stack_limit;
 
   /* Jump to the return address */
-  return return_address;
+  return frame->ret_addr;
 }
 
-static mjs_val_t mjs_find_scope(struct mjs *mjs, mjs_val_t key) {
-  size_t num_scopes = mjs_stack_size(&mjs->scopes);
-  while (num_scopes > 0) {
-    mjs_val_t scope = *vptr(&mjs->scopes, num_scopes - 1);
-    num_scopes--;
-    if (mjs_get_own_node_v(mjs, scope, key) != NULL) return scope;
+/*
+ * Returns whether the two variable names are equal. Names are interned per
+ * bcode part, so they are usually equal as values as well.
+ */
+static int scope_key_eq(struct mjs *mjs, mjs_val_t a, mjs_val_t b) {
+  const char *sa, *sb;
+  size_t na, nb;
+  if (a == b) return 1;
+  sa = mjs_get_string(mjs, &a, &na);
+  sb = mjs_get_string(mjs, &b, &nb);
+  return sa != NULL && sb != NULL && na == nb && memcmp(sa, sb, na) == 0;
+}
+
+/*
+ * Looks up the variable in the scopes, from the innermost one, see
+ * mjs_scopes_truncate(). Returns the index of the scope plus one, or 0 (and
+ * sets the error) if there is no such variable. If the scope is not
+ * materialised, `*var` is set to the variable, otherwise to NULL.
+ */
+static size_t scope_find(struct mjs *mjs, mjs_val_t key,
+                         struct mjs_scope_var **var) {
+  struct mjs_scope_var *vars = (struct mjs_scope_var *) mjs->scope_vars.buf;
+  size_t n = mjs->scope_vars.len / sizeof(*vars);
+  size_t k = mjs_stack_size(&mjs->scopes);
+  *var = NULL;
+  while (k-- > 0) {
+    mjs_val_t scope = *vptr(&mjs->scopes, k);
+    /* Skip variables of the scopes above, which were materialised */
+    while (n > 0 && vars[n - 1].scope_idx > k) n--;
+    if (scope == MJS_UNDEFINED) {
+      for (; n > 0 && vars[n - 1].scope_idx == k; n--) {
+        if (scope_key_eq(mjs, vars[n - 1].key, key)) {
+          *var = &vars[n - 1];
+          return k + 1;
+        }
+      }
+    } else if (mjs_get_own_node_v(mjs, scope, key) != NULL) {
+      return k + 1;
+    }
   }
   mjs_set_errorf(mjs, MJS_REFERENCE_ERROR, "[%s] is not defined",
                  mjs_get_cstring(mjs, &key));
-  return MJS_UNDEFINED;
+  return 0;
+}
+
+/* Turns the scope `k` into an object, if it's not done yet, and returns it */
+static mjs_val_t scope_materialise(struct mjs *mjs, size_t k) {
+  mjs_val_t obj = *vptr(&mjs->scopes, k);
+  if (obj == MJS_UNDEFINED) {
+    struct mjs_scope_var *vars = (struct mjs_scope_var *) mjs->scope_vars.buf;
+    size_t i, n = mjs->scope_vars.len / sizeof(*vars);
+    obj = mjs_mk_object(mjs);
+    for (i = 0; i < n; i++) {
+      if (vars[i].scope_idx == k) {
+        mjs_set_v(mjs, obj, vars[i].key, vars[i].value);
+      }
+    }
+    /* Variables of the scope are left in place, and skipped by scope_find() */
+    *vptr(&mjs->scopes, k) = obj;
+  }
+  return obj;
+}
+
+/*
+ * Returns the variable of the innermost scope, creating it with `undefined`
+ * value if there's none. Returns NULL if the scope is materialised.
+ */
+static struct mjs_scope_var *scope_var_declare(struct mjs *mjs,
+                                               mjs_val_t key) {
+  struct mjs_scope_var *vars = (struct mjs_scope_var *) mjs->scope_vars.buf;
+  size_t n = mjs->scope_vars.len / sizeof(*vars);
+  size_t k = mjs_stack_size(&mjs->scopes) - 1;
+  struct mjs_scope_var v;
+  if (vtop(&mjs->scopes) != MJS_UNDEFINED) return NULL;
+  for (; n > 0 && vars[n - 1].scope_idx == k; n--) {
+    if (scope_key_eq(mjs, vars[n - 1].key, key)) return &vars[n - 1];
+  }
+  v.key = key;
+  v.value = MJS_UNDEFINED;
+  v.scope_idx = k;
+  mbuf_append(&mjs->scope_vars, &v, sizeof(v));
+  return (struct mjs_scope_var *) (mjs->scope_vars.buf + mjs->scope_vars.len) -
+         1;
+}
+
+/* Returns the scope object which has the variable, see scope_find() */
+static mjs_val_t mjs_find_scope(struct mjs *mjs, mjs_val_t key) {
+  struct mjs_scope_var *var;
+  size_t k = scope_find(mjs, key, &var);
+  return k == 0 ? MJS_UNDEFINED : scope_materialise(mjs, k - 1);
+}
+
+/* Sets the value of an existing variable */
+static void scope_set(struct mjs *mjs, mjs_val_t key, mjs_val_t val) {
+  struct mjs_scope_var *var;
+  size_t k = scope_find(mjs, key, &var);
+  if (var != NULL) {
+    var->value = val;
+  } else if (k != 0) {
+    mjs_set_v(mjs, *vptr(&mjs->scopes, k - 1), key, val);
+  }
 }
 
 mjs_val_t mjs_get_this(struct mjs *mjs) {
   return mjs->vals.this_obj;
 }
 
-static double do_arith_op(double da, double db, int op, bool *resnan) {
+void mjs_set_trace(struct mjs *mjs, mjs_trace_cb_t *cb, void *user_data) {
+  mjs->trace_cb = cb;
+  mjs->trace_user_data = user_data;
+}
+
+void mjs_set_exec_budget(struct mjs *mjs, long budget) {
+  mjs->exec_budget = budget < 0 ? -1 : budget;
+}
+
+MJS_PRIVATE double do_arith_op(double da, double db, int op, bool *resnan) {
   *resnan = false;
 
   if (isnan(da) || isnan(db)) {
@@ -204,30 +346,32 @@ static mjs_val_t do_op(struct mjs *mjs, mjs_val_t a, mjs_val_t b, int op) {
 }
 
 static void op_assign(struct mjs *mjs, int op) {
-  mjs_val_t val = mjs_pop(mjs);
-  mjs_val_t obj = mjs_pop(mjs);
-  mjs_val_t key = mjs_pop(mjs);
+  mjs_val_t val = exec_pop(mjs);
+  mjs_val_t obj = exec_pop(mjs);
+  mjs_val_t key = exec_pop(mjs);
   if (mjs_is_object(obj) && mjs_is_string(key)) {
     mjs_val_t v = mjs_get_v(mjs, obj, key);
     mjs_set_v(mjs, obj, key, do_op(mjs, v, val, op));
-    mjs_push(mjs, v);
+    exec_push(mjs, v);
   } else {
     mjs_set_errorf(mjs, MJS_TYPE_ERROR, "invalid operand");
   }
 }
 
+/*
+ * Strict equality of numbers `a` and `b`, whose values are `va` and `vb`: NaN
+ * is not equal to itself, and 0 is not -0
+ */
+static int num_strict_eq(double a, double b, mjs_val_t va, mjs_val_t vb) {
+  return a == b && va == vb;
+}
+
 static int check_equal(struct mjs *mjs, mjs_val_t a, mjs_val_t b) {
   int ret = 0;
-  if (a == MJS_TAG_NAN && b == MJS_TAG_NAN) {
-    ret = 0;
+  if (mjs_is_number(a) && mjs_is_number(b)) {
+    ret = num_strict_eq(mjs_get_double(mjs, a), mjs_get_double(mjs, b), a, b);
   } else if (a == b) {
     ret = 1;
-  } else if (mjs_is_number(a) && mjs_is_number(b)) {
-    /*
-     * The case of equal numbers is handled above, so here the result is always
-     * false
-     */
-    ret = 0;
   } else if (mjs_is_string(a) && mjs_is_string(b)) {
     ret = s_cmp(mjs, a, b) == 0;
   } else if (mjs_is_foreign(a) && b == MJS_NULL) {
@@ -240,6 +384,41 @@ static int check_equal(struct mjs *mjs, mjs_val_t a, mjs_val_t b) {
   return ret;
 }
 
+/*
+ * Sets `obj[key]`, returns the value which the assignment evaluates to. Used
+ * by TOK_ASSIGN and its superinstructions.
+ */
+static mjs_val_t exec_setprop(struct mjs *mjs, mjs_val_t obj, mjs_val_t key,
+                              mjs_val_t val) {
+  if (mjs_is_object(obj)) {
+    mjs_set_v(mjs, obj, key, val);
+  } else if (mjs_is_foreign(obj)) {
+    /*
+     * We don't have setters, so in order to support properties which behave
+     * like setters, we have to parse key right here, instead of having real
+     * built-in prototype objects
+     */
+
+    int ikey = mjs_get_int(mjs, key);
+    int ival = mjs_get_int(mjs, val);
+
+    if (!mjs_is_number(key)) {
+      mjs_prepend_errorf(mjs, MJS_TYPE_ERROR, "index must be a number");
+      val = MJS_UNDEFINED;
+    } else if (!mjs_is_number(val) || ival < 0 || ival > 0xff) {
+      mjs_prepend_errorf(mjs, MJS_TYPE_ERROR,
+                         "only number 0 .. 255 can be assigned");
+      val = MJS_UNDEFINED;
+    } else {
+      uint8_t *ptr = (uint8_t *) mjs_get_ptr(mjs, obj);
+      *(ptr + ikey) = (uint8_t) ival;
+    }
+  } else {
+    mjs_prepend_errorf(mjs, MJS_TYPE_ERROR, "unsupported object type");
+  }
+  return val;
+}
+
 static void exec_expr(struct mjs *mjs, int op) {
   switch (op) {
     case TOK_DOT:
@@ -255,24 +434,24 @@ static void exec_expr(struct mjs *mjs, int op) {
     case TOK_LSHIFT:
     case TOK_RSHIFT:
     case TOK_URSHIFT: {
-      mjs_val_t b = mjs_pop(mjs);
-      mjs_val_t a = mjs_pop(mjs);
-      mjs_push(mjs, do_op(mjs, a, b, op));
+      mjs_val_t b = exec_pop(mjs);
+      mjs_val_t a = exec_pop(mjs);
+      exec_push(mjs, do_op(mjs, a, b, op));
       break;
     }
     case TOK_UNARY_MINUS: {
-      double a = mjs_get_double(mjs, mjs_pop(mjs));
-      mjs_push(mjs, mjs_mk_number(mjs, -a));
+      double a = mjs_get_double(mjs, exec_pop(mjs));
+      exec_push(mjs, mjs_mk_number(mjs, -a));
       break;
     }
     case TOK_NOT: {
-      mjs_val_t val = mjs_pop(mjs);
-      mjs_push(mjs, mjs_mk_boolean(mjs, !mjs_is_truthy(mjs, val)));
+      mjs_val_t val = exec_pop(mjs);
+      exec_push(mjs, mjs_mk_boolean(mjs, !mjs_is_truthy(mjs, val)));
       break;
     }
     case TOK_TILDA: {
-      double a = mjs_get_double(mjs, mjs_pop(mjs));
-      mjs_push(mjs, mjs_mk_number(mjs, (double) (~(int64_t) a)));
+      double a = mjs_get_double(mjs, exec_pop(mjs));
+      exec_push(mjs, mjs_mk_number(mjs, (double) (~(int64_t) a)));
       break;
     }
     case TOK_UNARY_PLUS:
@@ -284,121 +463,95 @@ static void exec_expr(struct mjs *mjs, int op) {
       mjs_set_errorf(mjs, MJS_NOT_IMPLEMENTED_ERROR, "Use !==, not !=");
       break;
     case TOK_EQ_EQ: {
-      mjs_val_t a = mjs_pop(mjs);
-      mjs_val_t b = mjs_pop(mjs);
-      mjs_push(mjs, mjs_mk_boolean(mjs, check_equal(mjs, a, b)));
+      mjs_val_t a = exec_pop(mjs);
+      mjs_val_t b = exec_pop(mjs);
+      exec_push(mjs, mjs_mk_boolean(mjs, check_equal(mjs, a, b)));
       break;
     }
     case TOK_NE_NE: {
-      mjs_val_t a = mjs_pop(mjs);
-      mjs_val_t b = mjs_pop(mjs);
-      mjs_push(mjs, mjs_mk_boolean(mjs, !check_equal(mjs, a, b)));
+      mjs_val_t a = exec_pop(mjs);
+      mjs_val_t b = exec_pop(mjs);
+      exec_push(mjs, mjs_mk_boolean(mjs, !check_equal(mjs, a, b)));
       break;
     }
     case TOK_LT: {
-      double b = mjs_get_double(mjs, mjs_pop(mjs));
-      double a = mjs_get_double(mjs, mjs_pop(mjs));
-      mjs_push(mjs, mjs_mk_boolean(mjs, a < b));
+      double b = mjs_get_double(mjs, exec_pop(mjs));
+      double a = mjs_get_double(mjs, exec_pop(mjs));
+      exec_push(mjs, mjs_mk_boolean(mjs, a < b));
       break;
     }
     case TOK_GT: {
-      double b = mjs_get_double(mjs, mjs_pop(mjs));
-      double a = mjs_get_double(mjs, mjs_pop(mjs));
-      mjs_push(mjs, mjs_mk_boolean(mjs, a > b));
+      double b = mjs_get_double(mjs, exec_pop(mjs));
+      double a = mjs_get_double(mjs, exec_pop(mjs));
+      exec_push(mjs, mjs_mk_boolean(mjs, a > b));
       break;
     }
     case TOK_LE: {
-      double b = mjs_get_double(mjs, mjs_pop(mjs));
-      double a = mjs_get_double(mjs, mjs_pop(mjs));
-      mjs_push(mjs, mjs_mk_boolean(mjs, a <= b));
+      double b = mjs_get_double(mjs, exec_pop(mjs));
+      double a = mjs_get_double(mjs, exec_pop(mjs));
+      exec_push(mjs, mjs_mk_boolean(mjs, a <= b));
       break;
     }
     case TOK_GE: {
-      double b = mjs_get_double(mjs, mjs_pop(mjs));
-      double a = mjs_get_double(mjs, mjs_pop(mjs));
-      mjs_push(mjs, mjs_mk_boolean(mjs, a >= b));
+      double b = mjs_get_double(mjs, exec_pop(mjs));
+      double a = mjs_get_double(mjs, exec_pop(mjs));
+      exec_push(mjs, mjs_mk_boolean(mjs, a >= b));
       break;
     }
     case TOK_ASSIGN: {
-      mjs_val_t val = mjs_pop(mjs);
-      mjs_val_t obj = mjs_pop(mjs);
-      mjs_val_t key = mjs_pop(mjs);
-      if (mjs_is_object(obj)) {
-        mjs_set_v(mjs, obj, key, val);
-      } else if (mjs_is_foreign(obj)) {
-        /*
-         * We don't have setters, so in order to support properties which behave
-         * like setters, we have to parse key right here, instead of having real
-         * built-in prototype objects
-         */
-
-        int ikey = mjs_get_int(mjs, key);
-        int ival = mjs_get_int(mjs, val);
-
-        if (!mjs_is_number(key)) {
-          mjs_prepend_errorf(mjs, MJS_TYPE_ERROR, "index must be a number");
-          val = MJS_UNDEFINED;
-        } else if (!mjs_is_number(val) || ival < 0 || ival > 0xff) {
-          mjs_prepend_errorf(mjs, MJS_TYPE_ERROR,
-                             "only number 0 .. 255 can be assigned");
-          val = MJS_UNDEFINED;
-        } else {
-          uint8_t *ptr = (uint8_t *) mjs_get_ptr(mjs, obj);
-          *(ptr + ikey) = (uint8_t) ival;
-        }
-      } else {
-        mjs_prepend_errorf(mjs, MJS_TYPE_ERROR, "unsupported object type");
-      }
-      mjs_push(mjs, val);
+      mjs_val_t val = exec_pop(mjs);
+      mjs_val_t obj = exec_pop(mjs);
+      mjs_val_t key = exec_pop(mjs);
+      exec_push(mjs, exec_setprop(mjs, obj, key, val));
       break;
     }
     case TOK_POSTFIX_PLUS: {
-      mjs_val_t obj = mjs_pop(mjs);
-      mjs_val_t key = mjs_pop(mjs);
+      mjs_val_t obj = exec_pop(mjs);
+      mjs_val_t key = exec_pop(mjs);
       if (mjs_is_object(obj) && mjs_is_string(key)) {
         mjs_val_t v = mjs_get_v(mjs, obj, key);
         mjs_val_t v1 = do_op(mjs, v, mjs_mk_number(mjs, 1), TOK_PLUS);
         mjs_set_v(mjs, obj, key, v1);
-        mjs_push(mjs, v);
+        exec_push(mjs, v);
       } else {
         mjs_set_errorf(mjs, MJS_TYPE_ERROR, "invalid operand for ++");
       }
       break;
     }
     case TOK_POSTFIX_MINUS: {
-      mjs_val_t obj = mjs_pop(mjs);
-      mjs_val_t key = mjs_pop(mjs);
+      mjs_val_t obj = exec_pop(mjs);
+      mjs_val_t key = exec_pop(mjs);
       if (mjs_is_object(obj) && mjs_is_string(key)) {
         mjs_val_t v = mjs_get_v(mjs, obj, key);
         mjs_val_t v1 = do_op(mjs, v, mjs_mk_number(mjs, 1), TOK_MINUS);
         mjs_set_v(mjs, obj, key, v1);
-        mjs_push(mjs, v);
+        exec_push(mjs, v);
       } else {
         mjs_set_errorf(mjs, MJS_TYPE_ERROR, "invalid operand for --");
       }
       break;
     }
     case TOK_MINUS_MINUS: {
-      mjs_val_t obj = mjs_pop(mjs);
-      mjs_val_t key = mjs_pop(mjs);
+      mjs_val_t obj = exec_pop(mjs);
+      mjs_val_t key = exec_pop(mjs);
       if (mjs_is_object(obj) && mjs_is_string(key)) {
         mjs_val_t v = mjs_get_v(mjs, obj, key);
         v = do_op(mjs, v, mjs_mk_number(mjs, 1), TOK_MINUS);
         mjs_set_v(mjs, obj, key, v);
-        mjs_push(mjs, v);
+        exec_push(mjs, v);
       } else {
         mjs_set_errorf(mjs, MJS_TYPE_ERROR, "invalid operand for --");
       }
       break;
     }
     case TOK_PLUS_PLUS: {
-      mjs_val_t obj = mjs_pop(mjs);
-      mjs_val_t key = mjs_pop(mjs);
+      mjs_val_t obj = exec_pop(mjs);
+      mjs_val_t key = exec_pop(mjs);
       if (mjs_is_object(obj) && mjs_is_string(key)) {
         mjs_val_t v = mjs_get_v(mjs, obj, key);
         v = do_op(mjs, v, mjs_mk_number(mjs, 1), TOK_PLUS);
         mjs_set_v(mjs, obj, key, v);
-        mjs_push(mjs, v);
+        exec_push(mjs, v);
       } else {
         mjs_set_errorf(mjs, MJS_TYPE_ERROR, "invalid operand for ++");
       }
@@ -425,7 +578,7 @@ static void exec_expr(struct mjs *mjs, int op) {
     case TOK_COMMA: break;
     /* clang-format on */
     case TOK_KEYWORD_TYPEOF:
-      mjs_push(mjs, mjs_mk_string(mjs, mjs_typeof(mjs_pop(mjs)), ~0, 1));
+      exec_push(mjs, mjs_mk_string(mjs, mjs_typeof(exec_pop(mjs)), ~0, 1));
       break;
     default:
       LOG(LL_ERROR, ("Unknown expr: %d", op));
@@ -433,66 +586,41 @@ static void exec_expr(struct mjs *mjs, int op) {
   }
 }
 
-static int getprop_builtin_string(struct mjs *mjs, mjs_val_t val,
-                                  const char *name, size_t name_len,
-                                  mjs_val_t *res) {
-  int isnum = 0;
-  int idx = cstr_to_ulong(name, name_len, &isnum);
-
-  if (strcmp(name, "length") == 0) {
-    size_t val_len;
-    mjs_get_string(mjs, &val, &val_len);
-    *res = mjs_mk_number(mjs, (double) val_len);
-    return 1;
-  } else if (strcmp(name, "at") == 0 || strcmp(name, "charCodeAt") == 0) {
-    *res = mjs_mk_foreign_func(mjs, (mjs_func_ptr_t) mjs_string_char_code_at);
-    return 1;
-  } else if (strcmp(name, "indexOf") == 0) {
-    *res = mjs_mk_foreign_func(mjs, (mjs_func_ptr_t) mjs_string_index_of);
-    return 1;
-  } else if (strcmp(name, "slice") == 0) {
-    *res = mjs_mk_foreign_func(mjs, (mjs_func_ptr_t) mjs_string_slice);
-    return 1;
-  } else if (isnum) {
-    /*
-     * string subscript: return a new one-byte string if the index
-     * is not out of bounds
-     */
-    size_t val_len;
-    const char *str = mjs_get_string(mjs, &val, &val_len);
-    if (idx >= 0 && idx < (int) val_len) {
-      *res = mjs_mk_string(mjs, str + idx, 1, 1);
-    } else {
-      *res = MJS_UNDEFINED;
+/*
+ * Returns the property name as an index, and sets `*isnum` if it's one: the
+ * same as cstr_to_ulong() of the name converted to string gives. Strings and
+ * integer numbers are not converted, so it doesn't allocate.
+ */
+static int getprop_index(struct mjs *mjs, mjs_val_t name, int *isnum) {
+  int idx = 0;
+  *isnum = 0;
+  if (mjs_is_string(name)) {
+    size_t n;
+    const char *s = mjs_get_string(mjs, &name, &n);
+    idx = cstr_to_ulong(s, n, isnum);
+  } else if (mjs_is_number(name) &&
+             fabs(mjs_get_double(mjs, name)) <= INT_MAX) {
+    double d = mjs_get_double(mjs, name);
+    if (d == (int) d) {
+      idx = (int) d;
+      *isnum = 1;
     }
-    return 1;
-  }
-  return 0;
-}
-
-static int getprop_builtin_array(struct mjs *mjs, mjs_val_t val,
-                                 const char *name, size_t name_len,
-                                 mjs_val_t *res) {
-  if (strcmp(name, "splice") == 0) {
-    *res = mjs_mk_foreign_func(mjs, (mjs_func_ptr_t) mjs_array_splice);
-    return 1;
-  } else if (strcmp(name, "push") == 0) {
-    *res = mjs_mk_foreign_func(mjs, (mjs_func_ptr_t) mjs_array_push_internal);
-    return 1;
-  } else if (strcmp(name, "length") == 0) {
-    *res = mjs_mk_number(mjs, mjs_array_length(mjs, val));
-    return 1;
+  } else {
+    size_t n;
+    char *s = NULL;
+    int need_free = 0;
+    if (mjs_to_string(mjs, &name, &s, &n, &need_free) == MJS_OK) {
+      idx = cstr_to_ulong(s, n, isnum);
+    }
+    if (need_free) free(s);
   }
-
-  (void) name_len;
-  return 0;
+  return idx;
 }
 
 static int getprop_builtin_foreign(struct mjs *mjs, mjs_val_t val,
-                                   const char *name, size_t name_len,
-                                   mjs_val_t *res) {
+                                   mjs_val_t name, mjs_val_t *res) {
   int isnum = 0;
-  int idx = cstr_to_ulong(name, name_len, &isnum);
+  int idx = getprop_index(mjs, name, &isnum);
 
   if (!isnum) {
     mjs_prepend_errorf(mjs, MJS_TYPE_ERROR, "index must be a number");
@@ -517,235 +645,899 @@ static void mjs_apply_(struct mjs *mjs) {
   mjs_return(mjs, res);
 }
 
+/* Receivers of a builtin property, see `struct getprop_method` */
+#define GETPROP_STRING 0x01 /* Strings */
+#define GETPROP_ARRAY 0x02  /* Arrays */
+#define GETPROP_OTHER 0x04  /* Everything else which is not a string */
+
+/* Builtin property which is the same for all values of its receiver types */
+struct getprop_method {
+  const char *name;
+  uint8_t len;
+  uint8_t recv;      /* Mask of GETPROP_* */
+  mjs_func_ptr_t fn; /* Method, or NULL for `length` */
+};
+
+/*
+ * Hash of a property name, which is perfect for the names in
+ * `getprop_methods`: every one of them gets its own entry, so the lookup is a
+ * single probe and a memcmp(). When adding a name, make sure it lands in a
+ * free entry.
+ */
+#define GETPROP_HASH(s, n) \
+  (((n) + (uint8_t)(s)[0] + (uint8_t)(s)[(n) - 1]) & 15)
+
+static const struct getprop_method getprop_methods[16] = {
+    [1] = {"charCodeAt", 10, GETPROP_STRING,
+           (mjs_func_ptr_t) mjs_string_char_code_at},
+    [6] = {"indexOf", 7, GETPROP_STRING, (mjs_func_ptr_t) mjs_string_index_of},
+    [7] = {"at", 2, GETPROP_STRING, (mjs_func_ptr_t) mjs_string_char_code_at},
+    [10] = {"length", 6, GETPROP_STRING | GETPROP_ARRAY, NULL},
+    [12] = {"push", 4, GETPROP_ARRAY, (mjs_func_ptr_t) mjs_array_push_internal},
+    [13] = {"slice", 5, GETPROP_STRING, (mjs_func_ptr_t) mjs_string_slice},
+    [14] = {"splice", 6, GETPROP_ARRAY, (mjs_func_ptr_t) mjs_array_splice},
+    [15] = {"apply", 5, GETPROP_ARRAY | GETPROP_OTHER,
+            (mjs_func_ptr_t) mjs_apply_},
+};
+
+/*
+ * Returns the builtin property named `name` of values of the receiver type
+ * `recv`, or NULL if there's no such property.
+ */
+static const struct getprop_method *getprop_method_find(struct mjs *mjs,
+                                                        mjs_val_t name,
+                                                        int recv) {
+  const struct getprop_method *m;
+  size_t n;
+  const char *s = mjs_get_string(mjs, &name, &n);
+  if (n < 2) return NULL;
+  m = &getprop_methods[GETPROP_HASH(s, n)];
+  if (!(m->recv & recv) || m->len != n || memcmp(m->name, s, n) != 0) {
+    return NULL;
+  }
+  return m;
+}
+
+/* Returns value of the builtin property `m` of `val` */
+static mjs_val_t getprop_method_value(struct mjs *mjs,
+                                      const struct getprop_method *m,
+                                      mjs_val_t val) {
+  size_t len;
+  if (m->fn != NULL) return mjs_mk_foreign_func(mjs, m->fn);
+  if (mjs_is_string(val)) {
+    mjs_get_string(mjs, &val, &len);
+  } else {
+    len = mjs_array_length(mjs, val);
+  }
+  return mjs_mk_number(mjs, (double) len);
+}
+
+static int getprop_builtin_string(struct mjs *mjs, mjs_val_t val,
+                                  mjs_val_t name, mjs_val_t *res) {
+  const struct getprop_method *m;
+  int isnum = 0, idx;
+
+  if (mjs_is_string(name) &&
+      (m = getprop_method_find(mjs, name, GETPROP_STRING)) != NULL) {
+    *res = getprop_method_value(mjs, m, val);
+    return 1;
+  }
+
+  idx = getprop_index(mjs, name, &isnum);
+  if (isnum) {
+    /*
+     * string subscript: return a new one-byte string if the index
+     * is not out of bounds
+     */
+    size_t val_len;
+    const char *str = mjs_get_string(mjs, &val, &val_len);
+    if (idx >= 0 && idx < (int) val_len) {
+      *res = mjs_mk_string(mjs, str + idx, 1, 1);
+    } else {
+      *res = MJS_UNDEFINED;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Looks up builtin properties of the value. Strings and foreign pointers have
+ * their own builtin properties; every other value has `apply`, and arrays
+ * also have a few methods. All of these have string names, and are found by
+ * a single probe of `getprop_methods`, so for an ordinary object, or a name
+ * which is not a string, this is just a couple of checks.
+ */
 static int getprop_builtin(struct mjs *mjs, mjs_val_t val, mjs_val_t name,
                            mjs_val_t *res) {
+  const struct getprop_method *m;
+
+  if (mjs_is_string(val)) {
+    return getprop_builtin_string(mjs, val, name, res);
+  } else if (mjs_is_foreign(val) && !mjs_is_string(name)) {
+    return getprop_builtin_foreign(mjs, val, name, res);
+  } else if (!mjs_is_string(name)) {
+    return 0;
+  }
+
+  m = getprop_method_find(mjs, name,
+                          mjs_is_array(val) ? GETPROP_ARRAY : GETPROP_OTHER);
+  if (m != NULL) {
+    *res = getprop_method_value(mjs, m, val);
+    return 1;
+  } else if (mjs_is_foreign(val)) {
+    return getprop_builtin_foreign(mjs, val, name, res);
+  }
+  return 0;
+}
+
+/*
+ * Interpreter dispatch. With MJS_ENABLE_COMPUTED_GOTO, each opcode handler
+ * is a label, and every handler ends with its own copy of the dispatch code
+ * (MJS_NEXT_OP()) which jumps straight to the handler of the next opcode. This
+ * gives the CPU one indirect branch per handler to predict, instead of a
+ * single shared one. Without it, handlers are just cases of a `switch`.
+ *
+ * The trace hook (see mjs_set_trace()) is not checked by the dispatch code at
+ * all. With computed goto, if it's installed, mjs_execute() dispatches through
+ * `trace_table` instead, which sends every opcode to `op_trace` first. The
+ * `switch` is on the opcode ORed with `trace_flag` instead, which is either 0
+ * or MJS_TRACE_FLAG, so that every opcode goes to the default case first.
+ */
+#define MJS_EXEC_TRACE()                                       \
+  mjs->trace_cb(mjs, (const uint8_t *) bp.data.p, code[i].off, \
+                mjs->trace_user_data)
+
+#if MJS_ENABLE_COMPUTED_GOTO
+#define MJS_OP(op) op_##op
+#define MJS_OP_DEFAULT op_default
+#define MJS_DISPATCH(opcode)                                   \
+  if ((opcode) >= OP_MAX) goto op_default;                     \
+  goto *dispatch[opcode];
+#define MJS_NEXT_OP()                                          \
+  do {                                                         \
+    if (mjs->error != MJS_OK) goto op_error;                   \
+    if (++i >= bp.insns_cnt) goto clean;                       \
+    prev_opcode = opcode;                                      \
+    opcode = code[i].opcode;                                   \
+    MJS_DISPATCH(opcode);                                      \
+  } while (0)
+#else
+#define MJS_OP(op) case op
+#define MJS_OP_DEFAULT default
+#define MJS_TRACE_FLAG 0x100
+#define MJS_DISPATCH(opcode)                                   \
+  sel = (opcode) | trace_flag;                                 \
+  op_dispatch:                                                 \
+  switch (sel)
+#define MJS_NEXT_OP() break
+#endif
+
+/*
+ * Handler of a binary operator which has its own opcode. If both operands are
+ * numbers `a` and `b`, and `cond` holds, the result is `res`, computed right
+ * here; otherwise the operator `tok` is executed by exec_expr().
+ */
+#define MJS_OP_NUM_BINOP(op, tok, cond, res)                              \
+  MJS_OP(op) : {                                                          \
+    mjs_val_t *sp = (mjs_val_t *) (mjs->stack.buf + mjs->stack.len);     \
+    if (mjs->stack.len >= 2 * sizeof(mjs_val_t) && mjs_is_number(sp[-2]) && \
+        mjs_is_number(sp[-1])) {                                          \
+      double a = mjs_get_double(mjs, sp[-2]);                             \
+      double b = mjs_get_double(mjs, sp[-1]);                             \
+      if (cond) {                                                         \
+        sp[-2] = (res);                                                   \
+        mjs->stack.len -= sizeof(mjs_val_t);                              \
+        MJS_NEXT_OP();                                                    \
+      }                                                                   \
+    }                                                                     \
+    exec_expr(mjs, tok);                                                  \
+    MJS_NEXT_OP();                                                        \
+  }
+
+/*
+ * Handler of a comparison fused with OP_JMP_FALSE. Like MJS_OP_NUM_BINOP(),
+ * if both operands are numbers `a` and `b`, the comparison is `cond`;
+ * otherwise the operator `tok` is executed by exec_expr().
+ */
+#define MJS_OP_JMP_FALSE_CMP(op, tok, cond)                               \
+  MJS_OP(op) : {                                                          \
+    mjs_val_t *sp = (mjs_val_t *) (mjs->stack.buf + mjs->stack.len);     \
+    int t;                                                                \
+    if (mjs->stack.len >= 2 * sizeof(mjs_val_t) && mjs_is_number(sp[-2]) && \
+        mjs_is_number(sp[-1])) {                                          \
+      double a = mjs_get_double(mjs, sp[-2]);                             \
+      double b = mjs_get_double(mjs, sp[-1]);                             \
+      t = (cond);                                                         \
+      mjs->stack.len -= 2 * sizeof(mjs_val_t);                            \
+    } else {                                                              \
+      exec_expr(mjs, tok);                                                \
+      t = mjs_is_truthy(mjs, exec_pop(mjs));                              \
+    }                                                                     \
+    if (!t) {                                                             \
+      exec_push(mjs, MJS_UNDEFINED);                                      \
+      i = code[i].a - 1;                                                  \
+    }                                                                     \
+    MJS_NEXT_OP();                                                        \
+  }
+
+/*
+ * Returns `obj[key]`, taking built-in properties into account. Used by OP_GET
+ * and its superinstructions.
+ */
+static mjs_val_t exec_getprop(struct mjs *mjs, mjs_val_t obj, mjs_val_t key) {
+  mjs_val_t val = MJS_UNDEFINED;
+  if (!getprop_builtin(mjs, obj, key, &val)) {
+    if (mjs_is_object(obj)) {
+      val = mjs_get_v_proto(mjs, obj, key);
+    } else {
+      mjs_prepend_errorf(mjs, MJS_TYPE_ERROR, "type error");
+    }
+  }
+  return val;
+}
+
+/*
+ * Returns the node of `obj[key]` remembered by the inline cache, or NULL. Only
+ * plain objects are cached: for arrays and other values, getprop_builtin()
+ * has to be consulted.
+ */
+static struct mjs_node *exec_prop_cache_get(struct mjs *mjs,
+                                            struct mjs_prop_cache *c,
+                                            mjs_val_t obj, mjs_val_t key) {
+  int k;
+  if ((obj & MJS_TAG_MASK) != MJS_TAG_OBJECT) return NULL;
+  if (c->epoch != mjs->prop_cache_epoch) {
+    memset(c, 0, sizeof(*c));
+    c->epoch = mjs->prop_cache_epoch;
+    return NULL;
+  }
+  for (k = 0; k < MJS_PROP_CACHE_SIZE; k++) {
+    if (c->entries[k].obj == obj && c->entries[k].key == key) {
+      return c->entries[k].node;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Remembers own property `name` of a plain object in the inline cache, under
+ * the given cache key (see `struct mjs_prop_cache`). Properties not found in
+ * the object itself are not cached: they can be shadowed later.
+ */
+static void exec_prop_cache_add(struct mjs *mjs, struct mjs_prop_cache *c,
+                                mjs_val_t obj, mjs_val_t key, mjs_val_t name) {
   size_t n;
   char *s = NULL;
   int need_free = 0;
-  int handled = 0;
-
-  mjs_err_t err = mjs_to_string(mjs, &name, &s, &n, &need_free);
-
-  if (err == MJS_OK) {
-    if (mjs_is_string(val)) {
-      handled = getprop_builtin_string(mjs, val, s, n, res);
-    } else if (s != NULL && n == 5 && strncmp(s, "apply", n) == 0) {
-      *res = mjs_mk_foreign_func(mjs, (mjs_func_ptr_t) mjs_apply_);
-      handled = 1;
-    } else if (mjs_is_array(val)) {
-      handled = getprop_builtin_array(mjs, val, s, n, res);
-    } else if (mjs_is_foreign(val)) {
-      handled = getprop_builtin_foreign(mjs, val, s, n, res);
+  if ((obj & MJS_TAG_MASK) != MJS_TAG_OBJECT ||
+      c->epoch != mjs->prop_cache_epoch ||
+      mjs_to_string(mjs, &name, &s, &n, &need_free) != MJS_OK) {
+    return;
+  }
+  /* `apply` is served by getprop_builtin() */
+  if (!(n == 5 && strncmp(s, "apply", n) == 0)) {
+    struct mjs_node *node = mjs_get_own_node(mjs, obj, s, n);
+    if (node != NULL) {
+      c->entries[c->next].obj = obj;
+      c->entries[c->next].key = key;
+      c->entries[c->next].node = node;
+      c->next = (c->next + 1) % MJS_PROP_CACHE_SIZE;
     }
   }
+  if (need_free) free(s);
+}
 
-  if (need_free) {
-    free(s);
-    s = NULL;
+/*
+ * Run pending garbage collection, if any. Allocations only set `need_gc`,
+ * since values held in C locals of the caller are not rooted; the collection
+ * itself happens at the next safepoint of the interpreter: on entry, at
+ * OP_CALL, OP_RETURN and at OP_CONTINUE, which is the back edge of every loop.
+ * Straight-line code in between doesn't pay for the check.
+ */
+static void exec_gc_check(struct mjs *mjs) {
+  if (mjs->need_gc) {
+    if (maybe_gc(mjs)) {
+      mjs->need_gc = 0;
+    }
   }
+#if MJS_AGGRESSIVE_GC
+  maybe_gc(mjs);
+#endif
+}
 
-  return handled;
+/*
+ * Returns whether the execution being run can be suspended right now: only the
+ * outermost one can, since nested ones have the C stack of their callers.
+ */
+static int exec_can_suspend(struct mjs *mjs) {
+  return mjs->exec_depth == 1 && mjs->can_suspend;
 }
 
-MJS_PRIVATE mjs_err_t mjs_execute(struct mjs *mjs, size_t off, mjs_val_t *res) {
-  size_t i;
-  uint8_t prev_opcode = OP_MAX;
-  uint8_t opcode = OP_MAX;
+/*
+ * Spends a unit of the execution budget, see mjs_set_exec_budget(). It's done
+ * at OP_CALL and OP_CONTINUE, i.e. at every call and loop iteration, since
+ * only these can make execution time unbounded.
+ *
+ * Returns 0 and sets the error if the budget is exhausted, 1 otherwise.
+ */
+static int exec_budget_check(struct mjs *mjs) {
+  if (mjs->exec_budget > 0) {
+    mjs->exec_budget--;
+  } else if (mjs->exec_budget == 0) {
+    mjs_set_errorf(mjs, MJS_BUDGET_EXHAUSTED, "execution budget exhausted");
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Returns index of the first local slot of the function being executed, i.e.
+ * the data stack index right after the called function, see OP_LOCALS.
+ */
+static size_t exec_frame_base(struct mjs *mjs) {
+  struct mjs_frame *frame = mjs_call_frame(mjs, 0);
+  return frame != NULL ? frame->retval_idx : 0;
+}
+
+/*
+ * Returns the innermost loop being executed by the current function, or NULL
+ */
+static struct mjs_loop *exec_loop_top(struct mjs *mjs) {
+  struct mjs_frame *frame = mjs_call_frame(mjs, 0);
+  size_t cnt = mjs->loop_addresses.len / sizeof(struct mjs_loop);
+  if (cnt == 0 || (frame != NULL && cnt <= frame->loop_idx)) return NULL;
+  return (struct mjs_loop *) mjs->loop_addresses.buf + cnt - 1;
+}
+
+/* Returns a copy of the decoded bcode part containing the given offset */
+static struct mjs_bcode_part exec_part_get(struct mjs *mjs, size_t offset) {
+  struct mjs_bcode_part *bp = mjs_bcode_part_get_by_offset(mjs, offset);
+  mjs_bcode_part_decode(mjs, bp);
+  return *bp;
+}
+
+/*
+ * Makes `bp` the decoded bcode part containing the given offset. Calls and
+ * returns mostly stay within the current part, which needs no lookup then.
+ */
+static void exec_part_switch(struct mjs *mjs, struct mjs_bcode_part *bp,
+                             size_t offset) {
+  if (offset - bp->start_idx >= bp->data.len) {
+    *bp = exec_part_get(mjs, offset);
+  }
+}
+
+/*
+ * Opcodes whose handlers are shared by the interpreter and the native code of
+ * the JIT, see `struct mjs_jit_helpers`. Each one works with the data stack
+ * only, and sets the error if any.
+ */
+
+/* OP_GET: ( key obj -- obj[key] ) */
+static void exec_get(struct mjs *mjs, struct mjs_prop_cache *c,
+                     int prev_opcode) {
+  mjs_val_t obj = exec_pop(mjs);
+  mjs_val_t key = exec_pop(mjs);
+  struct mjs_node *node = exec_prop_cache_get(mjs, c, obj, key);
+
+  if (node != NULL) {
+    exec_push(mjs, node->value);
+  } else {
+    exec_push(mjs, exec_getprop(mjs, obj, key));
+    exec_prop_cache_add(mjs, c, obj, key, key);
+  }
+  if (prev_opcode != OP_FIND_SCOPE) {
+    /*
+     * Previous opcode was not OP_FIND_SCOPE, so it's some "custom" object
+     * which might be used as `this`, so, save it
+     */
+    mjs->vals.last_getprop_obj = obj;
+  } else {
+    /*
+     * Previous opcode was OP_FIND_SCOPE, so we're getting value from the
+     * scope, and it should *not* be used as `this`
+     */
+    mjs->vals.last_getprop_obj = MJS_UNDEFINED;
+  }
+}
+
+/* OP_GET_VAR: ( -- a ) */
+static void exec_get_var(struct mjs *mjs, mjs_val_t key) {
+  struct mjs_scope_var *var;
+  size_t k = scope_find(mjs, key, &var);
+  if (k != 0) {
+    mjs_val_t scope = *vptr(&mjs->scopes, k - 1);
+    exec_push(mjs, var != NULL ? var->value : exec_getprop(mjs, scope, key));
+    /* Value from the scope should *not* be used as `this`, see OP_GET */
+    mjs->vals.last_getprop_obj = MJS_UNDEFINED;
+  }
+}
+
+/* OP_SET_VAR: ( a -- a ) */
+static void exec_set_var(struct mjs *mjs, mjs_val_t key) {
+  scope_set(mjs, key, vtop(&mjs->stack));
+}
+
+/* OP_CREATE_VAR: ( -- ) */
+static void exec_create_var(struct mjs *mjs, mjs_val_t key) {
+  mjs_val_t scope = vtop(&mjs->scopes);
+  if (scope_var_declare(mjs, key) == NULL &&
+      mjs_get_own_node_v(mjs, scope, key) == NULL) {
+    mjs_set_v(mjs, scope, key, MJS_UNDEFINED);
+  }
+}
+
+/* OP_GET_PROP_CONST: ( obj -- obj[key] ) */
+static void exec_get_prop_const(struct mjs *mjs, mjs_val_t key,
+                                struct mjs_prop_cache *c) {
+  mjs_val_t obj = exec_pop(mjs);
+  struct mjs_node *node = exec_prop_cache_get(mjs, c, obj, MJS_UNDEFINED);
+  if (node != NULL) {
+    exec_push(mjs, node->value);
+  } else {
+    exec_push(mjs, exec_getprop(mjs, obj, key));
+    exec_prop_cache_add(mjs, c, obj, MJS_UNDEFINED, key);
+  }
+  /* Save the object, it might be used as `this`, see OP_GET */
+  mjs->vals.last_getprop_obj = obj;
+}
+
+/* OP_SET_PROP_CONST: ( obj a -- a ) */
+static void exec_set_prop_const(struct mjs *mjs, mjs_val_t key,
+                                struct mjs_prop_cache *c) {
+  mjs_val_t val = exec_pop(mjs);
+  mjs_val_t obj = exec_pop(mjs);
+  struct mjs_node *node = exec_prop_cache_get(mjs, c, obj, MJS_UNDEFINED);
+  if (node != NULL) {
+    node->value = val;
+  } else {
+    val = exec_setprop(mjs, obj, key, val);
+    exec_prop_cache_add(mjs, c, obj, MJS_UNDEFINED, key);
+  }
+  exec_push(mjs, val);
+}
+
+/*
+ * OP_EXPR with TOK_ASSIGN: ( key obj a -- a ), property assignment with an
+ * inline cache like OP_SET_PROP_CONST
+ */
+static void exec_assign(struct mjs *mjs, struct mjs_prop_cache *c) {
+  mjs_val_t val = exec_pop(mjs);
+  mjs_val_t obj = exec_pop(mjs);
+  mjs_val_t key = exec_pop(mjs);
+  struct mjs_node *node = exec_prop_cache_get(mjs, c, obj, key);
+  if (node != NULL) {
+    node->value = val;
+  } else {
+    val = exec_setprop(mjs, obj, key, val);
+    exec_prop_cache_add(mjs, c, obj, key, key);
+  }
+  exec_push(mjs, val);
+}
 
+/* OP_FIND_SCOPE: ( a -- a b ) */
+static void exec_find_scope(struct mjs *mjs) {
+  mjs_val_t key = vtop(&mjs->stack);
+  exec_push(mjs, mjs_find_scope(mjs, key));
+}
+
+/* OP_ARGS: ( -- ) */
+static void exec_args(struct mjs *mjs, int prev_opcode) {
   /*
-   * remember lengths of all stacks, they will be restored in case of an error
+   * If OP_ARGS follows OP_GET or OP_GET_PROP_CONST, then last_getprop_obj is
+   * set to `this` value; otherwise, last_getprop_obj is irrelevant and we have
+   * to reset it to `undefined`
    */
-  int stack_len = mjs->stack.len;
-  int call_stack_len = mjs->call_stack.len;
-  int arg_stack_len = mjs->arg_stack.len;
-  int scopes_len = mjs->scopes.len;
-  int loop_addresses_len = mjs->loop_addresses.len;
-  size_t start_off = off;
-  const uint8_t *code;
+  if (prev_opcode != OP_GET && prev_opcode != OP_GET_PROP_CONST) {
+    mjs->vals.last_getprop_obj = MJS_UNDEFINED;
+  }
+
+  /* Push last_getprop_obj, which is going to be used as `this`, see OP_CALL */
+  push_mjs_val(&mjs->arg_stack, mjs->vals.last_getprop_obj);
+  /* Push current size of data stack, it's needed to place arguments properly */
+  push_mjs_val(&mjs->arg_stack,
+               mjs_mk_number(mjs, (double) mjs_stack_size(&mjs->stack)));
+}
+
+/*
+ * OP_SET_ARG: ( -- ), binds `in->op` arguments to their names in the
+ * innermost scope. The instructions which follow `in` give the rest of the
+ * names and argument numbers.
+ */
+static void exec_set_args(struct mjs *mjs, const mjs_val_t *consts,
+                          const struct mjs_insn *in) {
+  struct mbuf *m = &mjs->scope_vars;
+  struct mjs_scope_var *v = (struct mjs_scope_var *) m->buf;
+  size_t j, n = in->op, cnt = m->len / sizeof(*v);
+  size_t k = mjs_stack_size(&mjs->scopes) - 1;
+  if (vtop(&mjs->scopes) == MJS_UNDEFINED &&
+      (cnt == 0 || v[cnt - 1].scope_idx != k)) {
+    /* The scope has no variables yet, and names are distinct: no lookups */
+    size_t base = exec_frame_base(mjs), top = mjs_stack_size(&mjs->stack);
+    if (m->len + n * sizeof(*v) > m->size) {
+      mbuf_resize(m, m->size * 2 + n * sizeof(*v));
+    }
+    v = (struct mjs_scope_var *) (m->buf + m->len);
+    m->len += n * sizeof(*v);
+    for (j = 0; j < n; j++) {
+      size_t pos = base + in[j].b;
+      v[j].key = consts[in[j].a];
+      v[j].value = base > 0 && pos < top ? *vptr(&mjs->stack, pos)
+                                         : MJS_UNDEFINED;
+      v[j].scope_idx = k;
+    }
+  } else {
+    for (j = 0; j < n; j++) {
+      mjs_val_t key = consts[in[j].a];
+      mjs_val_t val = mjs_arg(mjs, in[j].b);
+      struct mjs_scope_var *var = scope_var_declare(mjs, key);
+      if (var != NULL) {
+        var->value = val;
+      } else {
+        mjs_set_v(mjs, vtop(&mjs->scopes), key, val);
+      }
+    }
+  }
+}
+
+/* OP_SETRETVAL: ( a -- ) */
+static void exec_setretval(struct mjs *mjs) {
+  struct mjs_frame *frame = mjs_call_frame(mjs, 0);
+  if (frame == NULL) {
+    mjs_set_errorf(mjs, MJS_INTERNAL_ERROR, "cannot return");
+  } else {
+    *vptr(&mjs->stack, frame->retval_idx - 1) = exec_pop(mjs);
+  }
+}
+
+/* OP_LOOP: ( -- ) */
+static void exec_loop(struct mjs *mjs, size_t brk, size_t cont) {
+  struct mbuf *m = &mjs->loop_addresses;
+  struct mjs_loop *loop;
+  if (m->len + sizeof(*loop) > m->size) {
+    mbuf_resize(m, m->size * 2 + sizeof(*loop));
+  }
+  loop = (struct mjs_loop *) (m->buf + m->len);
+  m->len += sizeof(*loop);
+  loop->scope_idx = mjs_stack_size(&mjs->scopes);
+  loop->brk = brk;
+  loop->cont = cont;
+}
+
+#if MJS_ENABLE_JIT
+static int exec_jit_cmp(struct mjs *mjs, int op) {
+  exec_expr(mjs, op);
+  return mjs_is_truthy(mjs, exec_pop(mjs));
+}
+
+/*
+ * Like OP_CONTINUE, but if it can't be done right away (there's no loop, or
+ * the budget is exhausted), it's left to the interpreter.
+ */
+static size_t exec_jit_continue(struct mjs *mjs) {
+  struct mjs_loop *loop = exec_loop_top(mjs);
+  size_t cont;
+  if (loop == NULL || mjs->exec_budget == 0) return (size_t) -1;
+  exec_budget_check(mjs);
+  mjs_scopes_truncate(mjs, loop->scope_idx);
+  cont = loop->cont;
+  exec_gc_check(mjs);
+  return cont;
+}
+
+/* Like OP_BREAK, but it's left to the interpreter if there's no loop */
+static size_t exec_jit_break(struct mjs *mjs) {
+  struct mjs_loop *loop = exec_loop_top(mjs);
+  if (loop == NULL) return (size_t) -1;
+  mjs->loop_addresses.len -= sizeof(*loop);
+  mjs_scopes_truncate(mjs, loop->scope_idx);
+  return loop->brk;
+}
+
+static const struct mjs_jit_helpers exec_jit_helpers = {
+    .expr = exec_expr,
+    .cmp = exec_jit_cmp,
+    .get = exec_get,
+    .get_var = exec_get_var,
+    .set_var = exec_set_var,
+    .create_var = exec_create_var,
+    .get_prop_const = exec_get_prop_const,
+    .set_prop_const = exec_set_prop_const,
+    .assign = exec_assign,
+    .find_scope = exec_find_scope,
+    .args = exec_args,
+    .setretval = exec_setretval,
+    .loop = exec_loop,
+    .cont = exec_jit_continue,
+    .brk = exec_jit_break,
+};
+
+/*
+ * Counts a call of the function whose first instruction is `entry`, and
+ * compiles the function once it's called MJS_JIT_THRESHOLD times
+ */
+static void exec_jit_count(struct mjs *mjs, const struct mjs_bcode_part *bp,
+                           size_t entry) {
+  struct mjs_jit *jit = bp->jit;
+  if (jit->code[entry] == NULL && ++jit->calls[entry] == MJS_JIT_THRESHOLD) {
+    mjs_jit_compile(mjs, bp, entry, &exec_jit_helpers);
+  }
+}
+#endif
+
+/*
+ * Runs the interpreter from the given state, until the execution is done or
+ * suspended. The state is either a new one, see mjs_execute(), or the one of
+ * the suspended execution, see mjs_resume().
+ */
+static mjs_err_t exec_run(struct mjs *mjs, const struct mjs_exec_state *st,
+                          mjs_val_t *res) {
+#if MJS_ENABLE_COMPUTED_GOTO
+  static const void *const dispatch_table[OP_MAX] = {
+      [OP_NOP] = &&op_OP_NOP,
+      [OP_DROP] = &&op_OP_DROP,
+      [OP_DUP] = &&op_OP_DUP,
+      [OP_SWAP] = &&op_OP_SWAP,
+      [OP_JMP] = &&op_OP_JMP,
+      [OP_JMP_TRUE] = &&op_default,
+      [OP_JMP_NEUTRAL_TRUE] = &&op_OP_JMP_NEUTRAL_TRUE,
+      [OP_JMP_FALSE] = &&op_OP_JMP_FALSE,
+      [OP_JMP_NEUTRAL_FALSE] = &&op_OP_JMP_NEUTRAL_FALSE,
+      [OP_FIND_SCOPE] = &&op_OP_FIND_SCOPE,
+      [OP_PUSH_SCOPE] = &&op_OP_PUSH_SCOPE,
+      [OP_PUSH_STR] = &&op_OP_PUSH_STR,
+      [OP_PUSH_TRUE] = &&op_OP_PUSH_TRUE,
+      [OP_PUSH_FALSE] = &&op_OP_PUSH_FALSE,
+      [OP_PUSH_INT] = &&op_OP_PUSH_INT,
+      [OP_PUSH_DBL] = &&op_OP_PUSH_DBL,
+      [OP_PUSH_NULL] = &&op_OP_PUSH_NULL,
+      [OP_PUSH_UNDEF] = &&op_OP_PUSH_UNDEF,
+      [OP_PUSH_OBJ] = &&op_OP_PUSH_OBJ,
+      [OP_PUSH_ARRAY] = &&op_OP_PUSH_ARRAY,
+      [OP_PUSH_FUNC] = &&op_OP_PUSH_FUNC,
+      [OP_PUSH_THIS] = &&op_OP_PUSH_THIS,
+      [OP_GET] = &&op_OP_GET,
+      [OP_CREATE] = &&op_OP_CREATE,
+      [OP_EXPR] = &&op_OP_EXPR,
+      [OP_APPEND] = &&op_OP_APPEND,
+      [OP_SET_ARG] = &&op_OP_SET_ARG,
+      [OP_NEW_SCOPE] = &&op_OP_NEW_SCOPE,
+      [OP_DEL_SCOPE] = &&op_OP_DEL_SCOPE,
+      [OP_CALL] = &&op_OP_CALL,
+      [OP_RETURN] = &&op_OP_RETURN,
+      [OP_LOOP] = &&op_OP_LOOP,
+      [OP_BREAK] = &&op_OP_BREAK,
+      [OP_CONTINUE] = &&op_OP_CONTINUE,
+      [OP_SETRETVAL] = &&op_OP_SETRETVAL,
+      [OP_EXIT] = &&op_OP_EXIT,
+      [OP_BCODE_HEADER] = &&op_OP_BCODE_HEADER,
+      [OP_ARGS] = &&op_OP_ARGS,
+      [OP_FOR_IN_NEXT] = &&op_OP_FOR_IN_NEXT,
+      [OP_GET_VAR] = &&op_OP_GET_VAR,
+      [OP_SET_VAR] = &&op_OP_SET_VAR,
+      [OP_CREATE_VAR] = &&op_OP_CREATE_VAR,
+      [OP_GET_PROP_CONST] = &&op_OP_GET_PROP_CONST,
+      [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+      [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+      [OP_LOCALS] = &&op_OP_LOCALS,
+      [OP_SET_PROP_CONST] = &&op_OP_SET_PROP_CONST,
+      [OP_ADD] = &&op_OP_ADD,
+      [OP_SUB] = &&op_OP_SUB,
+      [OP_MUL] = &&op_OP_MUL,
+      [OP_DIV] = &&op_OP_DIV,
+      [OP_LT] = &&op_OP_LT,
+      [OP_LE] = &&op_OP_LE,
+      [OP_GT] = &&op_OP_GT,
+      [OP_GE] = &&op_OP_GE,
+      [OP_EQ_EQ] = &&op_OP_EQ_EQ,
+      [OP_NE_NE] = &&op_OP_NE_NE,
+      [OP_JMP_FALSE_LT] = &&op_OP_JMP_FALSE_LT,
+      [OP_JMP_FALSE_LE] = &&op_OP_JMP_FALSE_LE,
+      [OP_JMP_FALSE_GT] = &&op_OP_JMP_FALSE_GT,
+      [OP_JMP_FALSE_GE] = &&op_OP_JMP_FALSE_GE,
+      [OP_JMP_FALSE_EQ_EQ] = &&op_OP_JMP_FALSE_EQ_EQ,
+      [OP_JMP_FALSE_NE_NE] = &&op_OP_JMP_FALSE_NE_NE,
+  };
+  static const void *const trace_table[OP_MAX] = {
+      [0 ... OP_MAX - 1] = &&op_trace,
+  };
+#if MJS_ENABLE_JIT
+  /* Sends the next opcode to `op_jit`, see mjs_jit.h */
+  static const void *const jit_table[OP_MAX] = {
+      [0 ... OP_MAX - 1] = &&op_jit,
+  };
+#endif
+  const void *const *dispatch =
+      mjs->trace_cb != NULL ? trace_table : dispatch_table;
+#else
+  unsigned sel, trace_flag = mjs->trace_cb != NULL ? MJS_TRACE_FLAG : 0;
+#endif
+  size_t i;
+  uint8_t prev_opcode = st->prev_opcode;
+  uint8_t opcode = st->prev_opcode;
+  size_t frame_base = exec_frame_base(mjs);
+  size_t prev_stack_limit = mjs->stack_limit;
+  const struct mjs_insn *code;
 
-  struct mjs_bcode_part bp = *mjs_bcode_part_get_by_offset(mjs, off);
+  struct mjs_bcode_part bp = exec_part_get(mjs, st->off);
 
   mjs_set_errorf(mjs, MJS_OK, NULL);
   free(mjs->stack_trace);
   mjs->stack_trace = NULL;
 
-  off -= bp.start_idx;
+  if (!exec_stack_reserve(mjs, bp.stack_max)) {
+    *res = MJS_UNDEFINED;
+    return mjs->error;
+  }
 
-  for (i = off; i < bp.data.len; i++) {
-    mjs->cur_bcode_offset = i;
+  /* Only the outermost script can be suspended, see mjs_yield() */
+  if (++mjs->exec_depth == 1) {
+    mjs->can_suspend = st->call_stack_len == 0 && !mjs->suspended;
+  }
 
-    if (mjs->need_gc) {
-      if (maybe_gc(mjs)) {
-        mjs->need_gc = 0;
-      }
-    }
-#if MJS_AGGRESSIVE_GC
-    maybe_gc(mjs);
-#endif
+  code = bp.insns;
+  exec_gc_check(mjs);
 
-    code = (const uint8_t *) bp.data.p;
-#if MJS_ENABLE_DEBUG
-    mjs_disasm_single(code, i);
-#endif
+  for (i = mjs_bcode_part_insn_idx(&bp, st->off - bp.start_idx);
+       i < bp.insns_cnt; i++) {
     prev_opcode = opcode;
-    opcode = code[i];
-    switch (opcode) {
-      case OP_BCODE_HEADER: {
-        mjs_header_item_t bcode_offset;
-        memcpy(&bcode_offset,
-               code + i + 1 +
-                   sizeof(mjs_header_item_t) * MJS_HDR_ITEM_BCODE_OFFSET,
-               sizeof(bcode_offset));
-        i += bcode_offset;
-      } break;
-      case OP_PUSH_NULL:
-        mjs_push(mjs, mjs_mk_null());
-        break;
-      case OP_PUSH_UNDEF:
-        mjs_push(mjs, mjs_mk_undefined());
-        break;
-      case OP_PUSH_FALSE:
-        mjs_push(mjs, mjs_mk_boolean(mjs, 0));
-        break;
-      case OP_PUSH_TRUE:
-        mjs_push(mjs, mjs_mk_boolean(mjs, 1));
-        break;
-      case OP_PUSH_OBJ:
-        mjs_push(mjs, mjs_mk_object(mjs));
-        break;
-      case OP_PUSH_ARRAY:
-        mjs_push(mjs, mjs_mk_array(mjs));
-        break;
-      case OP_PUSH_FUNC: {
-        int llen, n = cs_varint_decode_unsafe(&code[i + 1], &llen);
-        mjs_push(mjs, mjs_mk_function(mjs, bp.start_idx + i - n));
-        i += llen;
-        break;
-      }
-      case OP_PUSH_THIS:
-        mjs_push(mjs, mjs->vals.this_obj);
-        break;
-      case OP_JMP: {
-        int llen, n = cs_varint_decode_unsafe(&code[i + 1], &llen);
-        i += n + llen;
-        break;
-      }
-      case OP_JMP_FALSE: {
-        int llen, n = cs_varint_decode_unsafe(&code[i + 1], &llen);
-        i += llen;
-        if (!mjs_is_truthy(mjs, mjs_pop(mjs))) {
-          mjs_push(mjs, MJS_UNDEFINED);
-          i += n;
+    opcode = code[i].opcode;
+    MJS_DISPATCH(opcode) {
+      MJS_OP(OP_BCODE_HEADER):
+        /* Header and filename are not decoded, so there's nothing to skip */
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_NULL):
+        exec_push(mjs, mjs_mk_null());
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_UNDEF):
+        exec_push(mjs, mjs_mk_undefined());
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_FALSE):
+        exec_push(mjs, mjs_mk_boolean(mjs, 0));
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_TRUE):
+        exec_push(mjs, mjs_mk_boolean(mjs, 1));
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_OBJ):
+        exec_push(mjs, mjs_mk_object(mjs));
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_ARRAY):
+        exec_push(mjs, mjs_mk_array(mjs));
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_FUNC):
+        exec_push(mjs, mjs_mk_function(mjs, code[i].v.i));
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_THIS):
+        exec_push(mjs, mjs->vals.this_obj);
+        MJS_NEXT_OP();
+      /*
+       * Jump target is an index of the decoded instruction; since `i` is
+       * incremented before the next dispatch, we set it to the previous one.
+       */
+      MJS_OP(OP_JMP):
+        i = code[i].a - 1;
+        MJS_NEXT_OP();
+      MJS_OP(OP_JMP_FALSE): {
+        if (!mjs_is_truthy(mjs, exec_pop(mjs))) {
+          exec_push(mjs, MJS_UNDEFINED);
+          i = code[i].a - 1;
         }
-        break;
+        MJS_NEXT_OP();
       }
+      MJS_OP_JMP_FALSE_CMP(OP_JMP_FALSE_LT, TOK_LT, a < b)
+      MJS_OP_JMP_FALSE_CMP(OP_JMP_FALSE_LE, TOK_LE, a <= b)
+      MJS_OP_JMP_FALSE_CMP(OP_JMP_FALSE_GT, TOK_GT, a > b)
+      MJS_OP_JMP_FALSE_CMP(OP_JMP_FALSE_GE, TOK_GE, a >= b)
+      MJS_OP_JMP_FALSE_CMP(OP_JMP_FALSE_EQ_EQ, TOK_EQ_EQ,
+                           num_strict_eq(a, b, sp[-2], sp[-1]))
+      MJS_OP_JMP_FALSE_CMP(OP_JMP_FALSE_NE_NE, TOK_NE_NE,
+                           !num_strict_eq(a, b, sp[-2], sp[-1]))
       /*
        * OP_JMP_NEUTRAL_... ops are like as OP_JMP_..., but they are completely
        * stack-neutral: they just check the TOS, and increment instruction
        * pointer if the TOS is truthy/falsy.
        */
-      case OP_JMP_NEUTRAL_TRUE: {
-        int llen, n = cs_varint_decode_unsafe(&code[i + 1], &llen);
-        i += llen;
+      MJS_OP(OP_JMP_NEUTRAL_TRUE): {
         if (mjs_is_truthy(mjs, vtop(&mjs->stack))) {
-          i += n;
+          i = code[i].a - 1;
         }
-        break;
+        MJS_NEXT_OP();
       }
-      case OP_JMP_NEUTRAL_FALSE: {
-        int llen, n = cs_varint_decode_unsafe(&code[i + 1], &llen);
-        i += llen;
+      MJS_OP(OP_JMP_NEUTRAL_FALSE): {
         if (!mjs_is_truthy(mjs, vtop(&mjs->stack))) {
-          i += n;
+          i = code[i].a - 1;
         }
-        break;
+        MJS_NEXT_OP();
       }
-      case OP_FIND_SCOPE: {
-        mjs_val_t key = vtop(&mjs->stack);
-        mjs_push(mjs, mjs_find_scope(mjs, key));
-        break;
-      }
-      case OP_CREATE: {
-        mjs_val_t obj = mjs_pop(mjs);
-        mjs_val_t key = mjs_pop(mjs);
+      MJS_OP(OP_FIND_SCOPE):
+        exec_find_scope(mjs);
+        MJS_NEXT_OP();
+      MJS_OP(OP_CREATE): {
+        mjs_val_t obj = exec_pop(mjs);
+        mjs_val_t key = exec_pop(mjs);
         if (mjs_get_own_node_v(mjs, obj, key) == NULL) {
           mjs_set_v(mjs, obj, key, MJS_UNDEFINED);
         }
-        break;
+        MJS_NEXT_OP();
       }
-      case OP_APPEND: {
-        mjs_val_t val = mjs_pop(mjs);
-        mjs_val_t arr = mjs_pop(mjs);
+      MJS_OP(OP_APPEND): {
+        mjs_val_t val = exec_pop(mjs);
+        mjs_val_t arr = exec_pop(mjs);
         mjs_err_t err = mjs_array_push(mjs, arr, val);
         if (err != MJS_OK) {
           mjs_set_errorf(mjs, MJS_TYPE_ERROR, "append to non-array");
         }
-        break;
+        MJS_NEXT_OP();
       }
-      case OP_GET: {
-        mjs_val_t obj = mjs_pop(mjs);
-        mjs_val_t key = mjs_pop(mjs);
-        mjs_val_t val = MJS_UNDEFINED;
-
-        if (!getprop_builtin(mjs, obj, key, &val)) {
-          if (mjs_is_object(obj)) {
-            val = mjs_get_v_proto(mjs, obj, key);
-          } else {
-            mjs_prepend_errorf(mjs, MJS_TYPE_ERROR, "type error");
-          }
+      MJS_OP(OP_GET):
+        exec_get(mjs, &bp.prop_caches[code[i].b], prev_opcode);
+        MJS_NEXT_OP();
+      MJS_OP(OP_GET_VAR):
+        exec_get_var(mjs, bp.consts[code[i].a]);
+        MJS_NEXT_OP();
+      MJS_OP(OP_SET_VAR):
+        exec_set_var(mjs, bp.consts[code[i].a]);
+        MJS_NEXT_OP();
+      MJS_OP(OP_CREATE_VAR):
+        exec_create_var(mjs, bp.consts[code[i].a]);
+        MJS_NEXT_OP();
+      MJS_OP(OP_GET_PROP_CONST):
+        exec_get_prop_const(mjs, bp.consts[code[i].a],
+                            &bp.prop_caches[code[i].b]);
+        MJS_NEXT_OP();
+      MJS_OP(OP_GET_LOCAL):
+        exec_push(mjs, ((mjs_val_t *) mjs->stack.buf)[frame_base + code[i].a]);
+        MJS_NEXT_OP();
+      MJS_OP(OP_SET_LOCAL):
+        ((mjs_val_t *) mjs->stack.buf)[frame_base + code[i].a] =
+            vtop(&mjs->stack);
+        MJS_NEXT_OP();
+      MJS_OP(OP_LOCALS): {
+        /*
+         * Make the data stack hold exactly `nslots` values after the called
+         * function: arguments beyond the declared ones are dropped, missing
+         * arguments and the rest of the slots are `undefined`.
+         */
+        size_t nparams = code[i].b, nslots = code[i].a;
+        if (mjs_stack_size(&mjs->stack) > frame_base + nparams) {
+          mjs->stack.len = (frame_base + nparams) * sizeof(mjs_val_t);
         }
-
-        mjs_push(mjs, val);
-        if (prev_opcode != OP_FIND_SCOPE) {
-          /*
-           * Previous opcode was not OP_FIND_SCOPE, so it's some "custom"
-           * object which might be used as `this`, so, save it
-           */
-          mjs->vals.last_getprop_obj = obj;
-        } else {
-          /*
-           * Previous opcode was OP_FIND_SCOPE, so we're getting value from
-           * the scope, and it should *not* be used as `this`
-           */
-          mjs->vals.last_getprop_obj = MJS_UNDEFINED;
+        while (mjs_stack_size(&mjs->stack) < frame_base + nslots) {
+          exec_push(mjs, MJS_UNDEFINED);
         }
-        break;
+        MJS_NEXT_OP();
       }
-      case OP_DEL_SCOPE:
+      MJS_OP(OP_SET_PROP_CONST):
+        exec_set_prop_const(mjs, bp.consts[code[i].a],
+                            &bp.prop_caches[code[i].b]);
+        MJS_NEXT_OP();
+      MJS_OP(OP_DEL_SCOPE):
         if (mjs->scopes.len <= 1) {
           mjs_set_errorf(mjs, MJS_INTERNAL_ERROR, "scopes underflow");
         } else {
-          mjs_pop_val(&mjs->scopes);
+          mjs_scopes_truncate(mjs, mjs_stack_size(&mjs->scopes) - 1);
         }
-        break;
-      case OP_NEW_SCOPE:
-        push_mjs_val(&mjs->scopes, mjs_mk_object(mjs));
-        break;
-      case OP_PUSH_SCOPE:
+        MJS_NEXT_OP();
+      MJS_OP(OP_NEW_SCOPE):
+        /* The object is created only if needed, see mjs_scopes_truncate() */
+        push_mjs_val(&mjs->scopes, MJS_UNDEFINED);
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_SCOPE):
         assert(mjs_stack_size(&mjs->scopes) > 0);
-        mjs_push(mjs, vtop(&mjs->scopes));
-        break;
-      case OP_PUSH_STR: {
-        int llen, n = cs_varint_decode_unsafe(&code[i + 1], &llen);
-        mjs_push(mjs, mjs_mk_string(mjs, (char *) code + i + 1 + llen, n, 1));
-        i += llen + n;
-        break;
-      }
-      case OP_PUSH_INT: {
-        int llen;
-        int64_t n = cs_varint_decode_unsafe(&code[i + 1], &llen);
-        mjs_push(mjs, mjs_mk_number(mjs, (double) n));
-        i += llen;
-        break;
-      }
-      case OP_PUSH_DBL: {
-        int llen, n = cs_varint_decode_unsafe(&code[i + 1], &llen);
-        mjs_push(mjs, mjs_mk_number(
-                          mjs, strtod((char *) code + i + 1 + llen, NULL)));
-        i += llen + n;
-        break;
-      }
-      case OP_FOR_IN_NEXT: {
+        exec_push(mjs,
+                  scope_materialise(mjs, mjs_stack_size(&mjs->scopes) - 1));
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_STR):
+        exec_push(mjs, bp.consts[code[i].a]);
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_INT):
+        exec_push(mjs, mjs_mk_number(mjs, (double) code[i].v.i));
+        MJS_NEXT_OP();
+      MJS_OP(OP_PUSH_DBL):
+        exec_push(mjs, mjs_mk_number(mjs, code[i].v.d));
+        MJS_NEXT_OP();
+      MJS_OP(OP_FOR_IN_NEXT): {
         /*
          * Data stack layout:
          * ...                                    <-- Bottom of the data stack
@@ -759,86 +1551,87 @@ MJS_PRIVATE mjs_err_t mjs_execute(struct mjs *mjs, size_t off, mjs_val_t *res) {
           mjs_val_t var_name = *vptr(&mjs->stack, -3);
           mjs_val_t key = mjs_next_node(mjs, obj, iterator);
           if (key != MJS_UNDEFINED) {
-            mjs_val_t scope = mjs_find_scope(mjs, var_name);
-            mjs_set_v(mjs, scope, var_name, key);
+            scope_set(mjs, var_name, key);
           }
         } else {
           mjs_set_errorf(mjs, MJS_TYPE_ERROR,
                          "can't iterate over non-object value");
         }
-        break;
+        MJS_NEXT_OP();
       }
-      case OP_RETURN: {
+      MJS_OP(OP_RETURN): {
         /*
          * Return address is saved as a global bcode offset, so we need to
          * convert it to the local offset
          */
         size_t off_ret = call_stack_restore_frame(mjs);
+        frame_base = exec_frame_base(mjs);
+        exec_gc_check(mjs);
         if (off_ret != MJS_BCODE_OFFSET_EXIT) {
-          bp = *mjs_bcode_part_get_by_offset(mjs, off_ret);
-          code = (const uint8_t *) bp.data.p;
-          i = off_ret - bp.start_idx;
+          exec_part_switch(mjs, &bp, off_ret);
+          code = bp.insns;
+          i = mjs_bcode_part_insn_idx(&bp, off_ret - bp.start_idx);
+#if MJS_ENABLE_JIT
+          if (dispatch == dispatch_table) dispatch = jit_table;
+#endif
           LOG(LL_VERBOSE_DEBUG, ("RETURNING TO %d", (int) off_ret + 1));
         } else {
           goto clean;
         }
         // mjs_dump(mjs, 0, stdout);
-        break;
-      }
-      case OP_ARGS: {
-        /*
-         * If OP_ARGS follows OP_GET, then last_getprop_obj is set to `this`
-         * value; otherwise, last_getprop_obj is irrelevant and we have to
-         * reset it to `undefined`
-         */
-        if (prev_opcode != OP_GET) {
-          mjs->vals.last_getprop_obj = MJS_UNDEFINED;
-        }
-
-        /*
-         * Push last_getprop_obj, which is going to be used as `this`, see
-         * OP_CALL
-         */
-        push_mjs_val(&mjs->arg_stack, mjs->vals.last_getprop_obj);
-        /*
-         * Push current size of data stack, it's needed to place arguments
-         * properly
-         */
-        push_mjs_val(&mjs->arg_stack,
-                     mjs_mk_number(mjs, (double) mjs_stack_size(&mjs->stack)));
-        break;
+        MJS_NEXT_OP();
       }
-      case OP_CALL: {
+      MJS_OP(OP_ARGS):
+        exec_args(mjs, prev_opcode);
+        MJS_NEXT_OP();
+      MJS_OP(OP_CALL): {
         // LOG(LL_INFO, ("BEFORE CALL"));
         // mjs_dump(mjs, 0, stdout);
         int func_pos;
         mjs_val_t *func;
-        mjs_val_t retval_stack_idx = vtop(&mjs->arg_stack);
-        func_pos = mjs_get_int(mjs, retval_stack_idx) - 1;
+        size_t retval_stack_idx;
+        exec_gc_check(mjs);
+        if (!exec_budget_check(mjs)) {
+          /* The call is not started yet, so it's done again on resume */
+          if (exec_can_suspend(mjs)) goto suspend;
+          MJS_NEXT_OP();
+        }
+        retval_stack_idx = mjs_get_int(mjs, vtop(&mjs->arg_stack));
+        func_pos = retval_stack_idx - 1;
         func = vptr(&mjs->stack, func_pos);
 
         /* Drop data stack size (pushed by OP_ARGS) */
         mjs_pop_val(&mjs->arg_stack);
 
+        /* Let native code find out where it's called from */
+        mjs->cur_bcode_offset = bp.start_idx + code[i].off;
+
         if (mjs_is_function(*func)) {
           size_t off_call;
-          call_stack_push_frame(mjs, bp.start_idx + i, retval_stack_idx);
+          call_stack_push_frame(mjs, mjs->cur_bcode_offset, retval_stack_idx);
+          frame_base = exec_frame_base(mjs);
 
           /*
            * Function offset is a global bcode offset, so we need to convert it
-           * to the local offset
+           * to the index of the instruction in the part
            */
-          off_call = mjs_get_func_addr(*func) - 1;
-          bp = *mjs_bcode_part_get_by_offset(mjs, off_call);
-          code = (const uint8_t *) bp.data.p;
-          i = off_call - bp.start_idx;
+          off_call = mjs_get_func_addr(*func);
+          exec_part_switch(mjs, &bp, off_call);
+          code = bp.insns;
+          i = mjs_bcode_part_insn_idx(&bp, off_call - bp.start_idx) - 1;
+#if MJS_ENABLE_JIT
+          exec_jit_count(mjs, &bp, i + 1);
+          if (dispatch == dispatch_table) dispatch = jit_table;
+#endif
 
           *func = MJS_UNDEFINED;  // Return value
+          /* The OP_JMP over the body knows how much it pushes */
+          if (!exec_stack_reserve(mjs, code[i].b)) MJS_NEXT_OP();
           // LOG(LL_VERBOSE_DEBUG, ("CALLING  %d", i + 1));
         } else if (mjs_is_string(*func) || mjs_is_ffi_sig(*func)) {
           /* Call ffi-ed function */
 
-          call_stack_push_frame(mjs, bp.start_idx + i, retval_stack_idx);
+          call_stack_push_frame(mjs, mjs->cur_bcode_offset, retval_stack_idx);
 
           /* Perform the ffi-ed function call */
           mjs_ffi_call2(mjs);
@@ -847,7 +1640,7 @@ MJS_PRIVATE mjs_err_t mjs_execute(struct mjs *mjs, size_t off, mjs_val_t *res) {
         } else if (mjs_is_foreign(*func)) {
           /* Call cfunction */
 
-          call_stack_push_frame(mjs, bp.start_idx + i, retval_stack_idx);
+          call_stack_push_frame(mjs, mjs->cur_bcode_offset, retval_stack_idx);
 
           /* Perform the cfunction call */
           ((void (*) (struct mjs *)) mjs_get_ptr(mjs, *func))(mjs);
@@ -856,127 +1649,161 @@ MJS_PRIVATE mjs_err_t mjs_execute(struct mjs *mjs, size_t off, mjs_val_t *res) {
         } else {
           mjs_set_errorf(mjs, MJS_TYPE_ERROR, "calling non-callable");
         }
-        break;
+        MJS_NEXT_OP();
       }
-      case OP_SET_ARG: {
-        int llen1, llen2, n,
-            arg_no = cs_varint_decode_unsafe(&code[i + 1], &llen1);
-        mjs_val_t obj, key, v;
-        n = cs_varint_decode_unsafe(&code[i + llen1 + 1], &llen2);
-        key = mjs_mk_string(mjs, (char *) code + i + 1 + llen1 + llen2, n, 1);
-        obj = vtop(&mjs->scopes);
-        v = mjs_arg(mjs, arg_no);
-        mjs_set_v(mjs, obj, key, v);
-        i += llen1 + llen2 + n;
-        break;
+      MJS_OP(OP_SET_ARG): {
+        exec_set_args(mjs, bp.consts, &code[i]);
+        /* Skip the rest of the run, it's bound already */
+        i += code[i].op - 1;
+        MJS_NEXT_OP();
       }
-      case OP_SETRETVAL: {
-        if (mjs_stack_size(&mjs->call_stack) < CALL_STACK_FRAME_ITEMS_CNT) {
-          mjs_set_errorf(mjs, MJS_INTERNAL_ERROR, "cannot return");
+      MJS_OP(OP_SETRETVAL):
+        exec_setretval(mjs);
+        MJS_NEXT_OP();
+      MJS_OP(OP_EXPR):
+        if (code[i].op == TOK_ASSIGN) {
+          exec_assign(mjs, &bp.prop_caches[code[i].b]);
         } else {
-          size_t retval_pos = mjs_get_int(
-              mjs, *vptr(&mjs->call_stack,
-                         -1 - CALL_STACK_FRAME_ITEM_RETVAL_STACK_IDX));
-          *vptr(&mjs->stack, retval_pos - 1) = mjs_pop(mjs);
+          exec_expr(mjs, code[i].op);
         }
-        // LOG(LL_INFO, ("AFTER SETRETVAL"));
-        // mjs_dump(mjs, 0, stdout);
-        break;
-      }
-      case OP_EXPR: {
-        int op = code[i + 1];
-        exec_expr(mjs, op);
-        i++;
-        break;
-      }
-      case OP_DROP: {
-        mjs_pop(mjs);
-        break;
-      }
-      case OP_DUP: {
-        mjs_push(mjs, vtop(&mjs->stack));
-        break;
+        MJS_NEXT_OP();
+      /* Division by zero gives NaN, see do_arith_op() */
+      MJS_OP_NUM_BINOP(OP_ADD, TOK_PLUS, 1, mjs_mk_number(mjs, a + b))
+      MJS_OP_NUM_BINOP(OP_SUB, TOK_MINUS, 1, mjs_mk_number(mjs, a - b))
+      MJS_OP_NUM_BINOP(OP_MUL, TOK_MUL, 1, mjs_mk_number(mjs, a * b))
+      MJS_OP_NUM_BINOP(OP_DIV, TOK_DIV, b != 0, mjs_mk_number(mjs, a / b))
+      MJS_OP_NUM_BINOP(OP_LT, TOK_LT, 1, mjs_mk_boolean(mjs, a < b))
+      MJS_OP_NUM_BINOP(OP_LE, TOK_LE, 1, mjs_mk_boolean(mjs, a <= b))
+      MJS_OP_NUM_BINOP(OP_GT, TOK_GT, 1, mjs_mk_boolean(mjs, a > b))
+      MJS_OP_NUM_BINOP(OP_GE, TOK_GE, 1, mjs_mk_boolean(mjs, a >= b))
+      MJS_OP_NUM_BINOP(OP_EQ_EQ, TOK_EQ_EQ, 1,
+                       mjs_mk_boolean(mjs, num_strict_eq(a, b, sp[-2], sp[-1])))
+      MJS_OP_NUM_BINOP(OP_NE_NE, TOK_NE_NE, 1,
+                       mjs_mk_boolean(mjs,
+                                      !num_strict_eq(a, b, sp[-2], sp[-1])))
+      MJS_OP(OP_DROP): {
+        exec_pop(mjs);
+        MJS_NEXT_OP();
       }
-      case OP_SWAP: {
-        mjs_val_t a = mjs_pop(mjs);
-        mjs_val_t b = mjs_pop(mjs);
-        mjs_push(mjs, a);
-        mjs_push(mjs, b);
-        break;
+      MJS_OP(OP_DUP): {
+        exec_push(mjs, vtop(&mjs->stack));
+        MJS_NEXT_OP();
       }
-      case OP_LOOP: {
-        int l1, l2, off = cs_varint_decode_unsafe(&code[i + 1], &l1);
-        /* push scope index */
-        push_mjs_val(&mjs->loop_addresses,
-                     mjs_mk_number(mjs, (double) mjs_stack_size(&mjs->scopes)));
-
-        /* push break offset */
-        push_mjs_val(
-            &mjs->loop_addresses,
-            mjs_mk_number(mjs, (double) (i + 1 /* OP_LOOP */ + l1 + off)));
-        off = cs_varint_decode_unsafe(&code[i + 1 + l1], &l2);
-
-        /* push continue offset */
-        push_mjs_val(
-            &mjs->loop_addresses,
-            mjs_mk_number(mjs, (double) (i + 1 /* OP_LOOP*/ + l1 + l2 + off)));
-        i += l1 + l2;
-        break;
+      MJS_OP(OP_SWAP): {
+        mjs_val_t a = exec_pop(mjs);
+        mjs_val_t b = exec_pop(mjs);
+        exec_push(mjs, a);
+        exec_push(mjs, b);
+        MJS_NEXT_OP();
       }
-      case OP_CONTINUE: {
-        if (mjs_stack_size(&mjs->loop_addresses) >= 3) {
-          size_t scopes_len = mjs_get_int(mjs, *vptr(&mjs->loop_addresses, -3));
-          assert(mjs_stack_size(&mjs->scopes) >= scopes_len);
-          mjs->scopes.len = scopes_len * sizeof(mjs_val_t);
+      MJS_OP(OP_LOOP):
+        exec_loop(mjs, code[i].a, code[i].b);
+        MJS_NEXT_OP();
+      MJS_OP(OP_CONTINUE): {
+        struct mjs_loop *loop = exec_loop_top(mjs);
+        if (!exec_budget_check(mjs)) {
+          if (exec_can_suspend(mjs)) goto suspend;
+        } else if (loop != NULL) {
+          assert(mjs_stack_size(&mjs->scopes) >= loop->scope_idx);
+          mjs_scopes_truncate(mjs, loop->scope_idx);
 
           /* jump to "continue" address */
-          i = mjs_get_int(mjs, vtop(&mjs->loop_addresses)) - 1;
+          i = loop->cont - 1;
+          exec_gc_check(mjs);
         } else {
           mjs_set_errorf(mjs, MJS_SYNTAX_ERROR, "misplaced 'continue'");
         }
-      } break;
-      case OP_BREAK: {
-        if (mjs_stack_size(&mjs->loop_addresses) >= 3) {
-          size_t scopes_len;
-          /* drop "continue" address */
-          mjs_pop_val(&mjs->loop_addresses);
-
-          /* pop "break" address and jump to it */
-          i = mjs_get_int(mjs, mjs_pop_val(&mjs->loop_addresses)) - 1;
+        MJS_NEXT_OP();
+      }
+      MJS_OP(OP_BREAK): {
+        struct mjs_loop *loop = exec_loop_top(mjs);
+        if (loop != NULL) {
+          mjs->loop_addresses.len -= sizeof(*loop);
 
-          /* restore scope index */
-          scopes_len = mjs_get_int(mjs, mjs_pop_val(&mjs->loop_addresses));
-          assert(mjs_stack_size(&mjs->scopes) >= scopes_len);
-          mjs->scopes.len = scopes_len * sizeof(mjs_val_t);
+          /* restore scope index, and jump to "break" address */
+          assert(mjs_stack_size(&mjs->scopes) >= loop->scope_idx);
+          mjs_scopes_truncate(mjs, loop->scope_idx);
+          i = loop->brk - 1;
 
           LOG(LL_VERBOSE_DEBUG, ("BREAKING TO %d", (int) i + 1));
         } else {
           mjs_set_errorf(mjs, MJS_SYNTAX_ERROR, "misplaced 'break'");
         }
-      } break;
-      case OP_NOP:
-        break;
-      case OP_EXIT:
-        i = bp.data.len;
-        break;
-      default:
+        MJS_NEXT_OP();
+      }
+      MJS_OP(OP_NOP):
+        MJS_NEXT_OP();
+      MJS_OP(OP_EXIT):
+        i = bp.insns_cnt;
+        MJS_NEXT_OP();
+#if MJS_ENABLE_COMPUTED_GOTO
+    op_trace:
+      MJS_EXEC_TRACE();
+      goto *dispatch_table[opcode];
+#if MJS_ENABLE_JIT
+    /*
+     * Entered after calls and returns, and after the instructions which the
+     * native code leaves to the interpreter: if there's native code of the
+     * next instruction, it's run until an instruction which is not compiled.
+     * That one is executed right here, and then we get back to `op_jit`.
+     */
+    op_jit: {
+      void *native = bp.jit->code[i];
+      if (native == NULL) {
+        /* Not a compiled function: keep interpreting it */
+        dispatch = dispatch_table;
+      } else if (native != MJS_JIT_EXIT) {
+        struct mjs_jit_ctx ctx;
+        ctx.frame_base = frame_base;
+        ctx.prev_opcode = prev_opcode;
+        i = mjs_jit_run(mjs, bp.jit, &ctx, native);
+        prev_opcode = ctx.prev_opcode;
+        opcode = code[i].opcode;
+        if (mjs->error != MJS_OK) goto op_error;
+      }
+      if (opcode >= OP_MAX) goto op_default;
+      goto *dispatch_table[opcode];
+    }
+#endif
+#endif
+      MJS_OP_DEFAULT:
+#if !MJS_ENABLE_COMPUTED_GOTO
+        if (sel & MJS_TRACE_FLAG) {
+          MJS_EXEC_TRACE();
+          sel = opcode;
+          goto op_dispatch;
+        }
+#endif
 #if MJS_ENABLE_DEBUG
         mjs_dump(mjs, 1);
 #endif
         mjs_set_errorf(mjs, MJS_INTERNAL_ERROR, "Unknown opcode: %d, off %d+%d",
-                       (int) opcode, (int) bp.start_idx, (int) i);
-        i = bp.data.len;
-        break;
+                       (int) opcode, (int) bp.start_idx, (int) code[i].off);
+        i = bp.insns_cnt;
+        MJS_NEXT_OP();
     }
     if (mjs->error != MJS_OK) {
-      mjs_gen_stack_trace(mjs, bp.start_idx + i - 1 /* undo the i++ */);
+#if MJS_ENABLE_COMPUTED_GOTO
+    op_error:
+#endif
+      if (mjs->error == MJS_SUSPENDED) {
+        /* See mjs_yield(): the call is done, so continue after it */
+        prev_opcode = opcode;
+        i++;
+        goto suspend;
+      }
+
+      /* Offset of the last byte of the failed instruction, minus one */
+      mjs_gen_stack_trace(
+          mjs, bp.start_idx - 2 +
+                   (i + 1 < bp.insns_cnt ? code[i + 1].off : bp.data.len));
 
       /* restore stack lenghts */
-      mjs->stack.len = stack_len;
-      mjs->call_stack.len = call_stack_len;
-      mjs->arg_stack.len = arg_stack_len;
-      mjs->scopes.len = scopes_len;
-      mjs->loop_addresses.len = loop_addresses_len;
+      mjs->stack.len = st->stack_len;
+      mjs->call_stack.len = st->call_stack_len;
+      mjs->arg_stack.len = st->arg_stack_len;
+      mjs_scopes_truncate(mjs, st->scopes_len / sizeof(mjs_val_t));
+      mjs->loop_addresses.len = st->loop_addresses_len;
 
       /* script will evaluate to `undefined` */
       mjs_push(mjs, MJS_UNDEFINED);
@@ -986,10 +1813,55 @@ MJS_PRIVATE mjs_err_t mjs_execute(struct mjs *mjs, size_t off, mjs_val_t *res) {
 
 clean:
   /* Remember result of the evaluation of this bcode part */
-  mjs_bcode_part_get_by_offset(mjs, start_off)->exec_res = mjs->error;
+  mjs_bcode_part_get_by_offset(mjs, st->start_off)->exec_res = mjs->error;
 
+  mjs->exec_depth--;
+  mjs->stack_limit = prev_stack_limit;
   *res = mjs_pop(mjs);
   return mjs->error;
+
+suspend:
+  /* Instruction `i` is the next one to execute, everything else is kept */
+  mjs->exec_state = *st;
+  mjs->exec_state.off = bp.start_idx + code[i].off;
+  mjs->exec_state.prev_opcode = prev_opcode;
+  mjs->suspended = 1;
+
+  mjs->exec_depth--;
+  mjs->stack_limit = prev_stack_limit;
+  *res = MJS_UNDEFINED;
+  return mjs->error;
+}
+
+MJS_PRIVATE mjs_err_t mjs_execute(struct mjs *mjs, size_t off, mjs_val_t *res) {
+  struct mjs_exec_state st;
+  st.off = st.start_off = off;
+  st.prev_opcode = OP_MAX;
+  /* Remember lengths of all stacks, they will be restored in case of an error */
+  st.stack_len = mjs->stack.len;
+  st.call_stack_len = mjs->call_stack.len;
+  st.arg_stack_len = mjs->arg_stack.len;
+  st.scopes_len = mjs->scopes.len;
+  st.loop_addresses_len = mjs->loop_addresses.len;
+  return exec_run(mjs, &st, res);
+}
+
+mjs_err_t mjs_resume(struct mjs *mjs, mjs_val_t *res) {
+  struct mjs_exec_state st = mjs->exec_state;
+  mjs_val_t r = MJS_UNDEFINED;
+  if (!mjs->suspended) {
+    return mjs_set_errorf(mjs, MJS_BAD_ARGS_ERROR, "nothing to resume");
+  }
+  mjs->suspended = 0;
+  exec_run(mjs, &st, &r);
+  if (res != NULL) *res = r;
+  return mjs->error;
+}
+
+int mjs_yield(struct mjs *mjs) {
+  if (!exec_can_suspend(mjs)) return 0;
+  mjs_set_errorf(mjs, MJS_SUSPENDED, "execution suspended");
+  return 1;
 }
 
 MJS_PRIVATE mjs_err_t mjs_exec_internal(struct mjs *mjs, const char *path,
@@ -1123,6 +1995,13 @@ mjs_err_t mjs_exec_jsc(struct mjs *mjs, const char *path, mjs_val_t *res) {
   if (bytes == NULL) {
     error = MJS_FILE_READ_ERROR;
     mjs_prepend_errorf(mjs, error, "failed to read file \"%s\"", path);
+  } else if (size > 0 && bytes[0] == OP_BCODE_HEADER &&
+             mjs_bcode_version((uint8_t *) bytes) > MJS_BCODE_VERSION) {
+    /* The file was compiled by a newer mjs */
+    free(bytes);
+    error = MJS_NOT_IMPLEMENTED_ERROR;
+    mjs_prepend_errorf(mjs, error, "unsupported bcode version in \"%s\"",
+                       path);
   } else {
     mjs_val_t r = MJS_UNDEFINED;
     size_t off = mjs->bcode_len;
@@ -1133,7 +2012,7 @@ mjs_err_t mjs_exec_jsc(struct mjs *mjs, const char *path, mjs_val_t *res) {
     };
     mjs_bcode_part_add(mjs, &bp);
     mjs->bcode_len += size;
-    mjs_execute(mjs, off, &r);
+    error = mjs_execute(mjs, off, &r);
     if (res != NULL) {
       *res = r;
     }
@@ -1183,7 +2062,8 @@ mjs_err_t mjs_call(struct mjs *mjs, mjs_val_t *res, mjs_val_t func,
 
 mjs_err_t mjs_apply(struct mjs *mjs, mjs_val_t *res, mjs_val_t func,
                     mjs_val_t this_val, int nargs, mjs_val_t *args) {
-  mjs_val_t r, prev_this_val, retval_stack_idx, *resp;
+  mjs_val_t r, prev_this_val;
+  size_t retval_stack_idx;
   int i;
 
   if (!mjs_is_function(func) && !mjs_is_foreign(func) &&
@@ -1197,10 +2077,12 @@ mjs_err_t mjs_apply(struct mjs *mjs, mjs_val_t *res, mjs_val_t func,
 
   /* Push callable which will be later replaced with the return value */
   mjs_push(mjs, func);
-  resp = vptr(&mjs->stack, -1);
 
-  /* Remember index by which return value should be written */
-  retval_stack_idx = mjs_mk_number(mjs, (double) mjs_stack_size(&mjs->stack));
+  /*
+   * Remember index by which return value should be written: not a pointer,
+   * since the function can grow the stack
+   */
+  retval_stack_idx = mjs_stack_size(&mjs->stack);
 
   // Push all arguments
   for (i = 0; i < nargs; i++) {
@@ -1215,10 +2097,10 @@ mjs_err_t mjs_apply(struct mjs *mjs, mjs_val_t *res, mjs_val_t func,
 
   if (mjs_is_foreign(func)) {
     ((void (*) (struct mjs *)) mjs_get_ptr(mjs, func))(mjs);
-    if (res != NULL) *res = *resp;
+    if (res != NULL) *res = *vptr(&mjs->stack, retval_stack_idx - 1);
   } else if (mjs_is_ffi_sig(func)) {
     mjs_ffi_call2(mjs);
-    if (res != NULL) *res = *resp;
+    if (res != NULL) *res = *vptr(&mjs->stack, retval_stack_idx - 1);
   } else {
     size_t addr = mjs_get_func_addr(func);
     mjs_execute(mjs, addr, &r);
@@ -1226,10 +2108,10 @@ mjs_err_t mjs_apply(struct mjs *mjs, mjs_val_t *res, mjs_val_t func,
   }
 
   /*
-   * If there was an error, we need to restore frame and do the cleanup
-   * which is otherwise done by OP_RETURN
+   * If there was an error, or the function is native, we need to restore
+   * frame and do the cleanup which is otherwise done by OP_RETURN
    */
-  if (mjs->error != MJS_OK) {
+  if (mjs->error != MJS_OK || !mjs_is_function(func)) {
     call_stack_restore_frame(mjs);
 
     // Pop cell at which the returned value should've been written
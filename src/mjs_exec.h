@@ -20,6 +20,13 @@ extern "C" {
 
 MJS_PRIVATE mjs_err_t mjs_execute(struct mjs *mjs, size_t off, mjs_val_t *res);
 
+/*
+ * Applies arithmetic or bitwise operator `op` (TOK_PLUS, etc) to numbers.
+ * Sets `resnan` if the result is NaN. Also used by the parser for constant
+ * folding.
+ */
+MJS_PRIVATE double do_arith_op(double da, double db, int op, bool *resnan);
+
 #if defined(__cplusplus)
 }
 #endif /* __cplusplus */
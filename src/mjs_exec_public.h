@@ -25,6 +25,55 @@ mjs_err_t mjs_call(struct mjs *mjs, mjs_val_t *res, mjs_val_t func,
                    mjs_val_t this_val, int nargs, ...);
 mjs_val_t mjs_get_this(struct mjs *mjs);
 
+/*
+ * Execution trace hook: it's called before each instruction is executed, with
+ * the bcode part being executed and the offset of the instruction in it.
+ */
+typedef void(mjs_trace_cb_t)(struct mjs *mjs, const uint8_t *bcode,
+                             size_t offset, void *user_data);
+
+/*
+ * Installs the execution trace hook, or removes it if `cb` is NULL. The change
+ * takes effect the next time the interpreter is entered, e.g. by `mjs_exec()`
+ * or `mjs_call()`. Without a hook installed, execution doesn't pay for it.
+ */
+void mjs_set_trace(struct mjs *mjs, mjs_trace_cb_t *cb, void *user_data);
+
+/*
+ * Limits further execution to `budget` function calls and loop iterations,
+ * so that a script can't run forever: once the budget is spent, execution
+ * stops with `MJS_BUDGET_EXHAUSTED`, and keeps doing so until the budget is
+ * set again. Negative `budget` means no limit, which is the default.
+ *
+ * If possible, the execution is suspended rather than aborted, so it can be
+ * continued by `mjs_resume()` after the budget is set again.
+ */
+void mjs_set_exec_budget(struct mjs *mjs, long budget);
+
+/*
+ * Requests suspension of the script being executed: to be called by a
+ * cfunction, and the script is suspended as soon as the cfunction returns.
+ * `mjs_exec()` (or whichever function has started the script) then returns
+ * `MJS_SUSPENDED`, and the script can be continued by `mjs_resume()`.
+ *
+ * Only a script started by `mjs_exec()`, `mjs_exec_file()` or
+ * `mjs_exec_jsc()` can be suspended, when it calls the cfunction directly,
+ * and while no other execution is suspended. Returns 1 if the suspension is
+ * requested, 0 if it's not possible.
+ */
+int mjs_yield(struct mjs *mjs);
+
+/*
+ * Continues execution of the script which was suspended by `mjs_yield()`, or
+ * because of the exhausted budget. Returns the same as the function which has
+ * started the script, and may suspend again. If nothing is suspended, returns
+ * `MJS_BAD_ARGS_ERROR`.
+ *
+ * While a script is suspended, other code can be executed as usual, except
+ * that it can't be suspended itself.
+ */
+mjs_err_t mjs_resume(struct mjs *mjs, mjs_val_t *res);
+
 #if defined(__cplusplus)
 }
 #endif /* __cplusplus */
@@ -30,4 +30,50 @@
 #endif
 #endif
 
+/*
+ * MJS_ENABLE_COMPUTED_GOTO: if enabled, the interpreter loop dispatches
+ * opcodes through a table of label addresses (the "labels as values"
+ * extension of GCC and Clang), so that every opcode handler jumps directly to
+ * the next one. Otherwise, a portable `switch` is used.
+ *
+ * By default it's enabled for compilers which support the extension.
+ */
+#if !defined(MJS_ENABLE_COMPUTED_GOTO)
+#if defined(__GNUC__) || defined(__clang__)
+#define MJS_ENABLE_COMPUTED_GOTO 1
+#else
+#define MJS_ENABLE_COMPUTED_GOTO 0
+#endif
+#endif
+
+/*
+ * MJS_ENABLE_JIT: if enabled, functions called MJS_JIT_THRESHOLD times are
+ * compiled into native code, see mjs_jit.h. The interpreter executes the rest,
+ * and the instructions which are not compiled.
+ *
+ * Only x86-64 Linux is supported, along with MJS_ENABLE_COMPUTED_GOTO. By
+ * default it's disabled.
+ */
+#if !defined(MJS_ENABLE_JIT)
+#define MJS_ENABLE_JIT 0
+#endif
+
+#if MJS_ENABLE_JIT &&                                          \
+    !(defined(__x86_64__) && defined(__linux__) && MJS_ENABLE_COMPUTED_GOTO)
+#undef MJS_ENABLE_JIT
+#define MJS_ENABLE_JIT 0
+#endif
+
+#if !defined(MJS_JIT_THRESHOLD)
+#define MJS_JIT_THRESHOLD 1000
+#endif
+
+/*
+ * MJS_PROP_CACHE_SIZE: number of objects remembered by the inline cache of
+ * each property access site, see `struct mjs_prop_cache`. Must be at least 1.
+ */
+#if !defined(MJS_PROP_CACHE_SIZE)
+#define MJS_PROP_CACHE_SIZE 4
+#endif
+
 #endif /* MJS_FEATURES_H_ */
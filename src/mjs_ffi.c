@@ -711,8 +711,7 @@ MJS_PRIVATE mjs_err_t mjs_ffi_call2(struct mjs *mjs) {
   }
   res.v.i = 0;
 
-  nargs =
-      mjs_stack_size(&mjs->stack) - mjs_get_int(mjs, vtop(&mjs->call_stack));
+  nargs = mjs_stack_size(&mjs->stack) - mjs_call_frame(mjs, 0)->retval_idx;
 
   if (nargs != psig->args_cnt) {
     ret = MJS_TYPE_ERROR;
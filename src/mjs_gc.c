@@ -8,6 +8,7 @@
 #include "common/cs_varint.h"
 #include "common/mbuf.h"
 
+#include "mjs_bcode.h"
 #include "mjs_core.h"
 #include "mjs_ffi.h"
 #include "mjs_gc.h"
@@ -510,6 +511,40 @@ static void gc_mark_mbuf_val(struct mjs *mjs, const struct mbuf *mbuf) {
                     mbuf->len / sizeof(mjs_val_t));
 }
 
+/*
+ * mark constant pools of the bcode parts
+ */
+static void gc_mark_bcode_consts(struct mjs *mjs) {
+  int i, parts_cnt = mjs_bcode_parts_cnt(mjs);
+  for (i = 0; i < parts_cnt; i++) {
+    struct mjs_bcode_part *bp = mjs_bcode_part_get(mjs, i);
+    gc_mark_val_array(mjs, bp->consts, bp->consts_cnt);
+  }
+}
+
+/*
+ * mark `this` values saved in the call stack frames
+ */
+static void gc_mark_call_stack(struct mjs *mjs) {
+  struct mjs_frame *f = (struct mjs_frame *) mjs->call_stack.buf;
+  size_t i, n = mjs_call_frames_cnt(mjs);
+  for (i = 0; i < n; i++) {
+    gc_mark(mjs, &f[i].this_obj);
+  }
+}
+
+/*
+ * mark variables of the scopes which are not materialised
+ */
+static void gc_mark_scope_vars(struct mjs *mjs) {
+  struct mjs_scope_var *v = (struct mjs_scope_var *) mjs->scope_vars.buf;
+  size_t i, n = mjs->scope_vars.len / sizeof(*v);
+  for (i = 0; i < n; i++) {
+    gc_mark(mjs, &v[i].key);
+    gc_mark(mjs, &v[i].value);
+  }
+}
+
 static void gc_mark_ffi_cbargs_list(struct mjs *mjs, ffi_cb_args_t *cbargs) {
   for (; cbargs != NULL; cbargs = cbargs->next) {
     gc_mark(mjs, &cbargs->func);
@@ -524,8 +559,10 @@ void mjs_gc(struct mjs *mjs, int full) {
 
   gc_mark_mbuf_pt(mjs, &mjs->owned_values);
   gc_mark_mbuf_val(mjs, &mjs->scopes);
+  gc_mark_scope_vars(mjs);
   gc_mark_mbuf_val(mjs, &mjs->stack);
-  gc_mark_mbuf_val(mjs, &mjs->call_stack);
+  gc_mark_call_stack(mjs);
+  gc_mark_bcode_consts(mjs);
 
   gc_mark_ffi_cbargs_list(mjs, mjs->ffi_cb_args);
 
@@ -535,6 +572,9 @@ void mjs_gc(struct mjs *mjs, int full) {
   gc_sweep(mjs, &mjs->node_arena, 0);
   gc_sweep(mjs, &mjs->ffi_sig_arena, 0);
 
+  /* Nodes might be freed, and strings have moved: drop inline caches */
+  mjs->prop_cache_epoch++;
+
   if (full) {
     /*
      * In case of full GC, we also resize strings buffer, but we still leave
@@ -0,0 +1,776 @@
+/*
+ * Copyright (c) 2017 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#include "common/mbuf.h"
+
+#include "mjs_array.h"
+#include "mjs_bcode.h"
+#include "mjs_conversion.h"
+#include "mjs_core.h"
+#include "mjs_internal.h"
+#include "mjs_jit.h"
+#include "mjs_object.h"
+#include "mjs_primitive.h"
+#include "mjs_tok.h"
+
+#if MJS_ENABLE_JIT
+
+#include <sys/mman.h>
+
+/* Hidden by the strict feature macros, but it's always the same on Linux */
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS 0x20
+#endif
+
+/* General purpose registers, numbered as in the instruction encoding */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI };
+/* SSE registers */
+enum { XMM0, XMM1, XMM2 };
+
+/*
+ * Registers which hold the arguments of mjs_jit_run() in the native code;
+ * both are callee-saved, so they survive calls of the helpers
+ */
+#define R_MJS RBX
+#define R_CTX RBP
+
+/* No index register in the memory operand, see jit_mem() */
+#define NO_INDEX (-1)
+
+/* Condition codes of `jcc` and `setcc`; `cc ^ 1` is the opposite condition */
+enum {
+  CC_B = 2,
+  CC_AE = 3,
+  CC_E = 4,
+  CC_NE = 5,
+  CC_BE = 6,
+  CC_A = 7,
+  CC_P = 10,
+  CC_NP = 11,
+};
+/* Unconditional jump, see jit_jcc() */
+#define CC_ALWAYS (-1)
+
+/* Opcodes, two-byte ones include the 0x0f escape */
+#define X86_OR_RM 0x09
+#define X86_CMP_R 0x3b
+#define X86_ALU_IMM8 0x83
+#define X86_TEST 0x85
+#define X86_MOV_RM 0x89
+#define X86_MOV_R 0x8b
+#define X86_LEA 0x8d
+#define X86_MOV_RM8_IMM 0xc6
+#define X86_GRP5 0xff /* /2: call, /4: jmp */
+#define X86_MOVSD_LOAD 0x0f10
+#define X86_MOVSD_STORE 0x0f11
+#define X86_UCOMISD 0x0f2e
+#define X86_XORPD 0x0f57
+#define X86_ADDSD 0x0f58
+#define X86_MULSD 0x0f59
+#define X86_SUBSD 0x0f5c
+#define X86_DIVSD 0x0f5e
+#define X86_MOVQ_XMM 0x0f6e
+#define X86_SETCC 0x0f90
+#define X86_MOVZX8 0x0fb6
+
+/* Prefixes of the SSE instructions */
+#define X86_PFX_66 0x66
+#define X86_PFX_F2 0xf2
+
+#define OFF_STACK_BUF (offsetof(struct mjs, stack) + offsetof(struct mbuf, buf))
+#define OFF_STACK_LEN (offsetof(struct mjs, stack) + offsetof(struct mbuf, len))
+#define OFF_THIS (offsetof(struct mjs, vals) + offsetof(struct mjs_vals, this_obj))
+#define OFF_ERROR offsetof(struct mjs, error)
+#define OFF_FRAME_BASE offsetof(struct mjs_jit_ctx, frame_base)
+#define OFF_PREV_OPCODE offsetof(struct mjs_jit_ctx, prev_opcode)
+
+#define VAL_SIZE ((int32_t) sizeof(mjs_val_t))
+
+/* Executable memory holding the code of one compiled function */
+struct mjs_jit_block {
+  struct mjs_jit_block *next;
+  size_t size;
+};
+
+/* Jump to an instruction which is not emitted yet */
+struct jit_fixup {
+  size_t pos; /* Position of the 32-bit displacement */
+  size_t idx; /* Target instruction */
+};
+
+/* Function being compiled */
+struct jit_emit {
+  struct mbuf buf;    /* Native code */
+  struct mbuf fixups; /* struct jit_fixup */
+  struct mjs *mjs;
+  const struct mjs_bcode_part *bp;
+  const struct mjs_jit_helpers *h;
+  size_t entry, end; /* Instructions of the function */
+  size_t exit;       /* Position of the code returning to the interpreter */
+};
+
+static void jit_byte(struct jit_emit *e, uint8_t b) {
+  mbuf_append(&e->buf, &b, sizeof(b));
+}
+
+static void jit_u32(struct jit_emit *e, uint32_t v) {
+  mbuf_append(&e->buf, &v, sizeof(v));
+}
+
+static void jit_u64(struct jit_emit *e, uint64_t v) {
+  mbuf_append(&e->buf, &v, sizeof(v));
+}
+
+/* REX prefix, if any, for the given registers; `w` selects 64-bit operands */
+static void jit_rex(struct jit_emit *e, int w, int reg, int index, int base) {
+  uint8_t rex = 0x40 | (w ? 8 : 0) | ((reg & 8) >> 1) |
+                (index == NO_INDEX ? 0 : (index & 8) >> 2) | ((base & 8) >> 3);
+  if (rex != 0x40) jit_byte(e, rex);
+}
+
+static void jit_opcode(struct jit_emit *e, int pfx, int w, unsigned op,
+                       int reg, int index, int base) {
+  if (pfx != 0) jit_byte(e, pfx);
+  jit_rex(e, w, reg, index, base);
+  if (op > 0xff) jit_byte(e, op >> 8);
+  jit_byte(e, op & 0xff);
+}
+
+/*
+ * Instruction `op` with a register (or an opcode extension) `reg`, and memory
+ * operand `[base + index * scale + disp]`
+ */
+static void jit_mem(struct jit_emit *e, int pfx, int w, unsigned op, int reg,
+                    int base, int index, int scale, int32_t disp) {
+  int mod = 2;
+  if (disp == 0 && (base & 7) != RBP) {
+    mod = 0;
+  } else if (disp >= -128 && disp <= 127) {
+    mod = 1;
+  }
+  jit_opcode(e, pfx, w, op, reg, index, base);
+  if (index == NO_INDEX && (base & 7) != RSP) {
+    jit_byte(e, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+  } else {
+    int ss = scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+    jit_byte(e, (mod << 6) | ((reg & 7) << 3) | RSP);
+    jit_byte(e, (ss << 6) | ((index == NO_INDEX ? RSP : index & 7) << 3) |
+                    (base & 7));
+  }
+  if (mod == 1) {
+    jit_byte(e, (uint8_t) disp);
+  } else if (mod == 2) {
+    jit_u32(e, (uint32_t) disp);
+  }
+}
+
+/* Instruction `op` with register operands `reg` and `rm` */
+static void jit_rr(struct jit_emit *e, int pfx, int w, unsigned op, int reg,
+                   int rm) {
+  jit_opcode(e, pfx, w, op, reg, NO_INDEX, rm);
+  jit_byte(e, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* ALU operation `ext` (0: add, 5: sub, 7: cmp) of a register and `imm` */
+static void jit_alu_imm(struct jit_emit *e, int ext, int reg, int32_t imm) {
+  if (imm >= -128 && imm <= 127) {
+    jit_rr(e, 0, 1, X86_ALU_IMM8, ext, reg);
+    jit_byte(e, (uint8_t) imm);
+  } else {
+    jit_rr(e, 0, 1, 0x81, ext, reg);
+    jit_u32(e, (uint32_t) imm);
+  }
+}
+
+static void jit_mov_imm(struct jit_emit *e, int reg, uint64_t imm) {
+  if (imm <= 0xffffffff) {
+    /* 32-bit moves clear the upper half */
+    jit_rex(e, 0, 0, NO_INDEX, reg);
+    jit_byte(e, 0xb8 + (reg & 7));
+    jit_u32(e, (uint32_t) imm);
+  } else {
+    jit_rex(e, 1, 0, NO_INDEX, reg);
+    jit_byte(e, 0xb8 + (reg & 7));
+    jit_u64(e, imm);
+  }
+}
+
+static void jit_mov_ptr(struct jit_emit *e, int reg, const void *p) {
+  jit_mov_imm(e, reg, (uint64_t) (uintptr_t) p);
+}
+
+/* Loads the value at address `p`, which is read when the code is executed */
+static void jit_load_abs(struct jit_emit *e, int reg, const void *p) {
+  jit_mov_ptr(e, reg, p);
+  jit_mem(e, 0, 1, X86_MOV_R, reg, reg, NO_INDEX, 1, 0);
+}
+
+/* Emits `jcc` or `jmp` with a displacement to be set by jit_patch() */
+static size_t jit_jcc(struct jit_emit *e, int cc) {
+  if (cc == CC_ALWAYS) {
+    jit_byte(e, 0xe9);
+  } else {
+    jit_byte(e, 0x0f);
+    jit_byte(e, 0x80 + cc);
+  }
+  jit_u32(e, 0);
+  return e->buf.len - sizeof(uint32_t);
+}
+
+/* Sets the jump at `pos` to jump to `target` */
+static void jit_patch(struct jit_emit *e, size_t pos, size_t target) {
+  int32_t rel = (int32_t) (target - (pos + sizeof(rel)));
+  memcpy(e->buf.buf + pos, &rel, sizeof(rel));
+}
+
+/* Jumps to the current position from `pos`, see jit_jcc() */
+static void jit_here(struct jit_emit *e, size_t pos) {
+  jit_patch(e, pos, e->buf.len);
+}
+
+/* Returns to the interpreter, which is to execute instruction `idx` */
+static void jit_exit(struct jit_emit *e, size_t idx) {
+  jit_mov_imm(e, RAX, idx);
+  jit_patch(e, jit_jcc(e, CC_ALWAYS), e->exit);
+}
+
+static void jit_exit_if(struct jit_emit *e, int cc, size_t idx) {
+  size_t skip = jit_jcc(e, cc ^ 1);
+  jit_exit(e, idx);
+  jit_here(e, skip);
+}
+
+/* Jumps to instruction `idx` if condition `cc` holds */
+static void jit_goto(struct jit_emit *e, int cc, size_t idx) {
+  if (idx >= e->entry && idx < e->end) {
+    struct jit_fixup f;
+    f.pos = jit_jcc(e, cc);
+    f.idx = idx;
+    mbuf_append(&e->fixups, &f, sizeof(f));
+  } else if (cc == CC_ALWAYS) {
+    jit_exit(e, idx);
+  } else {
+    jit_exit_if(e, cc, idx);
+  }
+}
+
+/* Calls `fn` with `mjs` as the first argument; others should be set already */
+static void jit_call(struct jit_emit *e, const void *fn) {
+  jit_rr(e, 0, 1, X86_MOV_RM, R_MJS, RDI);
+  jit_mov_ptr(e, RAX, fn);
+  jit_rr(e, 0, 0, X86_GRP5, 2, RAX);
+}
+
+#define JIT_CALL(e, fn) jit_call(e, (const void *) (uintptr_t)(fn))
+
+/* Returns to the interpreter if a helper has set an error */
+static void jit_check_error(struct jit_emit *e, size_t idx) {
+  jit_mem(e, 0, 0, X86_ALU_IMM8, 7, R_MJS, NO_INDEX, 1, OFF_ERROR);
+  jit_byte(e, 0);
+  jit_exit_if(e, CC_NE, idx);
+}
+
+/* Remembers the opcode of the instruction as executed, for the next one */
+static void jit_set_prev(struct jit_emit *e, uint8_t opcode) {
+  jit_mem(e, 0, 0, X86_MOV_RM8_IMM, 0, R_CTX, NO_INDEX, 1, OFF_PREV_OPCODE);
+  jit_byte(e, opcode);
+}
+
+/*
+ * Loads the data stack: length into rdx, buffer into rcx. If there are less
+ * than `n` values, the instruction `idx` is left to the interpreter.
+ */
+static void jit_stack(struct jit_emit *e, int n, size_t idx) {
+  jit_mem(e, 0, 1, X86_MOV_R, RDX, R_MJS, NO_INDEX, 1, OFF_STACK_LEN);
+  if (n > 0) {
+    jit_alu_imm(e, 7, RDX, n * VAL_SIZE);
+    jit_exit_if(e, CC_B, idx);
+  }
+  jit_mem(e, 0, 1, X86_MOV_R, RCX, R_MJS, NO_INDEX, 1, OFF_STACK_BUF);
+}
+
+/* Drops `n` values from the stack loaded by jit_stack() */
+static void jit_drop(struct jit_emit *e, int n) {
+  jit_alu_imm(e, 5, RDX, n * VAL_SIZE);
+  jit_mem(e, 0, 1, X86_MOV_RM, RDX, R_MJS, NO_INDEX, 1, OFF_STACK_LEN);
+}
+
+/*
+ * Pushes rax. Like exec_push(), it doesn't grow the stack: the room is
+ * reserved when the function is called.
+ */
+static void jit_push(struct jit_emit *e) {
+  jit_mem(e, 0, 1, X86_MOV_R, RDX, R_MJS, NO_INDEX, 1, OFF_STACK_LEN);
+  jit_mem(e, 0, 1, X86_MOV_R, RCX, R_MJS, NO_INDEX, 1, OFF_STACK_BUF);
+  jit_mem(e, 0, 1, X86_MOV_RM, RAX, RCX, RDX, 1, 0);
+  jit_mem(e, 0, 1, X86_LEA, RDX, RDX, NO_INDEX, 1, VAL_SIZE);
+  jit_mem(e, 0, 1, X86_MOV_RM, RDX, R_MJS, NO_INDEX, 1, OFF_STACK_LEN);
+}
+
+static void jit_push_imm(struct jit_emit *e, mjs_val_t v) {
+  jit_mov_imm(e, RAX, v);
+  jit_push(e);
+}
+
+/* Loads the TOS into rax */
+static void jit_top(struct jit_emit *e, size_t idx) {
+  jit_stack(e, 1, idx);
+  jit_mem(e, 0, 1, X86_MOV_R, RAX, RCX, RDX, 1, -VAL_SIZE);
+}
+
+/* Pops the TOS into rax */
+static void jit_pop(struct jit_emit *e, size_t idx) {
+  jit_top(e, idx);
+  jit_drop(e, 1);
+}
+
+/* Calls mjs_is_truthy() for rax */
+static void jit_truthy(struct jit_emit *e) {
+  jit_rr(e, 0, 1, X86_MOV_RM, RAX, RSI);
+  JIT_CALL(e, mjs_is_truthy);
+}
+
+/*
+ * Conditional jump of instruction `k` to `idx`, by truthiness in eax: if
+ * `on_false`, it jumps if eax is 0, pushing `undefined` first if `push_undef`.
+ */
+static void jit_branch(struct jit_emit *e, size_t k, size_t idx, int on_false,
+                       int push_undef) {
+  jit_set_prev(e, e->bp->insns[k].opcode);
+  jit_rr(e, 0, 0, X86_TEST, RAX, RAX);
+  if (push_undef) {
+    size_t skip = jit_jcc(e, CC_NE);
+    jit_push_imm(e, MJS_UNDEFINED);
+    jit_goto(e, CC_ALWAYS, idx);
+    jit_here(e, skip);
+  } else {
+    jit_goto(e, on_false ? CC_E : CC_NE, idx);
+  }
+}
+
+/*
+ * Loads two numbers from the top of the stack into xmm0 and xmm1. Returns
+ * position of the jump to be taken if they're not numbers (or NaN, which is
+ * left to the slow path too): jit_stack() is done already.
+ */
+static void jit_load_numbers(struct jit_emit *e, size_t *slow) {
+  jit_mem(e, X86_PFX_F2, 0, X86_MOVSD_LOAD, XMM0, RCX, RDX, 1, -2 * VAL_SIZE);
+  jit_mem(e, X86_PFX_F2, 0, X86_MOVSD_LOAD, XMM1, RCX, RDX, 1, -VAL_SIZE);
+  jit_rr(e, X86_PFX_66, 0, X86_UCOMISD, XMM0, XMM0);
+  slow[0] = jit_jcc(e, CC_P);
+  jit_rr(e, X86_PFX_66, 0, X86_UCOMISD, XMM1, XMM1);
+  slow[1] = jit_jcc(e, CC_P);
+}
+
+/*
+ * Compares the numbers loaded by jit_load_numbers() as the given opcode does,
+ * leaving the boolean result in eax
+ */
+static void jit_compare(struct jit_emit *e, int opcode) {
+  int cc;
+  switch (opcode) {
+    case OP_LT:
+      cc = CC_B;
+      break;
+    case OP_LE:
+      cc = CC_BE;
+      break;
+    case OP_GT:
+      cc = CC_A;
+      break;
+    case OP_GE:
+      cc = CC_AE;
+      break;
+    default:
+      /* Like num_strict_eq(): since there are no NaNs, compare the bits */
+      jit_mem(e, 0, 1, X86_MOV_R, RAX, RCX, RDX, 1, -2 * VAL_SIZE);
+      jit_mem(e, 0, 1, X86_CMP_R, RAX, RCX, RDX, 1, -VAL_SIZE);
+      cc = opcode == OP_EQ_EQ ? CC_E : CC_NE;
+      break;
+  }
+  if (opcode >= OP_LT && opcode <= OP_GE) {
+    jit_rr(e, X86_PFX_66, 0, X86_UCOMISD, XMM0, XMM1);
+  }
+  jit_rr(e, 0, 0, X86_SETCC + cc, 0, RAX);
+  jit_rr(e, 0, 0, X86_MOVZX8, RAX, RAX);
+}
+
+/* Token of the operator of OP_ADD ... OP_NE_NE */
+static int jit_binop_tok(int opcode) {
+  static const int toks[] = {TOK_PLUS, TOK_MINUS, TOK_MUL,   TOK_DIV,
+                             TOK_LT,   TOK_LE,    TOK_GT,    TOK_GE,
+                             TOK_EQ_EQ, TOK_NE_NE};
+  return toks[opcode - OP_ADD];
+}
+
+/* OP_ADD ... OP_NE_NE, like MJS_OP_NUM_BINOP() */
+static void jit_binop(struct jit_emit *e, size_t k) {
+  int opcode = e->bp->insns[k].opcode;
+  size_t slow[4], done;
+  int nslow = 3, j;
+  jit_mem(e, 0, 1, X86_MOV_R, RDX, R_MJS, NO_INDEX, 1, OFF_STACK_LEN);
+  jit_alu_imm(e, 7, RDX, 2 * VAL_SIZE);
+  slow[2] = jit_jcc(e, CC_B);
+  jit_mem(e, 0, 1, X86_MOV_R, RCX, R_MJS, NO_INDEX, 1, OFF_STACK_BUF);
+  jit_load_numbers(e, slow);
+  if (opcode <= OP_DIV) {
+    static const unsigned ops[] = {X86_ADDSD, X86_SUBSD, X86_MULSD, X86_DIVSD};
+    size_t num;
+    if (opcode == OP_DIV) {
+      /* Division by zero is left to exec_expr(), like the interpreter does */
+      jit_rr(e, X86_PFX_66, 0, X86_XORPD, XMM2, XMM2);
+      jit_rr(e, X86_PFX_66, 0, X86_UCOMISD, XMM1, XMM2);
+      slow[nslow++] = jit_jcc(e, CC_E);
+    }
+    jit_rr(e, X86_PFX_F2, 0, ops[opcode - OP_ADD], XMM0, XMM1);
+    /* Like mjs_mk_number(), NaN results are canonical */
+    jit_rr(e, X86_PFX_66, 0, X86_UCOMISD, XMM0, XMM0);
+    num = jit_jcc(e, CC_NP);
+    jit_mov_imm(e, RAX, MJS_TAG_NAN);
+    jit_rr(e, X86_PFX_66, 1, X86_MOVQ_XMM, XMM0, RAX);
+    jit_here(e, num);
+    jit_mem(e, X86_PFX_F2, 0, X86_MOVSD_STORE, XMM0, RCX, RDX, 1,
+            -2 * VAL_SIZE);
+  } else {
+    jit_compare(e, opcode);
+    jit_mov_imm(e, RSI, MJS_TAG_BOOLEAN);
+    jit_rr(e, 0, 1, X86_OR_RM, RSI, RAX);
+    jit_mem(e, 0, 1, X86_MOV_RM, RAX, RCX, RDX, 1, -2 * VAL_SIZE);
+  }
+  jit_drop(e, 1);
+  done = jit_jcc(e, CC_ALWAYS);
+  for (j = 0; j < nslow; j++) jit_here(e, slow[j]);
+  jit_mov_imm(e, RSI, jit_binop_tok(opcode));
+  JIT_CALL(e, e->h->expr);
+  jit_check_error(e, k);
+  jit_here(e, done);
+  jit_set_prev(e, opcode);
+}
+
+/* OP_JMP_FALSE_LT ... OP_JMP_FALSE_NE_NE, like MJS_OP_JMP_FALSE_CMP() */
+static void jit_cmp_jmp(struct jit_emit *e, size_t k) {
+  int opcode = e->bp->insns[k].opcode - OP_JMP_FALSE_LT + OP_LT;
+  size_t slow[3], done;
+  int j;
+  jit_mem(e, 0, 1, X86_MOV_R, RDX, R_MJS, NO_INDEX, 1, OFF_STACK_LEN);
+  jit_alu_imm(e, 7, RDX, 2 * VAL_SIZE);
+  slow[2] = jit_jcc(e, CC_B);
+  jit_mem(e, 0, 1, X86_MOV_R, RCX, R_MJS, NO_INDEX, 1, OFF_STACK_BUF);
+  jit_load_numbers(e, slow);
+  jit_compare(e, opcode);
+  jit_drop(e, 2);
+  done = jit_jcc(e, CC_ALWAYS);
+  for (j = 0; j < 3; j++) jit_here(e, slow[j]);
+  jit_mov_imm(e, RSI, jit_binop_tok(opcode));
+  JIT_CALL(e, e->h->cmp);
+  jit_check_error(e, k);
+  jit_here(e, done);
+  jit_branch(e, k, e->bp->insns[k].a, 1, 1);
+}
+
+/*
+ * OP_CONTINUE and OP_BREAK: `fn` returns index of the target instruction,
+ * whose native code is looked up at run time
+ */
+static void jit_loop_jump(struct jit_emit *e, size_t k, size_t (*fn)(struct mjs *)) {
+  size_t interp;
+  JIT_CALL(e, fn);
+  jit_alu_imm(e, 7, RAX, -1);
+  jit_exit_if(e, CC_E, k);
+  jit_set_prev(e, e->bp->insns[k].opcode);
+  jit_mov_ptr(e, RCX, e->bp->jit->code);
+  jit_mem(e, 0, 1, X86_MOV_R, RCX, RCX, RAX, 8, 0);
+  jit_alu_imm(e, 7, RCX, (int32_t) (uintptr_t) MJS_JIT_EXIT);
+  interp = jit_jcc(e, CC_BE);
+  jit_rr(e, 0, 0, X86_GRP5, 4, RCX);
+  /* The target is not compiled: rax is its index already */
+  jit_here(e, interp);
+  jit_patch(e, jit_jcc(e, CC_ALWAYS), e->exit);
+}
+
+/*
+ * Emits native code of instruction `k`. Returns 0 if the instruction is left
+ * to the interpreter.
+ */
+static int jit_insn(struct jit_emit *e, size_t k) {
+  const struct mjs_insn *in = &e->bp->insns[k];
+  const struct mjs_jit_helpers *h = e->h;
+  switch (in->opcode) {
+    case OP_NOP:
+      break;
+    case OP_DROP:
+      jit_stack(e, 1, k);
+      jit_drop(e, 1);
+      break;
+    case OP_DUP:
+      jit_top(e, k);
+      jit_push(e);
+      break;
+    case OP_SWAP:
+      jit_stack(e, 2, k);
+      jit_mem(e, 0, 1, X86_MOV_R, RAX, RCX, RDX, 1, -VAL_SIZE);
+      jit_mem(e, 0, 1, X86_MOV_R, RSI, RCX, RDX, 1, -2 * VAL_SIZE);
+      jit_mem(e, 0, 1, X86_MOV_RM, RAX, RCX, RDX, 1, -2 * VAL_SIZE);
+      jit_mem(e, 0, 1, X86_MOV_RM, RSI, RCX, RDX, 1, -VAL_SIZE);
+      break;
+    case OP_PUSH_NULL:
+      jit_push_imm(e, MJS_NULL);
+      break;
+    case OP_PUSH_UNDEF:
+      jit_push_imm(e, MJS_UNDEFINED);
+      break;
+    case OP_PUSH_FALSE:
+      jit_push_imm(e, mjs_mk_boolean(e->mjs, 0));
+      break;
+    case OP_PUSH_TRUE:
+      jit_push_imm(e, mjs_mk_boolean(e->mjs, 1));
+      break;
+    case OP_PUSH_INT:
+      jit_push_imm(e, mjs_mk_number(e->mjs, (double) in->v.i));
+      break;
+    case OP_PUSH_DBL:
+      jit_push_imm(e, mjs_mk_number(e->mjs, in->v.d));
+      break;
+    case OP_PUSH_STR:
+      /* Constants are loaded at run time: GC can move the strings */
+      jit_load_abs(e, RAX, &e->bp->consts[in->a]);
+      jit_push(e);
+      break;
+    case OP_PUSH_THIS:
+      jit_mem(e, 0, 1, X86_MOV_R, RAX, R_MJS, NO_INDEX, 1, OFF_THIS);
+      jit_push(e);
+      break;
+    case OP_PUSH_OBJ:
+      JIT_CALL(e, mjs_mk_object);
+      jit_push(e);
+      break;
+    case OP_PUSH_ARRAY:
+      JIT_CALL(e, mjs_mk_array);
+      jit_push(e);
+      break;
+    case OP_GET_LOCAL:
+      jit_mem(e, 0, 1, X86_MOV_R, RAX, R_CTX, NO_INDEX, 1, OFF_FRAME_BASE);
+      jit_mem(e, 0, 1, X86_MOV_R, RCX, R_MJS, NO_INDEX, 1, OFF_STACK_BUF);
+      jit_mem(e, 0, 1, X86_MOV_R, RAX, RCX, RAX, 8, in->a * VAL_SIZE);
+      jit_push(e);
+      break;
+    case OP_SET_LOCAL:
+      jit_top(e, k);
+      jit_mem(e, 0, 1, X86_MOV_R, RSI, R_CTX, NO_INDEX, 1, OFF_FRAME_BASE);
+      jit_mem(e, 0, 1, X86_MOV_RM, RAX, RCX, RSI, 8, in->a * VAL_SIZE);
+      break;
+    case OP_JMP:
+      jit_set_prev(e, in->opcode);
+      jit_goto(e, CC_ALWAYS, in->a);
+      return 1;
+    case OP_JMP_FALSE:
+      jit_pop(e, k);
+      jit_truthy(e);
+      jit_branch(e, k, in->a, 1, 1);
+      return 1;
+    case OP_JMP_NEUTRAL_TRUE:
+    case OP_JMP_NEUTRAL_FALSE:
+      jit_top(e, k);
+      jit_truthy(e);
+      jit_branch(e, k, in->a, in->opcode == OP_JMP_NEUTRAL_FALSE, 0);
+      return 1;
+    case OP_JMP_FALSE_LT:
+    case OP_JMP_FALSE_LE:
+    case OP_JMP_FALSE_GT:
+    case OP_JMP_FALSE_GE:
+    case OP_JMP_FALSE_EQ_EQ:
+    case OP_JMP_FALSE_NE_NE:
+      jit_cmp_jmp(e, k);
+      return 1;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE:
+    case OP_EQ_EQ:
+    case OP_NE_NE:
+      jit_binop(e, k);
+      return 1;
+    case OP_EXPR:
+      if (in->op == TOK_ASSIGN) {
+        jit_mov_ptr(e, RSI, &e->bp->prop_caches[in->b]);
+        JIT_CALL(e, h->assign);
+      } else {
+        jit_mov_imm(e, RSI, in->op);
+        JIT_CALL(e, h->expr);
+      }
+      jit_check_error(e, k);
+      break;
+    case OP_GET:
+      jit_mov_ptr(e, RSI, &e->bp->prop_caches[in->b]);
+      jit_mem(e, 0, 0, X86_MOVZX8, RDX, R_CTX, NO_INDEX, 1, OFF_PREV_OPCODE);
+      JIT_CALL(e, h->get);
+      jit_check_error(e, k);
+      break;
+    case OP_GET_VAR:
+    case OP_SET_VAR:
+    case OP_CREATE_VAR:
+      jit_load_abs(e, RSI, &e->bp->consts[in->a]);
+      JIT_CALL(e, in->opcode == OP_GET_VAR
+                      ? h->get_var
+                      : in->opcode == OP_SET_VAR ? h->set_var : h->create_var);
+      jit_check_error(e, k);
+      break;
+    case OP_GET_PROP_CONST:
+    case OP_SET_PROP_CONST:
+      jit_load_abs(e, RSI, &e->bp->consts[in->a]);
+      jit_mov_ptr(e, RDX, &e->bp->prop_caches[in->b]);
+      JIT_CALL(e, in->opcode == OP_GET_PROP_CONST ? h->get_prop_const
+                                                  : h->set_prop_const);
+      jit_check_error(e, k);
+      break;
+    case OP_FIND_SCOPE:
+      JIT_CALL(e, h->find_scope);
+      jit_check_error(e, k);
+      break;
+    case OP_ARGS:
+      jit_mem(e, 0, 0, X86_MOVZX8, RSI, R_CTX, NO_INDEX, 1, OFF_PREV_OPCODE);
+      JIT_CALL(e, h->args);
+      break;
+    case OP_SETRETVAL:
+      JIT_CALL(e, h->setretval);
+      jit_check_error(e, k);
+      break;
+    case OP_LOOP:
+      jit_mov_imm(e, RSI, in->a);
+      jit_mov_imm(e, RDX, in->b);
+      JIT_CALL(e, h->loop);
+      break;
+    case OP_CONTINUE:
+      jit_loop_jump(e, k, h->cont);
+      return 1;
+    case OP_BREAK:
+      jit_loop_jump(e, k, h->brk);
+      return 1;
+    default:
+      /* Calls, returns, scopes and the rare ones */
+      jit_exit(e, k);
+      return 0;
+  }
+  jit_set_prev(e, in->opcode);
+  return 1;
+}
+
+MJS_PRIVATE struct mjs_jit *mjs_jit_create(size_t insns_cnt) {
+  struct mjs_jit *jit = (struct mjs_jit *) calloc(1, sizeof(*jit));
+  jit->calls = (uint32_t *) calloc(insns_cnt, sizeof(*jit->calls));
+  jit->code = (void **) calloc(insns_cnt, sizeof(*jit->code));
+  return jit;
+}
+
+MJS_PRIVATE void mjs_jit_free(struct mjs_jit *jit) {
+  if (jit == NULL) return;
+  while (jit->blocks != NULL) {
+    struct mjs_jit_block *b = jit->blocks;
+    jit->blocks = b->next;
+    munmap(b, b->size);
+  }
+  free(jit->calls);
+  free(jit->code);
+  free(jit);
+}
+
+MJS_PRIVATE void mjs_jit_compile(struct mjs *mjs,
+                                 const struct mjs_bcode_part *bp, size_t entry,
+                                 const struct mjs_jit_helpers *h) {
+  struct mjs_jit *jit = bp->jit;
+  struct jit_emit e;
+  struct mjs_jit_block *block;
+  size_t *pos, k, size, enter;
+  char *compiled;
+
+  /* Functions are preceded with a jump over them, see parse_function() */
+  if (entry == 0 || bp->insns[entry - 1].opcode != OP_JMP ||
+      bp->insns[entry - 1].a <= entry ||
+      bp->insns[entry - 1].a > bp->insns_cnt) {
+    return;
+  }
+  memset(&e, 0, sizeof(e));
+  mbuf_init(&e.buf, 0);
+  mbuf_init(&e.fixups, 0);
+  e.mjs = mjs;
+  e.bp = bp;
+  e.h = h;
+  e.entry = entry;
+  e.end = bp->insns[entry - 1].a;
+  pos = (size_t *) calloc(e.end - e.entry, sizeof(*pos));
+  compiled = (char *) calloc(e.end - e.entry, 1);
+
+  /*
+   * Entry: push rbx, rbp and align the stack; mjs and ctx are kept in them,
+   * see mjs_jit_run()
+   */
+  enter = e.buf.len;
+  jit_byte(&e, 0x50 + RBX);
+  jit_byte(&e, 0x50 + RBP);
+  jit_alu_imm(&e, 5, RSP, 8);
+  jit_rr(&e, 0, 1, X86_MOV_RM, RDI, R_MJS);
+  jit_rr(&e, 0, 1, X86_MOV_RM, RSI, R_CTX);
+  jit_rr(&e, 0, 0, X86_GRP5, 4, RDX);
+
+  /* Exit: rax is the index of the instruction to be interpreted */
+  e.exit = e.buf.len;
+  jit_alu_imm(&e, 0, RSP, 8);
+  jit_byte(&e, 0x58 + RBP);
+  jit_byte(&e, 0x58 + RBX);
+  jit_byte(&e, 0xc3);
+
+  for (k = e.entry; k < e.end; k++) {
+    pos[k - e.entry] = e.buf.len;
+    compiled[k - e.entry] = (char) jit_insn(&e, k);
+  }
+  jit_exit(&e, e.end);
+  for (k = 0; k < e.fixups.len / sizeof(struct jit_fixup); k++) {
+    const struct jit_fixup *f = &((struct jit_fixup *) e.fixups.buf)[k];
+    jit_patch(&e, f->pos, pos[f->idx - e.entry]);
+  }
+
+  size = sizeof(*block) + e.buf.len;
+  block = (struct mjs_jit_block *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (block != MAP_FAILED) {
+    char *code = (char *) (block + 1);
+    memcpy(code, e.buf.buf, e.buf.len);
+    block->next = jit->blocks;
+    block->size = size;
+    if (mprotect(block, size, PROT_READ | PROT_EXEC) == 0) {
+      jit->blocks = block;
+      if (jit->enter == NULL) jit->enter = code + enter;
+      /* Code of the nested functions might be compiled already */
+      for (k = e.entry; k < e.end; k++) {
+        if (jit->code[k] == NULL) {
+          jit->code[k] =
+              compiled[k - e.entry] ? code + pos[k - e.entry] : MJS_JIT_EXIT;
+        }
+      }
+      LOG(LL_DEBUG, ("compiled %d instructions at %d+%d: %d bytes",
+                     (int) (e.end - e.entry), (int) bp->start_idx,
+                     (int) bp->insns[entry].off, (int) e.buf.len));
+    } else {
+      munmap(block, size);
+    }
+  }
+  free(pos);
+  free(compiled);
+  mbuf_free(&e.buf);
+  mbuf_free(&e.fixups);
+}
+
+MJS_PRIVATE size_t mjs_jit_run(struct mjs *mjs, const struct mjs_jit *jit,
+                               struct mjs_jit_ctx *ctx, void *code) {
+  size_t (*enter)(struct mjs *, struct mjs_jit_ctx *, void *);
+  memcpy(&enter, &jit->enter, sizeof(enter));
+  return enter(mjs, ctx, code);
+}
+
+#endif /* MJS_ENABLE_JIT */
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2017 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef MJS_JIT_H_
+#define MJS_JIT_H_
+
+#include "mjs_core.h"
+#include "mjs_internal.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* __cplusplus */
+
+#if MJS_ENABLE_JIT
+
+/*
+ * Template JIT: once a function is called MJS_JIT_THRESHOLD times, its decoded
+ * instructions are translated into x86-64 code, one template per instruction.
+ * Numbers, stack and local slots, and jumps are handled by the native code
+ * itself; most of the other opcodes call the same C helpers as the
+ * interpreter, see `struct mjs_jit_helpers`. Calls, returns and a few rare
+ * opcodes are left to the interpreter: the native code returns to it right
+ * before such an instruction, and it enters the native code again right after
+ * (see `op_jit` in exec_run()).
+ */
+
+/*
+ * Entry of `code` of the instructions which are always executed by the
+ * interpreter
+ */
+#define MJS_JIT_EXIT ((void *) 1)
+
+/* JIT state of a bcode part, created along with its decoded instructions */
+struct mjs_jit {
+  /* Number of calls, by index of the first instruction of the function */
+  uint32_t *calls;
+  /*
+   * Native code of the compiled instructions, by index: NULL if the
+   * instruction is not compiled, MJS_JIT_EXIT if it's executed by the
+   * interpreter
+   */
+  void **code;
+  /* Entry point of the native code, see mjs_jit_run() */
+  void *enter;
+  /* Executable memory of the compiled functions, see mjs_jit_compile() */
+  struct mjs_jit_block *blocks;
+};
+
+/* State of the interpreter which is visible to the native code */
+struct mjs_jit_ctx {
+  size_t frame_base;   /* See exec_frame_base() */
+  uint8_t prev_opcode; /* Opcode of the last executed instruction */
+};
+
+/*
+ * C helpers called by the native code; each one does what the interpreter
+ * does for the given opcode.
+ */
+struct mjs_jit_helpers {
+  void (*expr)(struct mjs *mjs, int op);
+  /* Comparison `op` fused with OP_JMP_FALSE: returns truthiness of the result */
+  int (*cmp)(struct mjs *mjs, int op);
+  void (*get)(struct mjs *mjs, struct mjs_prop_cache *c, int prev_opcode);
+  void (*get_var)(struct mjs *mjs, mjs_val_t key);
+  void (*set_var)(struct mjs *mjs, mjs_val_t key);
+  void (*create_var)(struct mjs *mjs, mjs_val_t key);
+  void (*get_prop_const)(struct mjs *mjs, mjs_val_t key,
+                         struct mjs_prop_cache *c);
+  void (*set_prop_const)(struct mjs *mjs, mjs_val_t key,
+                         struct mjs_prop_cache *c);
+  void (*assign)(struct mjs *mjs, struct mjs_prop_cache *c);
+  void (*find_scope)(struct mjs *mjs);
+  void (*args)(struct mjs *mjs, int prev_opcode);
+  void (*setretval)(struct mjs *mjs);
+  void (*loop)(struct mjs *mjs, size_t brk, size_t cont);
+  /*
+   * OP_CONTINUE and OP_BREAK: return index of the instruction to jump to, or
+   * (size_t) -1 if the instruction has to be executed by the interpreter.
+   */
+  size_t (*cont)(struct mjs *mjs);
+  size_t (*brk)(struct mjs *mjs);
+};
+
+/* Creates JIT state of the bcode part with `insns_cnt` instructions */
+MJS_PRIVATE struct mjs_jit *mjs_jit_create(size_t insns_cnt);
+
+/* Frees JIT state and all native code of the bcode part */
+MJS_PRIVATE void mjs_jit_free(struct mjs_jit *jit);
+
+/*
+ * Compiles the function whose first instruction is `entry`, setting its
+ * entries in `bp->jit->code`. If the function can't be compiled, nothing is
+ * changed, and it's executed by the interpreter.
+ */
+MJS_PRIVATE void mjs_jit_compile(struct mjs *mjs,
+                                 const struct mjs_bcode_part *bp, size_t entry,
+                                 const struct mjs_jit_helpers *h);
+
+/*
+ * Runs native code `code` of an instruction. Returns index of the next
+ * instruction, which is to be executed by the interpreter: either it's one
+ * which is not compiled, or an error was set by the instruction itself.
+ */
+MJS_PRIVATE size_t mjs_jit_run(struct mjs *mjs, const struct mjs_jit *jit,
+                               struct mjs_jit_ctx *ctx, void *code);
+
+#endif /* MJS_ENABLE_JIT */
+
+#if defined(__cplusplus)
+}
+#endif /* __cplusplus */
+
+#endif /* MJS_JIT_H_ */
@@ -13,6 +13,16 @@
 #include "mjs_primitive.h"
 #include "mjs_util.h"
 
+#if MJS_ENABLE_DEBUG
+/* Trace hook which disassembles every instruction being executed */
+static void trace_disasm(struct mjs *mjs, const uint8_t *bcode, size_t offset,
+                         void *user_data) {
+  (void) mjs;
+  (void) user_data;
+  mjs_disasm_single(bcode, offset);
+}
+#endif
+
 int main(int argc, char *argv[]) {
   if (argc == 1) {
     printf("mJS (c) Cesanta, built: " __DATE__ "\n");
@@ -106,6 +116,11 @@ int main(int argc, char *argv[]) {
 
     /* Execute expression. */
     mjs = mjs_create();
+#if MJS_ENABLE_DEBUG
+    if (debug_level >= LL_VERBOSE_DEBUG) {
+      mjs_set_trace(mjs, trace_disasm, NULL);
+    }
+#endif
     err = mjs_exec(mjs, expr, &res);
   } else {
     /* Search for '-c', '-r' and '-j' options. */
@@ -201,6 +216,11 @@ int main(int argc, char *argv[]) {
 
     /* Process files. */
     mjs = mjs_create();
+#if MJS_ENABLE_DEBUG
+    if (debug_level >= LL_VERBOSE_DEBUG) {
+      mjs_set_trace(mjs, trace_disasm, NULL);
+    }
+#endif
     if (precompile) {
       mjs_set_generate_jsc(mjs, 1);
     }
@@ -315,6 +315,8 @@ int mjs_del(struct mjs *mjs, mjs_val_t obj, const char *name, size_t len) {
     z->parent = parent;
   }
   o->prop_count--;
+  /* The node is detached: drop inline caches, see `struct mjs_prop_cache` */
+  mjs->prop_cache_epoch++;
   return 0;
 }
 
@@ -7,6 +7,7 @@
 
 #include "mjs_bcode.h"
 #include "mjs_core.h"
+#include "mjs_exec.h"
 #include "mjs_internal.h"
 #include "mjs_parser.h"
 #include "mjs_string.h"
@@ -64,10 +65,156 @@ static int findtok(int *toks, int tok) {
   return toks[i];
 }
 
+/* Emits a number literal */
+static void emit_num(struct pstate *p, double d) {
+  double iv;
+  if (modf(d, &iv) == 0 && fabs(d) < 9007199254740992.0 /* 2^53 */ &&
+      !(d == 0 && signbit(d))) {
+    emit_byte(p, OP_PUSH_INT);
+    emit_int(p, (int64_t) d);
+  } else {
+    emit_byte(p, OP_PUSH_DBL);
+    emit_dbl(p, d);
+  }
+}
+
+/*
+ * Remembers the literal which was just emitted at `start`; `map_len` is size
+ * of the line numbers map before it was emitted. Literals are remembered while
+ * they follow each other, see fold_op().
+ */
+static void lit_add(struct pstate *p, int start, size_t map_len) {
+  if (p->lits_cnt == 0 || start != p->lits_end ||
+      map_len != p->lits_map_len) {
+    p->lits_cnt = 0;
+  } else if (p->lits_cnt == (int) ARRAY_SIZE(p->lits)) {
+    memmove(p->lits, p->lits + 1, sizeof(p->lits) - sizeof(p->lits[0]));
+    p->lits_cnt--;
+  }
+  p->lits[p->lits_cnt++] = start;
+  p->lits_end = p->cur_idx;
+  p->lits_map_len = p->offset_lineno_map.len;
+}
+
+/*
+ * Decodes the literal at `off`: sets either `d`, or `s` and `len`. Returns
+ * opcode of the literal.
+ */
+static uint8_t lit_get(struct pstate *p, int off, double *d, const char **s,
+                       size_t *len) {
+  const uint8_t *code = (const uint8_t *) p->mjs->bcode_gen.buf + off;
+  int llen;
+  switch (code[0]) {
+    case OP_PUSH_INT:
+      *d = (double) (int64_t) cs_varint_decode_unsafe(code + 1, &llen);
+      break;
+    case OP_PUSH_DBL:
+      memcpy(d, code + 1, sizeof(*d));
+      break;
+    case OP_PUSH_STR:
+      *len = cs_varint_decode_unsafe(code + 1, &llen);
+      *s = (const char *) code + 1 + llen;
+      break;
+  }
+  return code[0];
+}
+
+/*
+ * Constant folding: if the operands of the binary operator `tok` are the two
+ * literals emitted right before, replaces them with the literal result,
+ * computed just like mjs_execute() would. Returns whether it's done.
+ */
+static int fold_op(struct pstate *p, int tok) {
+  struct mbuf *b = &p->mjs->bcode_gen;
+  int start, res = 1;
+  uint8_t op1, op2;
+  double d1 = 0, d2 = 0;
+  const char *s1 = NULL, *s2 = NULL;
+  size_t len1 = 0, len2 = 0;
+  char *s = NULL;
+  bool resnan = false;
+
+  if (p->lits_cnt < 2 || p->lits_end != p->cur_idx ||
+      p->lits_map_len != p->offset_lineno_map.len) {
+    return 0;
+  }
+  start = p->lits[p->lits_cnt - 2];
+  op1 = lit_get(p, start, &d1, &s1, &len1);
+  op2 = lit_get(p, p->lits[p->lits_cnt - 1], &d2, &s2, &len2);
+
+  if (op1 != OP_PUSH_STR && op2 != OP_PUSH_STR) {
+    switch (tok) {
+      case TOK_PLUS:
+      case TOK_MINUS:
+      case TOK_MUL:
+      case TOK_DIV:
+      case TOK_REM:
+      case TOK_AND:
+      case TOK_OR:
+      case TOK_XOR:
+      case TOK_LSHIFT:
+      case TOK_RSHIFT:
+      case TOK_URSHIFT:
+        d1 = do_arith_op(d1, d2, tok, &resnan);
+        if (resnan) d1 = NAN;
+        break;
+      default:
+        res = 0;
+    }
+  } else if (op1 == OP_PUSH_STR && op2 == OP_PUSH_STR && tok == TOK_PLUS) {
+    /* The strings are about to be overwritten, so make a copy */
+    s = (char *) malloc(len1 + len2 + 1);
+    memcpy(s, s1, len1);
+    memcpy(s + len1, s2, len2);
+  } else {
+    res = 0;
+  }
+  if (!res) return 0;
+
+  /* Remove both literals, and emit the result in their place */
+  memmove(b->buf + start, b->buf + p->cur_idx, b->len - p->cur_idx);
+  b->len -= p->cur_idx - start;
+  p->cur_idx = start;
+  p->lits_cnt -= 2;
+  if (s != NULL) {
+    emit_byte(p, OP_PUSH_STR);
+    emit_str(p, s, len1 + len2);
+    free(s);
+  } else {
+    emit_num(p, d1);
+  }
+  p->lits[p->lits_cnt++] = start;
+  p->lits_end = p->cur_idx;
+  p->lits_map_len = p->offset_lineno_map.len;
+  return 1;
+}
+
 static void emit_op(struct pstate *pstate, int tok) {
-  assert(tok >= 0 && tok <= 255);
-  emit_byte(pstate, OP_EXPR);
-  emit_byte(pstate, (uint8_t) tok);
+  uint8_t opcode;
+  if (fold_op(pstate, tok)) return;
+  /* Operators which have their own opcodes */
+  switch (tok) {
+    /* clang-format off */
+    case TOK_PLUS:  opcode = OP_ADD; break;
+    case TOK_MINUS: opcode = OP_SUB; break;
+    case TOK_MUL:   opcode = OP_MUL; break;
+    case TOK_DIV:   opcode = OP_DIV; break;
+    case TOK_LT:    opcode = OP_LT; break;
+    case TOK_LE:    opcode = OP_LE; break;
+    case TOK_GT:    opcode = OP_GT; break;
+    case TOK_GE:    opcode = OP_GE; break;
+    case TOK_EQ_EQ: opcode = OP_EQ_EQ; break;
+    case TOK_NE_NE: opcode = OP_NE_NE; break;
+    /* clang-format on */
+    default:
+      assert(tok >= 0 && tok <= 255);
+      emit_byte(pstate, OP_EXPR);
+      emit_byte(pstate, (uint8_t) tok);
+      return;
+  }
+  /* Comparison can be fused with the jump which follows, see emit_cond_jmp() */
+  if (opcode >= OP_LT && opcode <= OP_NE_NE) pstate->cmp_idx = pstate->cur_idx;
+  emit_byte(pstate, opcode);
 }
 
 #define BINOP_STACK_FRAME_SIZE 16
@@ -107,6 +254,8 @@ static void emit_op(struct pstate *pstate, int tok) {
       if (off_if != 0) {                                                       \
         mjs_bcode_insert_offset(p, p->mjs, off_if,                             \
                                 p->cur_idx - off_if - MJS_INIT_OFFSET_SIZE);   \
+        /* The jump lands after the last comparison: it can't be fused */      \
+        p->cmp_idx = -1;                                                       \
       }                                                                        \
     }                                                                          \
   binop_clean:                                                                 \
@@ -114,20 +263,6 @@ static void emit_op(struct pstate *pstate, int tok) {
     return res;                                                                \
   } while (0)
 
-#define PARSE_RTL_BINOP(p, f1, f2, ops, prev_op)        \
-  do {                                                  \
-    mjs_err_t res = MJS_OK;                             \
-    (void) prev_op;                                     \
-    if ((res = f1(p, TOK_EOF)) != MJS_OK) return res;   \
-    if (findtok(ops, p->tok.tok) != TOK_EOF) {          \
-      int op = p->tok.tok;                              \
-      pnext1(p);                                        \
-      if ((res = f2(p, TOK_EOF)) != MJS_OK) return res; \
-      emit_op(p, op);                                   \
-    }                                                   \
-    return res;                                         \
-  } while (0)
-
 #if MJS_INIT_OFFSET_SIZE > 0
 static void emit_init_offset(struct pstate *p) {
   size_t i;
@@ -141,6 +276,211 @@ static void emit_init_offset(struct pstate *p) {
 }
 #endif
 
+/*
+ * Parses condition of a loop or `if`. Sets `cmp` to whether the condition
+ * ends with a comparison opcode, which can be fused with the jump: see
+ * emit_cond_jmp().
+ */
+static mjs_err_t parse_cond(struct pstate *p, int *cmp) {
+  mjs_err_t res;
+  p->cmp_idx = -1;
+  res = parse_expr(p);
+  *cmp = (p->cmp_idx >= 0 && p->cmp_idx == p->cur_idx - 1);
+  return res;
+}
+
+/*
+ * Emits a jump which is taken if the condition parsed by parse_cond() is
+ * falsy, like OP_JMP_FALSE, right after the condition. If the condition ends
+ * with a comparison, the latter is replaced with a fused compare-and-jump.
+ *
+ * Returns offset of the jump offset, to be set by mjs_bcode_insert_offset().
+ */
+static size_t emit_cond_jmp(struct pstate *p, int cmp) {
+  size_t off;
+  if (cmp) {
+    uint8_t *op = (uint8_t *) &p->mjs->bcode_gen.buf[p->cur_idx - 1];
+    *op = (uint8_t)(OP_JMP_FALSE_LT + (*op - OP_LT));
+  } else {
+    emit_byte(p, OP_JMP_FALSE);
+  }
+  off = p->cur_idx;
+  emit_init_offset(p);
+  return off;
+}
+
+/*
+ * Local slots. In a function which calls nothing, defines no other functions,
+ * and has no for..in loops (they assign the iterator variable by name),
+ * parameters and `let` variables are resolved at parse time to slots of the
+ * function frame, and accessed with OP_GET_LOCAL / OP_SET_LOCAL instead of
+ * being looked up in the scope objects at runtime. Other names are still
+ * looked up by name. Calls rule slots out since scoping is dynamic: a called
+ * function sees the variables of its caller, and load() declares the
+ * variables of the module in the caller's scope.
+ *
+ * The slot of a name is its index in p->locals; names are removed from
+ * there at the end of the block which declares them, so their slots are
+ * reused by the subsequent blocks.
+ */
+static int local_find(struct pstate *p, const struct tok *t) {
+  const struct tok *locals = (const struct tok *) p->locals.buf;
+  int i = p->locals.len / sizeof(*locals);
+  if (!p->use_locals) return -1;
+  while (--i >= 0) {
+    if (locals[i].len == t->len && memcmp(locals[i].ptr, t->ptr, t->len) == 0) {
+      break;
+    }
+  }
+  return i;
+}
+
+static int local_add(struct pstate *p, const struct tok *t) {
+  int slot = p->locals.len / sizeof(*t);
+  mbuf_append(&p->locals, t, sizeof(*t));
+  if (slot >= p->locals_max) p->locals_max = slot + 1;
+  return slot;
+}
+
+/* Returns slot of the `let` variable, which is reused if declared twice */
+static int local_declare(struct pstate *p, const struct tok *t) {
+  int slot = local_find(p, t);
+  if (slot < p->locals_block) slot = local_add(p, t);
+  return slot;
+}
+
+static int locals_block_begin(struct pstate *p) {
+  int prev = p->locals_block;
+  p->locals_block = p->locals.len / sizeof(struct tok);
+  return prev;
+}
+
+static void locals_block_end(struct pstate *p, int prev) {
+  p->locals.len = p->locals_block * sizeof(struct tok);
+  p->locals_block = prev;
+}
+
+/* Returns whether `(` after the token `tok` starts arguments of a call */
+static int tok_ends_callee(int tok) {
+  return tok == TOK_IDENT || tok == TOK_CLOSE_PAREN ||
+         tok == TOK_CLOSE_BRACKET;
+}
+
+/*
+ * Returns whether the function, which parameters start at the current token,
+ * can use local slots: see above.
+ */
+static int function_uses_locals(struct pstate *p) {
+  struct pstate saved = *p;
+  int depth = 0, res = 1, prev = TOK_EOF;
+  while (p->tok.tok != TOK_EOF) {
+    int tok = p->tok.tok;
+    if (tok == TOK_KEYWORD_FUNCTION || tok == TOK_KEYWORD_IN ||
+        (tok == TOK_OPEN_PAREN && tok_ends_callee(prev))) {
+      res = 0;
+      break;
+    } else if (tok == TOK_OPEN_CURLY) {
+      depth++;
+    } else if (tok == TOK_CLOSE_CURLY && --depth == 0) {
+      break;
+    }
+    prev = tok;
+    pnext(p);
+  }
+  *p = saved;
+  return res;
+}
+
+/*
+ * Returns whether the code from the current token to the end of the current
+ * statement needs a scope of its own: that is, whether it declares variables,
+ * which are created in the innermost scope (see OP_CREATE_VAR). `let` in a
+ * nested block goes to the scope of that block, but function declarations are
+ * looked for everywhere, and so are calls: the called function can be load(),
+ * or a native one which runs code, and that declares variables in the
+ * innermost scope too. `depth` is the number of brackets the current token is
+ * inside of, e.g. 1 in a loop header. Variables of functions which use local
+ * slots are never kept in scopes.
+ */
+static int scope_needed(struct pstate *p, int depth) {
+  struct pstate saved = *p;
+  /* A block ends with its `}`, even if it's the body of `if` with `else` */
+  int block = depth == 0 && p->tok.tok == TOK_OPEN_CURLY;
+  int curly = 0, res = 0, prev = TOK_EOF;
+  if (p->use_locals) return 0;
+  while (p->tok.tok != TOK_EOF) {
+    int tok = p->tok.tok;
+    if ((tok == TOK_KEYWORD_LET && curly <= 1) ||
+        tok == TOK_KEYWORD_FUNCTION ||
+        (tok == TOK_OPEN_PAREN && tok_ends_callee(prev))) {
+      res = 1;
+      break;
+    } else if (tok == TOK_OPEN_CURLY || tok == TOK_OPEN_PAREN ||
+               tok == TOK_OPEN_BRACKET) {
+      depth++;
+      if (tok == TOK_OPEN_CURLY) curly++;
+    } else if (tok == TOK_CLOSE_CURLY || tok == TOK_CLOSE_PAREN ||
+               tok == TOK_CLOSE_BRACKET) {
+      if (--depth < 0) break;
+      if (tok == TOK_CLOSE_CURLY) curly--;
+    }
+    prev = tok;
+    pnext(p);
+    if (depth == 0 && (tok == TOK_CLOSE_CURLY || tok == TOK_SEMICOLON) &&
+        (block || p->tok.tok != TOK_KEYWORD_ELSE)) {
+      break;
+    }
+  }
+  *p = saved;
+  return res;
+}
+
+static void emit_local(struct pstate *p, int opcode, int slot) {
+  emit_byte(p, (uint8_t) opcode);
+  emit_int(p, slot);
+}
+
+/*
+ * Emits increment (op is TOK_PLUS) or decrement (TOK_MINUS) of the slot which
+ * value is on top of the stack, and replaces it with the new value.
+ */
+static void emit_local_incr(struct pstate *p, int slot, int op) {
+  emit_byte(p, OP_PUSH_INT);
+  emit_int(p, 1);
+  emit_op(p, op);
+  emit_local(p, OP_SET_LOCAL, slot);
+}
+
+/*
+ * If the operand just parsed is a local slot pushed by parse_literal() for
+ * increment or decrement, returns the slot; otherwise returns -1.
+ */
+static int local_ref_get(struct pstate *p) {
+  int slot = p->local_ref_idx == p->cur_idx ? p->local_ref : -1;
+  p->local_ref = -1;
+  return slot;
+}
+
+/* Returns binary operator of the compound assignment operator */
+static int assign_binop(int op) {
+  /* clang-format off */
+  switch (op) {
+    case TOK_MINUS_ASSIGN:    return TOK_MINUS;
+    case TOK_PLUS_ASSIGN:     return TOK_PLUS;
+    case TOK_MUL_ASSIGN:      return TOK_MUL;
+    case TOK_DIV_ASSIGN:      return TOK_DIV;
+    case TOK_REM_ASSIGN:      return TOK_REM;
+    case TOK_AND_ASSIGN:      return TOK_AND;
+    case TOK_OR_ASSIGN:       return TOK_OR;
+    case TOK_XOR_ASSIGN:      return TOK_XOR;
+    case TOK_LSHIFT_ASSIGN:   return TOK_LSHIFT;
+    case TOK_RSHIFT_ASSIGN:   return TOK_RSHIFT;
+    case TOK_URSHIFT_ASSIGN:  return TOK_URSHIFT;
+    default:                  return op;
+  }
+  /* clang-format on */
+}
+
 static mjs_err_t parse_statement_list(struct pstate *p, int et) {
   mjs_err_t res = MJS_OK;
   int drop = 0;
@@ -164,6 +504,7 @@ static mjs_err_t parse_statement_list(struct pstate *p, int et) {
 
 static mjs_err_t parse_block(struct pstate *p, int mkscope) {
   mjs_err_t res = MJS_OK;
+  int locals_block;
   p->depth++;
   if (p->depth > (STACK_LIMIT / BINOP_STACK_FRAME_SIZE)) {
     mjs_set_errorf(p->mjs, MJS_SYNTAX_ERROR, "parser stack overflow");
@@ -171,32 +512,34 @@ static mjs_err_t parse_block(struct pstate *p, int mkscope) {
     return res;
   }
   LOG(LL_VERBOSE_DEBUG, ("[%.*s]", 10, p->tok.ptr));
+  if (mkscope) mkscope = scope_needed(p, 0);
   if (mkscope) emit_byte(p, OP_NEW_SCOPE);
+  locals_block = locals_block_begin(p);
   res = parse_statement_list(p, TOK_CLOSE_CURLY);
+  locals_block_end(p, locals_block);
+  if (res != MJS_OK) return res;
   EXPECT(p, TOK_CLOSE_CURLY);
   if (mkscope) emit_byte(p, OP_DEL_SCOPE);
   return res;
 }
 
 static mjs_err_t parse_function(struct pstate *p) {
-  size_t prologue, off;
+  size_t prologue, off, off_locals = 0;
   int arg_no = 0;
   int name_provided = 0;
+  int use_locals = p->use_locals, locals_max = p->locals_max, locals_block;
+  int loops = p->loops;
+  struct tok name;
   mjs_err_t res = MJS_OK;
 
   EXPECT(p, TOK_KEYWORD_FUNCTION);
 
   if (p->tok.tok == TOK_IDENT) {
     /* Function name was provided */
-    struct tok tmp = p->tok;
+    name = p->tok;
     name_provided = 1;
-    emit_byte(p, OP_PUSH_STR);
-    emit_str(p, tmp.ptr, tmp.len);
-    emit_byte(p, OP_PUSH_SCOPE);
-    emit_byte(p, OP_CREATE);
-    emit_byte(p, OP_PUSH_STR);
-    emit_str(p, tmp.ptr, tmp.len);
-    emit_byte(p, OP_FIND_SCOPE);
+    emit_byte(p, OP_CREATE_VAR);
+    emit_str(p, name.ptr, name.len);
     pnext1(p);
   }
 
@@ -206,27 +549,52 @@ static mjs_err_t parse_function(struct pstate *p) {
 
   prologue = p->cur_idx;
 
+  p->use_locals = function_uses_locals(p);
+  p->locals_max = 0;
+  /* break and continue can't reach loops outside of the function */
+  p->loops = 0;
+  locals_block = locals_block_begin(p);
+
   EXPECT(p, TOK_OPEN_PAREN);
-  emit_byte(p, OP_NEW_SCOPE);
-  // Emit names of function arguments
+  if (!p->use_locals) emit_byte(p, OP_NEW_SCOPE);
+  // Emit names of function arguments, or give them the first slots
   while (p->tok.tok != TOK_CLOSE_PAREN) {
     if (p->tok.tok != TOK_IDENT) SYNTAX_ERROR(p);
-    emit_byte(p, OP_SET_ARG);
-    emit_int(p, arg_no);
+    if (p->use_locals) {
+      local_add(p, &p->tok);
+    } else {
+      emit_byte(p, OP_SET_ARG);
+      emit_int(p, arg_no);
+      emit_str(p, p->tok.ptr, p->tok.len);
+    }
     arg_no++;
-    emit_str(p, p->tok.ptr, p->tok.len);
     if (ptest(p) == TOK_COMMA) pnext1(p);
     pnext1(p);
   }
   EXPECT(p, TOK_CLOSE_PAREN);
+  if (p->use_locals) {
+    /* Number of slots is known after the body is parsed */
+    emit_byte(p, OP_LOCALS);
+    emit_int(p, arg_no);
+    off_locals = p->cur_idx;
+    emit_init_offset(p);
+  }
   if ((res = parse_block(p, 0)) != MJS_OK) return res;
   emit_byte(p, OP_RETURN);
+  if (p->use_locals) {
+    mjs_bcode_insert_offset(p, p->mjs, off_locals, p->locals_max);
+  }
+  locals_block_end(p, locals_block);
+  p->use_locals = use_locals;
+  p->locals_max = locals_max;
+  p->loops = loops;
   prologue += mjs_bcode_insert_offset(p, p->mjs, off,
                                       p->cur_idx - off - MJS_INIT_OFFSET_SIZE);
   emit_byte(p, OP_PUSH_FUNC);
   emit_int(p, p->cur_idx - 1 /* OP_PUSH_FUNC */ - prologue);
   if (name_provided) {
-    emit_op(p, TOK_ASSIGN);
+    emit_byte(p, OP_SET_VAR);
+    emit_str(p, name.ptr, name.len);
   }
 
   return res;
@@ -290,36 +658,71 @@ static enum mjs_err parse_literal(struct pstate *p, const struct tok *t) {
     case TOK_IDENT: {
       int prev_tok = p->prev_tok;
       int next_tok = ptest(p);
-      emit_byte(p, OP_PUSH_STR);
-      emit_str(p, t->ptr, t->len);
-      emit_byte(p, (uint8_t)(prev_tok == TOK_DOT ? OP_SWAP : OP_FIND_SCOPE));
-      if (!findtok(s_assign_ops, next_tok) &&
-          !findtok(s_postfix_ops, next_tok) &&
-          /* TODO(dfrank): fix: it doesn't work for prefix ops */
-          !findtok(s_postfix_ops, prev_tok)) {
-        emit_byte(p, OP_GET);
+      int slot = prev_tok == TOK_DOT ? -1 : local_find(p, t);
+      int get = !findtok(s_assign_ops, next_tok) &&
+                !findtok(s_postfix_ops, next_tok) &&
+                /* TODO(dfrank): fix: it doesn't work for prefix ops */
+                !findtok(s_postfix_ops, prev_tok);
+      if (get && slot >= 0) {
+        emit_local(p, OP_GET_LOCAL, slot);
+      } else if (get) {
+        emit_byte(p, (uint8_t)(prev_tok == TOK_DOT ? OP_GET_PROP_CONST
+                                                   : OP_GET_VAR));
+        emit_str(p, t->ptr, t->len);
+      } else if (prev_tok == TOK_DOT && next_tok == TOK_ASSIGN) {
+        /*
+         * Property with a constant name is assigned: the object is already on
+         * the stack, parse_assignment() will emit OP_SET_PROP_CONST after the
+         * right side.
+         */
+        p->assign_var = *t;
+        p->assign_prop = p->cur_idx;
+      } else if (prev_tok != TOK_DOT && p->cur_idx == p->expr_start_idx &&
+                 !findtok(s_unary_ops, prev_tok) &&
+                 (next_tok == TOK_ASSIGN ||
+                  (slot >= 0 && findtok(s_assign_ops, next_tok)))) {
+        /*
+         * The whole left side of an assignment is a variable name: emit
+         * nothing here, parse_assignment() will emit OP_SET_VAR or
+         * OP_SET_LOCAL after the right side. A compound assignment to a slot
+         * also needs its value, and evaluates to the old one, like op_assign().
+         */
+        p->assign_var = *t;
+        p->assign_slot = slot;
+        if (next_tok != TOK_ASSIGN) {
+          emit_local(p, OP_GET_LOCAL, slot);
+          emit_byte(p, OP_DUP);
+        }
+      } else if (slot >= 0) {
+        /* Increment or decrement, see parse_postfix() and parse_unary() */
+        emit_local(p, OP_GET_LOCAL, slot);
+        p->local_ref = slot;
+        p->local_ref_idx = p->cur_idx;
+      } else {
+        emit_byte(p, OP_PUSH_STR);
+        emit_str(p, t->ptr, t->len);
+        emit_byte(p, (uint8_t)(prev_tok == TOK_DOT ? OP_SWAP : OP_FIND_SCOPE));
       }
       break;
     }
     case TOK_NUM: {
-      double iv, d = strtod(t->ptr, NULL);
+      int start = p->cur_idx;
+      size_t map_len = p->offset_lineno_map.len;
+      double d = strtod(t->ptr, NULL);
       unsigned long uv = strtoul(t->ptr + 2, NULL, 16);
       if (t->ptr[0] == '0' && t->ptr[1] == 'x') d = uv;
-      if (modf(d, &iv) == 0) {
-        emit_byte(p, OP_PUSH_INT);
-        emit_int(p, (int64_t) d);
-      } else {
-        emit_byte(p, OP_PUSH_DBL);
-        emit_str(p, t->ptr, t->len);
-      }
+      emit_num(p, d);
+      lit_add(p, start, map_len);
       break;
     }
     case TOK_STR: {
-      size_t oldlen;
+      int start = p->cur_idx;
+      size_t oldlen, map_len = p->offset_lineno_map.len;
       emit_byte(p, OP_PUSH_STR);
       oldlen = bcode_gen->len;
       embed_string(bcode_gen, p->cur_idx, t->ptr, t->len, EMBSTR_UNESCAPE);
       p->cur_idx += bcode_gen->len - oldlen;
+      lit_add(p, start, map_len);
     } break;
     case TOK_OPEN_BRACKET:
       res = parse_array_literal(p);
@@ -385,7 +788,15 @@ static mjs_err_t parse_postfix(struct pstate *p, int prev_op) {
   if ((res = parse_call_dot_mem(p, prev_op)) != MJS_OK) return res;
   if (p->tok.tok == TOK_PLUS_PLUS || p->tok.tok == TOK_MINUS_MINUS) {
     int op = p->tok.tok == TOK_PLUS_PLUS ? TOK_POSTFIX_PLUS : TOK_POSTFIX_MINUS;
-    emit_op(p, op);
+    int slot = local_ref_get(p);
+    if (slot >= 0) {
+      /* Keep the old value as a result */
+      emit_byte(p, OP_DUP);
+      emit_local_incr(p, slot, op == TOK_POSTFIX_PLUS ? TOK_PLUS : TOK_MINUS);
+      emit_byte(p, OP_DROP);
+    } else {
+      emit_op(p, op);
+    }
     pnext1(p);
   }
   return res;
@@ -404,7 +815,14 @@ static mjs_err_t parse_unary(struct pstate *p, int prev_op) {
     res = parse_postfix(p, prev_op);
   }
   if (res != MJS_OK) return res;
-  if (op != TOK_EOF) {
+  if (op == TOK_PLUS_PLUS || op == TOK_MINUS_MINUS) {
+    int slot = local_ref_get(p);
+    if (slot >= 0) {
+      emit_local_incr(p, slot, op == TOK_PLUS_PLUS ? TOK_PLUS : TOK_MINUS);
+    } else {
+      emit_op(p, op);
+    }
+  } else if (op != TOK_EOF) {
     if (op == TOK_MINUS) op = TOK_UNARY_MINUS;
     if (op == TOK_PLUS) op = TOK_UNARY_PLUS;
     emit_op(p, op);
@@ -494,13 +912,55 @@ static mjs_err_t parse_ternary(struct pstate *p, int prev_op) {
 
     mjs_bcode_insert_offset(p, p->mjs, off_if,
                             off_endif - off_if - MJS_INIT_OFFSET_SIZE);
+    /* The jump lands after the last comparison: it can't be fused */
+    p->cmp_idx = -1;
   }
 
   return res;
 }
 
 static mjs_err_t parse_assignment(struct pstate *p, int prev_op) {
-  PARSE_RTL_BINOP(p, parse_ternary, parse_assignment, s_assign_ops, prev_op);
+  mjs_err_t res = MJS_OK;
+  int saved_start_idx = p->expr_start_idx;
+  int slot, prop;
+  struct tok var;
+  (void) prev_op;
+
+  p->expr_start_idx = p->cur_idx;
+  p->assign_var.tok = TOK_EOF;
+  res = parse_ternary(p, TOK_EOF);
+  var = p->assign_var;
+  slot = p->assign_slot;
+  prop = p->assign_prop;
+  p->assign_var.tok = TOK_EOF;
+  p->assign_slot = p->assign_prop = -1;
+  p->expr_start_idx = saved_start_idx;
+  if (res != MJS_OK) return res;
+
+  if (findtok(s_assign_ops, p->tok.tok) != TOK_EOF) {
+    int op = p->tok.tok;
+    /* Something was emitted after the property name: not an lvalue */
+    if (prop >= 0 && prop != p->cur_idx) SYNTAX_ERROR(p);
+    pnext1(p);
+    if ((res = parse_assignment(p, TOK_EOF)) != MJS_OK) return res;
+    if (prop >= 0) {
+      /* Property name was not emitted by parse_literal(), see there */
+      emit_byte(p, OP_SET_PROP_CONST);
+      emit_str(p, var.ptr, var.len);
+    } else if (var.tok == TOK_IDENT && slot >= 0) {
+      /* Local slot, see parse_literal() */
+      if (op != TOK_ASSIGN) emit_op(p, assign_binop(op));
+      emit_local(p, OP_SET_LOCAL, slot);
+      if (op != TOK_ASSIGN) emit_byte(p, OP_DROP);
+    } else if (var.tok == TOK_IDENT) {
+      /* Variable name was not emitted by parse_literal(), see there */
+      emit_byte(p, OP_SET_VAR);
+      emit_str(p, var.ptr, var.len);
+    } else {
+      emit_op(p, op);
+    }
+  }
+  return res;
 }
 
 static mjs_err_t parse_expr(struct pstate *p) {
@@ -515,19 +975,28 @@ static mjs_err_t parse_let(struct pstate *p) {
     struct tok tmp = p->tok;
     EXPECT(p, TOK_IDENT);
 
-    emit_byte(p, OP_PUSH_STR);
-    emit_str(p, tmp.ptr, tmp.len);
-    emit_byte(p, OP_PUSH_SCOPE);
-    emit_byte(p, OP_CREATE);
-
-    if (p->tok.tok == TOK_ASSIGN) {
-      pnext1(p);
-      emit_byte(p, OP_PUSH_STR);
+    if (p->use_locals) {
+      /*
+       * The slot is declared after the initializer, so that the initializer
+       * can't see its stale value
+       */
+      if (p->tok.tok == TOK_ASSIGN) {
+        pnext1(p);
+        if ((res = parse_expr(p)) != MJS_OK) return res;
+      } else {
+        emit_byte(p, OP_PUSH_UNDEF);
+      }
+      emit_local(p, OP_SET_LOCAL, local_declare(p, &tmp));
+    } else if (p->tok.tok == TOK_ASSIGN) {
+      emit_byte(p, OP_CREATE_VAR);
       emit_str(p, tmp.ptr, tmp.len);
-      emit_byte(p, OP_FIND_SCOPE);
+      pnext1(p);
       if ((res = parse_expr(p)) != MJS_OK) return res;
-      emit_op(p, TOK_ASSIGN);
+      emit_byte(p, OP_SET_VAR);
+      emit_str(p, tmp.ptr, tmp.len);
     } else {
+      emit_byte(p, OP_CREATE_VAR);
+      emit_str(p, tmp.ptr, tmp.len);
       emit_byte(p, OP_PUSH_UNDEF);
     }
     if (p->tok.tok == TOK_COMMA) {
@@ -550,17 +1019,16 @@ static mjs_err_t parse_block_or_stmt(struct pstate *p, int cs) {
 static mjs_err_t parse_for_in(struct pstate *p) {
   mjs_err_t res = MJS_OK;
   size_t off_b, off_check_end;
+  int mkscope = scope_needed(p, 1);
 
   /* new scope should be pushed before OP_LOOP instruction */
-  emit_byte(p, OP_NEW_SCOPE);
+  if (mkscope) emit_byte(p, OP_NEW_SCOPE);
 
   /* Put iterator variable name to the stack */
   if (p->tok.tok == TOK_KEYWORD_LET) {
     EXPECT(p, TOK_KEYWORD_LET);
-    emit_byte(p, OP_PUSH_STR);
+    emit_byte(p, OP_CREATE_VAR);
     emit_str(p, p->tok.ptr, p->tok.len);
-    emit_byte(p, OP_PUSH_SCOPE);
-    emit_byte(p, OP_CREATE);
   }
   emit_byte(p, OP_PUSH_STR);
   emit_str(p, p->tok.ptr, p->tok.len);
@@ -586,12 +1054,14 @@ static mjs_err_t parse_for_in(struct pstate *p) {
   emit_init_offset(p);
 
   // Parse loop body
+  p->loops++;
   if (p->tok.tok == TOK_OPEN_CURLY) {
     if ((res = parse_statement_list(p, TOK_CLOSE_CURLY)) != MJS_OK) return res;
     pnext1(p);
   } else {
     if ((res = parse_statement(p)) != MJS_OK) return res;
   }
+  p->loops--;
   emit_byte(p, OP_DROP);
   emit_byte(p, OP_CONTINUE);
 
@@ -610,7 +1080,7 @@ static mjs_err_t parse_for_in(struct pstate *p) {
   emit_byte(p, OP_DROP);
   emit_byte(p, OP_DROP);
   emit_byte(p, OP_DROP);
-  emit_byte(p, OP_DEL_SCOPE);
+  if (mkscope) emit_byte(p, OP_DEL_SCOPE);
 
   return res;
 }
@@ -631,7 +1101,7 @@ static mjs_err_t parse_for(struct pstate *p) {
   mjs_err_t res = MJS_OK;
   size_t off_b, off_c, off_init_end;
   size_t off_incr_begin, off_cond_begin, off_cond_end;
-  int buf_cur_idx;
+  int buf_cur_idx, locals_block, cmp, mkscope;
 
   LOG(LL_VERBOSE_DEBUG, ("[%.*s]", 10, p->tok.ptr));
   EXPECT(p, TOK_KEYWORD_FOR);
@@ -658,7 +1128,9 @@ static mjs_err_t parse_for(struct pstate *p) {
    */
 
   /* new scope should be pushed before OP_LOOP instruction */
-  emit_byte(p, OP_NEW_SCOPE);
+  mkscope = scope_needed(p, 1);
+  if (mkscope) emit_byte(p, OP_NEW_SCOPE);
+  locals_block = locals_block_begin(p);
 
   /* Before parsing condition statement, push break/continue offsets  */
   emit_byte(p, OP_LOOP);
@@ -684,13 +1156,14 @@ static mjs_err_t parse_for(struct pstate *p) {
   off_cond_begin = p->cur_idx;
 
   /* Parse cond statement */
-  if ((res = parse_expr(p)) != MJS_OK) return res;
+  if ((res = parse_cond(p, &cmp)) != MJS_OK) return res;
   EXPECT(p, TOK_SEMICOLON);
 
   /* Parse incr statement */
   /* Incr statement should be placed before cond, so, adjust cur_idx */
   buf_cur_idx = p->cur_idx;
   p->cur_idx = off_incr_begin;
+  p->lits_cnt = 0;
 
   if ((res = parse_expr(p)) != MJS_OK) return res;
   EXPECT(p, TOK_CLOSE_PAREN);
@@ -704,21 +1177,22 @@ static mjs_err_t parse_for(struct pstate *p) {
     int incr_size = p->cur_idx - off_incr_begin;
     off_cond_begin += incr_size;
     p->cur_idx = buf_cur_idx + incr_size;
+    p->lits_cnt = 0;
   }
 
   /* p->cur_idx is now at the end of "cond" */
   /* Exit the loop if false */
-  emit_byte(p, OP_JMP_FALSE);
-  off_cond_end = p->cur_idx;
-  emit_init_offset(p);
+  off_cond_end = emit_cond_jmp(p, cmp);
 
   /* Parse loop body */
+  p->loops++;
   if (p->tok.tok == TOK_OPEN_CURLY) {
     if ((res = parse_statement_list(p, TOK_CLOSE_CURLY)) != MJS_OK) return res;
     pnext1(p);
   } else {
     if ((res = parse_statement(p)) != MJS_OK) return res;
   }
+  p->loops--;
   emit_byte(p, OP_DROP);
   emit_byte(p, OP_CONTINUE);
 
@@ -743,20 +1217,24 @@ static mjs_err_t parse_for(struct pstate *p) {
   mjs_bcode_insert_offset(p, p->mjs, off_b,
                           p->cur_idx - off_b - MJS_INIT_OFFSET_SIZE);
 
-  emit_byte(p, OP_DEL_SCOPE);
+  if (mkscope) emit_byte(p, OP_DEL_SCOPE);
+  locals_block_end(p, locals_block);
 
   return res;
 }
 
 static mjs_err_t parse_while(struct pstate *p) {
   size_t off_cond_end, off_b;
+  int locals_block, cmp, mkscope;
   mjs_err_t res = MJS_OK;
 
   EXPECT(p, TOK_KEYWORD_WHILE);
   EXPECT(p, TOK_OPEN_PAREN);
 
   /* new scope should be pushed before OP_LOOP instruction */
-  emit_byte(p, OP_NEW_SCOPE);
+  mkscope = scope_needed(p, 1);
+  if (mkscope) emit_byte(p, OP_NEW_SCOPE);
+  locals_block = locals_block_begin(p);
 
   /*
    * BC is a break+continue offsets (a part of OP_LOOP opcode)
@@ -780,21 +1258,21 @@ static mjs_err_t parse_while(struct pstate *p) {
   emit_byte(p, 0); /* Point OP_CONTINUE to the next instruction */
 
   // parse condition statement
-  if ((res = parse_expr(p)) != MJS_OK) return res;
+  if ((res = parse_cond(p, &cmp)) != MJS_OK) return res;
   EXPECT(p, TOK_CLOSE_PAREN);
 
   // Exit the loop if false
-  emit_byte(p, OP_JMP_FALSE);
-  off_cond_end = p->cur_idx;
-  emit_init_offset(p);
+  off_cond_end = emit_cond_jmp(p, cmp);
 
   // Parse loop body
+  p->loops++;
   if (p->tok.tok == TOK_OPEN_CURLY) {
     if ((res = parse_statement_list(p, TOK_CLOSE_CURLY)) != MJS_OK) return res;
     pnext1(p);
   } else {
     if ((res = parse_statement(p)) != MJS_OK) return res;
   }
+  p->loops--;
   emit_byte(p, OP_DROP);
   emit_byte(p, OP_CONTINUE);
 
@@ -810,21 +1288,21 @@ static mjs_err_t parse_while(struct pstate *p) {
   mjs_bcode_insert_offset(p, p->mjs, off_b,
                           p->cur_idx - off_b - MJS_INIT_OFFSET_SIZE);
 
-  emit_byte(p, OP_DEL_SCOPE);
+  if (mkscope) emit_byte(p, OP_DEL_SCOPE);
+  locals_block_end(p, locals_block);
   return res;
 }
 
 static mjs_err_t parse_if(struct pstate *p) {
   size_t off_if, off_endif;
+  int cmp;
   mjs_err_t res = MJS_OK;
   LOG(LL_VERBOSE_DEBUG, ("[%.*s]", 10, p->tok.ptr));
   EXPECT(p, TOK_KEYWORD_IF);
   EXPECT(p, TOK_OPEN_PAREN);
-  if ((res = parse_expr(p)) != MJS_OK) return res;
+  if ((res = parse_cond(p, &cmp)) != MJS_OK) return res;
 
-  emit_byte(p, OP_JMP_FALSE);
-  off_if = p->cur_idx;
-  emit_init_offset(p);
+  off_if = emit_cond_jmp(p, cmp);
 
   EXPECT(p, TOK_CLOSE_PAREN);
   if ((res = parse_block_or_stmt(p, 1)) != MJS_OK) return res;
@@ -914,11 +1392,19 @@ static mjs_err_t parse_statement(struct pstate *p) {
     case TOK_KEYWORD_WHILE:
       return parse_while(p);
     case TOK_KEYWORD_BREAK:
+      if (p->loops == 0) {
+        mjs_set_errorf(p->mjs, MJS_SYNTAX_ERROR, "misplaced 'break'");
+        return MJS_SYNTAX_ERROR;
+      }
       emit_byte(p, OP_PUSH_UNDEF);
       emit_byte(p, OP_BREAK);
       pnext1(p);
       return MJS_OK;
     case TOK_KEYWORD_CONTINUE:
+      if (p->loops == 0) {
+        mjs_set_errorf(p->mjs, MJS_SYNTAX_ERROR, "misplaced 'continue'");
+        return MJS_SYNTAX_ERROR;
+      }
       emit_byte(p, OP_CONTINUE);
       pnext1(p);
       return MJS_OK;
@@ -959,6 +1445,7 @@ mjs_parse(const char *path, const char *buf, struct mjs *mjs) {
   size_t start_idx, llen;
   int map_len;
   mjs_header_item_t bcode_offset, map_offset, total_size;
+  mjs_header_item_t version = MJS_BCODE_VERSION;
 
   pinit(path, buf, &p);
   p.mjs = mjs;
@@ -974,6 +1461,9 @@ mjs_parse(const char *path, const char *buf, struct mjs *mjs) {
   start_idx = p.mjs->bcode_gen.len;
   mbuf_append(&p.mjs->bcode_gen, NULL,
               sizeof(mjs_header_item_t) * MJS_HDR_ITEMS_CNT);
+  memcpy(p.mjs->bcode_gen.buf + start_idx +
+             sizeof(mjs_header_item_t) * MJS_HDR_ITEM_VERSION,
+         &version, sizeof(mjs_header_item_t));
 
   /* Append NULL-terminated filename */
   mbuf_append(&p.mjs->bcode_gen, path, strlen(path) + 1 /* null-terminate */);
@@ -988,6 +1478,7 @@ mjs_parse(const char *path, const char *buf, struct mjs *mjs) {
 
   res = parse_statement_list(&p, TOK_EOF);
   emit_byte(&p, OP_EXIT);
+  if (res == MJS_OK) mjs_bcode_optimize(&p);
 
   /* remember map offset */
   map_offset = p.mjs->bcode_gen.len - start_idx;
@@ -1013,6 +1504,7 @@ mjs_parse(const char *path, const char *buf, struct mjs *mjs) {
          &total_size, sizeof(mjs_header_item_t));
 
   mbuf_free(&p.offset_lineno_map);
+  mbuf_free(&p.locals);
 
   /*
    * If parsing was successful, commit the bcode; otherwise drop generated
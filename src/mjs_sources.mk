@@ -18,6 +18,7 @@ MJS_SOURCES = \
           mjs_exec.c \
           mjs_ffi.c \
           mjs_gc.c \
+          mjs_jit.c \
           mjs_json.c \
           mjs_main.c \
           mjs_object.c \
@@ -59,6 +60,7 @@ HEADERS = common/mbuf.h \
           mjs_ffi.h \
           mjs_gc.h \
           mjs_internal.h \
+          mjs_jit.h \
           mjs_json.h \
           mjs_license.h \
           mjs_mm.h \
@@ -17,6 +17,8 @@ MJS_PRIVATE void pinit(const char *file_name, const char *buf,
   p->file_name = file_name;
   p->buf = p->pos = buf;
   mbuf_init(&p->offset_lineno_map, 0);
+  mbuf_init(&p->locals, 0);
+  p->assign_slot = p->assign_prop = p->local_ref = p->cmp_idx = -1;
 }
 
 // We're not relying on the target libc ctype, as it may incorrectly
@@ -32,6 +32,22 @@ struct pstate {
   int cur_idx; /* Index in mjs->bcode at which newly generated code is inserted
                   */
   int depth;
+  int expr_start_idx;    /* cur_idx at the start of the current assignment */
+  struct tok assign_var; /* Variable assigned with `=`, see parse_assignment */
+  int assign_slot;       /* Local slot of assign_var, or -1 */
+  int assign_prop;       /* If assign_var is a property: cur_idx after it */
+  struct mbuf locals;    /* Names of the local slots in scope (struct tok) */
+  int locals_block;      /* Index of the first slot of the current block */
+  int locals_max;        /* Number of slots used by the current function */
+  int use_locals;        /* Whether the current function uses local slots */
+  int local_ref;         /* Slot pushed by the last identifier, or -1 */
+  int local_ref_idx;     /* cur_idx right after local_ref was pushed */
+  int loops;             /* Loops being parsed in the current function */
+  int cmp_idx;           /* cur_idx of the last comparison opcode, or -1 */
+  int lits[4];           /* Offsets of the literals just emitted: fold_op() */
+  int lits_cnt;          /* Number of items in `lits` */
+  int lits_end;          /* cur_idx after the last literal */
+  size_t lits_map_len;   /* offset_lineno_map.len after the last literal */
 };
 
 enum {
@@ -103,7 +103,11 @@ MJS_PRIVATE const char *opcodetostr(uint8_t opcode) {
       "PUSH_UNDEF", "PUSH_OBJ", "PUSH_ARRAY", "PUSH_FUNC", "PUSH_THIS", "GET",
       "CREATE", "EXPR", "APPEND", "SET_ARG", "NEW_SCOPE", "DEL_SCOPE", "CALL",
       "RETURN", "LOOP", "BREAK", "CONTINUE", "SETRETVAL", "EXIT", "BCODE_HDR",
-      "ARGS", "FOR_IN_NEXT",
+      "ARGS", "FOR_IN_NEXT", "GET_VAR", "SET_VAR", "CREATE_VAR", "GET_PROP",
+      "GET_LOCAL", "SET_LOCAL", "LOCALS", "SET_PROP", "ADD", "SUB", "MUL",
+      "DIV", "LT", "LE", "GT", "GE", "EQ_EQ", "NE_NE", "JMP_FALSE_LT",
+      "JMP_FALSE_LE", "JMP_FALSE_GT", "JMP_FALSE_GE", "JMP_FALSE_EQ_EQ",
+      "JMP_FALSE_NE_NE",
   };
   const char *name = "???";
   assert(ARRAY_SIZE(names) == OP_MAX);
@@ -132,6 +136,23 @@ MJS_PRIVATE size_t mjs_disasm_single(const uint8_t *code, size_t i) {
       i += llen;
       break;
     }
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL: {
+      cs_varint_decode(&code[i + 1], ~0, &n, &llen);
+      LOG(LL_VERBOSE_DEBUG, ("%s\t%u", buf, (unsigned) n));
+      i += llen;
+      break;
+    }
+    case OP_LOCALS: {
+      size_t llen2;
+      uint64_t nslots;
+      cs_varint_decode(&code[i + 1], ~0, &n, &llen);
+      cs_varint_decode(&code[i + llen + 1], ~0, &nslots, &llen2);
+      LOG(LL_VERBOSE_DEBUG,
+          ("%s\t%u %u", buf, (unsigned) n, (unsigned) nslots));
+      i += llen + llen2;
+      break;
+    }
     case OP_SET_ARG: {
       size_t llen2;
       uint64_t arg_no;
@@ -142,8 +163,28 @@ MJS_PRIVATE size_t mjs_disasm_single(const uint8_t *code, size_t i) {
       i += llen + llen2 + n;
       break;
     }
-    case OP_PUSH_STR:
     case OP_PUSH_DBL: {
+      /* `code` is the whole bcode part, starting with the header */
+      if (code[0] != OP_BCODE_HEADER || mjs_bcode_version(code) >= 1) {
+        double d;
+        memcpy(&d, &code[i + 1], sizeof(d));
+        LOG(LL_VERBOSE_DEBUG, ("%s\t%g", buf, d));
+        i += sizeof(d);
+      } else {
+        /* Version 0 bcode: the number is a decimal string */
+        cs_varint_decode(&code[i + 1], ~0, &n, &llen);
+        LOG(LL_VERBOSE_DEBUG,
+            ("%s\t[%.*s]", buf, (int) n, code + i + 1 + llen));
+        i += llen + n;
+      }
+      break;
+    }
+    case OP_PUSH_STR:
+    case OP_GET_VAR:
+    case OP_SET_VAR:
+    case OP_CREATE_VAR:
+    case OP_GET_PROP_CONST:
+    case OP_SET_PROP_CONST: {
       cs_varint_decode(&code[i + 1], ~0, &n, &llen);
       LOG(LL_VERBOSE_DEBUG, ("%s\t[%.*s]", buf, (int) n, code + i + 1 + llen));
       i += llen + n;
@@ -153,7 +194,13 @@ MJS_PRIVATE size_t mjs_disasm_single(const uint8_t *code, size_t i) {
     case OP_JMP_TRUE:
     case OP_JMP_NEUTRAL_TRUE:
     case OP_JMP_FALSE:
-    case OP_JMP_NEUTRAL_FALSE: {
+    case OP_JMP_NEUTRAL_FALSE:
+    case OP_JMP_FALSE_LT:
+    case OP_JMP_FALSE_LE:
+    case OP_JMP_FALSE_GT:
+    case OP_JMP_FALSE_GE:
+    case OP_JMP_FALSE_EQ_EQ:
+    case OP_JMP_FALSE_NE_NE: {
       cs_varint_decode(&code[i + 1], ~0, &n, &llen);
       LOG(LL_VERBOSE_DEBUG,
           ("%s\t%u", buf,
@@ -236,7 +283,7 @@ MJS_PRIVATE size_t mjs_disasm_single(const uint8_t *code, size_t i) {
       memcpy(&map_offset,
              &code[i + 1 + MJS_HDR_ITEM_MAP_OFFSET * sizeof(total_size)],
              sizeof(map_offset));
-      i += sizeof(mjs_header_item_t) * MJS_HDR_ITEMS_CNT;
+      i += mjs_bcode_header_size(code + i);
       LOG(LL_VERBOSE_DEBUG, ("%s\t[%s] end:%lu map_offset: %lu", buf,
                              &code[i + 1], (unsigned long) start + total_size,
                              (unsigned long) start + map_offset));
@@ -285,12 +332,36 @@ static void mjs_dump_obj_stack(const char *name, const struct mbuf *m,
   }
 }
 
+static void mjs_dump_call_stack(struct mjs *mjs) {
+  char buf[50];
+  size_t i, n = mjs_call_frames_cnt(mjs);
+  LOG(LL_VERBOSE_DEBUG, ("%12s (%d frames): ", "CALL_STACK", (int) n));
+  for (i = 0; i < n; i++) {
+    struct mjs_frame *f = mjs_call_frame(mjs, n - 1 - i);
+    mjs_sprintf(f->this_obj, mjs, buf, sizeof(buf));
+    LOG(LL_VERBOSE_DEBUG,
+        ("%14s ret %d scopes %d loops %d retval %d this %s", "",
+         (int) f->ret_addr, (int) f->scope_idx, (int) f->loop_idx,
+         (int) f->retval_idx, buf));
+  }
+}
+
+static void mjs_dump_loops(struct mjs *mjs) {
+  size_t i, n = mjs->loop_addresses.len / sizeof(struct mjs_loop);
+  LOG(LL_VERBOSE_DEBUG, ("%12s (%d loops): ", "LOOPS", (int) n));
+  for (i = 0; i < n; i++) {
+    struct mjs_loop *l = (struct mjs_loop *) mjs->loop_addresses.buf + i;
+    LOG(LL_VERBOSE_DEBUG, ("%14s scopes %d break %d continue %d", "",
+                           (int) l->scope_idx, (int) l->brk, (int) l->cont));
+  }
+}
+
 void mjs_dump(struct mjs *mjs, int do_disasm) {
   LOG(LL_VERBOSE_DEBUG, ("------- MJS VM DUMP BEGIN"));
   mjs_dump_obj_stack("DATA_STACK", &mjs->stack, mjs);
-  mjs_dump_obj_stack("CALL_STACK", &mjs->call_stack, mjs);
+  mjs_dump_call_stack(mjs);
   mjs_dump_obj_stack("SCOPES", &mjs->scopes, mjs);
-  mjs_dump_obj_stack("LOOP_OFFSETS", &mjs->loop_addresses, mjs);
+  mjs_dump_loops(mjs);
   mjs_dump_obj_stack("ARG_STACK", &mjs->arg_stack, mjs);
   if (do_disasm) {
     int parts_cnt = mjs_bcode_parts_cnt(mjs);
@@ -357,7 +428,7 @@ MJS_PRIVATE const char *mjs_get_bcode_filename(struct mjs *mjs,
                                                struct mjs_bcode_part *bp) {
   (void) mjs;
   return bp->data.p + 1 /* OP_BCODE_HEADER */ +
-         sizeof(mjs_header_item_t) * MJS_HDR_ITEMS_CNT;
+         mjs_bcode_header_size((const uint8_t *) bp->data.p);
 }
 
 const char *mjs_get_bcode_filename_by_offset(struct mjs *mjs, int offset) {
@@ -418,14 +489,9 @@ int mjs_get_offset_by_call_frame_num(struct mjs *mjs, int cf_num) {
   if (cf_num == 0) {
     /* Return current bcode offset */
     ret = mjs->cur_bcode_offset;
-  } else if (cf_num > 0 &&
-             mjs->call_stack.len >=
-                 sizeof(mjs_val_t) * CALL_STACK_FRAME_ITEMS_CNT * cf_num) {
+  } else if (cf_num > 0 && mjs_call_frame(mjs, cf_num - 1) != NULL) {
     /* Get offset from the call_stack */
-    int pos = CALL_STACK_FRAME_ITEM_RETURN_ADDR +
-              CALL_STACK_FRAME_ITEMS_CNT * (cf_num - 1);
-    mjs_val_t val = *vptr(&mjs->call_stack, -1 - pos);
-    ret = mjs_get_int(mjs, val);
+    ret = mjs_call_frame(mjs, cf_num - 1)->ret_addr;
   }
   return ret;
 }
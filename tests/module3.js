@@ -0,0 +1 @@
+let mx = 1;
@@ -0,0 +1 @@
+let my = 1;
@@ -66,6 +66,13 @@ static void cleanup_dir(DIR **d) {
   *d = NULL;
 }
 
+/* Grows the data stack before returning, see mjs_apply() */
+static void test_grow_stack(struct mjs *mjs) {
+  int i;
+  for (i = 0; i < 4096; i++) mjs_push(mjs, mjs_mk_number(mjs, i));
+  mjs_return(mjs, mjs_mk_number(mjs, 42));
+}
+
 static void test_this_plus_arg(struct mjs *mjs) {
   mjs_val_t res = MJS_UNDEFINED;
   mjs_val_t arg0 = mjs_arg(mjs, 0);
@@ -136,6 +143,10 @@ const char *test_arithmetic(struct mjs *mjs) {
   CHECK_NUMERIC("200*50", 10000);
   CHECK_NUMERIC("200/50", 4);
   CHECK_NUMERIC("200 % 21", 11);
+  ASSERT_EXEC_OK(mjs_exec(mjs, "let a = 1, b = 0; a / b", &res));
+  ASSERT(isnan(mjs_get_double(mjs, res)));
+  ASSERT_EXEC_OK(mjs_exec(mjs, "'ab' + 'c'", &res));
+  ASSERT_STREQ(mjs_get_cstring(mjs, &res), "abc");
   ASSERT_EXEC_OK(mjs_exec(mjs, "200 % 0.999", &res));
   ASSERT(isnan(mjs_get_double(mjs, res)));
   CHECK_NUMERIC("5 % 2", 1);
@@ -149,6 +160,18 @@ const char *test_arithmetic(struct mjs *mjs) {
   CHECK_NUMERIC("6 | 3", 7);
   CHECK_NUMERIC("6 ^ 3", 5);
 
+  /* constant expressions, folded by the parser */
+  CHECK_NUMERIC("60 * 60 * 1000", 3600000);
+  CHECK_NUMERIC("5 - 1 * 2", 3);
+  CHECK_NUMERIC("(1 + 2) * 3 - 10", -1);
+  CHECK_NUMERIC("1 +\n 2", 3);
+  CHECK_NUMERIC("let c = 0; (c ? 1 : 2) + 3", 5);
+  ASSERT_EXEC_OK(mjs_exec(mjs, "'prefix_' + 'name' + '!'", &res));
+  ASSERT_STREQ(mjs_get_cstring(mjs, &res), "prefix_name!");
+  ASSERT_EXEC_OK(mjs_exec(mjs, "(0 - 1) * 0 === 0", &res));
+  ASSERT_EQ64(res, mjs_mk_boolean(mjs, 0));
+  ASSERT_EQ(mjs_exec(mjs, "'a' + 1", &res), MJS_TYPE_ERROR);
+
   // /* double arithmetic */
   // CHECK_NUMERIC("0.1 + 0.2", 0.3);
   CHECK_NUMERIC("123.4 + 0.1", 123.5);
@@ -201,6 +224,10 @@ const char *test_arithmetic(struct mjs *mjs) {
   ASSERT_EXEC_OK(mjs_exec(mjs, "NaN === []", &res));
   ASSERT_EQ(mjs_get_bool(mjs, res), 0);
 
+  /* Comparisons fused with a jump agree with the plain ones */
+  CHECK_NUMERIC("let n = 0; if (NaN === NaN) n += 1; if (NaN !== NaN) n += 10; if (0 === -0) n += 100;"
+                "if (0 !== -0) n += 1000; if (2 === 2) n += 10000; n", 11010);
+
   ASSERT_EXEC_OK(mjs_exec(mjs, "isNaN(NaN)", &res));
   ASSERT_EQ(mjs_get_bool(mjs, res), 1);
 
@@ -218,6 +245,13 @@ const char *test_arithmetic(struct mjs *mjs) {
   return NULL;
 }
 
+/* Trace hook for test_block(): counts OP_NEW_SCOPE instructions */
+static void trace_new_scope(struct mjs *mjs, const uint8_t *bcode,
+                            size_t offset, void *user_data) {
+  (void) mjs;
+  if (bcode[offset] == OP_NEW_SCOPE) (*(int *) user_data)++;
+}
+
 const char *test_block(struct mjs *mjs) {
   mjs_val_t res = MJS_UNDEFINED;
   mjs_own(mjs, &res);
@@ -227,9 +261,30 @@ const char *test_block(struct mjs *mjs) {
   ASSERT(res == MJS_UNDEFINED);
   CHECK_NUMERIC("{let a = 42; }", 42);
   CHECK_NUMERIC("let a = 1, b = 2; { let a = 3; b += a; } b;", 5);
+  CHECK_NUMERIC("let a = 1, b = 2; { let a = 3; b = a; } b + a;", 4);
+  CHECK_NUMERIC("let a, b; a = b = 3; a + b", 6);
+  CHECK_NUMERIC("let o = {a: {b: 3}}; o.a.b = o.a.b + 1; o.a.b", 4);
   ASSERT_EXEC_OK(mjs_exec(mjs, "{}", &res));
   ASSERT(res == MJS_UNDEFINED);
 
+  /* Blocks and loops which declare no variables have no scopes */
+  {
+    int cnt = 0;
+    mjs_set_trace(mjs, trace_new_scope, &cnt);
+    CHECK_NUMERIC("let n = 0, o = {x: 1, y: 2}, k; while (n < 3) { n++; } for (k in o) { if (n) { n += o[k]; } } n", 6);
+    ASSERT_EQ(cnt, 0);
+    CHECK_NUMERIC("let n = 0; for (let i = 0; i < 3; i++) { n += i; } n", 3);
+    ASSERT_EQ(cnt, 1);
+    CHECK_NUMERIC("let n = 0; while (n < 3) { if (n) { n++; } else { let m = 1; n += m; } } n", 3);
+    ASSERT_EQ(cnt, 2);
+    CHECK_NUMERIC("let n = 1; while (n < 3) { let m = n; n = m + 1; } n", 3);
+    ASSERT_EQ(cnt, 3);
+    /* A call can be load() under any name, which declares variables in the block */
+    CHECK_NUMERIC("let my = 7, l = load; if (my) { l('tests/module4.js'); } my", 7);
+    ASSERT_EQ(cnt, 4);
+    mjs_set_trace(mjs, NULL, NULL);
+  }
+
   mjs_disown(mjs, &res);
   return NULL;
 }
@@ -253,6 +308,40 @@ const char *test_function(struct mjs *mjs) {
   CHECK_NUMERIC("function f(){}; f ? 1 : 2", 1);
   CHECK_NUMERIC("function f(x){return x ? {x:x} : 0}; f(f).x(0);", 0);
 
+  /* Local slots */
+  CHECK_NUMERIC("let f = function(a,b){ let c = a; c += b; return c*2; }; f(1,2);", 6);
+  CHECK_NUMERIC("let f = function(n){ let s = 0; for (let i = 0; i < n; i++) s += i; return s; }; f(5);", 10);
+  CHECK_NUMERIC("let f = function(a){ let x = 1; { let x = 2; a = x; } return a * 10 + x; }; f(0);", 21);
+  CHECK_NUMERIC("let f = function(i){ let j = i++; let k = ++i; return i * 100 + j * 10 + k; }; f(1);", 313);
+  CHECK_NUMERIC("let g = 1; let f = function(){ g = g + 1; return g; }; f(); g;", 2);
+  CHECK_NUMERIC("let f = function(a,b){ let c; return b === undefined && c === undefined ? a : 0; }; f(4);", 4);
+  /* Functions which call something don't use slots: callees see their variables */
+  CHECK_NUMERIC("function inner(){ return secret; } function outer(){ let secret = 5; return inner(); } outer();", 5);
+  CHECK_NUMERIC("function inner2(){ p = 9; } function outer2(p){ inner2(); return p; } outer2(1);", 9);
+  CHECK_NUMERIC("let mx = 7; function lf(){ load('tests/module3.js'); } lf(); mx;", 7);
+  /* The data stack is reserved for what a function pushes, slots included */
+  CHECK_NUMERIC("let w = function(a, b){ let c = a + b, d = c + 1, e = d + 1, f = e + 1, g = f + 1, h = g + 1, i = h + 1,"
+                "j = i + 1, k = j + 1, l = k + 1, m = l + 1, n = m + 1, o = n + 1, p = o + 1, q = p + 1, r = q + 1; return r - 14; };"
+                "let t = function(o){ let s = 0; for (let k in o) s += w(w(o[k], w(1, 2)), w(w(3, 4), o[k])); return s; };"
+                "t({a: 1, b: 2});", 36);
+
+  /* Scopes without objects, and materialised ones */
+  CHECK_NUMERIC("let f = function(a,b){ let g = function(){ return a * b; }; let c = g(); { let a = 5; c += a; } return c + a; }; f(3,4);", 20);
+  CHECK_NUMERIC("let f = function(a){ let g = function(){}; a++; let b = a; a += b; return a; }; f(1) + f(2);", 10);
+  CHECK_NUMERIC("let f = function(o){ let g = function(){}; let s = ''; for (let k in o) s += k; return s.length; }; f({ab: 1, c: 2});", 3);
+  CHECK_NUMERIC("let f = function(n){ let g = function(){}; return n === 0 ? 0 : n + f(n - 1); }; gc(true); f(50);", 1275);
+  CHECK_NUMERIC("let f = function(a,b,c){ let g = function(){}; return c === undefined ? a * 10 + b : -1; }; f(1,2) + f(3,4,undefined,5);", 46);
+  CHECK_NUMERIC("let f = function(a,b,a,c){ let g = function(){}; return a * 100 + b * 10 + c; }; f(1,2,3,4);", 324);
+
+  /* Hot functions, which are compiled if the JIT is enabled */
+  CHECK_NUMERIC("let f = function(n){ let s = 0; for (let i = 0; i < n; i++) { if (i % 3 === 0) continue; if (i > 20) break; s += i * 0.5; } return s; };"
+                "let t = 0; for (let k = 0; k < 2000; k++) t += f(k % 30); t;", 73377);
+#if MJS_ENABLE_JIT
+  ASSERT(mjs_bcode_part_get(mjs, mjs_bcode_parts_cnt(mjs) - 1)->jit->enter != NULL);
+#endif
+  CHECK_NUMERIC("let g = function(o, k){ o.n = o.n + k; return o.n > 100 ? 'big' : o.n; };"
+                "let o = {n: 0}; let r; for (let k = 0; k < 2000; k++) r = g(o, 1); r === 'big' ? o.n : -1;", 2000);
+
   /* Test return without a value */
   ASSERT_EXEC_OK(mjs_exec(mjs,
         STRINGIFY(
@@ -269,6 +358,18 @@ const char *test_function(struct mjs *mjs) {
   return NULL;
 }
 
+/* Suspends the script, returns whether it's possible */
+static void test_yield(struct mjs *mjs) {
+  mjs_return(mjs, mjs_mk_boolean(mjs, mjs_yield(mjs)));
+}
+
+/* Calls the given function, and returns the result */
+static void test_call_arg(struct mjs *mjs) {
+  mjs_val_t res = MJS_UNDEFINED;
+  mjs_call(mjs, &res, mjs_arg(mjs, 0), MJS_UNDEFINED, 0);
+  mjs_return(mjs, res);
+}
+
 const char *test_cfunction(struct mjs *mjs) {
   mjs_val_t res = MJS_UNDEFINED;
   mjs_own(mjs, &res);
@@ -277,6 +378,28 @@ const char *test_cfunction(struct mjs *mjs) {
 
   CHECK_NUMERIC("let o = {foo: 100, f:test_this_plus_arg}; o.f(20, 5);", 100+20-5);
 
+  /* cfunction can suspend the script, which is then resumed */
+  mjs_set(mjs, mjs_get_global(mjs), "yield", ~0, mjs_mk_foreign(mjs, test_yield));
+  mjs_set(mjs, mjs_get_global(mjs), "call", ~0, mjs_mk_foreign(mjs, test_call_arg));
+  ASSERT_EQ(mjs_exec(mjs,
+                     "let s = ''; let f = function(k) { s += k; yield(); "
+                     "s += k; return s; }; f('a') + f('b')",
+                     &res),
+            MJS_SUSPENDED);
+  ASSERT(res == MJS_UNDEFINED);
+  /* stack is not empty while the script is suspended */
+  ASSERT_EQ(mjs_exec(mjs, "s", &res), MJS_OK);
+  ASSERT_STREQ(mjs_get_cstring(mjs, &res), "a");
+  ASSERT_EQ(mjs_resume(mjs, &res), MJS_SUSPENDED);
+  ASSERT_EQ(mjs_exec(mjs, "s", &res), MJS_OK);
+  ASSERT_STREQ(mjs_get_cstring(mjs, &res), "aab");
+  ASSERT_EXEC_OK(mjs_resume(mjs, &res));
+  ASSERT_STREQ(mjs_get_cstring(mjs, &res), "aaaabb");
+
+  /* nested executions can't be suspended */
+  CHECK_TRUE("call(function() { return yield(); }) === false");
+  ASSERT_EQ(mjs_yield(mjs), 0);
+
   mjs_disown(mjs, &res);
   return NULL;
 }
@@ -363,6 +486,18 @@ const char *test_if(struct mjs *mjs) {
         };
         b;
         ), 20);
+  CHECK_NUMERIC( STRINGIFY(
+        let a = 1; let b = 1; if (a < 2 && a > 2) { b = 10; }; b;
+        ), 1);
+  CHECK_NUMERIC( STRINGIFY(
+        let a = 1; let b = 1; if (a ? a > 2 : a < 2) { b = 10; }; b;
+        ), 1);
+  CHECK_NUMERIC( STRINGIFY(
+        let a = 'a'; let b = 1; if (a !== 'b') { b = 10; }; b;
+        ), 10);
+  CHECK_NUMERIC( STRINGIFY(
+        let a = 0; let b = 1; if (a === -a) { b = 10; }; b;
+        ), 1);
 
   mjs_disown(mjs, &res);
   return NULL;
@@ -478,6 +613,18 @@ const char *test_comparison(struct mjs *mjs) {
   ASSERT_EXEC_OK(mjs_exec(mjs, "let o1={}, o2=o1; o1===o2", &res));
   ASSERT_EQ64(res, mjs_mk_boolean(mjs, 1));
 
+  ASSERT_EXEC_OK(mjs_exec(mjs, "let z = 0; -z === z", &res));
+  ASSERT_EQ64(res, mjs_mk_boolean(mjs, 0));
+
+  ASSERT_EXEC_OK(mjs_exec(mjs, "let n = 0 / 0; n !== n", &res));
+  ASSERT_EQ64(res, mjs_mk_boolean(mjs, 1));
+
+  ASSERT_EXEC_OK(mjs_exec(mjs, "let a = 1, b = 2; a < b && b >= a", &res));
+  ASSERT_EQ64(res, mjs_mk_boolean(mjs, 1));
+
+  ASSERT_EXEC_OK(mjs_exec(mjs, "1 === true", &res));
+  ASSERT_EQ64(res, mjs_mk_boolean(mjs, 0));
+
   mjs_disown(mjs, &res);
   return NULL;
 }
@@ -514,6 +661,12 @@ const char *test_logic(struct mjs *mjs) {
   ASSERT_EQ(mjs_is_boolean(res), 1);
   ASSERT_EQ(mjs_get_bool(mjs, res), 1);
 
+  ASSERT_EXEC_OK(mjs_exec(mjs, "let a = 1; ((a > 2 && true) && a) || 7", &res));
+  ASSERT_EQ(mjs_get_int(mjs, res), 7);
+
+  ASSERT_EXEC_OK(mjs_exec(mjs, "let a = 1; a ? (a > 2 ? 2 : 3) : 4", &res));
+  ASSERT_EQ(mjs_get_int(mjs, res), 3);
+
   ASSERT_EXEC_OK(mjs_exec(mjs, "1 || 2", &res));
   ASSERT_EQ(mjs_is_boolean(res), 0);
   ASSERT_EQ(mjs_get_double(mjs, res), 1);
@@ -1696,6 +1849,8 @@ const char *test_errors(struct mjs *mjs) {
 
   ASSERT_EQ(mjs_exec(mjs, "x", &res), MJS_REFERENCE_ERROR);
   ASSERT_STREQ(mjs->error_msg, "[x] is not defined");
+  ASSERT_EQ(mjs_exec(mjs, "x = 1", &res), MJS_REFERENCE_ERROR);
+  ASSERT_STREQ(mjs->error_msg, "[x] is not defined");
   ASSERT_EQ(mjs_exec(mjs, "let o = {}; o.a", &res), MJS_OK);
   ASSERT(res == MJS_UNDEFINED);
   ASSERT_EQ(mjs_exec(mjs, "let o = {}; o.a.b", &res), MJS_TYPE_ERROR);
@@ -1746,6 +1901,13 @@ const char *test_errors(struct mjs *mjs) {
   ASSERT_EQ(mjs_exec(mjs, "break;", &res), MJS_SYNTAX_ERROR);
   ASSERT_STREQ(mjs->error_msg, "misplaced 'break'");
 
+  /* break and continue are checked by the parser, even if never executed */
+  ASSERT_EQ(mjs_exec(mjs, "if (false) { continue; }", &res), MJS_SYNTAX_ERROR);
+  ASSERT_STREQ(mjs->error_msg, "misplaced 'continue'");
+
+  ASSERT_EQ(mjs_exec(mjs, "while (true) { let f = function() { break; }; f(); }", &res), MJS_SYNTAX_ERROR);
+  ASSERT_STREQ(mjs->error_msg, "misplaced 'break'");
+
   ASSERT_EQ(mjs_exec(mjs, "load('foo/bar/bazzz')", &res), MJS_FILE_READ_ERROR);
   {
     const char *rs = "failed to exec file \"foo/bar/bazzz\": failed to read file \"foo/bar/bazzz\"";
@@ -1761,6 +1923,49 @@ const char *test_errors(struct mjs *mjs) {
   ASSERT_EQ(mjs_exec(mjs, "for (let i in 0) {}", &res), MJS_TYPE_ERROR);
   ASSERT_STREQ(mjs->error_msg, "can't iterate over non-object value");
 
+  /*
+   * Execution budget is spent by loop iterations and calls; the script is
+   * suspended when it's exhausted, and can be resumed with a new budget
+   */
+  mjs_set_exec_budget(mjs, 100);
+  ASSERT_EQ(mjs_exec(mjs,
+                     "let n = 0; let f = function() { n++; }; "
+                     "while (n < 250) { f(); } n",
+                     &res),
+            MJS_BUDGET_EXHAUSTED);
+  ASSERT_STREQ(mjs->error_msg, "execution budget exhausted");
+  ASSERT(res == MJS_UNDEFINED);
+  ASSERT_EQ(mjs_resume(mjs, &res), MJS_BUDGET_EXHAUSTED);
+  /* meanwhile, other code can run, but can't be suspended */
+  ASSERT_EQ(mjs_exec(mjs, "1 + 2", &res), MJS_OK);
+  ASSERT_EQ(mjs_get_int(mjs, res), 3);
+  ASSERT_EQ(mjs_exec(mjs, "while (true) {}", &res), MJS_BUDGET_EXHAUSTED);
+  mjs_set_exec_budget(mjs, 100);
+  ASSERT_EQ(mjs_exec(mjs, "let r = function() { r(); }; r()", &res),
+            MJS_BUDGET_EXHAUSTED);
+  mjs_set_exec_budget(mjs, 200);
+  ASSERT_EQ(mjs_resume(mjs, &res), MJS_BUDGET_EXHAUSTED);
+  mjs_set_exec_budget(mjs, 200);
+  ASSERT_EQ(mjs_resume(mjs, &res), MJS_OK);
+  ASSERT_EQ(mjs_get_int(mjs, res), 250);
+  ASSERT_EQ(mjs_resume(mjs, &res), MJS_BAD_ARGS_ERROR);
+  ASSERT_STREQ(mjs->error_msg, "nothing to resume");
+
+  /* function calls from C are not suspended, but aborted */
+  mjs_set_exec_budget(mjs, 10);
+  ASSERT_EXEC_OK(mjs_exec(mjs, "let g = function() { g(); }; g", &res));
+  ASSERT_EQ(mjs_call(mjs, &res, res, MJS_UNDEFINED, 0), MJS_BUDGET_EXHAUSTED);
+  ASSERT_EQ(mjs_resume(mjs, &res), MJS_BAD_ARGS_ERROR);
+
+  /* the budget is spent across executions */
+  mjs_set_exec_budget(mjs, 10);
+  CHECK_NUMERIC("let n = 0; for (let i = 0; i < 9; i++) { n++; } n", 9);
+  ASSERT_EQ(mjs_exec(mjs, "for (let i = 0; i < 9; i++) {}", &res),
+            MJS_BUDGET_EXHAUSTED);
+  mjs_set_exec_budget(mjs, -1);
+  ASSERT_EXEC_OK(mjs_resume(mjs, &res));
+  CHECK_NUMERIC("let n = 0; for (let i = 0; i < 1000; i++) { n++; } n", 1000);
+
   mjs_disown(mjs, &res);
   return NULL;
 }
@@ -1805,6 +2010,15 @@ const char *test_this(struct mjs *mjs) {
           ), &res));
   ASSERT_EQ(mjs_get_int(mjs, res), 600);
 
+  /* `this` is restored on return from deep calls, and survives GC */
+  ASSERT_EXEC_OK(mjs_exec(mjs,
+        "let o = {n: 0, f: function(k) {"
+        "  if (k === 0) { gc(true); return this.n; }"
+        "  let p = {n: this.n + 1, f: this.f};"
+        "  return p.f(k - 1) + this.n;"
+        "}}; o.f(100)", &res));
+  ASSERT_EQ(mjs_get_int(mjs, res), 5050);
+
   ASSERT_EXEC_OK(mjs_exec(mjs,
         STRINGIFY(
           let a;
@@ -1873,6 +2087,9 @@ const char *test_while(struct mjs *mjs) {
   ASSERT_EQ(mjs_exec(mjs, "let i=50; let j=100; while(i<10) {i+=1;j+=1;} j;", &res), MJS_OK);
   ASSERT_EQ(mjs_get_int(mjs, res), 100);
 
+  ASSERT_EQ(mjs_exec(mjs, "let i=0; while(i++<10) {} i;", &res), MJS_OK);
+  ASSERT_EQ(mjs_get_int(mjs, res), 11);
+
   /* while loop inside of a function */
   ASSERT_EXEC_OK(mjs_exec(mjs,
         STRINGIFY(
@@ -1981,6 +2198,18 @@ const char *test_while(struct mjs *mjs) {
         ), &res));
   ASSERT_STREQ(mjs_get_cstring(mjs, &res), "....---.....");
 
+  /* Garbage is collected at the loop back edge, which is a GC safepoint */
+  {
+    unsigned long garbage = mjs->object_arena.garbage;
+    ASSERT_EXEC_OK(mjs_exec(mjs,
+                            "let o; for (let i = 0; i < 1000; i++) "
+                            "{ o = {i: i}; } o.i",
+                            &res));
+    ASSERT_EQ(mjs_get_int(mjs, res), 999);
+    ASSERT(mjs->object_arena.garbage > garbage);
+    ASSERT(mjs->object_arena.alive < 1000);
+  }
+
   mjs_disown(mjs, &res);
 
   return NULL;
@@ -2628,6 +2857,16 @@ const char *test_objects(struct mjs *mjs) {
       "p_foo:3_o1_foo:2_o2_foo:3_"
       );
 
+  /* Inline caches of property access sites must notice deleted properties */
+  ASSERT_EXEC_OK(mjs_exec(mjs,
+        "let pc = {x: 1, y: 2};"
+        "let pf = function(o) { o.y = o.y + 1; return o.x; };"
+        "pf(pc) + pf({x: 3, y: 0}) + pf(pc) + pc.y;", &res));
+  ASSERT_EQ(mjs_get_int(mjs, res), 9);
+  mjs_del(mjs, mjs_get(mjs, mjs_get_global(mjs), "pc", ~0), "x", ~0);
+  ASSERT_EXEC_OK(mjs_exec(mjs, "pf(pc)", &res));
+  ASSERT(res == MJS_UNDEFINED);
+
   mjs_disown(mjs, &res);
 
   return NULL;
@@ -2864,6 +3103,7 @@ const char *test_json(struct mjs *mjs) {
 
 const char *test_string(struct mjs *mjs) {
   mjs_val_t res = MJS_UNDEFINED;
+  int i;
   mjs_own(mjs, &res);
 
   ASSERT_EXEC_OK(mjs_exec(mjs, "''.length", &res));
@@ -2906,6 +3146,21 @@ const char *test_string(struct mjs *mjs) {
   ASSERT(mjs_is_truthy(mjs, res));
   ASSERT_EXEC_OK(mjs_exec(mjs, "'ы'[1] === '\x8b'", &res));
   ASSERT(mjs_is_truthy(mjs, res));
+  ASSERT_EXEC_OK(mjs_exec(mjs, "let s = 'abc', i = 1; s[i + 1] + s['0'] + s[1 + 1]", &res));
+  ASSERT_STREQ(mjs_get_cstring(mjs, &res), "cac");
+  ASSERT_EQ(mjs_exec(mjs, "'abc'[0.5]", &res), MJS_TYPE_ERROR);
+  ASSERT_EXEC_OK(mjs_exec(mjs, "let o = {length: 3, push: 4}; o.length + o.push + [1, 2].length", &res));
+  ASSERT_EQ(mjs_get_int(mjs, res), 9);
+  ASSERT_EXEC_OK(mjs_exec(mjs, "let o = {lenght: 1}; o.lenght + [].push(4) + ([1, 2].lenght === undefined ? 1 : 0)", &res));
+  ASSERT_EQ(mjs_get_int(mjs, res), 3);
+  ASSERT_EXEC_OK(mjs_exec(mjs, "typeof ({}).apply", &res));
+  ASSERT_STREQ(mjs_get_cstring(mjs, &res), "foreign_ptr");
+  for (i = 0; i < (int) ARRAY_SIZE(getprop_methods); i++) {
+    const struct getprop_method *m = &getprop_methods[i];
+    if (m->name == NULL) continue;
+    ASSERT_EQ(GETPROP_HASH(m->name, strlen(m->name)), i);
+    ASSERT_EQ(m->len, strlen(m->name));
+  }
 
   /* slice */
   ASSERT_EXEC_OK(mjs_exec(mjs, "'abcdef'.slice(0)", &res));
@@ -3021,11 +3276,36 @@ const char *test_string(struct mjs *mjs) {
   /* no autoconversion */
   ASSERT_EQ(mjs_exec( mjs, "'foo' + 123", &res), MJS_TYPE_ERROR);
 
+  /* String literals come from the constant pool, and survive GC */
+  {
+    size_t len;
+    ASSERT_EXEC_OK(mjs_exec(mjs,
+                            "let lit = function() { let s; for (let i = 0; "
+                            "i < 10; i++) { s = 'temperature'; } return s; };"
+                            " lit()",
+                            &res));
+    len = mjs->owned_strings.len;
+    ASSERT_EXEC_OK(mjs_exec(mjs, "lit()", &res));
+    ASSERT_EQ(mjs->owned_strings.len, len);
+    mjs_gc(mjs, 1);
+    ASSERT_EXEC_OK(mjs_exec(mjs, "gc(true); lit() + lit()", &res));
+    ASSERT_STREQ(mjs_get_cstring(mjs, &res), "temperaturetemperature");
+  }
+
   mjs_disown(mjs, &res);
 
   return NULL;
 }
 
+/* Trace hook for test_call_api(): counts instructions, and OP_EXIT ones */
+static void trace_count(struct mjs *mjs, const uint8_t *bcode, size_t offset,
+                        void *user_data) {
+  int *cnt = (int *) user_data;
+  (void) mjs;
+  cnt[0]++;
+  if (bcode[offset] == OP_EXIT) cnt[1]++;
+}
+
 const char *test_call_api(struct mjs *mjs) {
   mjs_val_t func = MJS_UNDEFINED;
   mjs_val_t res = MJS_UNDEFINED;
@@ -3080,6 +3360,22 @@ const char *test_call_api(struct mjs *mjs) {
   ASSERT_EQ(mjs_apply(mjs, &res, MJS_UNDEFINED, MJS_UNDEFINED, 0, NULL), MJS_TYPE_ERROR);
 
   CHECK_NUMERIC("let f = function(a,b){return a+b;}; f.apply(null,[1,2])", 3);
+  ASSERT_EQ(mjs_apply(mjs, &res, mjs_mk_foreign_func(mjs, (mjs_func_ptr_t) test_grow_stack), MJS_UNDEFINED, 0, NULL), MJS_OK);
+  ASSERT_EQ(mjs_get_int(mjs, res), 42);
+  CHECK_NUMERIC("function f(n) { return n === 0 ? 0 : (1 + (2 + (3 + f(n - 1)))) - 5; } f(300)", 300);
+
+  /* trace hook sees every instruction, until it's removed */
+  {
+    int cnt[2] = {0, 0};
+    mjs_set_trace(mjs, trace_count, cnt);
+    CHECK_NUMERIC("let t = 0; for (let i = 0; i < 10; i++) { t += i; } t", 45);
+    ASSERT(cnt[0] > 10 * 3);
+    ASSERT_EQ(cnt[1], 1);
+    mjs_set_trace(mjs, NULL, NULL);
+    cnt[0] = 0;
+    CHECK_NUMERIC("t", 45);
+    ASSERT_EQ(cnt[0], 0);
+  }
 
   mjs_disown(mjs, &obj);
   mjs_disown(mjs, &res);
@@ -3393,6 +3689,32 @@ const char *test_backtrace(struct mjs *mjs) {
       "  at <stdin>:1\n"
       );
 
+  /* Calls and returns across many bcode parts */
+  {
+    int k;
+    char buf[100];
+    ASSERT_EQ(mjs_exec(mjs, "let p0 = function(x) { return x + 1; };", &res),
+              MJS_OK);
+    for (k = 1; k < 64; k++) {
+      snprintf(buf, sizeof(buf),
+               "let p%d = function(x) { return p%d(x) + 1; };", k, k - 1);
+      ASSERT_EQ(mjs_exec(mjs, buf, &res), MJS_OK);
+    }
+    ASSERT_EQ(mjs_exec(mjs, "p63(0)", &res), MJS_OK);
+    ASSERT_EQ(mjs_get_double(mjs, res), 64);
+    ASSERT_EQ(mjs_exec(mjs, "p0(bar)", &res), MJS_REFERENCE_ERROR);
+    ASSERT_STREQ(mjs->stack_trace, "  at <stdin>:1\n");
+    ASSERT_EQ(mjs_exec(mjs, "p0 = function(x) { return bar; };", &res),
+              MJS_OK);
+    ASSERT_EQ(mjs_exec(mjs, "p2(0)", &res), MJS_REFERENCE_ERROR);
+    ASSERT_STREQ(mjs->stack_trace,
+        "  at <stdin>:1\n"
+        "  at <stdin>:1\n"
+        "  at <stdin>:1\n"
+        "  at <stdin>:1\n"
+        );
+  }
+
   mjs_disown(mjs, &res);
 
   return NULL;
@@ -4030,12 +4352,62 @@ const char *test_parser(struct mjs *mjs) {
   return NULL;
 }
 
+const char *test_bcode_version(struct mjs *mjs) {
+  /*
+   * "let f = function(x) { return x * 0.5 + 0.25; }; f(3)" from t.js,
+   * compiled to version 0 bcode: the doubles are decimal strings
+   */
+  static const uint8_t v0[] = {
+    0x24, 0x48, 0x00, 0x00, 0x00, 0x11, 0x00, 0x00, 0x00, 0x47, 0x00, 0x00,
+    0x00, 0x74, 0x2e, 0x6a, 0x73, 0x00, 0x0b, 0x01, 0x66, 0x0a, 0x17, 0x0b,
+    0x01, 0x66, 0x09, 0x04, 0x1c, 0x1b, 0x1a, 0x00, 0x01, 0x78, 0x0b, 0x01,
+    0x78, 0x09, 0x16, 0x0f, 0x03, 0x30, 0x2e, 0x35, 0x18, 0x0c, 0x0f, 0x04,
+    0x30, 0x2e, 0x32, 0x35, 0x18, 0x0d, 0x22, 0x1e, 0x1e, 0x14, 0x1c, 0x18,
+    0x05, 0x01, 0x0b, 0x01, 0x66, 0x09, 0x16, 0x25, 0x0e, 0x03, 0x1d, 0x23,
+    0x00
+  };
+  mjs_val_t res = MJS_UNDEFINED;
+  struct mjs_bcode_part *bp;
+  mjs_own(mjs, &res);
+
+  CHECK_NUMERIC("let f = function(x) { return x * 0.5 + 0.25; }; f(3)", 1.75);
+  bp = mjs_bcode_part_get(mjs, mjs_bcode_parts_cnt(mjs) - 1);
+  ASSERT_EQ(mjs_bcode_version((const uint8_t *) bp->data.p),
+            MJS_BCODE_VERSION);
+  ASSERT_STREQ(mjs_get_bcode_filename(mjs, bp), "<stdin>");
+
+  /* Version 0 bcode, like the one loaded from an old .jsc file */
+  {
+    size_t off = mjs->bcode_len;
+    char *data = (char *) malloc(sizeof(v0));
+    struct mjs_bcode_part v0bp;
+    memcpy(data, v0, sizeof(v0));
+    memset(&v0bp, 0, sizeof(v0bp));
+    v0bp.start_idx = off;
+    v0bp.data.p = data;
+    v0bp.data.len = sizeof(v0);
+    v0bp.exec_res = MJS_ERRS_CNT;
+    mjs_bcode_part_add(mjs, &v0bp);
+    mjs->bcode_len += sizeof(v0);
+
+    bp = mjs_bcode_part_get(mjs, mjs_bcode_parts_cnt(mjs) - 1);
+    ASSERT_EQ(mjs_bcode_version((const uint8_t *) bp->data.p), 0);
+    ASSERT_STREQ(mjs_get_bcode_filename(mjs, bp), "t.js");
+    ASSERT_EXEC_OK(mjs_execute(mjs, off, &res));
+    ASSERT_EQ(mjs_get_double(mjs, res), 1.75);
+  }
+
+  mjs_disown(mjs, &res);
+  return NULL;
+}
+
 void tests_setup(void) {
 }
 
 const char *tests_run(const char *filter) {
   RUN_TEST_MJS(test_nodes);
   RUN_TEST_MJS(test_parser);
+  RUN_TEST_MJS(test_bcode_version);
   RUN_TEST_MJS(test_arithmetic);
   RUN_TEST_MJS(test_block);
   RUN_TEST_MJS(test_function);